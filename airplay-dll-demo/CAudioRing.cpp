@@ -0,0 +1,162 @@
+#include "CAudioRing.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MARK_POS(mark)	((unsigned int)((mark) & 0xffffffff))
+#define MARK_PTS(mark)	((unsigned int)((mark) >> 32))
+#define MAKE_MARK(pts, pos)	(((unsigned long long)(pts) << 32) | (pos))
+
+CAudioRing::CAudioRing()
+	: m_pBuffer(NULL)
+	, m_nSize(0)
+	, m_nMask(0)
+	, m_nFrameBytes(0)
+	, m_nSampleRate(0)
+	, m_nReadPos(0)
+	, m_nWritePos(0)
+	, m_nMarkRead(0)
+	, m_nMarkWrite(0)
+	, m_nNextPts(0)
+	, m_nOverflows(0)
+{
+}
+
+CAudioRing::~CAudioRing()
+{
+	unInit();
+}
+
+bool CAudioRing::init(unsigned int sampleRate, unsigned int channels, unsigned int bitsPerSample, unsigned int bufferMs)
+{
+	unInit();
+	if (sampleRate == 0 || channels == 0 || bitsPerSample == 0) {
+		return false;
+	}
+
+	m_nFrameBytes = channels * (bitsPerSample / 8);
+	m_nSampleRate = sampleRate;
+
+	unsigned int need = (unsigned int)((unsigned long long)sampleRate * m_nFrameBytes * bufferMs / 1000);
+	unsigned int size = 1024;
+	while (size < need) {
+		size <<= 1;
+	}
+	m_pBuffer = (unsigned char*)malloc(size);
+	if (m_pBuffer == NULL) {
+		return false;
+	}
+	m_nSize = size;
+	m_nMask = size - 1;
+	m_nReadPos.store(0, std::memory_order_relaxed);
+	m_nWritePos.store(0, std::memory_order_relaxed);
+	m_nMarkRead.store(0, std::memory_order_relaxed);
+	m_nMarkWrite.store(0, std::memory_order_relaxed);
+	m_nNextPts = 0;
+	m_nOverflows.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+void CAudioRing::unInit()
+{
+	if (m_pBuffer) {
+		free(m_pBuffer);
+		m_pBuffer = NULL;
+	}
+	m_nSize = 0;
+	m_nMask = 0;
+}
+
+unsigned int CAudioRing::write(const unsigned char* data, unsigned int len, unsigned int pts)
+{
+	if (m_pBuffer == NULL) {
+		return 0;
+	}
+	unsigned int writePos = m_nWritePos.load(std::memory_order_relaxed);
+	unsigned int readPos = m_nReadPos.load(std::memory_order_acquire);
+	unsigned int space = m_nSize - (writePos - readPos);
+
+	// Keep whole sample frames only
+	len -= len % m_nFrameBytes;
+	if (len == 0) {
+		return 0;
+	}
+	unsigned int markWrite = m_nMarkWrite.load(std::memory_order_relaxed);
+	bool newMark = markWrite == 0 || pts != m_nNextPts;
+	if (len > space ||
+		(newMark && markWrite - m_nMarkRead.load(std::memory_order_acquire) == AUDIO_RING_MARKS)) {
+		m_nOverflows.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+	if (newMark) {
+		m_marks[markWrite % AUDIO_RING_MARKS] = MAKE_MARK(pts, writePos);
+		m_nMarkWrite.store(markWrite + 1, std::memory_order_release);
+	}
+
+	unsigned int offset = writePos & m_nMask;
+	unsigned int first = len < m_nSize - offset ? len : m_nSize - offset;
+	memcpy(m_pBuffer + offset, data, first);
+	memcpy(m_pBuffer, data + first, len - first);
+
+	m_nNextPts = pts + len / m_nFrameBytes;
+	m_nWritePos.store(writePos + len, std::memory_order_release);
+	return len;
+}
+
+unsigned int CAudioRing::read(unsigned char* out, unsigned int len, unsigned int* pts)
+{
+	if (m_pBuffer == NULL) {
+		return 0;
+	}
+	unsigned int writePos = m_nWritePos.load(std::memory_order_acquire);
+	unsigned int readPos = m_nReadPos.load(std::memory_order_relaxed);
+	unsigned int used = writePos - readPos;
+
+	// The mark of a packet is published before its data, so every byte
+	// below writePos has one. Marks the read position has passed are freed.
+	unsigned int markWrite = m_nMarkWrite.load(std::memory_order_acquire);
+	unsigned int markRead = m_nMarkRead.load(std::memory_order_relaxed);
+	while (markWrite - markRead > 1 &&
+		(int)(MARK_POS(m_marks[(markRead + 1) % AUDIO_RING_MARKS]) - readPos) <= 0) {
+		markRead++;
+	}
+	m_nMarkRead.store(markRead, std::memory_order_release);
+
+	if (pts != NULL) {
+		if (markWrite != markRead) {
+			unsigned long long mark = m_marks[markRead % AUDIO_RING_MARKS];
+			*pts = MARK_PTS(mark) + (readPos - MARK_POS(mark)) / m_nFrameBytes;
+		} else {
+			*pts = 0;
+		}
+	}
+
+	len -= len % m_nFrameBytes;
+	if (len > used) {
+		len = used;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	unsigned int offset = readPos & m_nMask;
+	unsigned int first = len < m_nSize - offset ? len : m_nSize - offset;
+	memcpy(out, m_pBuffer + offset, first);
+	memcpy(out + first, m_pBuffer, len - first);
+
+	m_nReadPos.store(readPos + len, std::memory_order_release);
+	return len;
+}
+
+unsigned int CAudioRing::available() const
+{
+	unsigned int writePos = m_nWritePos.load(std::memory_order_acquire);
+	return writePos - m_nReadPos.load(std::memory_order_acquire);
+}
+
+unsigned int CAudioRing::bufferedMs() const
+{
+	if (m_nFrameBytes == 0 || m_nSampleRate == 0) {
+		return 0;
+	}
+	return (unsigned int)((unsigned long long)available() / m_nFrameBytes * 1000 / m_nSampleRate);
+}
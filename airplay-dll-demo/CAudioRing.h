@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+
+// Timestamp discontinuities the ring can hold at once
+#define AUDIO_RING_MARKS	64
+
+// Single producer / single consumer PCM byte ring.
+// The network thread writes, the SDL audio callback reads, neither side locks.
+class CAudioRing
+{
+public:
+	CAudioRing();
+	~CAudioRing();
+
+	// Allocates room for bufferMs of audio, rounded up to a power of two.
+	// Must not race with read() or write().
+	bool init(unsigned int sampleRate, unsigned int channels, unsigned int bitsPerSample, unsigned int bufferMs);
+	void unInit();
+
+	// Producer side. pts is the RTP timestamp of the first sample in data.
+	// Returns the number of bytes stored, a packet that does not fit is
+	// dropped whole.
+	unsigned int write(const unsigned char* data, unsigned int len, unsigned int pts);
+
+	// Consumer side. Returns the number of bytes copied to out.
+	// When pts is not NULL it receives the timestamp of the first byte read.
+	unsigned int read(unsigned char* out, unsigned int len, unsigned int* pts);
+
+	unsigned int available() const;
+	unsigned int bufferedMs() const;
+	unsigned int overflows() const { return m_nOverflows.load(std::memory_order_relaxed); }
+	unsigned int frameBytes() const { return m_nFrameBytes; }
+	unsigned int sampleRate() const { return m_nSampleRate; }
+
+protected:
+	unsigned char*				m_pBuffer;
+	unsigned int				m_nSize;
+	unsigned int				m_nMask;
+	unsigned int				m_nFrameBytes;
+	unsigned int				m_nSampleRate;
+
+	std::atomic<unsigned int>	m_nReadPos;
+	std::atomic<unsigned int>	m_nWritePos;
+	// pts (high 32 bits) of the sample at a position (low 32 bits), one for
+	// every packet that does not continue the previous one. The reader keeps
+	// the last mark at or before its position, so a dropped packet moves the
+	// clock where its gap is played instead of shifting what is buffered.
+	unsigned long long			m_marks[AUDIO_RING_MARKS];
+	std::atomic<unsigned int>	m_nMarkRead;
+	std::atomic<unsigned int>	m_nMarkWrite;
+	// Producer only, pts following the last stored sample
+	unsigned int				m_nNextPts;
+	std::atomic<unsigned int>	m_nOverflows;
+};
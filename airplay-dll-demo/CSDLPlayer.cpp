@@ -24,6 +24,17 @@ CSDLPlayer::CSDLPlayer()
 	: m_surface(NULL)
 	, m_yuv(NULL)
 	, m_bAudioInited(false)
+	, m_bAudioPlaying(false)
+	, m_nAudioDeviceSamples(0)
+	, m_nAudioUnderruns(0)
+	, m_nConcealLen(0)
+	, m_nConcealPos(0)
+	, m_bConcealed(false)
+	, m_nPlayoutSeq(0)
+	, m_nAudioMapSeq(0)
+	, m_nAudioMapRtp(0)
+	, m_llAudioMapNtp(0)
+	, m_scheduler(this)
 	, m_bDumpAudio(false)
 	, m_fileWav(NULL)
 	, m_sAudioFmt()
@@ -33,7 +44,7 @@ CSDLPlayer::CSDLPlayer()
 {
 	ZeroMemory(&m_sAudioFmt, sizeof(SFgAudioFrame));
 	ZeroMemory(&m_rect, sizeof(SDL_Rect));
-	m_mutexAudio = CreateMutex(NULL, FALSE, NULL);
+	ZeroMemory(&m_sPlayout, sizeof(SDemoPlayout));
 	m_mutexVideo = CreateMutex(NULL, FALSE, NULL);
 }
 
@@ -41,7 +52,6 @@ CSDLPlayer::~CSDLPlayer()
 {
 	unInit();
 
-	CloseHandle(m_mutexAudio);
 	CloseHandle(m_mutexVideo);
 }
 
@@ -64,6 +74,7 @@ bool CSDLPlayer::init()
 	/* Filter quit and mouse motion events */
 	SDL_SetEventFilter(FilterEvents);
 
+	m_scheduler.start();
 	m_server.start(this);
 
 	return true;
@@ -71,6 +82,7 @@ bool CSDLPlayer::init()
 
 void CSDLPlayer::unInit()
 {
+	m_scheduler.stop();
 	unInitVideo();
 	unInitAudio();
 
@@ -135,6 +147,10 @@ void CSDLPlayer::loopEvents()
 					m_fRatio = m_server.setVideoScale(m_fRatio);
 					break;
 				}
+				case SDLK_i: {
+					printSyncStats();
+					break;
+				}
 			}
 				break;
 		}
@@ -158,6 +174,11 @@ void CSDLPlayer::outputVideo(SFgVideoFrame* data)
 	if (data->width == 0 || data->height == 0) {
 		return;
 	}
+	m_scheduler.push(data);
+}
+
+void CSDLPlayer::displayVideo(SFgVideoFrame* data)
+{
 
 	if (data->width != m_rect.w || data->height != m_rect.h) {
 		{
@@ -216,22 +237,24 @@ void CSDLPlayer::outputAudio(SFgAudioFrame* data)
 
 	initAudio(data);
 
+	if (data->ntpPts != 0) {
+		m_nAudioMapSeq.fetch_add(1, std::memory_order_acq_rel);
+		m_nAudioMapRtp = (unsigned int)data->pts;
+		m_llAudioMapNtp = (long long)data->ntpPts;
+		m_nAudioMapSeq.fetch_add(1, std::memory_order_release);
+	}
+
 	if (m_bDumpAudio) {
 		if (m_fileWav != NULL) {
 			fwrite(data->data, data->dataLen, 1, m_fileWav);
 		}
 	}
 
-	SDemoAudioFrame* dataClone = new SDemoAudioFrame();
-	dataClone->dataTotal = data->dataLen;
-	dataClone->pts = data->pts;
-	dataClone->dataLeft = dataClone->dataTotal;
-	dataClone->data = new uint8_t[dataClone->dataTotal];
-	memcpy(dataClone->data, data->data, dataClone->dataTotal);
+	m_ringAudio.write(data->data, data->dataLen, (unsigned int)data->pts);
 
-	{
-		CAutoLock oLock(m_mutexAudio, "outputAudio");
-		m_queueAudio.push(dataClone);
+	if (!m_bAudioPlaying && m_ringAudio.bufferedMs() >= AUDIO_PREBUFFER_MS) {
+		m_bAudioPlaying = true;
+		SDL_PauseAudio(0);
 	}
 }
 
@@ -288,7 +311,7 @@ void CSDLPlayer::initAudio(SFgAudioFrame* data)
 		wanted_spec.format = AUDIO_S16SYS;
 		wanted_spec.channels = data->channels;
 		wanted_spec.silence = 0;
-		wanted_spec.samples = 1920;
+		wanted_spec.samples = AUDIO_DEVICE_SAMPLES;
 		wanted_spec.callback = sdlAudioCallback;
 		wanted_spec.userdata = this;
 
@@ -300,6 +323,17 @@ void CSDLPlayer::initAudio(SFgAudioFrame* data)
 
 		SDL_PauseAudio(1);
 
+		if (!m_ringAudio.init(obtained_spec.freq, obtained_spec.channels, 16, AUDIO_RING_MS)) {
+			SDL_CloseAudio();
+			return;
+		}
+		m_nAudioDeviceSamples = obtained_spec.samples;
+		m_nAudioUnderruns = 0;
+		m_nConcealLen = 0;
+		m_nConcealPos = 0;
+		m_bConcealed = false;
+		m_bAudioPlaying = false;
+
 		m_sAudioFmt.bitsPerSample = data->bitsPerSample;
 		m_sAudioFmt.channels = data->channels;
 		m_sAudioFmt.sampleRate = data->sampleRate;
@@ -309,27 +343,20 @@ void CSDLPlayer::initAudio(SFgAudioFrame* data)
 			m_fileWav = fopen("demo-audio.wav", "wb");
 		}
 	}
-	if (m_queueAudio.size() > 5) {
-		SDL_PauseAudio(0);
-	}
 }
 
 void CSDLPlayer::unInitAudio()
 {
+	// Waits for a running callback, after this the ring has no reader
 	SDL_CloseAudio();
 	m_bAudioInited = false;
+	m_bAudioPlaying = false;
 	memset(&m_sAudioFmt, 0, sizeof(m_sAudioFmt));
+	m_ringAudio.unInit();
 
-	{
-		CAutoLock oLock(m_mutexAudio, "unInitAudio");
-		while (!m_queueAudio.empty())
-		{
-			SDemoAudioFrame* pAudioFrame = m_queueAudio.front();
-			delete[] pAudioFrame->data;
-			delete pAudioFrame;
-			m_queueAudio.pop();
-		}
-	}
+	m_nPlayoutSeq.fetch_add(1, std::memory_order_acq_rel);
+	m_sPlayout.valid = false;
+	m_nPlayoutSeq.fetch_add(1, std::memory_order_release);
 
 	if (m_fileWav != NULL) {
 		fclose(m_fileWav);
@@ -340,30 +367,118 @@ void CSDLPlayer::unInitAudio()
 void CSDLPlayer::sdlAudioCallback(void* userdata, Uint8* stream, int len)
 {
 	CSDLPlayer* pThis = (CSDLPlayer*)userdata;
-	int needLen = len;
-	int streamPos = 0;
-	memset(stream, 0, len);
-
-	CAutoLock oLock(pThis->m_mutexAudio, "sdlAudioCallback");
-	while (!pThis->m_queueAudio.empty())
-	{
-		SDemoAudioFrame* pAudioFrame = pThis->m_queueAudio.front();
-		int pos = pAudioFrame->dataTotal - pAudioFrame->dataLeft;
-		int readLen = min(pAudioFrame->dataLeft, needLen);
-
-		//SDL_MixAudio(stream + streamPos, pAudioFrame->data + pos, readLen, 100);
-		memcpy(stream + streamPos, pAudioFrame->data + pos, readLen);
-
-		pAudioFrame->dataLeft -= readLen;
-		needLen -= readLen;
-		streamPos += readLen;
-		if (pAudioFrame->dataLeft <= 0) {
-			pThis->m_queueAudio.pop();
-			delete[] pAudioFrame->data;
-			delete pAudioFrame;
+	long long now = nowUs();
+	unsigned int pts = 0;
+
+	int readLen = pThis->m_ringAudio.read(stream, len, &pts);
+	if (readLen > 0) {
+		int frameBytes = pThis->m_ringAudio.frameBytes();
+		if (pThis->m_bConcealed) {
+			// Fade back in after a gap so the seam does not click
+			short* samples = (short*)stream;
+			int count = min(readLen, AUDIO_CONCEAL_SAMPLES * frameBytes) / 2;
+			for (int i = 0; i < count; i++) {
+				samples[i] = (short)(samples[i] * i / count);
+			}
+			pThis->m_bConcealed = false;
 		}
-		if (needLen <= 0) {
-			break;
+		// Remember the tail, it is what an underrun gets bridged with
+		int keep = min(readLen, (int)sizeof(pThis->m_concealBuf));
+		memcpy(pThis->m_concealBuf, stream + readLen - keep, keep);
+		pThis->m_nConcealLen = keep;
+		pThis->m_nConcealPos = 0;
+
+		// Samples handed over now play after the ones already queued in the device
+		SDemoPlayout* playout = &pThis->m_sPlayout;
+		pThis->m_nPlayoutSeq.fetch_add(1, std::memory_order_acq_rel);
+		playout->pts = pts - pThis->m_nAudioDeviceSamples;
+		playout->sampleRate = pThis->m_ringAudio.sampleRate();
+		playout->timeUs = now;
+		playout->valid = true;
+		pThis->m_nPlayoutSeq.fetch_add(1, std::memory_order_release);
+	}
+	if (readLen < len) {
+		pThis->m_nAudioUnderruns++;
+		pThis->concealAudio(stream + readLen, len - readLen);
+	}
+}
+
+void CSDLPlayer::concealAudio(Uint8* stream, int len)
+{
+	// Repeat the last samples with a falling gain, then go silent
+	short* out = (short*)stream;
+	int count = len / 2;
+	int concealCount = m_nConcealLen / 2;
+	int i = 0;
+	if (concealCount > 0) {
+		short* in = (short*)m_concealBuf;
+		for (; i < count && m_nConcealPos < concealCount; i++, m_nConcealPos++) {
+			int gain = concealCount - m_nConcealPos;
+			out[i] = (short)(in[m_nConcealPos] * gain / concealCount);
 		}
 	}
+	memset(out + i, 0, (count - i) * 2);
+	m_bConcealed = true;
+}
+
+bool CSDLPlayer::getAudioPlayout(SDemoPlayout* playout)
+{
+	unsigned int seq;
+	do {
+		seq = m_nPlayoutSeq.load(std::memory_order_acquire);
+		*playout = m_sPlayout;
+	} while ((seq & 1) || seq != m_nPlayoutSeq.load(std::memory_order_acquire));
+	return playout->valid;
+}
+
+bool CSDLPlayer::getAudioClockUs(long long now, long long* clockUs)
+{
+	SDemoPlayout playout;
+	if (!getAudioPlayout(&playout) || playout.sampleRate == 0) {
+		return false;
+	}
+	// A callback that has not run for a while means audio stopped
+	if (now - playout.timeUs > 200000) {
+		return false;
+	}
+
+	unsigned int seq;
+	unsigned int mapRtp;
+	long long mapNtp;
+	do {
+		seq = m_nAudioMapSeq.load(std::memory_order_acquire);
+		mapRtp = m_nAudioMapRtp;
+		mapNtp = m_llAudioMapNtp;
+	} while ((seq & 1) || seq != m_nAudioMapSeq.load(std::memory_order_acquire));
+	if (mapNtp == 0) {
+		return false;
+	}
+
+	long long delta = (int)(playout.pts - mapRtp);
+	*clockUs = mapNtp + delta * 1000000 / playout.sampleRate + (now - playout.timeUs);
+	return true;
+}
+
+void CSDLPlayer::printSyncStats()
+{
+	static const char* s_clockNames[] = { "none", "audio", "free-run" };
+	SDemoSyncStats stats;
+	m_scheduler.getStats(&stats);
+	printf("sync: clock=%s shown=%u late=%u overflow=%u resync=%u "
+		"error last=%lldus mean=%lldus max=%lldus underruns=%u audio=%ums\n",
+		s_clockNames[stats.clockSource], stats.framesShown, stats.framesLate,
+		stats.framesOverflow, stats.resyncs, stats.lastErrorUs, stats.meanAbsErrorUs,
+		stats.maxAbsErrorUs, stats.audioUnderruns, m_ringAudio.bufferedMs());
+}
+
+long long CSDLPlayer::nowUs()
+{
+	static LARGE_INTEGER s_freq = { 0 };
+	LARGE_INTEGER counter;
+	if (s_freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&s_freq);
+	}
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart / s_freq.QuadPart * 1000000 +
+		counter.QuadPart % s_freq.QuadPart * 1000000 / s_freq.QuadPart;
 }
@@ -6,21 +6,31 @@
 #include "SDL_thread.h"
 #undef main 
 #include "CAirServer.h"
+#include "CAudioRing.h"
+#include "CVideoScheduler.h"
 
 typedef void sdlAudioCallback(void* userdata, Uint8* stream, int len);
 
-typedef struct SDemoAudioFrame {
-	unsigned long long pts;
-	unsigned int dataTotal;
-	unsigned int dataLeft;
-	unsigned char* data;
-} SDemoAudioFrame;
-
-typedef std::queue<SDemoAudioFrame*> SDemoAudioFrameQueue;
 typedef std::queue<SFgVideoFrame*> SFgVideoFrameQueue;
 
 #define VIDEO_SIZE_CHANGED_CODE 1
 
+// Audio kept in the ring, and how much must be there before playback starts
+#define AUDIO_RING_MS		500
+#define AUDIO_PREBUFFER_MS	100
+// Samples the SDL device asks for per callback
+#define AUDIO_DEVICE_SAMPLES	1024
+// Longest stretch an underrun is bridged by repeating the last samples
+#define AUDIO_CONCEAL_SAMPLES	480
+
+// Audio sample currently leaving the speaker, in RTP timestamp units
+typedef struct SDemoPlayout {
+	unsigned int pts;
+	unsigned int sampleRate;
+	long long timeUs;		// local time pts was sampled at
+	bool valid;
+} SDemoPlayout;
+
 class CSDLPlayer
 {
 public:
@@ -33,12 +43,21 @@ public:
 
 	void outputVideo(SFgVideoFrame* data);
 	void outputAudio(SFgAudioFrame* data);
+	void displayVideo(SFgVideoFrame* data);
+	void printSyncStats();
 
 	void initVideo(int width, int height);
 	void unInitVideo();
 	void initAudio(SFgAudioFrame* data);
 	void unInitAudio();
 	static void sdlAudioCallback(void* userdata, Uint8* stream, int len);
+	void concealAudio(Uint8* stream, int len);
+
+	// Safe to call from any thread
+	bool getAudioPlayout(SDemoPlayout* playout);
+	// Sender NTP time (us) of the audio being heard at local time now
+	bool getAudioClockUs(long long now, long long* clockUs);
+	static long long nowUs();
 
 	SDL_Surface* m_surface;
 	//SDL_VideoInfo* vi;
@@ -47,8 +66,27 @@ public:
 
 	SFgAudioFrame m_sAudioFmt;
 	bool m_bAudioInited;
-	SDemoAudioFrameQueue m_queueAudio;
-	HANDLE m_mutexAudio;
+	bool m_bAudioPlaying;
+	CAudioRing m_ringAudio;
+	unsigned int m_nAudioDeviceSamples;
+	unsigned int m_nAudioUnderruns;
+
+	// Owned by the audio callback
+	short m_concealBuf[AUDIO_CONCEAL_SAMPLES * 2];
+	int m_nConcealLen;
+	int m_nConcealPos;
+	bool m_bConcealed;
+
+	// Playout position published by the audio callback, seqlock protected
+	std::atomic<unsigned int> m_nPlayoutSeq;
+	SDemoPlayout m_sPlayout;
+
+	// RTP to sender NTP mapping from the latest frame, seqlock protected
+	std::atomic<unsigned int> m_nAudioMapSeq;
+	unsigned int m_nAudioMapRtp;
+	long long m_llAudioMapNtp;
+
+	CVideoScheduler m_scheduler;
 	HANDLE m_mutexVideo;
 
 	SDL_Event m_evtVideoSizeChange;
@@ -0,0 +1,252 @@
+#include "CVideoScheduler.h"
+#include "CSDLPlayer.h"
+#include "CAutoLock.h"
+
+CVideoScheduler::CVideoScheduler(CSDLPlayer* pPlayer)
+	: m_pPlayer(pPlayer)
+	, m_hThread(NULL)
+	, m_bQuit(false)
+	, m_nFlushes(0)
+	, m_bAnchored(false)
+	, m_llAnchorPts(0)
+	, m_llAnchorTime(0)
+	, m_bResynced(false)
+	, m_llAbsErrorSum(0)
+{
+	ZeroMemory(m_slots, sizeof(m_slots));
+	ZeroMemory(&m_stats, sizeof(m_stats));
+	for (int i = 0; i < VIDEO_SCHEDULE_SLOTS; i++) {
+		m_free.push_back(&m_slots[i]);
+	}
+	m_hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_mutexQueue = CreateMutex(NULL, FALSE, NULL);
+	m_mutexStats = CreateMutex(NULL, FALSE, NULL);
+}
+
+CVideoScheduler::~CVideoScheduler()
+{
+	stop();
+	for (int i = 0; i < VIDEO_SCHEDULE_SLOTS; i++) {
+		delete[] m_slots[i].frame.data;
+	}
+	CloseHandle(m_hEvent);
+	CloseHandle(m_mutexQueue);
+	CloseHandle(m_mutexStats);
+}
+
+void CVideoScheduler::start()
+{
+	if (m_hThread != NULL) {
+		return;
+	}
+	m_bQuit = false;
+	m_hThread = CreateThread(NULL, 0, presentThread, this, 0, NULL);
+}
+
+void CVideoScheduler::stop()
+{
+	if (m_hThread == NULL) {
+		return;
+	}
+	m_bQuit = true;
+	SetEvent(m_hEvent);
+	WaitForSingleObject(m_hThread, INFINITE);
+	CloseHandle(m_hThread);
+	m_hThread = NULL;
+	flush();
+}
+
+void CVideoScheduler::flush()
+{
+	CAutoLock oLock(m_mutexQueue, "flush");
+	while (!m_pending.empty()) {
+		m_free.push_back(m_pending.front());
+		m_pending.pop_front();
+	}
+	m_nFlushes++;
+	m_bAnchored = false;
+	m_bResynced = false;
+}
+
+void CVideoScheduler::push(SFgVideoFrame* frame)
+{
+	SDemoVideoSlot* slot = NULL;
+	{
+		CAutoLock oLock(m_mutexQueue, "push");
+		if (!m_free.empty()) {
+			slot = m_free.back();
+			m_free.pop_back();
+		}
+		else if (!m_pending.empty()) {
+			// Presentation fell behind, the oldest frame is the least useful
+			slot = m_pending.front();
+			m_pending.pop_front();
+			CAutoLock oStatsLock(m_mutexStats, "push");
+			m_stats.framesOverflow++;
+		}
+	}
+	if (slot == NULL) {
+		return;
+	}
+
+	if (slot->capacity < frame->dataTotalLen) {
+		delete[] slot->frame.data;
+		slot->frame.data = new unsigned char[frame->dataTotalLen];
+		slot->capacity = frame->dataTotalLen;
+	}
+	unsigned char* data = slot->frame.data;
+	slot->frame = *frame;
+	slot->frame.data = data;
+	memcpy(slot->frame.data, frame->data, frame->dataTotalLen);
+
+	{
+		CAutoLock oLock(m_mutexQueue, "push");
+		m_pending.push_back(slot);
+	}
+	SetEvent(m_hEvent);
+}
+
+void CVideoScheduler::releaseSlot(SDemoVideoSlot* slot)
+{
+	CAutoLock oLock(m_mutexQueue, "releaseSlot");
+	m_free.push_back(slot);
+}
+
+// Gives back a slot the presenter took but did not show yet, unless the
+// queue was flushed meanwhile
+void CVideoScheduler::requeueSlot(SDemoVideoSlot* slot, unsigned int flushes)
+{
+	CAutoLock oLock(m_mutexQueue, "requeueSlot");
+	if (flushes == m_nFlushes) {
+		m_pending.push_front(slot);
+	}
+	else {
+		m_free.push_back(slot);
+	}
+}
+
+void CVideoScheduler::getStats(SDemoSyncStats* stats)
+{
+	CAutoLock oLock(m_mutexStats, "getStats");
+	*stats = m_stats;
+}
+
+void CVideoScheduler::updateStats(long long errorUs)
+{
+	long long absError = errorUs < 0 ? -errorUs : errorUs;
+
+	CAutoLock oLock(m_mutexStats, "updateStats");
+	m_stats.framesShown++;
+	m_stats.lastErrorUs = errorUs;
+	m_llAbsErrorSum += absError;
+	m_stats.meanAbsErrorUs = m_llAbsErrorSum / m_stats.framesShown;
+	if (absError > m_stats.maxAbsErrorUs) {
+		m_stats.maxAbsErrorUs = absError;
+	}
+}
+
+long long CVideoScheduler::clockUs(long long now, int* source)
+{
+	long long audioClock = 0;
+	bool bAudio = m_pPlayer->getAudioClockUs(now, &audioClock);
+	if (bAudio && m_bResynced) {
+		long long drift = audioClock - (m_llAnchorPts + (now - m_llAnchorTime));
+		if (drift > VIDEO_RESYNC_US || drift < -VIDEO_RESYNC_US) {
+			bAudio = false;
+		}
+		else {
+			m_bResynced = false;
+		}
+	}
+	if (bAudio) {
+		// Keep the free running clock in step so losing audio does not jump
+		m_llAnchorPts = audioClock;
+		m_llAnchorTime = now;
+		m_bAnchored = true;
+		*source = DEMO_CLOCK_AUDIO;
+		return audioClock;
+	}
+	if (!m_bAnchored) {
+		*source = DEMO_CLOCK_NONE;
+		return 0;
+	}
+	*source = DEMO_CLOCK_FREE_RUN;
+	return m_llAnchorPts + (now - m_llAnchorTime);
+}
+
+DWORD WINAPI CVideoScheduler::presentThread(LPVOID param)
+{
+	CVideoScheduler* pThis = (CVideoScheduler*)param;
+	pThis->presentLoop();
+	return 0;
+}
+
+void CVideoScheduler::presentLoop()
+{
+	while (!m_bQuit) {
+		SDemoVideoSlot* slot = NULL;
+		unsigned int flushes = 0;
+		{
+			CAutoLock oLock(m_mutexQueue, "presentLoop");
+			if (!m_pending.empty()) {
+				slot = m_pending.front();
+				m_pending.pop_front();
+			}
+			flushes = m_nFlushes;
+		}
+		if (slot == NULL) {
+			WaitForSingleObject(m_hEvent, 100);
+			continue;
+		}
+
+		long long now = CSDLPlayer::nowUs();
+		long long pts = (long long)slot->frame.pts;
+		int source = DEMO_CLOCK_NONE;
+		long long clock = clockUs(now, &source);
+		long long early = pts - clock;
+
+		if (source == DEMO_CLOCK_NONE || early > VIDEO_RESYNC_US || early < -VIDEO_RESYNC_US) {
+			// First frame, or sender and clock disagree completely: restart
+			// the timeline on this frame. It free runs from there until the
+			// audio clock agrees again, so the frame is due next pass.
+			m_llAnchorPts = pts - VIDEO_FREE_RUN_DELAY_US;
+			m_llAnchorTime = now;
+			m_bAnchored = true;
+			if (source != DEMO_CLOCK_NONE) {
+				m_bResynced = true;
+				CAutoLock oLock(m_mutexStats, "presentLoop");
+				m_stats.resyncs++;
+			}
+			requeueSlot(slot, flushes);
+			continue;
+		}
+		if (early > 1000) {
+			// Not due yet, a new frame also wakes us to re-evaluate
+			DWORD waitMs = (DWORD)min(early / 1000, 20);
+			requeueSlot(slot, flushes);
+			WaitForSingleObject(m_hEvent, waitMs);
+			continue;
+		}
+
+		bool hasNext = false;
+		{
+			CAutoLock oLock(m_mutexQueue, "presentLoop");
+			hasNext = !m_pending.empty();
+		}
+		{
+			CAutoLock oLock(m_mutexStats, "presentLoop");
+			m_stats.clockSource = source;
+			m_stats.audioUnderruns = m_pPlayer->m_nAudioUnderruns;
+		}
+
+		if (early < -VIDEO_LATE_US && hasNext) {
+			CAutoLock oLock(m_mutexStats, "presentLoop");
+			m_stats.framesLate++;
+		}
+		else {
+			m_pPlayer->displayVideo(&slot->frame);
+			updateStats(early);
+		}
+		releaseSlot(slot);
+	}
+}
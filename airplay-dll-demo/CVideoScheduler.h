@@ -0,0 +1,89 @@
+#pragma once
+#include <Windows.h>
+#include <deque>
+#include <vector>
+#include "Airplay2Head.h"
+
+class CSDLPlayer;
+
+// Decoded frames waiting for their presentation time
+#define VIDEO_SCHEDULE_SLOTS	8
+// A frame later than this is dropped when a newer one is already waiting
+#define VIDEO_LATE_US			40000
+// Beyond this distance from the clock the timeline is considered broken
+#define VIDEO_RESYNC_US			1000000
+// Presentation delay used when there is no audio to follow
+#define VIDEO_FREE_RUN_DELAY_US	80000
+
+enum EDemoClockSource {
+	DEMO_CLOCK_NONE = 0,
+	DEMO_CLOCK_AUDIO,
+	DEMO_CLOCK_FREE_RUN,
+};
+
+typedef struct SDemoSyncStats {
+	unsigned int framesShown;
+	unsigned int framesLate;		// dropped because the clock was past them
+	unsigned int framesOverflow;	// dropped because the queue was full
+	unsigned int resyncs;
+	long long lastErrorUs;			// shown pts minus clock, negative is late
+	long long meanAbsErrorUs;
+	long long maxAbsErrorUs;
+	int clockSource;
+	unsigned int audioUnderruns;
+} SDemoSyncStats;
+
+typedef struct SDemoVideoSlot {
+	SFgVideoFrame frame;
+	unsigned int capacity;
+} SDemoVideoSlot;
+
+// Queues decoded frames by pts and presents them against the audio playout
+// clock, or against a free running clock anchored on the sender timeline.
+class CVideoScheduler
+{
+public:
+	CVideoScheduler(CSDLPlayer* pPlayer);
+	~CVideoScheduler();
+
+	void start();
+	void stop();
+
+	// Decoder thread, copies the frame
+	void push(SFgVideoFrame* frame);
+	void getStats(SDemoSyncStats* stats);
+
+protected:
+	static DWORD WINAPI presentThread(LPVOID param);
+	void presentLoop();
+	void flush();
+	long long clockUs(long long now, int* source);
+	void releaseSlot(SDemoVideoSlot* slot);
+	void requeueSlot(SDemoVideoSlot* slot, unsigned int flushes);
+	void updateStats(long long errorUs);
+
+protected:
+	CSDLPlayer*					m_pPlayer;
+	HANDLE						m_hThread;
+	HANDLE						m_hEvent;
+	HANDLE						m_mutexQueue;
+	volatile bool				m_bQuit;
+
+	SDemoVideoSlot				m_slots[VIDEO_SCHEDULE_SLOTS];
+	std::vector<SDemoVideoSlot*>	m_free;
+	std::deque<SDemoVideoSlot*>	m_pending;
+	// The presenter takes the front slot out of m_pending while it looks at
+	// it, so push and flush never touch a frame that may be on screen
+	unsigned int				m_nFlushes;
+
+	// Free running clock, presentation thread only
+	bool						m_bAnchored;
+	long long					m_llAnchorPts;
+	long long					m_llAnchorTime;
+	// Set by a resync, the audio clock is ignored until it is back in range
+	bool						m_bResynced;
+
+	HANDLE						m_mutexStats;
+	SDemoSyncStats				m_stats;
+	long long					m_llAbsErrorSum;
+};
@@ -0,0 +1,388 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* Times the request body parsing done by the /play and SETUP handlers, once
+ * with the bplist cursor they use now and once with plist_from_bin and the
+ * plist_get_*_val getters they used before. Both sides read the same fields
+ * as the handlers and copy strings and data out the way the handlers do.
+ *
+ * The bodies are binary plists with the keys, types and sizes an iOS 16
+ * sender puts in them: the /play request of a video app, the session SETUP
+ * with the FairPlay key, then the mirroring and the audio stream SETUPs. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bplist.h"
+#include "plist/plist.h"
+
+#define DEFAULT_ITERATIONS 200000
+
+static const unsigned char play_body[898] = {
+	0x62, 0x70, 0x6c, 0x69, 0x73, 0x74, 0x30, 0x30, 0xdc, 0x01, 0x02, 0x03,
+	0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x5f, 0x10, 0x10,
+	0x43, 0x6f, 0x6e, 0x74, 0x65, 0x6e, 0x74, 0x2d, 0x4c, 0x6f, 0x63, 0x61,
+	0x74, 0x69, 0x6f, 0x6e, 0x5e, 0x53, 0x74, 0x61, 0x72, 0x74, 0x2d, 0x50,
+	0x6f, 0x73, 0x69, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x10, 0x16, 0x53, 0x74,
+	0x61, 0x72, 0x74, 0x2d, 0x50, 0x6f, 0x73, 0x69, 0x74, 0x69, 0x6f, 0x6e,
+	0x2d, 0x53, 0x65, 0x63, 0x6f, 0x6e, 0x64, 0x73, 0x56, 0x76, 0x6f, 0x6c,
+	0x75, 0x6d, 0x65, 0x54, 0x72, 0x61, 0x74, 0x65, 0x54, 0x75, 0x75, 0x69,
+	0x64, 0x5f, 0x10, 0x14, 0x70, 0x6c, 0x61, 0x79, 0x62, 0x61, 0x63, 0x6b,
+	0x52, 0x65, 0x73, 0x74, 0x72, 0x69, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x73,
+	0x5e, 0x63, 0x6c, 0x69, 0x65, 0x6e, 0x74, 0x50, 0x72, 0x6f, 0x63, 0x4e,
+	0x61, 0x6d, 0x65, 0x5e, 0x63, 0x6c, 0x69, 0x65, 0x6e, 0x74, 0x42, 0x75,
+	0x6e, 0x64, 0x6c, 0x65, 0x49, 0x44, 0x5f, 0x10, 0x10, 0x53, 0x65, 0x6e,
+	0x64, 0x65, 0x72, 0x4d, 0x41, 0x43, 0x41, 0x64, 0x64, 0x72, 0x65, 0x73,
+	0x73, 0x55, 0x6d, 0x6f, 0x64, 0x65, 0x6c, 0x5f, 0x10, 0x22, 0x6d, 0x69,
+	0x67, 0x68, 0x74, 0x53, 0x75, 0x70, 0x70, 0x6f, 0x72, 0x74, 0x53, 0x74,
+	0x6f, 0x72, 0x65, 0x50, 0x61, 0x73, 0x74, 0x69, 0x73, 0x4b, 0x65, 0x79,
+	0x52, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x73, 0x5f, 0x11, 0x01, 0xc9,
+	0x68, 0x74, 0x74, 0x70, 0x73, 0x3a, 0x2f, 0x2f, 0x72, 0x34, 0x2d, 0x2d,
+	0x2d, 0x73, 0x6e, 0x2d, 0x34, 0x67, 0x35, 0x65, 0x36, 0x6e, 0x73, 0x7a,
+	0x2e, 0x67, 0x6f, 0x6f, 0x67, 0x6c, 0x65, 0x76, 0x69, 0x64, 0x65, 0x6f,
+	0x2e, 0x63, 0x6f, 0x6d, 0x2f, 0x76, 0x69, 0x64, 0x65, 0x6f, 0x70, 0x6c,
+	0x61, 0x79, 0x62, 0x61, 0x63, 0x6b, 0x3f, 0x65, 0x78, 0x70, 0x69, 0x72,
+	0x65, 0x3d, 0x31, 0x37, 0x36, 0x30, 0x39, 0x30, 0x30, 0x30, 0x30, 0x30,
+	0x26, 0x65, 0x69, 0x3d, 0x61, 0x62, 0x63, 0x64, 0x45, 0x46, 0x47, 0x48,
+	0x26, 0x69, 0x70, 0x3d, 0x31, 0x39, 0x32, 0x2e, 0x30, 0x2e, 0x32, 0x2e,
+	0x31, 0x30, 0x26, 0x69, 0x64, 0x3d, 0x6f, 0x2d, 0x41, 0x62, 0x43, 0x64,
+	0x45, 0x66, 0x47, 0x68, 0x49, 0x6a, 0x4b, 0x6c, 0x4d, 0x6e, 0x4f, 0x70,
+	0x51, 0x72, 0x53, 0x74, 0x55, 0x76, 0x57, 0x78, 0x59, 0x7a, 0x30, 0x31,
+	0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x26, 0x69, 0x74, 0x61,
+	0x67, 0x3d, 0x32, 0x32, 0x26, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 0x3d,
+	0x79, 0x6f, 0x75, 0x74, 0x75, 0x62, 0x65, 0x26, 0x72, 0x65, 0x71, 0x75,
+	0x69, 0x72, 0x65, 0x73, 0x73, 0x6c, 0x3d, 0x79, 0x65, 0x73, 0x26, 0x6d,
+	0x69, 0x6d, 0x65, 0x3d, 0x76, 0x69, 0x64, 0x65, 0x6f, 0x25, 0x32, 0x46,
+	0x6d, 0x70, 0x34, 0x26, 0x64, 0x75, 0x72, 0x3d, 0x32, 0x31, 0x32, 0x2e,
+	0x30, 0x39, 0x31, 0x26, 0x6c, 0x6d, 0x74, 0x3d, 0x31, 0x37, 0x30, 0x30,
+	0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+	0x26, 0x72, 0x61, 0x74, 0x65, 0x62, 0x79, 0x70, 0x61, 0x73, 0x73, 0x3d,
+	0x79, 0x65, 0x73, 0x26, 0x73, 0x70, 0x61, 0x72, 0x61, 0x6d, 0x73, 0x3d,
+	0x65, 0x78, 0x70, 0x69, 0x72, 0x65, 0x25, 0x32, 0x43, 0x65, 0x69, 0x25,
+	0x32, 0x43, 0x69, 0x70, 0x25, 0x32, 0x43, 0x69, 0x64, 0x25, 0x32, 0x43,
+	0x69, 0x74, 0x61, 0x67, 0x25, 0x32, 0x43, 0x73, 0x6f, 0x75, 0x72, 0x63,
+	0x65, 0x25, 0x32, 0x43, 0x72, 0x65, 0x71, 0x75, 0x69, 0x72, 0x65, 0x73,
+	0x73, 0x6c, 0x25, 0x32, 0x43, 0x6d, 0x69, 0x6d, 0x65, 0x25, 0x32, 0x43,
+	0x64, 0x75, 0x72, 0x25, 0x32, 0x43, 0x6c, 0x6d, 0x74, 0x25, 0x32, 0x43,
+	0x72, 0x61, 0x74, 0x65, 0x62, 0x79, 0x70, 0x61, 0x73, 0x73, 0x26, 0x73,
+	0x69, 0x67, 0x3d, 0x41, 0x4f, 0x71, 0x30, 0x51, 0x4a, 0x38, 0x77, 0x52,
+	0x51, 0x49, 0x68, 0x41, 0x4b, 0x7a, 0x34, 0x78, 0x59, 0x77, 0x56, 0x74,
+	0x37, 0x71, 0x39, 0x6c, 0x5a, 0x33, 0x6d, 0x32, 0x6e, 0x31, 0x70, 0x30,
+	0x6f, 0x39, 0x69, 0x38, 0x75, 0x37, 0x79, 0x36, 0x74, 0x35, 0x72, 0x34,
+	0x65, 0x33, 0x77, 0x32, 0x71, 0x31, 0x41, 0x69, 0x42, 0x78, 0x78, 0x78,
+	0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78, 0x78,
+	0x78, 0x23, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x23, 0x40,
+	0x29, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x23, 0x3f, 0xf0, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x5f, 0x10, 0x24, 0x38, 0x46, 0x33, 0x43, 0x32,
+	0x41, 0x31, 0x30, 0x2d, 0x36, 0x42, 0x34, 0x44, 0x2d, 0x34, 0x45, 0x31,
+	0x46, 0x2d, 0x39, 0x41, 0x37, 0x42, 0x2d, 0x31, 0x43, 0x32, 0x44, 0x33,
+	0x45, 0x34, 0x46, 0x35, 0x41, 0x36, 0x42, 0x10, 0x00, 0x57, 0x59, 0x6f,
+	0x75, 0x54, 0x75, 0x62, 0x65, 0x5f, 0x10, 0x16, 0x63, 0x6f, 0x6d, 0x2e,
+	0x67, 0x6f, 0x6f, 0x67, 0x6c, 0x65, 0x2e, 0x69, 0x6f, 0x73, 0x2e, 0x79,
+	0x6f, 0x75, 0x74, 0x75, 0x62, 0x65, 0x5f, 0x10, 0x11, 0x41, 0x41, 0x3a,
+	0x42, 0x42, 0x3a, 0x43, 0x43, 0x3a, 0x44, 0x44, 0x3a, 0x45, 0x45, 0x3a,
+	0x46, 0x46, 0x5a, 0x69, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x31, 0x34, 0x2c,
+	0x35, 0x09, 0x00, 0x08, 0x00, 0x21, 0x00, 0x34, 0x00, 0x43, 0x00, 0x5c,
+	0x00, 0x63, 0x00, 0x68, 0x00, 0x6d, 0x00, 0x84, 0x00, 0x93, 0x00, 0xa2,
+	0x00, 0xb5, 0x00, 0xbb, 0x00, 0xe0, 0x02, 0xad, 0x02, 0xb6, 0x02, 0xbf,
+	0x02, 0xc8, 0x02, 0xef, 0x02, 0xf1, 0x02, 0xf9, 0x03, 0x12, 0x03, 0x26,
+	0x03, 0x31, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x32,
+};
+
+static const unsigned char setup_session_body[664] = {
+	0x62, 0x70, 0x6c, 0x69, 0x73, 0x74, 0x30, 0x30, 0xdf, 0x10, 0x11, 0x01,
+	0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+	0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x58, 0x64, 0x65,
+	0x76, 0x69, 0x63, 0x65, 0x49, 0x44, 0x5b, 0x73, 0x65, 0x73, 0x73, 0x69,
+	0x6f, 0x6e, 0x55, 0x55, 0x49, 0x44, 0x5e, 0x74, 0x69, 0x6d, 0x69, 0x6e,
+	0x67, 0x50, 0x72, 0x6f, 0x74, 0x6f, 0x63, 0x6f, 0x6c, 0x5a, 0x74, 0x69,
+	0x6d, 0x69, 0x6e, 0x67, 0x50, 0x6f, 0x72, 0x74, 0x54, 0x65, 0x6b, 0x65,
+	0x79, 0x53, 0x65, 0x69, 0x76, 0x52, 0x65, 0x74, 0x5f, 0x10, 0x18, 0x69,
+	0x73, 0x53, 0x63, 0x72, 0x65, 0x65, 0x6e, 0x4d, 0x69, 0x72, 0x72, 0x6f,
+	0x72, 0x69, 0x6e, 0x67, 0x53, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x5a,
+	0x6d, 0x61, 0x63, 0x41, 0x64, 0x64, 0x72, 0x65, 0x73, 0x73, 0x55, 0x6d,
+	0x6f, 0x64, 0x65, 0x6c, 0x54, 0x6e, 0x61, 0x6d, 0x65, 0x5e, 0x6f, 0x73,
+	0x42, 0x75, 0x69, 0x6c, 0x64, 0x56, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e,
+	0x56, 0x6f, 0x73, 0x4e, 0x61, 0x6d, 0x65, 0x59, 0x6f, 0x73, 0x56, 0x65,
+	0x72, 0x73, 0x69, 0x6f, 0x6e, 0x5d, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65,
+	0x56, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x5f, 0x10, 0x16, 0x73, 0x74,
+	0x61, 0x74, 0x73, 0x43, 0x6f, 0x6c, 0x6c, 0x65, 0x63, 0x74, 0x69, 0x6f,
+	0x6e, 0x45, 0x6e, 0x61, 0x62, 0x6c, 0x65, 0x64, 0x5e, 0x74, 0x69, 0x6d,
+	0x69, 0x6e, 0x67, 0x50, 0x65, 0x65, 0x72, 0x49, 0x6e, 0x66, 0x6f, 0x5f,
+	0x10, 0x11, 0x41, 0x41, 0x3a, 0x42, 0x42, 0x3a, 0x43, 0x43, 0x3a, 0x44,
+	0x44, 0x3a, 0x45, 0x45, 0x3a, 0x46, 0x46, 0x5f, 0x10, 0x24, 0x46, 0x31,
+	0x45, 0x32, 0x44, 0x33, 0x43, 0x34, 0x2d, 0x42, 0x35, 0x41, 0x36, 0x2d,
+	0x34, 0x37, 0x39, 0x38, 0x2d, 0x38, 0x41, 0x39, 0x42, 0x2d, 0x30, 0x43,
+	0x31, 0x44, 0x32, 0x45, 0x33, 0x46, 0x34, 0x41, 0x35, 0x42, 0x53, 0x4e,
+	0x54, 0x50, 0x11, 0xdf, 0xf3, 0x4f, 0x10, 0x48, 0x52, 0xf2, 0x26, 0x65,
+	0xa6, 0x0c, 0x12, 0xd2, 0x89, 0x18, 0x5d, 0x95, 0x0e, 0xe8, 0x81, 0x36,
+	0x09, 0x16, 0x6f, 0x6b, 0x11, 0x3d, 0x17, 0x8d, 0x6c, 0x0f, 0xd3, 0x90,
+	0x1f, 0xf2, 0x39, 0xa1, 0xa0, 0x95, 0xf2, 0x0f, 0x93, 0x95, 0x65, 0x0c,
+	0xf9, 0x38, 0x0b, 0x8e, 0xdb, 0x22, 0x4a, 0x6b, 0x24, 0x8a, 0x1e, 0x92,
+	0x4e, 0x8f, 0xd0, 0xae, 0x2e, 0x1a, 0x94, 0x92, 0xa3, 0x30, 0x5f, 0x18,
+	0x8c, 0xb6, 0x10, 0x90, 0x0f, 0x9e, 0x34, 0x7f, 0x4f, 0x10, 0x10, 0xae,
+	0x88, 0x6d, 0xc6, 0x50, 0x77, 0x95, 0xec, 0x74, 0x5c, 0x4c, 0x3f, 0xcb,
+	0x2e, 0xb2, 0xc7, 0x10, 0x20, 0x09, 0x5f, 0x10, 0x11, 0x41, 0x41, 0x3a,
+	0x42, 0x42, 0x3a, 0x43, 0x43, 0x3a, 0x44, 0x44, 0x3a, 0x45, 0x45, 0x3a,
+	0x46, 0x30, 0x5a, 0x69, 0x50, 0x68, 0x6f, 0x6e, 0x65, 0x31, 0x34, 0x2c,
+	0x35, 0x6f, 0x10, 0x17, 0x00, 0x69, 0x00, 0x50, 0x00, 0x68, 0x00, 0x6f,
+	0x00, 0x6e, 0x00, 0x65, 0x00, 0x20, 0x00, 0x64, 0x00, 0x65, 0x00, 0x20,
+	0x00, 0x6c, 0x20, 0x19, 0x00, 0x75, 0x00, 0x74, 0x00, 0x69, 0x00, 0x6c,
+	0x00, 0x69, 0x00, 0x73, 0x00, 0x61, 0x00, 0x74, 0x00, 0x65, 0x00, 0x75,
+	0x00, 0x72, 0x55, 0x32, 0x30, 0x47, 0x37, 0x35, 0x59, 0x69, 0x50, 0x68,
+	0x6f, 0x6e, 0x65, 0x20, 0x4f, 0x53, 0x54, 0x31, 0x36, 0x2e, 0x36, 0x57,
+	0x36, 0x39, 0x30, 0x2e, 0x37, 0x2e, 0x31, 0x08, 0xd2, 0x23, 0x24, 0x25,
+	0x13, 0x59, 0x41, 0x64, 0x64, 0x72, 0x65, 0x73, 0x73, 0x65, 0x73, 0x52,
+	0x49, 0x44, 0xa2, 0x26, 0x27, 0x5a, 0x31, 0x39, 0x32, 0x2e, 0x30, 0x2e,
+	0x32, 0x2e, 0x31, 0x30, 0x57, 0x66, 0x65, 0x38, 0x30, 0x3a, 0x3a, 0x31,
+	0x00, 0x08, 0x00, 0x2d, 0x00, 0x36, 0x00, 0x42, 0x00, 0x51, 0x00, 0x5c,
+	0x00, 0x61, 0x00, 0x65, 0x00, 0x68, 0x00, 0x83, 0x00, 0x8e, 0x00, 0x94,
+	0x00, 0x99, 0x00, 0xa8, 0x00, 0xaf, 0x00, 0xb9, 0x00, 0xc7, 0x00, 0xe0,
+	0x00, 0xef, 0x01, 0x03, 0x01, 0x2a, 0x01, 0x2e, 0x01, 0x31, 0x01, 0x7c,
+	0x01, 0x8f, 0x01, 0x91, 0x01, 0x92, 0x01, 0xa6, 0x01, 0xb1, 0x01, 0xe2,
+	0x01, 0xe8, 0x01, 0xf2, 0x01, 0xf7, 0x01, 0xff, 0x02, 0x00, 0x02, 0x05,
+	0x02, 0x0f, 0x02, 0x12, 0x02, 0x15, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x02, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x02, 0x28,
+};
+
+static const unsigned char setup_mirror_body[188] = {
+	0x62, 0x70, 0x6c, 0x69, 0x73, 0x74, 0x30, 0x30, 0xd1, 0x01, 0x02, 0x57,
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x73, 0xa1, 0x03, 0xd3, 0x04, 0x05,
+	0x06, 0x07, 0x08, 0x09, 0x54, 0x74, 0x79, 0x70, 0x65, 0x5f, 0x10, 0x12,
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x43, 0x6f, 0x6e, 0x6e, 0x65, 0x63,
+	0x74, 0x69, 0x6f, 0x6e, 0x49, 0x44, 0x5d, 0x74, 0x69, 0x6d, 0x65, 0x73,
+	0x74, 0x61, 0x6d, 0x70, 0x49, 0x6e, 0x66, 0x6f, 0x10, 0x6e, 0x13, 0x12,
+	0x34, 0x56, 0x78, 0x90, 0xab, 0xcd, 0xef, 0xa5, 0x0a, 0x0d, 0x0f, 0x11,
+	0x13, 0xd1, 0x0b, 0x0c, 0x54, 0x6e, 0x61, 0x6d, 0x65, 0x55, 0x53, 0x75,
+	0x62, 0x53, 0x75, 0xd1, 0x0b, 0x0e, 0x55, 0x42, 0x65, 0x50, 0x78, 0x54,
+	0xd1, 0x0b, 0x10, 0x55, 0x41, 0x66, 0x50, 0x78, 0x54, 0xd1, 0x0b, 0x12,
+	0x55, 0x42, 0x65, 0x66, 0x45, 0x6e, 0xd1, 0x0b, 0x14, 0x55, 0x45, 0x6d,
+	0x45, 0x6e, 0x63, 0x08, 0x0b, 0x13, 0x15, 0x1c, 0x21, 0x36, 0x44, 0x46,
+	0x4f, 0x55, 0x58, 0x5d, 0x63, 0x66, 0x6c, 0x6f, 0x75, 0x78, 0x7e, 0x81,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x87,
+};
+
+static const unsigned char setup_audio_body[248] = {
+	0x62, 0x70, 0x6c, 0x69, 0x73, 0x74, 0x30, 0x30, 0xd1, 0x01, 0x02, 0x57,
+	0x73, 0x74, 0x72, 0x65, 0x61, 0x6d, 0x73, 0xa1, 0x03, 0xdc, 0x04, 0x05,
+	0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11,
+	0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x17, 0x54, 0x74,
+	0x79, 0x70, 0x65, 0x52, 0x63, 0x74, 0x53, 0x73, 0x70, 0x66, 0x52, 0x73,
+	0x72, 0x5b, 0x61, 0x75, 0x64, 0x69, 0x6f, 0x46, 0x6f, 0x72, 0x6d, 0x61,
+	0x74, 0x59, 0x61, 0x75, 0x64, 0x69, 0x6f, 0x4d, 0x6f, 0x64, 0x65, 0x5b,
+	0x63, 0x6f, 0x6e, 0x74, 0x72, 0x6f, 0x6c, 0x50, 0x6f, 0x72, 0x74, 0x57,
+	0x69, 0x73, 0x4d, 0x65, 0x64, 0x69, 0x61, 0x5a, 0x6c, 0x61, 0x74, 0x65,
+	0x6e, 0x63, 0x79, 0x4d, 0x61, 0x78, 0x5a, 0x6c, 0x61, 0x74, 0x65, 0x6e,
+	0x63, 0x79, 0x4d, 0x69, 0x6e, 0x5e, 0x72, 0x65, 0x64, 0x75, 0x6e, 0x64,
+	0x61, 0x6e, 0x74, 0x41, 0x75, 0x64, 0x69, 0x6f, 0x5b, 0x75, 0x73, 0x69,
+	0x6e, 0x67, 0x53, 0x63, 0x72, 0x65, 0x65, 0x6e, 0x10, 0x60, 0x10, 0x08,
+	0x11, 0x01, 0xe0, 0x11, 0xac, 0x44, 0x12, 0x01, 0x00, 0x00, 0x00, 0x57,
+	0x64, 0x65, 0x66, 0x61, 0x75, 0x6c, 0x74, 0x11, 0xdf, 0xf2, 0x09, 0x12,
+	0x00, 0x01, 0x58, 0x88, 0x11, 0x2b, 0x11, 0x10, 0x02, 0x08, 0x0b, 0x13,
+	0x15, 0x2e, 0x33, 0x36, 0x3a, 0x3d, 0x49, 0x53, 0x5f, 0x67, 0x72, 0x7d,
+	0x8c, 0x98, 0x9a, 0x9c, 0x9f, 0xa2, 0xa7, 0xaf, 0xb2, 0xb3, 0xb8, 0xbb,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x1b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xbd,
+};
+
+static const struct {
+	const char *name;
+	const unsigned char *data;
+	uint32_t len;
+} bodies[] = {
+	{ "play", play_body, sizeof(play_body) },
+	{ "setup session", setup_session_body, sizeof(setup_session_body) },
+	{ "setup mirror", setup_mirror_body, sizeof(setup_mirror_body) },
+	{ "setup audio", setup_audio_body, sizeof(setup_audio_body) },
+};
+
+/* Keeps the compiler from dropping reads whose results are unused */
+static volatile uint64_t sink;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+parse_bplist(const unsigned char *data, uint32_t len)
+{
+	bplist_t bplist;
+	uint64_t root, stream, value = 0, datalen = 0;
+	const uint8_t *bytes = NULL;
+	double real = 0;
+	char name[128];
+
+	if (bplist_init(&bplist, data, len) < 0) {
+		return -1;
+	}
+	root = bplist_root(&bplist);
+
+	/* airplay_handler_play */
+	bplist_get_real(&bplist, bplist_dict_get(&bplist, root, "Start-Position-Seconds"), &real);
+	bplist_get_real(&bplist, bplist_dict_get(&bplist, root, "Start-Position"), &real);
+	bplist_get_real(&bplist, bplist_dict_get(&bplist, root, "volume"), &real);
+	uint64_t url_node = bplist_dict_get(&bplist, root, "Content-Location");
+	uint64_t url_size = bplist_string_size(&bplist, url_node);
+	if (url_size > 0) {
+		char *url = malloc((size_t)url_size);
+		bplist_copy_string(&bplist, url_node, url, (int)url_size);
+		value += (unsigned char)url[0];
+		free(url);
+	}
+
+	/* raop_handler_setup */
+	stream = bplist_array_get(&bplist, bplist_dict_get(&bplist, root, "streams"), 0);
+	if (bplist_get_data(&bplist, bplist_dict_get(&bplist, root, "eiv"), &bytes, &datalen) == 0) {
+		bplist_get_data(&bplist, bplist_dict_get(&bplist, root, "ekey"), &bytes, &datalen);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, root, "timingPort"), &value);
+		bplist_copy_string(&bplist, bplist_dict_get(&bplist, root, "name"), name, sizeof(name));
+		bplist_copy_string(&bplist, bplist_dict_get(&bplist, root, "deviceID"), name, sizeof(name));
+	} else if (stream != BPLIST_NONE) {
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "type"), &value);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "streamConnectionID"), &value);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "audioFormat"), &value);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "ct"), &value);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "spf"), &value);
+		bplist_get_uint(&bplist, bplist_dict_get(&bplist, stream, "sr"), &value);
+	}
+	sink += value + datalen + (uint64_t)real;
+	return 0;
+}
+
+/* The plist getters assert on a missing node, the old handlers checked
+ * every lookup the same way */
+static void
+plist_uint(plist_t dict, const char *key, uint64_t *value)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node != NULL) {
+		plist_get_uint_val(node, value);
+	}
+}
+
+static void
+plist_real(plist_t dict, const char *key, double *value)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node != NULL) {
+		plist_get_real_val(node, value);
+	}
+}
+
+static int
+parse_plist(const unsigned char *data, uint32_t len)
+{
+	plist_t root = NULL, stream, node;
+	uint64_t value = 0, datalen = 0;
+	char *bytes = NULL, *str = NULL;
+	double real = 0;
+
+	plist_from_bin((const char *)data, len, &root);
+	if (root == NULL) {
+		return -1;
+	}
+
+	/* airplay_handler_play */
+	plist_real(root, "Start-Position-Seconds", &real);
+	plist_real(root, "Start-Position", &real);
+	plist_real(root, "volume", &real);
+	if ((node = plist_dict_get_item(root, "Content-Location")) != NULL) {
+		plist_get_string_val(node, &str);
+		value += (unsigned char)str[0];
+		free(str);
+	}
+
+	/* raop_handler_setup */
+	stream = plist_array_get_item(plist_dict_get_item(root, "streams"), 0);
+	if ((node = plist_dict_get_item(root, "eiv")) != NULL) {
+		plist_get_data_val(node, &bytes, &datalen);
+		free(bytes);
+		plist_get_data_val(plist_dict_get_item(root, "ekey"), &bytes, &datalen);
+		free(bytes);
+		plist_uint(root, "timingPort", &value);
+		plist_get_string_val(plist_dict_get_item(root, "name"), &str);
+		free(str);
+		plist_get_string_val(plist_dict_get_item(root, "deviceID"), &str);
+		free(str);
+	} else if (stream != NULL) {
+		plist_uint(stream, "type", &value);
+		plist_uint(stream, "streamConnectionID", &value);
+		plist_uint(stream, "audioFormat", &value);
+		plist_uint(stream, "ct", &value);
+		plist_uint(stream, "spf", &value);
+		plist_uint(stream, "sr", &value);
+	}
+	plist_free(root);
+	sink += value + datalen + (uint64_t)real;
+	return 0;
+}
+
+static double
+run(int (*parse)(const unsigned char *, uint32_t), const unsigned char *data, uint32_t len, int iterations)
+{
+	double start = now_ns();
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (parse(data, len) < 0) {
+			return -1;
+		}
+	}
+	return (now_ns() - start) / iterations;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	size_t i;
+
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	printf("%-14s %6s %12s %12s %8s\n", "body", "bytes", "bplist ns", "plist ns", "speedup");
+	for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+		/* One untimed pass each so both start with warm caches */
+		run(parse_bplist, bodies[i].data, bodies[i].len, iterations / 10 + 1);
+		run(parse_plist, bodies[i].data, bodies[i].len, iterations / 10 + 1);
+
+		double bp = run(parse_bplist, bodies[i].data, bodies[i].len, iterations);
+		double pl = run(parse_plist, bodies[i].data, bodies[i].len, iterations);
+		if (bp < 0 || pl < 0) {
+			fprintf(stderr, "%s: body does not parse\n", bodies[i].name);
+			return 1;
+		}
+		printf("%-14s %6u %12.0f %12.0f %7.1fx\n", bodies[i].name, bodies[i].len, bp, pl, pl / bp);
+	}
+	return 0;
+}
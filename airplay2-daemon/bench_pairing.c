@@ -0,0 +1,122 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* Times pairing_session_handshake, the part of pair-verify that runs on the
+ * httpd thread. bench-pairing uses the library as built, with the keygen
+ * pool, bench-pairing-nopool links a copy of pairing.c built with
+ * PAIRING_NO_KEYGEN so every handshake makes its key inline.
+ *
+ * Paced handshakes leave the keygen thread time to refill the pool between
+ * connections, as real senders do. Back to back handshakes drain it, that
+ * rate is what a burst of reconnecting senders sees. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pairing.h"
+
+#define DEFAULT_ITERATIONS  500
+#define PACE_US             2000
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+sleep_us(long us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+handshake(pairing_t *pairing, const unsigned char ecdh_key[32], const unsigned char ed_key[32], double *elapsed)
+{
+	pairing_session_t *session = pairing_session_init(pairing);
+	double start;
+	int ret;
+
+	if (session == NULL) {
+		return -1;
+	}
+	start = now_us();
+	ret = pairing_session_handshake(session, ecdh_key, ed_key);
+	*elapsed = now_us() - start;
+	pairing_session_destroy(session);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned char seed[32] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	unsigned char ecdh_key[32], ed_key[32];
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	pairing_t *pairing;
+	double *samples, total, start;
+	int i;
+
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	for (i = 0; i < 32; i++) {
+		ecdh_key[i] = (unsigned char)(i * 7 + 3);
+		ed_key[i] = (unsigned char)(i * 13 + 5);
+	}
+	samples = malloc(iterations * sizeof(double));
+	pairing = pairing_init_seed(seed);
+	if (samples == NULL || pairing == NULL) {
+		return 1;
+	}
+
+	total = 0;
+	for (i = 0; i < iterations; i++) {
+		sleep_us(PACE_US);
+		if (handshake(pairing, ecdh_key, ed_key, &samples[i]) < 0) {
+			fprintf(stderr, "Handshake failed\n");
+			return 1;
+		}
+		total += samples[i];
+	}
+	qsort(samples, iterations, sizeof(double), compare_double);
+	printf("paced:        mean %7.1f us  median %7.1f us  p99 %7.1f us\n",
+	       total / iterations, samples[iterations / 2], samples[iterations * 99 / 100]);
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		if (handshake(pairing, ecdh_key, ed_key, &samples[i]) < 0) {
+			fprintf(stderr, "Handshake failed\n");
+			return 1;
+		}
+	}
+	printf("back to back: %7.0f handshakes/s\n", iterations * 1e6 / (now_us() - start));
+
+	pairing_destroy(pairing);
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,552 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/* Headless receiver: mirrored video goes out as H.264 Annex B and audio as
+ * interleaved PCM (s16le, the format is logged when it changes), each to a
+ * file, a FIFO or a Unix socket. With --record every mirroring session is
+ * also stored as a fragmented MP4 of the received H.264 and AAC-ELD, nothing
+ * is decoded or encoded for it. Nothing here touches a display or an audio
+ * device. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "dnssd.h"
+#include "airplay.h"
+#include "raop.h"
+#include "fmp4.h"
+#include "threads.h"
+#include "sink.h"
+
+#define DEFAULT_VIDEO_QUEUE     (8 * 1024 * 1024)
+#define DEFAULT_AUDIO_QUEUE     (1024 * 1024)
+#define RECORD_QUEUE            (32 * 1024 * 1024)
+#define RECORD_MAX_FRAGMENT     (4 * 1024 * 1024)
+#define STATS_INTERVAL          10
+
+typedef struct daemon_s {
+	sink_t *video;
+	sink_t *audio;
+	int verbose;
+
+	/* Last PCM format logged, written by the audio thread only */
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+
+	/* One recording per session, opened on its first video frame. Video,
+	 * audio and disconnect come from different threads. */
+	const char *record_spec;
+	mutex_handle_t record_mutex;
+	sink_t *record;
+	fmp4_t *fmp4;
+} daemon_t;
+
+static volatile sig_atomic_t running = 1;
+
+static void
+signal_handler(int sig)
+{
+	running = 0;
+}
+
+static void
+record_write(void *cls, const unsigned char *data, int len, int flags)
+{
+	daemon_t *daemon = cls;
+	int sink_flags = 0;
+
+	if (flags & FMP4_INIT) {
+		sink_flags |= SINK_CONFIG;
+	}
+	if (flags & FMP4_KEYFRAME) {
+		sink_flags |= SINK_KEYFRAME;
+	}
+	sink_write(daemon->record, data, len, sink_flags);
+}
+
+/* Called with record_mutex held */
+static void
+record_open(daemon_t *daemon)
+{
+	static const unsigned char audio_config[] = AAC_ELD_CONFIG;
+	char path[1024];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	if (strftime(path, sizeof(path), daemon->record_spec, &tm) == 0) {
+		return;
+	}
+	daemon->record = sink_create(path, RECORD_QUEUE, SINK_MODE_DROP);
+	if (!daemon->record) {
+		fprintf(stderr, "Invalid recording output %s\n", path);
+		return;
+	}
+	daemon->fmp4 = fmp4_init(audio_config, sizeof(audio_config), 44100, 2, AAC_ELD_FRAME_SAMPLES,
+	                         RECORD_MAX_FRAGMENT, record_write, daemon);
+	if (!daemon->fmp4) {
+		sink_destroy(daemon->record);
+		daemon->record = NULL;
+		return;
+	}
+	fprintf(stderr, "Recording to %s\n", path);
+}
+
+/* Called with record_mutex held */
+static void
+record_close(daemon_t *daemon)
+{
+	/* The muxer writes its last fragment into the sink, which then drains */
+	fmp4_destroy(daemon->fmp4);
+	daemon->fmp4 = NULL;
+	sink_destroy(daemon->record);
+	daemon->record = NULL;
+}
+
+static void
+video_process(void *cls, h264_decode_struct *data, const char *remoteName, const char *remoteDeviceId)
+{
+	daemon_t *daemon = cls;
+	int flags;
+
+	if (daemon->record_spec && data->data_len > 0 && data->codec == VIDEO_CODEC_H264) {
+		MUTEX_LOCK(daemon->record_mutex);
+		if (!daemon->fmp4) {
+			record_open(daemon);
+		}
+		if (daemon->fmp4) {
+			fmp4_write_video(daemon->fmp4, data->data, data->data_len, data->ntp_pts);
+		}
+		MUTEX_UNLOCK(daemon->record_mutex);
+	}
+	if (!daemon->video || data->data_len <= 0) {
+		return;
+	}
+	if (data->frame_type == 0) {
+		flags = SINK_CONFIG;
+	} else {
+		flags = data->is_key ? SINK_KEYFRAME : 0;
+	}
+	sink_write(daemon->video, data->data, data->data_len, flags);
+}
+
+static void
+audio_process(void *cls, pcm_data_struct *data, const char *remoteName, const char *remoteDeviceId)
+{
+	daemon_t *daemon = cls;
+
+	if (daemon->record_spec) {
+		MUTEX_LOCK(daemon->record_mutex);
+		/* The MP4 audio track is AAC-ELD, what mirroring senders use */
+		if (daemon->fmp4 && data->codec == AUDIO_CODEC_AAC_ELD) {
+			fmp4_write_audio(daemon->fmp4, data->encoded, data->encoded ? data->encoded_len : 0, data->ntp_pts);
+		}
+		MUTEX_UNLOCK(daemon->record_mutex);
+	}
+	if (!daemon->audio || data->data_len <= 0) {
+		return;
+	}
+	if (data->sample_rate != daemon->sample_rate || data->channels != daemon->channels ||
+	    data->bits_per_sample != daemon->bits_per_sample) {
+		daemon->sample_rate = data->sample_rate;
+		daemon->channels = data->channels;
+		daemon->bits_per_sample = data->bits_per_sample;
+		fprintf(stderr, "Audio from %s: %u Hz, %u channels, %u bits\n", remoteName,
+		        data->sample_rate, data->channels, data->bits_per_sample);
+	}
+	/* Every PCM packet is a place a reader can start */
+	sink_write(daemon->audio, data->data, data->data_len, SINK_KEYFRAME);
+}
+
+static void
+connected(void *cls, const char *remoteName, const char *remoteDeviceId)
+{
+	fprintf(stderr, "Connected: %s (%s)\n", remoteName, remoteDeviceId);
+}
+
+static void
+disconnected(void *cls, const char *remoteName, const char *remoteDeviceId)
+{
+	daemon_t *daemon = cls;
+
+	fprintf(stderr, "Disconnected: %s (%s)\n", remoteName, remoteDeviceId);
+	/* The next sender starts with its own parameter sets */
+	if (daemon->video) {
+		sink_reset(daemon->video);
+	}
+	if (daemon->record_spec) {
+		MUTEX_LOCK(daemon->record_mutex);
+		record_close(daemon);
+		MUTEX_UNLOCK(daemon->record_mutex);
+	}
+}
+
+static void
+log_callback(void *cls, int level, const char *msg)
+{
+	daemon_t *daemon = cls;
+
+	if (level <= RAOP_LOG_WARNING || daemon->verbose) {
+		fprintf(stderr, "%s\n", msg);
+	}
+}
+
+static int
+parse_hwaddr(const char *str, char hwaddr[6])
+{
+	unsigned int b[6];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+		return -1;
+	}
+	for (i = 0; i < 6; i++) {
+		if (b[i] > 0xff) {
+			return -1;
+		}
+		hwaddr[i] = (char)b[i];
+	}
+	return 0;
+}
+
+/* WIDTHxHEIGHT[@FPS], the display senders encode the mirror stream for */
+static int
+parse_display(const char *str, raop_info_t *info)
+{
+	int width, height, fps = 0;
+
+	if (sscanf(str, "%dx%d@%d", &width, &height, &fps) < 2) {
+		return -1;
+	}
+	if (width <= 0 || width > 0xffff || height <= 0 || height > 0xffff || fps < 0 || fps > 0xff) {
+		return -1;
+	}
+	info->display_width = width;
+	info->display_height = height;
+	if (fps) {
+		info->display_max_fps = fps;
+		if (info->display_refresh_rate < fps) {
+			info->display_refresh_rate = fps;
+		}
+	}
+	return 0;
+}
+
+/* Same idea as the pairing.key of the Windows DLL: senders keep trusting
+ * the receiver across restarts */
+static int
+load_pairing_seed(const char *path, unsigned char seed[32])
+{
+	FILE *fp;
+	int fd;
+
+	fp = fopen(path, "rb");
+	if (fp) {
+		size_t read = fread(seed, 1, 32, fp);
+
+		fclose(fp);
+		if (read == 32) {
+			return 0;
+		}
+	}
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (read(fd, seed, 32) != 32) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || write(fd, seed, 32) != 32) {
+		fprintf(stderr, "Could not save the pairing key to %s\n", path);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return 0;
+}
+
+static void
+print_stats(const char *name, sink_t *sink)
+{
+	sink_stats_t stats;
+
+	if (!sink) {
+		return;
+	}
+	sink_get_stats(sink, &stats);
+	fprintf(stderr, "%s: %s, %llu bytes written, %llu packets (%llu bytes) dropped\n", name,
+	        stats.connected ? "connected" : "waiting for output",
+	        (unsigned long long)stats.written_bytes, (unsigned long long)stats.dropped_packets,
+	        (unsigned long long)stats.dropped_bytes);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n, --name NAME          advertised name (default AirPlay)\n"
+		"  -m, --hwaddr MAC         device id, aa:bb:cc:dd:ee:ff\n"
+		"  -k, --key FILE           keep the pairing identity in FILE\n"
+		"  -V, --video SINK         H.264 or H.265 Annex B output\n"
+		"  -A, --audio SINK         PCM s16le output\n"
+		"  -R, --record SINK        fragmented MP4 of every mirroring session,\n"
+		"                           strftime conversions are expanded,\n"
+		"                           H.264 sessions only\n"
+		"  -d, --display WxH[@FPS]  display advertised to senders, they encode\n"
+		"                           for it (default 1920x1080@30)\n"
+		"  -o, --overscan           advertise an overscanned display\n"
+		"  -f, --features BITS      AirPlay feature bits, hex\n"
+		"  -H, --hevc               let senders mirror in H.265\n"
+		"  -B, --buffered-audio     offer buffered audio, the sender streams\n"
+		"                           ahead over TCP\n"
+		"  -q, --queue KB           video queue size (default %d)\n"
+		"  -b, --block              when a queue is full wait for the reader\n"
+		"                           instead of dropping up to the next keyframe\n"
+		"  -r, --raop-port PORT     default 5000\n"
+		"  -a, --airplay-port PORT  default 7000\n"
+		"  -v, --verbose\n"
+		"SINK is file:PATH, fifo:PATH, unix:PATH or just a file path.\n",
+		argv0, DEFAULT_VIDEO_QUEUE / 1024);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "name", required_argument, NULL, 'n' },
+		{ "hwaddr", required_argument, NULL, 'm' },
+		{ "key", required_argument, NULL, 'k' },
+		{ "video", required_argument, NULL, 'V' },
+		{ "audio", required_argument, NULL, 'A' },
+		{ "record", required_argument, NULL, 'R' },
+		{ "display", required_argument, NULL, 'd' },
+		{ "overscan", no_argument, NULL, 'o' },
+		{ "features", required_argument, NULL, 'f' },
+		{ "hevc", no_argument, NULL, 'H' },
+		{ "buffered-audio", no_argument, NULL, 'B' },
+		{ "queue", required_argument, NULL, 'q' },
+		{ "block", no_argument, NULL, 'b' },
+		{ "raop-port", required_argument, NULL, 'r' },
+		{ "airplay-port", required_argument, NULL, 'a' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *name = "AirPlay";
+	const char *keyfile = NULL;
+	const char *video_spec = NULL;
+	const char *audio_spec = NULL;
+	int video_queue = DEFAULT_VIDEO_QUEUE;
+	int mode = SINK_MODE_DROP;
+	unsigned short raop_port = 5000;
+	unsigned short airplay_port = 7000;
+	char hwaddr[] = { 0x48, 0x5d, 0x60, 0x7c, 0xee, 0x22 };
+	unsigned char seed[32];
+	int have_seed = 0;
+	int hevc = 0;
+	int buffered_audio = 0;
+
+	daemon_t daemon;
+	raop_t *raop = NULL;
+	airplay_t *airplay = NULL;
+	dnssd_t *dnssd = NULL;
+	raop_callbacks_t raop_cbs;
+	airplay_callbacks_t ap_cbs;
+	raop_info_t info;
+	struct sigaction sa;
+	int error = 0;
+	int ret = 1;
+	int seconds = 0;
+	int opt;
+
+	memset(&daemon, 0, sizeof(daemon));
+	raop_info_init(&info);
+	while ((opt = getopt_long(argc, argv, "n:m:k:V:A:R:d:of:HBq:br:a:vh", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n': name = optarg; break;
+		case 'm':
+			if (parse_hwaddr(optarg, hwaddr) < 0) {
+				fprintf(stderr, "Invalid hardware address %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'k': keyfile = optarg; break;
+		case 'V': video_spec = optarg; break;
+		case 'A': audio_spec = optarg; break;
+		case 'R': daemon.record_spec = optarg; break;
+		case 'd':
+			if (parse_display(optarg, &info) < 0) {
+				fprintf(stderr, "Invalid display %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o': info.display_overscanned = 1; break;
+		case 'f': info.features = strtoull(optarg, NULL, 16); break;
+		case 'H': hevc = 1; break;
+		case 'B': buffered_audio = 1; break;
+		case 'q': video_queue = atoi(optarg) * 1024; break;
+		case 'b': mode = SINK_MODE_BLOCK; break;
+		case 'r': raop_port = (unsigned short)atoi(optarg); break;
+		case 'a': airplay_port = (unsigned short)atoi(optarg); break;
+		case 'v': daemon.verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!video_spec && !audio_spec && !daemon.record_spec) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (hevc) {
+		info.features |= RAOP_FEATURE_SCREEN_MULTI_CODEC;
+	}
+	if (buffered_audio) {
+		info.features |= RAOP_FEATURE_BUFFERED_AUDIO;
+	}
+	MUTEX_CREATE(daemon.record_mutex);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* A reader going away shows up as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (video_spec) {
+		daemon.video = sink_create(video_spec, video_queue, mode);
+		if (!daemon.video) {
+			fprintf(stderr, "Invalid video output %s\n", video_spec);
+			goto cleanup;
+		}
+	}
+	if (audio_spec) {
+		daemon.audio = sink_create(audio_spec, DEFAULT_AUDIO_QUEUE, mode);
+		if (!daemon.audio) {
+			fprintf(stderr, "Invalid audio output %s\n", audio_spec);
+			goto cleanup;
+		}
+	}
+	if (keyfile && load_pairing_seed(keyfile, seed) == 0) {
+		have_seed = 1;
+	}
+
+	memset(&ap_cbs, 0, sizeof(ap_cbs));
+	ap_cbs.cls = &daemon;
+	airplay = airplay_init(10, &ap_cbs, NULL, &error);
+	if (!airplay) {
+		fprintf(stderr, "airplay_init failed\n");
+		goto cleanup;
+	}
+	if (have_seed) {
+		airplay_set_pairing_seed(airplay, seed);
+	}
+	airplay_set_log_level(airplay, daemon.verbose ? AIRPLAY_LOG_DEBUG : AIRPLAY_LOG_WARNING);
+	airplay_set_log_callback(airplay, &log_callback, &daemon);
+	if (airplay_start(airplay, &airplay_port, hwaddr, sizeof(hwaddr), NULL) < 0) {
+		fprintf(stderr, "Could not listen on port %u\n", airplay_port);
+		goto cleanup;
+	}
+
+	memset(&raop_cbs, 0, sizeof(raop_cbs));
+	raop_cbs.cls = &daemon;
+	raop_cbs.connected = connected;
+	raop_cbs.disconnected = disconnected;
+	raop_cbs.audio_process = audio_process;
+	raop_cbs.video_process = video_process;
+	raop = raop_init(10, &raop_cbs);
+	if (!raop) {
+		fprintf(stderr, "raop_init failed\n");
+		goto cleanup;
+	}
+	if (have_seed) {
+		raop_set_pairing_seed(raop, seed);
+	}
+	memset(seed, 0, sizeof(seed));
+
+	/* /info reports the same identity as the mDNS records */
+	raop_get_public_key(raop, info.pk);
+	snprintf(info.name, sizeof(info.name), "%s", name);
+	snprintf(info.deviceid, sizeof(info.deviceid), "%02x:%02x:%02x:%02x:%02x:%02x",
+	         (unsigned char)hwaddr[0], (unsigned char)hwaddr[1], (unsigned char)hwaddr[2],
+	         (unsigned char)hwaddr[3], (unsigned char)hwaddr[4], (unsigned char)hwaddr[5]);
+	if (raop_set_info(raop, &info) < 0) {
+		fprintf(stderr, "Could not build the /info reply\n");
+		goto cleanup;
+	}
+
+	raop_set_log_level(raop, daemon.verbose ? RAOP_LOG_DEBUG : RAOP_LOG_WARNING);
+	raop_set_log_callback(raop, &log_callback, &daemon);
+	/* The sinks and the MP4 muxer take Annex B */
+	raop_set_video_format(raop, VIDEO_FORMAT_ANNEXB);
+	if (raop_start(raop, &raop_port) < 0) {
+		fprintf(stderr, "Could not listen on port %u\n", raop_port);
+		goto cleanup;
+	}
+	raop_set_port(raop, raop_port);
+
+	dnssd = dnssd_init(&error);
+	if (!dnssd) {
+		fprintf(stderr, "Could not start mDNS, error %d\n", error);
+		goto cleanup;
+	}
+	dnssd_set_features(dnssd, info.features);
+	if (dnssd_register_raop(dnssd, name, raop_port, hwaddr, sizeof(hwaddr), 0) < 0 ||
+	    dnssd_register_airplay(dnssd, name, airplay_port, hwaddr, sizeof(hwaddr)) < 0) {
+		fprintf(stderr, "Could not register the mDNS services\n");
+		goto cleanup;
+	}
+
+	fprintf(stderr, "Receiving as \"%s\" on ports %u/%u\n", name, raop_port, airplay_port);
+	while (running) {
+		sleep(1);
+		if (daemon.verbose && ++seconds % STATS_INTERVAL == 0) {
+			print_stats("video", daemon.video);
+			print_stats("audio", daemon.audio);
+		}
+	}
+	ret = 0;
+
+cleanup:
+	if (dnssd) {
+		dnssd_unregister_airplay(dnssd);
+		dnssd_unregister_raop(dnssd);
+		dnssd_destroy(dnssd);
+	}
+	if (raop) {
+		raop_destroy(raop);
+	}
+	if (airplay) {
+		airplay_destroy(airplay);
+	}
+	print_stats("video", daemon.video);
+	print_stats("audio", daemon.audio);
+	/* After the receivers, so nothing writes any more. Queued data is
+	 * still written out. */
+	sink_destroy(daemon.video);
+	sink_destroy(daemon.audio);
+	record_close(&daemon);
+	MUTEX_DESTROY(daemon.record_mutex);
+	return ret;
+}
@@ -0,0 +1,376 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sink.h"
+#include "threads.h"
+
+#define SINK_MAX_TYPES          11
+/* Every ring entry starts with its length and flags, a length of -1 means
+ * the rest of the ring is unused and the next entry is at offset 0 */
+#define SINK_HEADER_SIZE        8
+#define SINK_ALIGN(x)           (((x) + 7) & ~7)
+
+static const sink_ops_t *sink_types[SINK_MAX_TYPES] = {
+	&sink_file_ops,
+	&sink_fifo_ops,
+	&sink_unix_ops,
+};
+
+struct sink_s {
+	const sink_ops_t *ops;
+	char *path;
+	int mode;
+
+	unsigned char *ring;
+	int size;
+	int head;
+	int tail;
+	int used;
+
+	/* Dropping until the next keyframe */
+	int resync;
+	unsigned char *config;
+	int configlen;
+	/* The cached config already went out on this connection */
+	int config_sent;
+
+	sink_stats_t stats;
+	int running;
+	int broken;
+
+	thread_handle_t thread;
+	mutex_handle_t mutex;
+	cond_handle_t data_cond;
+	cond_handle_t room_cond;
+};
+
+int
+sink_register(const sink_ops_t *ops)
+{
+	int i;
+
+	assert(ops);
+	assert(ops->scheme);
+
+	for (i = 0; i < SINK_MAX_TYPES; i++) {
+		if (!sink_types[i]) {
+			sink_types[i] = ops;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static const sink_ops_t *
+sink_find_type(const char *spec, const char **path)
+{
+	const char *colon = strchr(spec, ':');
+	int i;
+
+	if (colon) {
+		for (i = 0; i < SINK_MAX_TYPES && sink_types[i]; i++) {
+			if (strlen(sink_types[i]->scheme) == (size_t)(colon - spec) &&
+			    !strncmp(sink_types[i]->scheme, spec, colon - spec)) {
+				*path = colon + 1;
+				return sink_types[i];
+			}
+		}
+	}
+	*path = spec;
+	return &sink_file_ops;
+}
+
+static void
+sink_clear(sink_t *sink)
+{
+	sink->head = 0;
+	sink->tail = 0;
+	sink->used = 0;
+}
+
+/* Copies one entry into the ring, -1 if there is no room */
+static int
+sink_push(sink_t *sink, const void *data, int len, int flags)
+{
+	int need = SINK_HEADER_SIZE + SINK_ALIGN(len);
+	int skip = 0;
+	int header[2];
+
+	if (sink->size - sink->head < need) {
+		skip = sink->size - sink->head;
+	}
+	if (sink->used + skip + need > sink->size) {
+		return -1;
+	}
+	if (skip) {
+		header[0] = -1;
+		header[1] = 0;
+		memcpy(sink->ring + sink->head, header, SINK_HEADER_SIZE);
+		sink->used += skip;
+		sink->head = 0;
+	}
+	header[0] = len;
+	header[1] = flags;
+	memcpy(sink->ring + sink->head, header, SINK_HEADER_SIZE);
+	memcpy(sink->ring + sink->head + SINK_HEADER_SIZE, data, len);
+	sink->head = (sink->head + need) % sink->size;
+	sink->used += need;
+	COND_SIGNAL(sink->data_cond);
+	return 0;
+}
+
+static void
+sink_drop(sink_t *sink, int len)
+{
+	sink->resync = 1;
+	sink->stats.dropped_packets++;
+	sink->stats.dropped_bytes += len;
+}
+
+int
+sink_write(sink_t *sink, const void *data, int len, int flags)
+{
+	int ret = -1;
+
+	assert(sink);
+
+	if (len <= 0) {
+		return 0;
+	}
+	MUTEX_LOCK(sink->mutex);
+	if (flags & SINK_CONFIG) {
+		unsigned char *config = realloc(sink->config, len);
+
+		if (config) {
+			memcpy(config, data, len);
+			sink->config = config;
+			sink->configlen = len;
+			sink->config_sent = 0;
+		}
+	}
+	if (!sink->stats.connected) {
+		sink_drop(sink, len);
+	} else if (sink->resync) {
+		/* The cached parameter sets go out right before the keyframe,
+		 * unless the reader already has them */
+		if (flags & SINK_KEYFRAME) {
+			if ((sink->configlen == 0 || sink->config_sent ||
+			     sink_push(sink, sink->config, sink->configlen, SINK_CONFIG) == 0) &&
+			    sink_push(sink, data, len, flags) == 0) {
+				sink->resync = 0;
+				sink->config_sent = 1;
+				ret = 0;
+			} else {
+				sink_drop(sink, len);
+			}
+		} else if (!(flags & SINK_CONFIG)) {
+			sink_drop(sink, len);
+		}
+	} else {
+		ret = sink_push(sink, data, len, flags);
+		while (ret < 0 && sink->mode == SINK_MODE_BLOCK && sink->stats.connected && sink->running &&
+		       SINK_HEADER_SIZE + SINK_ALIGN(len) <= sink->size) {
+			COND_WAIT(sink->room_cond, sink->mutex);
+			ret = sink_push(sink, data, len, flags);
+		}
+		if (ret < 0) {
+			sink_drop(sink, len);
+		} else if (flags & SINK_CONFIG) {
+			sink->config_sent = 1;
+		}
+	}
+	MUTEX_UNLOCK(sink->mutex);
+	return ret;
+}
+
+void
+sink_reset(sink_t *sink)
+{
+	assert(sink);
+
+	MUTEX_LOCK(sink->mutex);
+	sink->resync = 1;
+	sink->configlen = 0;
+	MUTEX_UNLOCK(sink->mutex);
+}
+
+void
+sink_get_stats(sink_t *sink, sink_stats_t *stats)
+{
+	assert(sink);
+	assert(stats);
+
+	MUTEX_LOCK(sink->mutex);
+	*stats = sink->stats;
+	MUTEX_UNLOCK(sink->mutex);
+}
+
+/* Gives up on a stalled output only when the sink is being destroyed */
+static int
+sink_write_all(sink_t *sink, void *ctx, const unsigned char *data, int len)
+{
+	while (len > 0) {
+		int ret = sink->ops->write(ctx, data, len);
+
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			int running;
+
+			MUTEX_LOCK(sink->mutex);
+			running = sink->running;
+			MUTEX_UNLOCK(sink->mutex);
+			if (!running) {
+				return -1;
+			}
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static THREAD_RETVAL
+sink_thread(void *arg)
+{
+	sink_t *sink = arg;
+	void *ctx = NULL;
+
+	MUTEX_LOCK(sink->mutex);
+	/* What was queued before destroy is still written out */
+	while (sink->running || (ctx && sink->used > 0)) {
+		int header[2];
+		int need;
+
+		if (!ctx && sink->broken) {
+			COND_WAIT(sink->data_cond, sink->mutex);
+			continue;
+		}
+		if (!ctx) {
+			MUTEX_UNLOCK(sink->mutex);
+			ctx = sink->ops->open(sink->path);
+			if (!ctx) {
+				sleepms(250);
+			}
+			MUTEX_LOCK(sink->mutex);
+			if (ctx) {
+				fprintf(stderr, "Sink %s:%s connected\n", sink->ops->scheme, sink->path);
+				sink_clear(sink);
+				sink->resync = 1;
+				sink->config_sent = 0;
+				sink->stats.connected = 1;
+			}
+			continue;
+		}
+		if (sink->used == 0) {
+			COND_WAIT(sink->data_cond, sink->mutex);
+			continue;
+		}
+
+		memcpy(header, sink->ring + sink->tail, SINK_HEADER_SIZE);
+		if (header[0] < 0) {
+			sink->used -= sink->size - sink->tail;
+			sink->tail = 0;
+			continue;
+		}
+		need = SINK_HEADER_SIZE + SINK_ALIGN(header[0]);
+
+		/* Producers do not touch the entry until tail moves past it */
+		MUTEX_UNLOCK(sink->mutex);
+		if (sink_write_all(sink, ctx, sink->ring + sink->tail + SINK_HEADER_SIZE, header[0]) < 0) {
+			sink->ops->close(ctx);
+			ctx = NULL;
+			MUTEX_LOCK(sink->mutex);
+			fprintf(stderr, "Sink %s:%s disconnected\n", sink->ops->scheme, sink->path);
+			sink_clear(sink);
+			sink->stats.connected = 0;
+			sink->broken = !sink->ops->reconnect;
+			COND_SIGNAL(sink->room_cond);
+			continue;
+		}
+		MUTEX_LOCK(sink->mutex);
+		sink->tail = (sink->tail + need) % sink->size;
+		sink->used -= need;
+		sink->stats.written_bytes += header[0];
+		COND_SIGNAL(sink->room_cond);
+	}
+	MUTEX_UNLOCK(sink->mutex);
+
+	if (ctx) {
+		sink->ops->close(ctx);
+	}
+	return 0;
+}
+
+sink_t *
+sink_create(const char *spec, int queue_size, int mode)
+{
+	sink_t *sink;
+	const char *path;
+
+	assert(spec);
+
+	if (queue_size < 4096) {
+		return NULL;
+	}
+	sink = calloc(1, sizeof(sink_t));
+	if (!sink) {
+		return NULL;
+	}
+	sink->ops = sink_find_type(spec, &path);
+	sink->path = strdup(path);
+	sink->mode = mode;
+	sink->size = SINK_ALIGN(queue_size);
+	sink->ring = malloc(sink->size);
+	if (!sink->path || !sink->ring) {
+		free(sink->path);
+		free(sink->ring);
+		free(sink);
+		return NULL;
+	}
+	sink->resync = 1;
+
+	MUTEX_CREATE(sink->mutex);
+	COND_CREATE(sink->data_cond);
+	COND_CREATE(sink->room_cond);
+	sink->running = 1;
+	THREAD_CREATE(sink->thread, sink_thread, sink);
+	return sink;
+}
+
+void
+sink_destroy(sink_t *sink)
+{
+	if (!sink) {
+		return;
+	}
+	MUTEX_LOCK(sink->mutex);
+	sink->running = 0;
+	COND_SIGNAL(sink->data_cond);
+	COND_SIGNAL(sink->room_cond);
+	MUTEX_UNLOCK(sink->mutex);
+	THREAD_JOIN(sink->thread);
+
+	COND_DESTROY(sink->room_cond);
+	COND_DESTROY(sink->data_cond);
+	MUTEX_DESTROY(sink->mutex);
+	free(sink->config);
+	free(sink->ring);
+	free(sink->path);
+	free(sink);
+}
@@ -0,0 +1,76 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+
+/* Output of one elementary stream.
+ *
+ * sink_write only copies into a bounded ring, a writer thread per sink
+ * empties it into the output, so the receive threads never wait for a slow
+ * reader unless SINK_MODE_BLOCK asks for it. When a packet does not fit
+ * the sink drops it and everything after it up to the next SINK_KEYFRAME,
+ * the last SINK_CONFIG packet is written again in front of that keyframe
+ * if it changed meanwhile. The same happens whenever the output is
+ * (re)connected, so a reader always starts on a decodable stream. */
+
+#define SINK_CONFIG             0x01    /* parameter sets, kept for resync */
+#define SINK_KEYFRAME           0x02    /* a reader can start here */
+
+#define SINK_MODE_DROP          0
+/* Wait for room while the output is connected. The mirror thread stalls
+ * and TCP pushes back to the sender, which then lowers its bitrate. */
+#define SINK_MODE_BLOCK         1
+
+/* An output type, picked by the "scheme:" prefix of the sink spec.
+ * Everything runs on the writer thread. */
+typedef struct sink_ops_s {
+	const char *scheme;
+	/* NULL while the output is not available yet, retried every 250ms */
+	void *(*open)(const char *path);
+	/* Returns the bytes written, 0 if nothing could be written within
+	 * about 250ms, -1 when the output is gone */
+	int (*write)(void *ctx, const void *buf, int len);
+	void (*close)(void *ctx);
+	/* Open again after a write error instead of giving up */
+	int reconnect;
+} sink_ops_t;
+
+typedef struct sink_stats_s {
+	uint64_t written_bytes;
+	uint64_t dropped_packets;
+	uint64_t dropped_bytes;
+	int connected;
+} sink_stats_t;
+
+typedef struct sink_s sink_t;
+
+/* file:PATH, fifo:PATH or unix:PATH, a bare path is a file */
+sink_t *sink_create(const char *spec, int queue_size, int mode);
+void sink_destroy(sink_t *sink);
+
+/* Returns 0 when queued, -1 when dropped */
+int sink_write(sink_t *sink, const void *data, int len, int flags);
+/* Stream discontinuity, e.g. a new sender. Waits for the next keyframe. */
+void sink_reset(sink_t *sink);
+void sink_get_stats(sink_t *sink, sink_stats_t *stats);
+
+/* Adds an output type, up to 8 besides the built in ones */
+int sink_register(const sink_ops_t *ops);
+
+extern const sink_ops_t sink_file_ops;
+extern const sink_ops_t sink_fifo_ops;
+extern const sink_ops_t sink_unix_ops;
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+
+/* Outputs that are a plain file descriptor. Pipes and sockets are non
+ * blocking so a stalled reader cannot keep the writer thread from seeing
+ * sink_destroy. */
+
+#define SINK_FD_TIMEOUT_MS      250
+
+static void *
+sink_fd_wrap(int fd)
+{
+	int *ctx;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	ctx = malloc(sizeof(int));
+	if (!ctx) {
+		close(fd);
+		return NULL;
+	}
+	*ctx = fd;
+	return ctx;
+}
+
+static int
+sink_fd_write(void *ctx, const void *buf, int len)
+{
+	int fd = *(int *)ctx;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, SINK_FD_TIMEOUT_MS);
+	if (ret < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	if (ret == 0) {
+		return 0;
+	}
+	ret = write(fd, buf, len);
+	if (ret < 0) {
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	return (int)ret;
+}
+
+static void
+sink_fd_close(void *ctx)
+{
+	close(*(int *)ctx);
+	free(ctx);
+}
+
+static void *
+sink_file_open(const char *path)
+{
+	return sink_fd_wrap(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+}
+
+/* Without a reader the open fails with ENXIO and is retried, the FIFO is
+ * created if it does not exist */
+static void *
+sink_fifo_open(const char *path)
+{
+	int fd;
+
+	if (mkfifo(path, 0644) < 0 && errno != EEXIST) {
+		return NULL;
+	}
+	fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	return sink_fd_wrap(fd);
+}
+
+/* Connects to a reader listening on a SOCK_STREAM socket */
+static void *
+sink_unix_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return sink_fd_wrap(fd);
+}
+
+const sink_ops_t sink_file_ops = {
+	"file", sink_file_open, sink_fd_write, sink_fd_close, 0
+};
+
+const sink_ops_t sink_fifo_ops = {
+	"fifo", sink_fifo_open, sink_fd_write, sink_fd_close, 1
+};
+
+const sink_ops_t sink_unix_ops = {
+	"unix", sink_unix_open, sink_fd_write, sink_fd_close, 1
+};
@@ -14,6 +14,7 @@
 //#include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 //#include <ao/ao.h>
@@ -174,12 +175,21 @@ VideoSource::VideoSource()
 	memset(&xdw_decoder_q, 0, sizeof(struct __xdw_air_decoder_q));
 	xdw_q_init(&xdw_decoder_q.audio_pkt_q, fn_q_mode_unblock);
 	xdw_q_set_property(&xdw_decoder_q.audio_pkt_q, fn_q_node_max_nr, (void *)MAX_CACHED_AFRAME_NUM, NULL);
-	xdw_q_init(&xdw_decoder_q.video_pkt_q, fn_q_mode_unblock);
+	xdw_q_init(&xdw_decoder_q.video_pkt_q, fn_q_mode_block_empty);
 	xdw_q_set_property(&xdw_decoder_q.video_pkt_q, fn_q_node_max_nr, (void *)MAX_CACHED_VFRAME_NUM, NULL);
+	for (int i = 0; i < MAX_CACHED_VFRAME_NUM; i++)
+	{
+		xdw_decoder_q.video_nodes[i].packet = av_packet_alloc();
+	}
+	xdw_q_init_pool(&xdw_decoder_q.video_free_q, xdw_decoder_q.video_nodes, sizeof(xdw_pkt_video_qnode_t),
+		MAX_CACHED_VFRAME_NUM, offsetof(xdw_pkt_video_qnode_t, list));
 
 	airtunes_audio_timestamp = -1.0;
 
 	vs = nullptr;
+	raop = nullptr;
+	airplay = nullptr;
+	dnssd = nullptr;
 
     pixelData   = nullptr;
 	mediaWidth  = 0;
@@ -197,6 +207,9 @@ VideoSource::VideoSource()
 
 VideoSource::~VideoSource()
 { 
+	// The receiver threads fill the queues, they have to be gone first
+	stop_airplay();
+
 	if (vs != nullptr)
 	{
 		delete vs;
@@ -214,7 +227,12 @@ VideoSource::~VideoSource()
 
 	MUTEX_DESTROY(textureLock);
 
-	stop_airplay();
+	for (int i = 0; i < MAX_CACHED_VFRAME_NUM; i++)
+	{
+		av_packet_free(&xdw_decoder_q.video_nodes[i].packet);
+	}
+	xdw_q_destroy(&xdw_decoder_q.video_pkt_q);
+	xdw_q_destroy(&xdw_decoder_q.video_free_q);
 }
 
 void *lock(void *data, void **pixelData)
@@ -364,7 +382,6 @@ int VideoState::queue_picture(AVFrame *pFrame)
 
 void VideoState::video_thread_loop(VideoState *self)
 {
-	AVPacket pkt1, *packet = &pkt1;
 	int frameFinished;
 	AVFrame *pFrame;
 
@@ -376,6 +393,7 @@ void VideoState::video_thread_loop(VideoState *self)
 		struct xdw_list_head *ptr;
 		xdw_pkt_video_qnode_t *pkt_qnode;
 
+		// Sleeps until a packet is queued, deinit() wakes it up with NULL
 		struct xdw_q_head *video_pkt_q = &(self->xdw_decoder_q_video->video_pkt_q);
 		ptr = xdw_q_pop(video_pkt_q);
 		if (ptr == NULL)
@@ -384,23 +402,15 @@ void VideoState::video_thread_loop(VideoState *self)
 		}
 
 		pkt_qnode = (xdw_pkt_video_qnode_t *)list_entry(ptr, xdw_pkt_video_qnode_t, list);
-		if (pkt_qnode == NULL)
-		{
-			continue;
-		}
-
-		av_new_packet(packet, pkt_qnode->VideoBuffer->size);
-		memcpy(packet->data, pkt_qnode->VideoBuffer->data, pkt_qnode->VideoBuffer->size);
-
-		free((void *)(pkt_qnode->VideoBuffer->data));
-		free((void *)(pkt_qnode->VideoBuffer));
-		free((void *)pkt_qnode);
 
+		// The packet is refcounted, the decoder takes a reference to its buffer
+		// instead of a copy and the node goes back to the pool right away
 		// avcodec_decode_video2(self->codecCtx, pFrame, &frameFinished, packet);
-		int ret = avcodec_send_packet(self->codecCtx, packet);
-		frameFinished = avcodec_receive_frame(self->codecCtx, pFrame);
+		int ret = avcodec_send_packet(self->codecCtx, pkt_qnode->packet);
+		av_packet_unref(pkt_qnode->packet);
+		xdw_q_push(&pkt_qnode->list, &(self->xdw_decoder_q_video->video_free_q));
 
-		av_packet_unref(packet);
+		frameFinished = avcodec_receive_frame(self->codecCtx, pFrame);
 
 		// Did we get a video frame?
 		if (frameFinished == 0)
@@ -438,6 +448,7 @@ int VideoState::init(xdw_air_decoder_q *xdw_decoder_q, const void *privatedata,
 	}
 
 	this->video_quit = false;
+	xdw_q_set_property(&xdw_decoder_q->video_pkt_q, fn_q_node_stop_blocking, NULL, NULL);
 
 	THREAD_CREATE(this->video_thread, (LPTHREAD_START_ROUTINE)video_thread_loop, this);
 	this->audioClock = airtunes_audio_clock;
@@ -448,6 +459,7 @@ int VideoState::init(xdw_air_decoder_q *xdw_decoder_q, const void *privatedata,
 void VideoState::deinit()
 {
 	this->video_quit = true;
+	xdw_q_set_property(&xdw_decoder_q_video->video_pkt_q, fn_q_node_stop_blocking, (void *)1, NULL);
 	EVENT_POST(this->pictq_cond);
 	THREAD_JOIN(this->video_thread);
 
@@ -611,6 +623,28 @@ void VideoSource::AirPlayOutputFunctions::audio_flush(void *cls)
 
 
 
+// Takes a node from the pool with a size bytes packet, NULL when the decoder
+// is too far behind. Once pushed the packet belongs to the decoder thread.
+static xdw_pkt_video_qnode_t *get_video_node(VideoSource *vsource, int size)
+{
+	struct xdw_list_head *ptr;
+	xdw_pkt_video_qnode_t *frm_node;
+
+	ptr = xdw_q_pop_timeout(&vsource->xdw_decoder_q.video_free_q, VIDEO_NODE_WAIT_MS);
+	if (ptr == NULL)
+	{
+		return NULL;
+	}
+
+	frm_node = list_entry(ptr, xdw_pkt_video_qnode_t, list);
+	if (av_new_packet(frm_node->packet, size) < 0)
+	{
+		xdw_q_push(&frm_node->list, &vsource->xdw_decoder_q.video_free_q);
+		return NULL;
+	}
+	return frm_node;
+}
+
 void VideoSource::AirPlayOutputFunctions::mirroring_play(void *cls, int width, int height, const void *buffer, int buflen, int payloadtype, double timestamp)
 {
 	struct xdw_q_head *q_head;
@@ -620,14 +654,13 @@ void VideoSource::AirPlayOutputFunctions::mirroring_play(void *cls, int width, i
 	{
 		struct xdw_list_head *ptr;
 		xdw_pkt_video_qnode_t *frm_node;
-		ptr = xdw_q_pop(q_head);
+		ptr = xdw_q_pop_timeout(q_head, 0);
 
 		if (!ptr)
 			break; // error
 		frm_node = list_entry(ptr, xdw_pkt_video_qnode_t, list);
-		free(frm_node->VideoBuffer->data);
-		free(frm_node->VideoBuffer);
-		free(frm_node);
+		av_packet_unref(frm_node->packet);
+		xdw_q_push(&frm_node->list, &(((VideoSource *)cls)->xdw_decoder_q.video_free_q));
 	}
 
 
@@ -654,17 +687,17 @@ void VideoSource::AirPlayOutputFunctions::mirroring_process(void* cls, h264_deco
 
 			unsigned    char *head = (unsigned  char *)h264data->data;
 
-			xdw_pkt_video_qnode_t *frm_node = (xdw_pkt_video_qnode_t *)malloc(sizeof(xdw_pkt_video_qnode_t));
-
-			xdw_video_frm_t *pkt = (xdw_video_frm_t *)malloc(sizeof(xdw_video_frm_t));
-			memset(pkt, 0, sizeof(xdw_video_frm_t));
-
 			spscnt = head[5] & 0x1f;
 			spsnalsize = ((uint32_t)head[6] << 8) | ((uint32_t)head[7]);
 			ppscnt = head[8 + spsnalsize];
 			ppsnalsize = ((uint32_t)head[9 + spsnalsize] << 8) | ((uint32_t)head[10 + spsnalsize]);
 
-			pkt->data = (unsigned char *)malloc(4 + spsnalsize + 4 + ppsnalsize);
+			xdw_pkt_video_qnode_t *frm_node = get_video_node((VideoSource *)cls, 4 + spsnalsize + 4 + ppsnalsize);
+			if (frm_node == NULL)
+			{
+				return;
+			}
+			AVPacket *pkt = frm_node->packet;
 
 			pkt->data[0] = 0;
 			pkt->data[1] = 0;
@@ -680,27 +713,17 @@ void VideoSource::AirPlayOutputFunctions::mirroring_process(void* cls, h264_deco
 
 			memcpy(pkt->data + 8 + spsnalsize, head + 11 + spsnalsize, ppsnalsize);
 
-			pkt->size = 4 + spsnalsize + 4 + ppsnalsize;
-
-			frm_node->VideoBuffer = pkt;
-
 			xdw_q_push(&frm_node->list, &(((VideoSource *)cls)->xdw_decoder_q.video_pkt_q));
 		}
 		else if (h264data->frame_type == 1)
 		{
-			int		    rLen;
-			unsigned    char *data;
-
-			xdw_pkt_video_qnode_t *frm_node = (xdw_pkt_video_qnode_t *)malloc(sizeof(xdw_pkt_video_qnode_t));
-
-			xdw_video_frm_t *pkt = (xdw_video_frm_t *)malloc(sizeof(xdw_video_frm_t));
-			memset(pkt, 0, sizeof(xdw_video_frm_t));
-
-			pkt->data = (unsigned char *)malloc(h264data->data_len);
-			memcpy(pkt->data, h264data->data, h264data->data_len);
-			pkt->size = h264data->data_len;
-
-			frm_node->VideoBuffer = pkt;
+			// The only copy, h264data is gone once we return
+			xdw_pkt_video_qnode_t *frm_node = get_video_node((VideoSource *)cls, h264data->data_len);
+			if (frm_node == NULL)
+			{
+				return;
+			}
+			memcpy(frm_node->packet->data, h264data->data, h264data->data_len);
 
 			xdw_q_push(&frm_node->list, &(((VideoSource *)cls)->xdw_decoder_q.video_pkt_q));
 		}
@@ -722,14 +745,13 @@ void VideoSource::AirPlayOutputFunctions::mirroring_stop(void *cls)
 	{
 		struct xdw_list_head *ptr;
 		xdw_pkt_video_qnode_t *frm_node;
-		ptr = xdw_q_pop(q_head);
+		ptr = xdw_q_pop_timeout(q_head, 0);
 
 		if (!ptr)
 			break; // error
 		frm_node = list_entry(ptr, xdw_pkt_video_qnode_t, list);
-		free(frm_node->VideoBuffer->data);
-		free(frm_node->VideoBuffer);
-		free(frm_node);
+		av_packet_unref(frm_node->packet);
+		xdw_q_push(&frm_node->list, &(((VideoSource *)cls)->xdw_decoder_q.video_free_q));
 	}
 }
 
@@ -766,11 +788,8 @@ void VideoSource::start_airplay()
 	const char hwaddr[] = { 0x48, 0x5d, 0x60, 0x7c, 0xee, 0x22 };
 	char* pemstr = NULL;
 
-	dnssd_t* dnssd;
-	airplay_t* airplay;
 	airplay_callbacks_t ap_cbs;
 	memset(&ap_cbs, 0, sizeof(airplay_callbacks_t));
-	raop_t* raop;
 	raop_callbacks_t raop_cbs;
 	memset(&raop_cbs, 0, sizeof(raop_callbacks_t));
 	raop_cbs.cls = this;
@@ -797,6 +816,8 @@ void VideoSource::start_airplay()
 
 	raop_set_log_level(raop, RAOP_LOG_DEBUG);
 	raop_set_log_callback(raop, &raop_log_callback, NULL);
+	// The decoder is opened with the Annex B SPS and PPS as extradata
+	raop_set_video_format(raop, VIDEO_FORMAT_ANNEXB);
 	raop_start(raop, &raop_port);
 	raop_set_port(raop, raop_port);
 
@@ -805,28 +826,27 @@ void VideoSource::start_airplay()
 	dnssd_register_airplay(dnssd, name, airplay_port, hwaddr, sizeof(hwaddr));
 
 	printf("Startup complete... Kill with Ctrl+C\n");
-
-	int running = 1;
-	while (running != 0) {
-#ifndef WIN32
-		sleep(1);
-#else
-		Sleep(1000);
-#endif
-	}
-
-	raop_stop(raop);
-	raop_destroy(raop);
-
-	airplay_stop(airplay);
-
-	dnssd_unregister_airplay(dnssd);
-	dnssd_unregister_raop(dnssd);
-	dnssd_destroy(dnssd);
 }
 
 void VideoSource::stop_airplay()
 {
+	if (dnssd != nullptr)
+	{
+		dnssd_unregister_airplay(dnssd);
+		dnssd_unregister_raop(dnssd);
+		dnssd_destroy(dnssd);
+		dnssd = nullptr;
+	}
+	if (raop != nullptr)
+	{
+		raop_destroy(raop);
+		raop = nullptr;
+	}
+	if (airplay != nullptr)
+	{
+		airplay_destroy(airplay);
+		airplay = nullptr;
+	}
 	SDL_Quit();
 }
 
@@ -39,6 +39,7 @@ typedef HANDLE event_handle_t;
 
 #define EVENT_CREATE(handle) handle = CreateEvent(NULL,TRUE,FALSE,NULL)
 #define EVENT_WAIT(handle)      do { WaitForSingleObject(handle, INFINITE);ResetEvent(handle);} while(0)
+#define EVENT_TIMEDWAIT(handle, ms) do { WaitForSingleObject(handle, ms);ResetEvent(handle);} while(0)
 #define EVENT_POST(handle)    SetEvent(handle)
 #define EVENT_DESTORY(handle) CloseHandle(handle)
 
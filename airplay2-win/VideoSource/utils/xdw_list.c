@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 #define  XDW_DBG_LOG(...)  printf
 
@@ -91,6 +92,20 @@ static  void __xdw_list_del(struct xdw_list_head * prev, struct xdw_list_head *
 			xdw_q_head->priv = parm1;
 			break;
 		}
+		case fn_q_node_stop_blocking:
+		{
+			xdw_q_head->stop_blocking_empty = (parm1 != NULL);
+			xdw_q_head->stop_blocking_full = (parm1 != NULL);
+			if(parm1 && (xdw_q_head->mode & fn_q_mode_block_empty))
+			{
+				EVENT_POST(xdw_q_head->has_node);
+			}
+			if(parm1 && (xdw_q_head->mode & fn_q_mode_block_full))
+			{
+				EVENT_POST(xdw_q_head->has_space);
+			}
+			break;
+		}
 		default:
 			break;
 	}
@@ -282,8 +297,16 @@ void reset_q_init(struct xdw_q_head *old_head, struct xdw_q_head *head)
 
 // if already empty, would block if mode is block, otherwise returns NULL
 struct xdw_list_head *xdw_q_pop(struct xdw_q_head *xdw_q_head)
+{
+	return xdw_q_pop_timeout(xdw_q_head, XDW_Q_INFINITE);
+}
+
+// block mode waits up to timeout_ms (XDW_Q_INFINITE for ever) for a node,
+// returns NULL on timeout or once blocking is stopped and the q is empty
+struct xdw_list_head *xdw_q_pop_timeout(struct xdw_q_head *xdw_q_head,int timeout_ms)
 {
 	struct xdw_list_head *poped_item;
+	DWORD start = GetTickCount();
 	xdw_mutex_lock(xdw_q_head->mutex);
 
 	if(xdw_q_head->mode & fn_q_mode_block_empty)
@@ -292,6 +315,25 @@ struct xdw_list_head *xdw_q_pop(struct xdw_q_head *xdw_q_head)
 		//while(xdw_list_empty(&xdw_q_head->lst_head))
 		while(xdw_q_head->is_empty_func(xdw_q_head))
 		{
+			DWORD wait = INFINITE;
+
+			if(xdw_q_head->stop_blocking_empty)
+			{
+	//			XDW_DBG_LOG("stop blocking empty...\n");
+				xdw_mutex_unlock(xdw_q_head->mutex);
+				return (struct xdw_list_head *)NULL;
+			}
+			if(timeout_ms != XDW_Q_INFINITE)
+			{
+				DWORD elapsed = GetTickCount() - start;
+				if(elapsed >= (DWORD)timeout_ms)
+				{
+					xdw_mutex_unlock(xdw_q_head->mutex);
+					return (struct xdw_list_head *)NULL;
+				}
+				wait = (DWORD)timeout_ms - elapsed;
+			}
+
 			// block until newly code added
 			if(xdw_q_head->empty_func)
 			{
@@ -299,20 +341,19 @@ struct xdw_list_head *xdw_q_pop(struct xdw_q_head *xdw_q_head)
 				xdw_mutex_unlock(xdw_q_head->mutex);
 				xdw_q_head->empty_func(xdw_q_head->empty_parm);
 				xdw_mutex_lock(xdw_q_head->mutex);
+				if(!xdw_q_head->is_empty_func(xdw_q_head))
+					break;
 			}
 			//pthread_cond_wait(&xdw_q_head->has_node,(pthread_mutex_t*)xdw_q_head->mutex);
 			{
+				// has_node is manual reset, a push between the unlock and
+				// the wait leaves it set and the wait returns at once
 				xdw_mutex_unlock(xdw_q_head->mutex);
-				EVENT_WAIT(xdw_q_head->has_node);
+				EVENT_TIMEDWAIT(xdw_q_head->has_node, wait);
 				xdw_mutex_lock(xdw_q_head->mutex);
 
 			}
 //			XDW_DBG_LOG("stop pthread_cond_wait\n");
-			if(xdw_q_head->stop_blocking_empty)
-			{
-	//			XDW_DBG_LOG("stop blocking empty...\n");
-				break;
-			}
 		}
 	}
 	else
@@ -348,6 +389,26 @@ struct xdw_list_head *xdw_q_pop(struct xdw_q_head *xdw_q_head)
 	return poped_item;
 }
 
+  int xdw_q_init_pool(struct xdw_q_head *xdw_q_head,void *nodes,int node_size,int node_nr,int list_offset)
+{
+	int i;
+
+	memset(xdw_q_head,0,sizeof(struct xdw_q_head));
+	if(xdw_q_init(xdw_q_head,fn_q_mode_block_empty) < 0)
+	{
+		return -1;
+	}
+	xdw_q_head->max_node_nr = node_nr;
+
+	for(i = 0; i < node_nr; i++)
+	{
+		struct xdw_list_head *node = (struct xdw_list_head *)((char *)nodes + i * node_size + list_offset);
+		xdw_xdw_list_add_tail(node,&xdw_q_head->lst_head);
+		xdw_q_head->node_nr++;
+	}
+	return 0;
+}
+
 
 
 // if already empty, returns NULL
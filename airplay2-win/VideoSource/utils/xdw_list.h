@@ -60,6 +60,7 @@ typedef enum _q_node_property_e_
 	fn_q_node_push_func,
 	fn_q_node_pop_func,
 	fn_q_node_priv_data,
+	fn_q_node_stop_blocking,	// parm1 != 0 wakes every waiter and makes pops return NULL when empty
 	fn_q_node_max
 }q_node_property_e;
 
@@ -111,9 +112,18 @@ int xdw_q_push(struct xdw_list_head *newly,struct xdw_q_head *xdw_q_head);
 int xdw_q_is_empty(struct xdw_q_head *xdw_q_head);
 struct xdw_list_head *xdw_q_get_first(struct xdw_q_head *xdw_q_head);
 struct xdw_list_head *xdw_q_pop(struct xdw_q_head *xdw_q_head);
+struct xdw_list_head *xdw_q_pop_timeout(struct xdw_q_head *xdw_q_head,int timeout_ms);
 int xdw_q_get_max_node_nr(struct xdw_q_head *xdw_q_head);
 int xdw_q_get_node_nr(struct xdw_q_head *xdw_q_head);
 
+#define XDW_Q_INFINITE	(-1)
+
+// Bounded pool of preallocated nodes: a blocking q holding node_nr nodes of
+// node_size bytes laid out in nodes[], the xdw_list_head of each one at
+// list_offset. Take a node with xdw_q_pop(_timeout), give it back with
+// xdw_q_push, nothing is allocated while the pool is in use.
+int xdw_q_init_pool(struct xdw_q_head *xdw_q_head,void *nodes,int node_size,int node_nr,int list_offset);
+
 #ifdef __cplusplus
 }
 #endif
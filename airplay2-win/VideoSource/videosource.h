@@ -32,10 +32,19 @@ extern "C"
 
 #define MAX_CACHED_AFRAME_NUM 100
 #define MAX_CACHED_VFRAME_NUM 10
+#define VIDEO_NODE_WAIT_MS 500	// how long the receiver waits for a free node before dropping
+
+typedef struct _VideoPktBufferPool
+{
+	AVPacket *packet;	// preallocated, its buffer is handed to the decoder
+	struct xdw_list_head list;
+}xdw_pkt_video_qnode_t;
 
 typedef struct __xdw_air_decoder_q
 {
 	struct xdw_q_head video_pkt_q;	// raw packet q that not be decoded
+	struct xdw_q_head video_free_q;	// pool of the unused video_nodes
+	xdw_pkt_video_qnode_t video_nodes[MAX_CACHED_VFRAME_NUM];
 	struct xdw_q_head audio_pkt_q;
 }xdw_air_decoder_q;
 
@@ -57,13 +66,6 @@ typedef struct __xdw_video_frm_t
 	unsigned char *data;
 }xdw_video_frm_t;
 
-
-typedef struct _VideoPktBufferPool
-{
-	xdw_video_frm_t *VideoBuffer;
-	struct xdw_list_head list;
-}xdw_pkt_video_qnode_t;
-
 #define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
 #define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
 #define AV_SYNC_THRESHOLD 0.01
@@ -143,6 +145,10 @@ public:
 	struct VideoState  *vs;
 	void start_airplay();
 	void stop_airplay();
+	// Owned by start_airplay, stop_airplay ends the callbacks into this object
+	raop_t *raop;
+	airplay_t *airplay;
+	dnssd_t *dnssd;
 	volatile bool audio_quit;
 
 	int  audio_volume;
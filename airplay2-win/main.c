@@ -358,6 +358,8 @@ main(int argc, char* argv[])
 
 	raop_set_log_level(raop, RAOP_LOG_DEBUG);
 	raop_set_log_callback(raop, &raop_log_callback, NULL);
+	// video_process writes and parses Annex B
+	raop_set_video_format(raop, VIDEO_FORMAT_ANNEXB);
 	raop_start(raop, &raop_port);
 	raop_set_port(raop, raop_port);
 
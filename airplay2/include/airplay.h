@@ -23,8 +23,24 @@ extern "C" {
 #define AIRPLAY_LOG_DEBUG       7       /* debug-level messages */
 
 
+	/* Playback states, as reported to senders */
+#define AIRPLAY_STATE_PLAYING   0
+#define AIRPLAY_STATE_PAUSED    1
+#define AIRPLAY_STATE_LOADING   2
+#define AIRPLAY_STATE_STOPPED   3
+
 	typedef struct airplay_s airplay_t;
 
+	/* Times in seconds. position is where playback was when the state was
+	 * set, it moves on at rate while playing. */
+	struct airplay_playback_state_s {
+		int state;
+		double duration;
+		double position;
+		double rate;
+	};
+	typedef struct airplay_playback_state_s airplay_playback_state_t;
+
 	typedef void(*airplay_log_callback_t)(void *cls, int level, const char *msg);
 
 	struct airplay_callbacks_s {
@@ -49,9 +65,17 @@ extern "C" {
 	AIRPLAY_API airplay_t *airplay_init(int max_clients, airplay_callbacks_t *callbacks, const char *pemkey, int *error);
 	AIRPLAY_API airplay_t *airplay_init_from_keyfile(int max_clients, airplay_callbacks_t *callbacks, const char *keyfile, int *error);
 
+	/* Only before airplay_start, see raop_set_pairing_seed */
+	AIRPLAY_API int airplay_set_pairing_seed(airplay_t *airplay, const unsigned char seed[32]);
+
 	AIRPLAY_API void airplay_set_log_level(airplay_t *airplay, int level);
 	AIRPLAY_API void airplay_set_log_callback(airplay_t *airplay, airplay_log_callback_t callback, void *cls);
 
+	/* The player publishes its state here when it changes. /playback-info is
+	 * then answered from it instead of calling video_get_play_info, and
+	 * senders that opened /reverse get the changes pushed as events. */
+	AIRPLAY_API void airplay_set_playback_state(airplay_t *airplay, const airplay_playback_state_t *state);
+
 	AIRPLAY_API int airplay_start(airplay_t *airplay, unsigned short *port, const char *hwaddr, int hwaddrlen, const char *password);
 	AIRPLAY_API int airplay_is_running(airplay_t *airplay);
 	AIRPLAY_API void airplay_stop(airplay_t *airplay);
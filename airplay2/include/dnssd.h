@@ -7,6 +7,8 @@
 # define DNSSD_API
 #endif
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -16,6 +18,7 @@ extern "C" {
 #define DNSSD_ERROR_OUTOFMEM      2
 #define DNSSD_ERROR_LIBNOTFOUND   3
 #define DNSSD_ERROR_PROCNOTFOUND  4
+#define DNSSD_ERROR_SOCKET        5
 
 typedef struct dnssd_s dnssd_t;
 
@@ -24,6 +27,14 @@ DNSSD_API dnssd_t *dnssd_init(int *error);
 DNSSD_API int dnssd_register_raop(dnssd_t *dnssd, const char *name, unsigned short port, const char *hwaddr, int hwaddrlen, int password);
 DNSSD_API int dnssd_register_airplay(dnssd_t *dnssd, const char *name, unsigned short port, const char *hwaddr, int hwaddrlen);
 
+/* The feature bits announced with the AirPlay service, they should match
+ * raop_info_t.features. Either before registering or to update them. */
+DNSSD_API int dnssd_set_features(dnssd_t *dnssd, uint64_t features);
+
+/* Adds or replaces one TXT key of a registered service and re-announces it */
+DNSSD_API int dnssd_set_raop_txt(dnssd_t *dnssd, const char *key, const char *value);
+DNSSD_API int dnssd_set_airplay_txt(dnssd_t *dnssd, const char *key, const char *value);
+
 DNSSD_API void dnssd_unregister_raop(dnssd_t *dnssd);
 DNSSD_API void dnssd_unregister_airplay(dnssd_t *dnssd);
 
@@ -0,0 +1,57 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef FMP4_H
+#define FMP4_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fragmented MP4 muxer for a mirroring session, no transcoding.
+ *
+ * Video goes in as the Annex B frames video_process delivers and is stored
+ * as an avc3 track, the parameter sets stay in band so a rotation does not
+ * need a new moov. Audio goes in as the AAC-ELD packets of pcm_data_struct.
+ * Both are timed by their ntp_pts, the first video keyframe is time 0.
+ *
+ * Nothing is written before that keyframe. Then every write callback gets
+ * one complete piece: the init segment (ftyp and moov) once, and after it
+ * one moof+mdat fragment per GOP, cut earlier after 2s or max_fragment
+ * bytes. Memory stays below about max_fragment bytes per track. The muxer
+ * does no I/O, the callback should queue the data for another thread.
+ *
+ * Calls must not overlap, the caller serializes video and audio. */
+
+#define FMP4_INIT               0x01    /* ftyp and moov */
+#define FMP4_KEYFRAME           0x02    /* the fragment starts with a sync sample */
+
+typedef void (*fmp4_write_t)(void *cls, const unsigned char *data, int len, int flags);
+
+typedef struct fmp4_s fmp4_t;
+
+/* audio_config is the AudioSpecificConfig, NULL for a video only file */
+fmp4_t *fmp4_init(const unsigned char *audio_config, int audio_config_len, int sample_rate, int channels,
+                  int frame_samples, int max_fragment, fmp4_write_t write, void *cls);
+/* Writes what is still buffered */
+void fmp4_destroy(fmp4_t *fmp4);
+
+int fmp4_write_video(fmp4_t *fmp4, const unsigned char *data, int len, uint64_t ntp_pts);
+/* len 0 stands for a lost packet and only moves the audio clock on */
+int fmp4_write_audio(fmp4_t *fmp4, const unsigned char *data, int len, uint64_t ntp_pts);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -33,6 +33,21 @@ typedef struct raop_s raop_t;
 
 typedef void (*raop_log_callback_t)(void *cls, int level, const char *msg);
 
+/* Connection phases reported through connection_phase, each at most once per
+ * connection and stamped when the phase completes */
+#define RAOP_PHASE_INFO              0       /* GET /info answered */
+#define RAOP_PHASE_PAIR_SETUP        1
+#define RAOP_PHASE_PAIR_VERIFY       2       /* signature checked */
+#define RAOP_PHASE_FP_SETUP          3       /* FairPlay handshake done */
+#define RAOP_PHASE_SETUP_SESSION     4       /* SETUP 1, keys */
+#define RAOP_PHASE_SETUP_MIRROR      5       /* SETUP 2, type 110 */
+#define RAOP_PHASE_SETUP_AUDIO       6       /* SETUP 3, type 96 or 103 */
+#define RAOP_PHASE_RECORD            7
+#define RAOP_PHASE_MIRROR_ACCEPT     8       /* mirror data connection accepted */
+#define RAOP_PHASE_MIRROR_SPS_PPS    9       /* first codec header */
+#define RAOP_PHASE_MIRROR_IDR        10      /* first frame holding an IDR slice */
+#define RAOP_PHASE_COUNT             11
+
 struct raop_callbacks_s {
 	void* cls;
 
@@ -48,15 +63,105 @@ struct raop_callbacks_s {
 	void  (*audio_set_coverart)(void *cls, void *session, const void *buffer, int buflen, const char* remoteName, const char* remoteDeviceId);
 	void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header, const char* remoteName, const char* remoteDeviceId);
 	void  (*audio_set_progress)(void *cls, void *session, unsigned int start, unsigned int curr, unsigned int end, const char* remoteName, const char* remoteDeviceId);
+
+	/* Optional, time_us is raop_clock_us when the phase completed. Phases
+	 * before SETUP 1 are held back until the sender has named itself, so
+	 * the calls are not in time order. Called from the connection and the
+	 * mirror threads. */
+	void  (*connection_phase)(void *cls, int phase, uint64_t time_us, const char* remoteName, const char* remoteDeviceId);
 };
 typedef struct raop_callbacks_s raop_callbacks_t;
 
+/* Feature bit offering buffered audio (stream type 103): the sender pushes
+ * compressed audio over TCP ahead of time and anchors it with
+ * SETRATEANCHORTIME. Opt-in, senders that see it also expect PTP timing,
+ * which this library does not provide. */
+#define RAOP_FEATURE_BUFFERED_AUDIO (1ULL << 40)
+
+/* Feature bit telling senders they may mirror in H.265, video_process then
+ * reports VIDEO_CODEC_H265 */
+#define RAOP_FEATURE_SCREEN_MULTI_CODEC (1ULL << 42)
+
+/* What GET /info reports about this receiver, see raop_info_init for the
+ * defaults. Strings are ASCII. Senders encode the mirror stream for the
+ * display described here, so a receiver that shows it smaller should ask
+ * for less instead of scaling down. Width and height go up to 65535,
+ * refresh rate and max FPS up to 255. */
+struct raop_info_s {
+	char name[64];
+	char deviceid[18];			/* aa:bb:cc:dd:ee:ff, also used as macAddress */
+	char model[32];
+	char source_version[16];
+	char pi[37];
+	char display_uuid[37];
+	unsigned char pk[32];
+	uint64_t features;
+	uint32_t status_flags;
+	int display_width;
+	int display_height;
+	int display_refresh_rate;
+	int display_max_fps;
+	int display_overscanned;
+	uint32_t display_features;
+};
+typedef struct raop_info_s raop_info_t;
+
+/* Roles of the threads the library starts, each with its own scheduling,
+ * see raop_set_thread_policy */
+#define RAOP_THREAD_AUDIO            0       /* audio receive and decode */
+#define RAOP_THREAD_TIMING           1       /* NTP requests to the sender */
+#define RAOP_THREAD_MIRROR           2       /* mirror receive, video_process runs on it */
+#define RAOP_THREAD_DECODE           3       /* video work on threads of the embedder */
+#define RAOP_THREAD_CONTROL          4       /* RTSP/HTTP, mDNS, key generation */
+#define RAOP_THREAD_ROLE_COUNT       5
+
+#define RAOP_SCHED_OTHER             0
+#define RAOP_SCHED_FIFO              1       /* MMCSS on Windows */
+#define RAOP_SCHED_RR                2
+
+/* By default audio and timing run SCHED_FIFO and, with three or more CPUs,
+ * on the last one, while mirror and decode threads keep off it. When a
+ * realtime class is not permitted the thread gets the highest priority
+ * RLIMIT_RTPRIO allows, then a raised nice value. */
+struct raop_thread_policy_s {
+	int sched;			/* RAOP_SCHED_* */
+	int priority;			/* 1-99 for FIFO and RR, otherwise a nice value */
+	uint64_t affinity;		/* CPU mask, 0 lets the system choose */
+	char name[16];			/* shown by debuggers and top */
+};
+typedef struct raop_thread_policy_s raop_thread_policy_t;
+
 RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks);
 
+/* Monotonic clock in microseconds, the time base of connection_phase */
+RAOP_API uint64_t raop_clock_us(void);
+/* Process wide, threads started afterwards use the new policy. Returns -1
+ * for an unknown role or sched. */
+RAOP_API void raop_get_thread_policy(int role, raop_thread_policy_t *policy);
+RAOP_API int raop_set_thread_policy(int role, const raop_thread_policy_t *policy);
+/* Applies the policy of role to the calling thread, for threads of the
+ * embedder that do the same work. Returns 0, 1 if the thread had to settle
+ * for a lower priority or could not be pinned, -1 for an unknown role. */
+RAOP_API int raop_apply_thread_policy(int role);
+/* Called by a thread that applied a policy before it exits. Releases the
+ * MMCSS task on Windows, does nothing elsewhere. */
+RAOP_API void raop_revert_thread_policy(void);
+
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
 RAOP_API void raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls);
 RAOP_API void raop_log(raop_t* raop, int level, const char* fmt, ...);
+/* Only before raop_start, replaces the identity generated by raop_init.
+ * Keeping the seed lets senders recognise the receiver across restarts. */
+RAOP_API int raop_set_pairing_seed(raop_t *raop, const unsigned char seed[32]);
+RAOP_API void raop_get_public_key(raop_t *raop, unsigned char public_key[32]);
+RAOP_API void raop_info_init(raop_info_t *info);
+/* Only before raop_start, the /info reply is rebuilt from info */
+RAOP_API int raop_set_info(raop_t *raop, const raop_info_t *info);
 RAOP_API void raop_set_port(raop_t *raop, unsigned short port);
+/* VIDEO_FORMAT_* of video_process for sessions set up after the call.
+ * VIDEO_FORMAT_AVCC (the default) passes frames on as the sender sent
+ * them, Annex B costs a rewrite of every frame. */
+RAOP_API void raop_set_video_format(raop_t *raop, int format);
 RAOP_API unsigned short raop_get_port(raop_t *raop);
 RAOP_API void *raop_get_callback_cls(raop_t *raop);
 RAOP_API int raop_start(raop_t *raop, unsigned short *port);
@@ -7,6 +7,15 @@
 
 #include <stdint.h>
 
+#define VIDEO_CODEC_H264        0
+#define VIDEO_CODEC_H265        1
+
+/* Layout of h264_decode_struct data, see raop_set_video_format */
+#define VIDEO_FORMAT_AVCC       0   /* 4 byte NAL lengths, avcC/hvcC record */
+#define VIDEO_FORMAT_ANNEXB     1   /* start codes, parameter sets as NALs */
+
+/* One mirrored frame, or with frame_type 0 the parameter sets (for H.265
+ * with the VPS). Despite the name also used for H.265. */
 typedef struct {
     int nGOPIndex;
     int frame_type;
@@ -15,8 +24,23 @@ typedef struct {
     int data_len;
     unsigned int nTimeStamp;
     uint64_t pts;
+    /* Capture time on the sender NTP clock in us, 0 for parameter sets */
+    uint64_t ntp_pts;
+    int codec;                  /* VIDEO_CODEC_* */
+    int format;                 /* VIDEO_FORMAT_* */
+    int is_key;                 /* IDR, for H.265 any IRAP picture */
 } h264_decode_struct;
 
+/* AudioSpecificConfig of the AAC-ELD audio senders use when mirroring:
+ * 44.1kHz, stereo, 480 samples per frame */
+#define AAC_ELD_CONFIG          { 0xF8, 0xE8, 0x50, 0x00 }
+#define AAC_ELD_FRAME_SAMPLES   480
+
+/* Audio codecs, the ct of the SETUP stream */
+#define AUDIO_CODEC_ALAC        2
+#define AUDIO_CODEC_AAC_LC      4
+#define AUDIO_CODEC_AAC_ELD     8
+
 typedef struct {
     unsigned short *data;
     int data_len;
@@ -24,5 +48,12 @@ typedef struct {
     uint32_t sample_rate;
     uint16_t channels;
     uint16_t bits_per_sample;
+    /* Play time on the sender NTP clock in us, 0 until the first sync packet */
+    uint64_t ntp_pts;
+    /* The packet data was decoded from, NULL when data is silence filling
+     * a lost packet */
+    const unsigned char *encoded;
+    int encoded_len;
+    int codec;                  /* AUDIO_CODEC_* of encoded */
 } pcm_data_struct;
 #endif //AIRPLAYSERVER_STREAM_H
@@ -0,0 +1,62 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "raop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pipeline spans for chrome://tracing / Perfetto.
+ *
+ * Build every project with AIRPLAY_TRACE defined to record, otherwise the
+ * macros expand to nothing. Each thread appends to its own buffer without
+ * locking, a full buffer drops further spans until the next trace_start.
+ * The buffer of a thread that exited is reused by the next new thread, its
+ * spans are in the dump until then.
+ * Names must be string literals, only the pointer is stored.
+ *
+ *     TRACE_SPAN_BEGIN(decrypt);
+ *     mirror_buffer_decrypt(...);
+ *     TRACE_SPAN_END(decrypt, "mirror_decrypt");
+ */
+
+#ifdef AIRPLAY_TRACE
+#define TRACE_THREAD_NAME(name)             trace_thread_name(name)
+#define TRACE_SPAN_BEGIN(span)              uint64_t trace_span_##span = raop_clock_us()
+#define TRACE_SPAN_END(span, name)          trace_span(name, trace_span_##span, -1)
+/* arg shows up in the span details, e.g. a payload size */
+#define TRACE_SPAN_END_ARG(span, name, arg) trace_span(name, trace_span_##span, (int64_t)(arg))
+#else
+#define TRACE_THREAD_NAME(name)
+#define TRACE_SPAN_BEGIN(span)
+#define TRACE_SPAN_END(span, name)
+#define TRACE_SPAN_END_ARG(span, name, arg)
+#endif
+
+void trace_thread_name(const char *name);
+void trace_span(const char *name, uint64_t begin_us, int64_t arg);
+
+/* Drops what was recorded and starts over. Return -1 when tracing is not
+ * compiled in. */
+int trace_start(void);
+/* Writes the spans recorded since trace_start as Chrome trace JSON */
+int trace_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -4,7 +4,9 @@
 #include <assert.h>
 
 #include "airplay.h"
+#include "raop.h"
 #include "raop_rtp.h"
+#include "threads.h"
 //#include "rsakey.h"
 #include "digest.h"
 #include "httpd.h"	
@@ -28,7 +30,19 @@
 
 #define MAX_PACKET_LEN 4096
 
+#ifdef WIN32
 const __int64 DELTA_EPOCH_IN_MICROSECS = 11644473600000000;
+#endif
+
+#if defined(WIN32)
+#define PLAYBACK_LOAD(p)            InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define PLAYBACK_INCREMENT(p)       InterlockedIncrement((volatile LONG *)(p))
+#define PLAYBACK_FENCE()            MemoryBarrier()
+#else
+#define PLAYBACK_LOAD(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PLAYBACK_INCREMENT(p)       __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define PLAYBACK_FENCE()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
 
 
 struct airplay_s
@@ -49,6 +63,16 @@ struct airplay_s
 
 	/* Password information */
 	char password[MAX_PASSWORD_LEN + 1];
+
+	/* What the player published, written under playback_mutex and read
+	 * without it: playback_seq is odd while it is written, 0 until the
+	 * first state. playback_generation counts the state changes. */
+	mutex_handle_t playback_mutex;
+	volatile unsigned int playback_seq;
+	airplay_playback_state_t playback;
+	uint64_t playback_us;
+	unsigned int playback_generation;
+	volatile unsigned int reverse_sessions;
 };
 
 struct airplay_conn_s
@@ -71,6 +95,11 @@ struct airplay_conn_s
 	unsigned char buffer[MAX_PACKET_LEN];
 	int pos;
 
+	/* Set on the /reverse connection of a sender */
+	int reverse;
+	int event_session;
+	unsigned int event_generation;
+	char session_id[64];
 };
 
 typedef struct airplay_conn_s airplay_conn_t;
@@ -184,9 +213,49 @@ const char *eventStrings[] = { "playing", "paused", "loading", "stopped" };
 "</dict>\r\n"\
 "</plist>\r\n"\
 
+#define EVENT_REQUEST "POST /event HTTP/1.1\r\n"\
+"Content-Type: text/x-apple-plist+xml\r\n"\
+"Content-Length: %d\r\n"\
+"X-Apple-Session-ID: %s\r\n"\
+"\r\n"
+
 #define AUTH_REALM "AirPlay"
 #define AUTH_REQUIRED "WWW-Authenticate: Digest realm=\""  AUTH_REALM  "\", nonce=\"%s\"\r\n"
 
+/* Copies the latest published state with the position it has reached by
+ * now. Returns 0 if the player never published one. */
+static int
+airplay_get_playback_state(airplay_t *airplay, airplay_playback_state_t *state, unsigned int *generation)
+{
+	uint64_t published_us;
+	unsigned int seq;
+
+	for (;;) {
+		seq = PLAYBACK_LOAD(&airplay->playback_seq);
+		if (seq == 0) {
+			return 0;
+		}
+		if (seq & 1) {
+			continue;
+		}
+		*state = airplay->playback;
+		published_us = airplay->playback_us;
+		*generation = airplay->playback_generation;
+		PLAYBACK_FENCE();
+		if (PLAYBACK_LOAD(&airplay->playback_seq) == seq) {
+			break;
+		}
+	}
+
+	if (state->state == AIRPLAY_STATE_PLAYING) {
+		state->position += state->rate * (double)(raop_clock_us() - published_us) / 1000000.0;
+		if (state->duration > 0 && state->position > state->duration) {
+			state->position = state->duration;
+		}
+	}
+	return 1;
+}
+
 #include "airplay_handlers.h"
 
 static void *
@@ -257,6 +326,38 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
 
 }
 
+static int
+conn_event(void *ptr, char *buffer, int size)
+{
+	airplay_conn_t *conn = ptr;
+	airplay_playback_state_t state;
+	unsigned int generation;
+	char *body = (char *)conn->buffer;
+	int bodylen, len;
+
+	if (!conn->reverse || !airplay_get_playback_state(conn->airplay, &state, &generation) ||
+	    generation == conn->event_generation) {
+		return 0;
+	}
+	if (state.state < AIRPLAY_STATE_PLAYING || state.state > AIRPLAY_STATE_STOPPED) {
+		return 0;
+	}
+
+	bodylen = snprintf(body, sizeof(conn->buffer), EVENT_INFO, conn->event_session, eventStrings[state.state]);
+	if (bodylen < 0 || bodylen >= (int)sizeof(conn->buffer)) {
+		return 0;
+	}
+	len = snprintf(buffer, size, EVENT_REQUEST, bodylen, conn->session_id);
+	if (len < 0 || len + bodylen > size) {
+		return 0;
+	}
+	memcpy(buffer + len, body, bodylen);
+	/* Only what goes out counts as delivered */
+	conn->event_generation = generation;
+	logger_log(conn->airplay->logger, LOGGER_DEBUG, "[AirPlay] Event %s", eventStrings[state.state]);
+	return len + bodylen;
+}
+
 static void 
 conn_request(void *ptr, http_request_t *request, http_response_t **response)
 {
@@ -334,6 +435,14 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
 		*response = http_response_init("HTTP/1.1", 101, "Switching Protocols");
 		http_response_add_header(*response, "Upgrade", "PTTH/1.0");
 		http_response_add_header(*response, "Connection", "Upgrade");
+		http_response_set_upgrade(*response, 1);
+		conn->reverse = 1;
+		conn->event_session = (int)PLAYBACK_INCREMENT(&airplay->reverse_sessions);
+		/* Header names are matched as sent */
+		const char *session_id = m_sessionId ? m_sessionId : http_request_get_header(request, "X-Apple-Session-ID");
+		if (session_id) {
+			strncpy(conn->session_id, session_id, sizeof(conn->session_id) - 1);
+		}
 	}
 
 	if (handler != NULL) {
@@ -341,7 +450,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
 	}
 
 	http_response_finish(*response, response_data, response_datalen);
-	if (response_data) {
+	if (response_data && response_data != (char *)conn->buffer) {
 		free(response_data);
 		response_data = NULL;
 		response_datalen = 0;
@@ -423,6 +532,7 @@ airplay_init(int max_clients, airplay_callbacks_t *callbacks, const char *pemkey
 	httpd_cbs.conn_init = &conn_init;
 	httpd_cbs.conn_request = &conn_request;
 	httpd_cbs.conn_destroy = &conn_destroy;
+	httpd_cbs.conn_event = &conn_event;
 	// httpd_cbs.conn_datafeed = &conn_datafeed;
 
 	httpd = httpd_init(airplay->logger, &httpd_cbs, max_clients);
@@ -457,6 +567,7 @@ airplay_init(int max_clients, airplay_callbacks_t *callbacks, const char *pemkey
 	//airplay->rsakey = rsakey;
 
 	airplay->mirror_server = mirror_server;
+	MUTEX_CREATE(airplay->playback_mutex);
 
 	return airplay;
 }
@@ -485,6 +596,45 @@ airplay_is_running(airplay_t *airplay)
 	return httpd_is_running(airplay->httpd);
 }
 
+int
+airplay_set_pairing_seed(airplay_t *airplay, const unsigned char seed[32])
+{
+	pairing_t *pairing;
+
+	assert(airplay);
+	assert(seed);
+
+	if (httpd_is_running(airplay->httpd)) {
+		return -1;
+	}
+	pairing = pairing_init_seed(seed);
+	if (!pairing) {
+		return -1;
+	}
+	pairing_destroy(airplay->pairing);
+	airplay->pairing = pairing;
+	return 0;
+}
+
+void
+airplay_set_playback_state(airplay_t *airplay, const airplay_playback_state_t *state)
+{
+	assert(airplay);
+	assert(state);
+
+	MUTEX_LOCK(airplay->playback_mutex);
+	PLAYBACK_INCREMENT(&airplay->playback_seq);
+	PLAYBACK_FENCE();
+	if (airplay->playback_seq == 1 || airplay->playback.state != state->state) {
+		airplay->playback_generation++;
+	}
+	airplay->playback = *state;
+	airplay->playback_us = raop_clock_us();
+	PLAYBACK_FENCE();
+	PLAYBACK_INCREMENT(&airplay->playback_seq);
+	MUTEX_UNLOCK(airplay->playback_mutex);
+}
+
 void
 airplay_set_log_level(airplay_t *airplay, int level)
 {
@@ -554,6 +704,7 @@ void airplay_destroy(airplay_t* airplay) {
 		httpd_destroy(airplay->mirror_server);
 		pairing_destroy(airplay->pairing);
 		logger_destroy(airplay->logger);
+		MUTEX_DESTROY(airplay->playback_mutex);
 		free(airplay);
 
 		/* Cleanup the network */
@@ -0,0 +1,566 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "alac.h"
+
+/* ALACSpecificConfig of the AirPlay streams */
+#define ALAC_BIT_DEPTH          16
+#define ALAC_PB                 40
+#define ALAC_MB                 10
+#define ALAC_KB                 14
+
+/* Adaptive Golomb coding of the residuals */
+#define QBSHIFT                 9
+#define QB                      (1 << QBSHIFT)
+#define MMULSHIFT               2
+#define MDENSHIFT               (QBSHIFT - MMULSHIFT - 1)
+#define MOFF                    (1 << (MDENSHIFT - 2))
+#define BITOFF                  24
+#define MAX_PREFIX_16           9
+#define MAX_PREFIX_32           9
+#define MAX_DATATYPE_BITS_16    16
+#define N_MAX_MEAN_CLAMP        0xffff
+#define N_MEAN_CLAMP_VAL        0xffff
+
+/* Syntactic elements of a packet */
+#define ID_SCE                  0
+#define ID_CPE                  1
+#define ID_CCE                  2
+#define ID_LFE                  3
+#define ID_DSE                  4
+#define ID_PCE                  5
+#define ID_FIL                  6
+#define ID_END                  7
+
+#define ALAC_MAX_COEFS          32
+/* The Golomb reader loads up to 8 bytes from where a code starts */
+#define ALAC_INPUT_PADDING      16
+
+struct alac_s {
+    int frame_samples;
+    int channels;
+
+    int32_t *predictor;
+    int32_t *mix[2];
+
+    /* Copy of the packet followed by ALAC_INPUT_PADDING zero bytes */
+    unsigned char *input;
+    int input_size;
+};
+
+typedef struct {
+    const unsigned char *data;
+    uint32_t pos;
+    /* Bits in data, pos runs past it once a read does */
+    uint32_t end;
+} alac_bits_t;
+
+static int
+lead(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse(&index, x) ? 31 - (int)index : 32;
+#elif defined(__GNUC__)
+    return x ? __builtin_clz(x) : 32;
+#else
+    int n = 0;
+    if (!x) return 32;
+    while (!(x & 0x80000000u)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static uint32_t
+read_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int32_t
+sign_of(int32_t i)
+{
+    return (int32_t)((uint32_t)-i >> 31) | (i >> 31);
+}
+
+/* Up to 16 bits of the element headers */
+static uint32_t
+bits_read(alac_bits_t *bits, int n)
+{
+    uint32_t v;
+
+    if (bits->pos + n > bits->end) {
+        bits->pos = bits->end + 1;
+        return 0;
+    }
+    v = read_be32(bits->data + (bits->pos >> 3)) << (bits->pos & 7);
+    bits->pos += n;
+    return v >> (32 - n);
+}
+
+static void
+bits_skip(alac_bits_t *bits, uint32_t n)
+{
+    bits->pos = (n > bits->end - bits->pos + 1) ? bits->end + 1 : bits->pos + n;
+}
+
+/* n (1 to 32) bits at bit offset pos */
+static uint32_t
+stream_bits(const unsigned char *in, uint32_t pos, int n)
+{
+    uint64_t v = ((uint64_t)read_be32(in + (pos >> 3)) << 32) | read_be32(in + (pos >> 3) + 4);
+    return (uint32_t)((v << (pos & 7)) >> (64 - n));
+}
+
+/* A residual: unary prefix and k bit suffix, or max_bits verbatim after an
+ * escape prefix */
+static uint32_t
+dyn_get_32bit(const unsigned char *in, uint32_t *bitpos, uint32_t m, uint32_t k, int max_bits)
+{
+    uint32_t pos = *bitpos;
+    uint32_t stream = read_be32(in + (pos >> 3)) << (pos & 7);
+    uint32_t result = lead(~stream);
+
+    if (result >= MAX_PREFIX_32) {
+        result = stream_bits(in, pos + MAX_PREFIX_32, max_bits);
+        pos += MAX_PREFIX_32 + max_bits;
+    } else {
+        pos += result + 1;
+        if (k != 1) {
+            uint32_t v = (stream << (result + 1)) >> (32 - k);
+            pos += k - 1;
+            result *= m;
+            if (v >= 2) {
+                result += v - 1;
+                pos += 1;
+            }
+        }
+    }
+    *bitpos = pos;
+    return result;
+}
+
+/* Length of a run of zero residuals */
+static uint32_t
+dyn_get(const unsigned char *in, uint32_t *bitpos, uint32_t m, uint32_t k)
+{
+    uint32_t pos = *bitpos;
+    uint32_t stream = read_be32(in + (pos >> 3)) << (pos & 7);
+    uint32_t pre = lead(~stream);
+    uint32_t result;
+
+    if (pre >= MAX_PREFIX_16) {
+        stream <<= MAX_PREFIX_16;
+        result = stream >> (32 - MAX_DATATYPE_BITS_16);
+        pos += MAX_PREFIX_16 + MAX_DATATYPE_BITS_16;
+    } else {
+        uint32_t v = (stream << (pre + 1)) >> (32 - k);
+        pos += pre + 1 + k;
+        result = pre * m;
+        if (v >= 2) {
+            result += v - 1;
+        } else {
+            pos -= 1;
+        }
+    }
+    *bitpos = pos;
+    return result;
+}
+
+/* Decodes the residuals of one channel. The stream position is kept in a
+ * local, the packet copy is padded so no code needs a bounds check of its
+ * own, only the start of each one is checked against the end. */
+static int
+dyn_decomp(alac_bits_t *bits, int32_t *out, int num_samples, int chan_bits, int pb_factor)
+{
+    const unsigned char *in = bits->data;
+    uint32_t pos = bits->pos;
+    uint32_t pb = (ALAC_PB * pb_factor) / 4;
+    uint32_t wb = (1 << ALAC_KB) - 1;
+    uint32_t mb = ALAC_MB;
+    uint32_t zmode = 0;
+    int c = 0;
+
+    while (c < num_samples) {
+        uint32_t k, m, n, ndecode;
+
+        if (pos >= bits->end) {
+            return -1;
+        }
+        k = 31 - lead((mb >> QBSHIFT) + 3);
+        if (k > ALAC_KB) {
+            k = ALAC_KB;
+        }
+        m = (1 << k) - 1;
+        n = dyn_get_32bit(in, &pos, m, k, chan_bits);
+
+        /* The least significant bit is the sign */
+        ndecode = n + zmode;
+        out[c++] = (int32_t)((ndecode + 1) >> 1) * (-(int32_t)(ndecode & 1) | 1);
+
+        mb = pb * ndecode + mb - ((pb * mb) >> QBSHIFT);
+        if (n > N_MAX_MEAN_CLAMP) {
+            mb = N_MEAN_CLAMP_VAL;
+        }
+        zmode = 0;
+
+        if ((mb << MMULSHIFT) < QB && c < num_samples) {
+            zmode = 1;
+            k = lead(mb) - BITOFF + ((mb + MOFF) >> MDENSHIFT);
+            m = ((1 << k) - 1) & wb;
+            n = dyn_get(in, &pos, m, k);
+            if (n > (uint32_t)(num_samples - c)) {
+                return -1;
+            }
+            memset(out + c, 0, n * sizeof(int32_t));
+            c += n;
+            if (n >= 65535) {
+                zmode = 0;
+            }
+            mb = 0;
+        }
+    }
+    if (pos > bits->end) {
+        return -1;
+    }
+    bits->pos = pos;
+    return 0;
+}
+
+/* Runs the adaptive predictor over the residuals in pc. coefs are stored
+ * oldest sample first, so both the prediction and the coefficient update
+ * walk the history forwards; the prediction is a plain dot product the
+ * compiler vectorizes. pc and out may be the same buffer when num_active
+ * is 31, the first order predictor. */
+static void
+unpc_block(const int32_t *pc, int32_t *out, int num, int16_t *coefs, int num_active,
+           int chan_bits, int den_shift)
+{
+    int chan_shift = 32 - chan_bits;
+    int32_t den_half = den_shift ? 1 << (den_shift - 1) : 0;
+    int lim = num_active + 1;
+    int i, j;
+
+    if (num <= 0) {
+        return;
+    }
+    out[0] = pc[0];
+    if (num_active == 0) {
+        if (num > 1 && pc != out) {
+            memcpy(out + 1, pc + 1, (num - 1) * sizeof(int32_t));
+        }
+        return;
+    }
+    if (num_active == 31) {
+        int32_t prev = out[0];
+        for (j = 1; j < num; j++) {
+            int32_t del = pc[j] + prev;
+            prev = (int32_t)((uint32_t)del << chan_shift) >> chan_shift;
+            out[j] = prev;
+        }
+        return;
+    }
+
+    /* Warm up on the first order difference */
+    for (j = 1; j < lim && j < num; j++) {
+        int32_t del = pc[j] + out[j - 1];
+        out[j] = (int32_t)((uint32_t)del << chan_shift) >> chan_shift;
+    }
+
+    for (j = lim; j < num; j++) {
+        const int32_t *history = out + j - num_active;
+        int32_t top = out[j - lim];
+        uint32_t sum = 0;
+        int32_t del, del0, sg;
+
+        /* Wraps like the reference decoder on corrupt input */
+        for (i = 0; i < num_active; i++) {
+            sum += (uint32_t)coefs[i] * (uint32_t)(history[i] - top);
+        }
+
+        del = del0 = pc[j];
+        sg = sign_of(del);
+        del = (int32_t)((uint32_t)del + top + (uint32_t)((int32_t)(sum + den_half) >> den_shift));
+        out[j] = (int32_t)((uint32_t)del << chan_shift) >> chan_shift;
+
+        /* Nudge the coefficients towards the sign of the error until it
+         * is used up, from history[0], the oldest sample in the window,
+         * like the reference decoder */
+        if (sg > 0) {
+            for (i = 0; i < num_active; i++) {
+                int32_t dd = top - history[i];
+                int32_t sgn = sign_of(dd);
+                coefs[i] -= sgn;
+                del0 -= (i + 1) * ((sgn * dd) >> den_shift);
+                if (del0 <= 0) {
+                    break;
+                }
+            }
+        } else if (sg < 0) {
+            for (i = 0; i < num_active; i++) {
+                int32_t dd = top - history[i];
+                int32_t sgn = sign_of(dd);
+                coefs[i] += sgn;
+                del0 -= (i + 1) * ((-sgn * dd) >> den_shift);
+                if (del0 >= 0) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* A single channel (SCE, LFE) or channel pair (CPE) element, written to
+ * pcm starting at channel */
+static int
+decode_element(alac_t *alac, alac_bits_t *bits, int num_channels, short *pcm, int channel,
+               int *num_samples)
+{
+    int16_t coefs[2][ALAC_MAX_COEFS];
+    int mode[2], den_shift[2], pb_factor[2], num_coefs[2];
+    int header, bytes_shifted, samples, chan_bits;
+    int mix_bits = 0, mix_res = 0;
+    int stride = alac->channels;
+    int ch, i;
+
+    bits_read(bits, 4);                    /* element instance tag */
+    if (bits_read(bits, 12) != 0) {
+        return -1;
+    }
+    header = bits_read(bits, 4);
+    bytes_shifted = (header >> 1) & 0x3;
+    if (bytes_shifted != 0) {
+        /* Only used above 16 bits */
+        return -1;
+    }
+    samples = alac->frame_samples;
+    if (header & 0x8) {
+        uint32_t partial = bits_read(bits, 16) << 16;
+        partial |= bits_read(bits, 16);
+        if (partial == 0 || partial > (uint32_t)alac->frame_samples) {
+            return -1;
+        }
+        samples = (int)partial;
+    }
+    if (*num_samples == 0) {
+        *num_samples = samples;
+    } else if (*num_samples != samples) {
+        return -1;
+    }
+    chan_bits = ALAC_BIT_DEPTH + num_channels - 1;
+
+    if (!(header & 0x1)) {
+        mix_bits = bits_read(bits, 8);
+        mix_res = (int8_t)bits_read(bits, 8);
+        if (mix_bits >= 32) {
+            return -1;
+        }
+        for (ch = 0; ch < num_channels; ch++) {
+            int value = bits_read(bits, 8);
+            mode[ch] = value >> 4;
+            den_shift[ch] = value & 0xf;
+            value = bits_read(bits, 8);
+            pb_factor[ch] = value >> 5;
+            num_coefs[ch] = value & 0x1f;
+            /* Oldest sample first, see unpc_block */
+            for (i = num_coefs[ch] - 1; i >= 0; i--) {
+                coefs[ch][i] = (int16_t)bits_read(bits, 16);
+            }
+        }
+        if (bits->pos > bits->end) {
+            return -1;
+        }
+        for (ch = 0; ch < num_channels; ch++) {
+            if (dyn_decomp(bits, alac->predictor, samples, chan_bits, pb_factor[ch]) < 0) {
+                return -1;
+            }
+            if (mode[ch] != 0) {
+                unpc_block(alac->predictor, alac->predictor, samples, NULL, 31, chan_bits, 0);
+            }
+            unpc_block(alac->predictor, alac->mix[ch], samples, coefs[ch], num_coefs[ch],
+                       chan_bits, den_shift[ch]);
+        }
+    } else {
+        /* Uncompressed, the channels interleaved */
+        for (i = 0; i < samples; i++) {
+            for (ch = 0; ch < num_channels; ch++) {
+                alac->mix[ch][i] = (int16_t)bits_read(bits, ALAC_BIT_DEPTH);
+            }
+        }
+        if (bits->pos > bits->end) {
+            return -1;
+        }
+    }
+
+    pcm += channel;
+    if (num_channels == 1) {
+        const int32_t *u = alac->mix[0];
+        for (i = 0; i < samples; i++) {
+            pcm[i * stride] = (short)u[i];
+        }
+    } else if (mix_res != 0) {
+        /* Undo the mid/side matrix */
+        const int32_t *u = alac->mix[0];
+        const int32_t *v = alac->mix[1];
+        for (i = 0; i < samples; i++) {
+            int32_t l = u[i] + v[i] - ((mix_res * v[i]) >> mix_bits);
+            pcm[i * stride] = (short)l;
+            pcm[i * stride + 1] = (short)(l - v[i]);
+        }
+    } else {
+        const int32_t *u = alac->mix[0];
+        const int32_t *v = alac->mix[1];
+        for (i = 0; i < samples; i++) {
+            pcm[i * stride] = (short)u[i];
+            pcm[i * stride + 1] = (short)v[i];
+        }
+    }
+    return 0;
+}
+
+alac_t *
+alac_init(int frame_samples, int channels)
+{
+    alac_t *alac;
+
+    if (frame_samples <= 0 || channels < 1 || channels > 2) {
+        return NULL;
+    }
+    alac = calloc(1, sizeof(alac_t));
+    if (!alac) {
+        return NULL;
+    }
+    alac->frame_samples = frame_samples;
+    alac->channels = channels;
+    alac->predictor = malloc(frame_samples * sizeof(int32_t));
+    alac->mix[0] = malloc(frame_samples * sizeof(int32_t));
+    alac->mix[1] = malloc(frame_samples * sizeof(int32_t));
+    if (!alac->predictor || !alac->mix[0] || !alac->mix[1]) {
+        alac_destroy(alac);
+        return NULL;
+    }
+    return alac;
+}
+
+int
+alac_decode(alac_t *alac, const unsigned char *data, int len, short *pcm)
+{
+    alac_bits_t bits;
+    int channel = 0;
+    int samples = 0;
+
+    if (len <= 0) {
+        return -1;
+    }
+    if (alac->input_size < len + ALAC_INPUT_PADDING) {
+        unsigned char *input = realloc(alac->input, len + ALAC_INPUT_PADDING);
+        if (!input) {
+            return -1;
+        }
+        alac->input = input;
+        alac->input_size = len + ALAC_INPUT_PADDING;
+    }
+    memcpy(alac->input, data, len);
+    memset(alac->input + len, 0, ALAC_INPUT_PADDING);
+
+    bits.data = alac->input;
+    bits.pos = 0;
+    bits.end = (uint32_t)len * 8;
+
+    while (channel < alac->channels) {
+        int tag = bits_read(&bits, 3);
+        uint32_t count;
+
+        switch (tag) {
+        case ID_SCE:
+        case ID_LFE:
+            if (decode_element(alac, &bits, 1, pcm, channel, &samples) < 0) {
+                return -1;
+            }
+            channel += 1;
+            break;
+        case ID_CPE:
+            if (channel + 2 > alac->channels) {
+                goto done;
+            }
+            if (decode_element(alac, &bits, 2, pcm, channel, &samples) < 0) {
+                return -1;
+            }
+            channel += 2;
+            break;
+        case ID_FIL:
+            count = bits_read(&bits, 4);
+            if (count == 15) {
+                count += bits_read(&bits, 8) - 1;
+            }
+            bits_skip(&bits, count * 8);
+            break;
+        case ID_DSE:
+            bits_read(&bits, 4);            /* element instance tag */
+            {
+                int align = bits_read(&bits, 1);
+                count = bits_read(&bits, 8);
+                if (count == 255) {
+                    count += bits_read(&bits, 8);
+                }
+                if (align) {
+                    bits_skip(&bits, (8 - (bits.pos & 7)) & 7);
+                }
+                bits_skip(&bits, count * 8);
+            }
+            break;
+        case ID_END:
+            goto done;
+        default:
+            return -1;
+        }
+        if (bits.pos > bits.end) {
+            return -1;
+        }
+    }
+
+done:
+    if (channel == 0) {
+        return -1;
+    }
+    /* Channels the packet had no element for are silent */
+    for (; channel < alac->channels; channel++) {
+        int i;
+        for (i = 0; i < samples; i++) {
+            pcm[i * alac->channels + channel] = 0;
+        }
+    }
+    return samples;
+}
+
+void
+alac_destroy(alac_t *alac)
+{
+    if (alac) {
+        free(alac->predictor);
+        free(alac->mix[0]);
+        free(alac->mix[1]);
+        free(alac->input);
+        free(alac);
+    }
+}
@@ -0,0 +1,31 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef ALAC_H
+#define ALAC_H
+
+/* Apple Lossless decoder for the streams AirPlay senders SETUP with ct 2.
+ *
+ * Only what those streams use is supported: 16 bit samples, one or two
+ * channels and the ALACSpecificConfig every sender announces
+ * (352 0 16 40 10 14 2 255 0 0 44100), apart from the frame length. */
+
+typedef struct alac_s alac_t;
+
+alac_t *alac_init(int frame_samples, int channels);
+/* Decodes one packet into interleaved 16 bit PCM, pcm must hold
+ * frame_samples * channels samples. Returns the samples per channel, -1 if
+ * the packet is corrupt. */
+int alac_decode(alac_t *alac, const unsigned char *data, int len, short *pcm);
+void alac_destroy(alac_t *alac);
+
+#endif
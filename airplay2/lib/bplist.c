@@ -0,0 +1,436 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bplist.h"
+
+#define BPLIST_MAGIC        "bplist00"
+#define BPLIST_MAGIC_LEN    8
+#define BPLIST_TRAILER_LEN  32
+
+static uint64_t
+read_be(const uint8_t *ptr, uint8_t size)
+{
+    uint64_t value = 0;
+    uint8_t i;
+
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+/* Offset of the marker byte of object obj, 0 when obj is out of range */
+static uint64_t
+object_offset(const bplist_t *bplist, uint64_t obj)
+{
+    uint64_t offset;
+
+    if (obj >= bplist->objects) {
+        return 0;
+    }
+    offset = read_be(bplist->data + bplist->offtab + obj * bplist->offsize, bplist->offsize);
+    if (offset < BPLIST_MAGIC_LEN || offset >= bplist->offtab) {
+        return 0;
+    }
+    return offset;
+}
+
+/* Resolves the marker of obj into its payload offset and element count.
+ * Counts of 15 or more are stored as an integer object after the marker. */
+static int
+object_header(const bplist_t *bplist, uint64_t obj, uint8_t *type, uint64_t *payload, uint64_t *count)
+{
+    uint64_t offset = object_offset(bplist, obj);
+    uint8_t marker, size;
+
+    if (!offset) {
+        return -1;
+    }
+    marker = bplist->data[offset++];
+    *type = marker & 0xF0;
+    *count = marker & 0x0F;
+    if (*count == 0x0F && *type != BPLIST_TYPE_PRIMITIVE && *type != BPLIST_TYPE_INTEGER &&
+        *type != BPLIST_TYPE_REAL && *type != BPLIST_TYPE_DATE) {
+        if (offset >= bplist->offtab || (bplist->data[offset] & 0xF0) != BPLIST_TYPE_INTEGER) {
+            return -1;
+        }
+        if ((bplist->data[offset] & 0x0F) > 3) {
+            return -1;
+        }
+        size = 1 << (bplist->data[offset] & 0x0F);
+        if (offset + 1 + size > bplist->offtab) {
+            return -1;
+        }
+        *count = read_be(bplist->data + offset + 1, size);
+        offset += 1 + size;
+    }
+    *payload = offset;
+    return 0;
+}
+
+/* Makes sure count elements of elemsize bytes fit before the offset table */
+static int
+payload_fits(const bplist_t *bplist, uint64_t payload, uint64_t count, uint64_t elemsize)
+{
+    uint64_t room = bplist->offtab - payload;
+
+    if (payload > bplist->offtab) {
+        return 0;
+    }
+    return elemsize == 0 || count <= room / elemsize;
+}
+
+int
+bplist_init(bplist_t *bplist, const void *data, uint64_t datalen)
+{
+    const uint8_t *trailer;
+
+    assert(bplist);
+
+    memset(bplist, 0, sizeof(bplist_t));
+    if (!data || datalen < BPLIST_MAGIC_LEN + BPLIST_TRAILER_LEN) {
+        return -1;
+    }
+    if (memcmp(data, BPLIST_MAGIC, BPLIST_MAGIC_LEN)) {
+        return -1;
+    }
+
+    trailer = (const uint8_t *)data + datalen - BPLIST_TRAILER_LEN;
+    bplist->offsize = trailer[6];
+    bplist->refsize = trailer[7];
+    bplist->objects = read_be(trailer + 8, 8);
+    bplist->root = read_be(trailer + 16, 8);
+    bplist->offtab = read_be(trailer + 24, 8);
+
+    if (bplist->offsize < 1 || bplist->offsize > 8 || bplist->refsize < 1 || bplist->refsize > 8) {
+        return -1;
+    }
+    if (bplist->offtab < BPLIST_MAGIC_LEN || bplist->offtab > datalen - BPLIST_TRAILER_LEN) {
+        return -1;
+    }
+    if (bplist->objects == 0 || bplist->root >= bplist->objects ||
+        bplist->objects > (datalen - BPLIST_TRAILER_LEN - bplist->offtab) / bplist->offsize) {
+        return -1;
+    }
+    bplist->data = data;
+    bplist->datalen = datalen;
+    return 0;
+}
+
+uint64_t
+bplist_root(const bplist_t *bplist)
+{
+    assert(bplist);
+
+    if (!bplist->data) {
+        return BPLIST_NONE;
+    }
+    return bplist->root;
+}
+
+uint8_t
+bplist_get_type(const bplist_t *bplist, uint64_t obj)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    if (object_header(bplist, obj, &type, &payload, &count) < 0) {
+        return BPLIST_TYPE_INVALID;
+    }
+    return type;
+}
+
+uint64_t
+bplist_get_count(const bplist_t *bplist, uint64_t obj)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    if (object_header(bplist, obj, &type, &payload, &count) < 0) {
+        return 0;
+    }
+    if (type != BPLIST_TYPE_ARRAY && type != BPLIST_TYPE_DICT) {
+        return 0;
+    }
+    return count;
+}
+
+uint64_t
+bplist_array_get(const bplist_t *bplist, uint64_t array, uint64_t idx)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    if (object_header(bplist, array, &type, &payload, &count) < 0 || type != BPLIST_TYPE_ARRAY) {
+        return BPLIST_NONE;
+    }
+    if (idx >= count || !payload_fits(bplist, payload, count, bplist->refsize)) {
+        return BPLIST_NONE;
+    }
+    return read_be(bplist->data + payload + idx * bplist->refsize, bplist->refsize);
+}
+
+uint64_t
+bplist_dict_get(const bplist_t *bplist, uint64_t dict, const char *key)
+{
+    uint8_t type, keytype;
+    uint64_t payload, count, keypayload, keylen;
+    uint64_t wantlen, i;
+
+    assert(key);
+
+    if (object_header(bplist, dict, &type, &payload, &count) < 0 || type != BPLIST_TYPE_DICT) {
+        return BPLIST_NONE;
+    }
+    /* Keys come first, followed by the same number of value references */
+    if (!payload_fits(bplist, payload, count, 2 * (uint64_t)bplist->refsize)) {
+        return BPLIST_NONE;
+    }
+    wantlen = strlen(key);
+    for (i = 0; i < count; i++) {
+        uint64_t keyobj = read_be(bplist->data + payload + i * bplist->refsize, bplist->refsize);
+        if (object_header(bplist, keyobj, &keytype, &keypayload, &keylen) < 0) {
+            continue;
+        }
+        if (keytype != BPLIST_TYPE_STRING || keylen != wantlen ||
+            !payload_fits(bplist, keypayload, keylen, 1)) {
+            continue;
+        }
+        if (!memcmp(bplist->data + keypayload, key, (size_t)keylen)) {
+            return read_be(bplist->data + payload + (count + i) * bplist->refsize, bplist->refsize);
+        }
+    }
+    return BPLIST_NONE;
+}
+
+int
+bplist_get_bool(const bplist_t *bplist, uint64_t obj, int *value)
+{
+    uint64_t offset = object_offset(bplist, obj);
+
+    assert(value);
+
+    if (!offset) {
+        return -1;
+    }
+    switch (bplist->data[offset]) {
+    case 0x08:
+        *value = 0;
+        return 0;
+    case 0x09:
+        *value = 1;
+        return 0;
+    }
+    return -1;
+}
+
+int
+bplist_get_uint(const bplist_t *bplist, uint64_t obj, uint64_t *value)
+{
+    uint64_t offset = object_offset(bplist, obj);
+    uint8_t marker, size;
+
+    assert(value);
+
+    if (!offset) {
+        return -1;
+    }
+    marker = bplist->data[offset];
+    if ((marker & 0xF0) != BPLIST_TYPE_INTEGER || (marker & 0x0F) > 4) {
+        return -1;
+    }
+    size = 1 << (marker & 0x0F);
+    if (offset + 1 + size > bplist->offtab) {
+        return -1;
+    }
+    /* 16 byte integers only exist to hold unsigned 64 bit values */
+    if (size == 16) {
+        *value = read_be(bplist->data + offset + 9, 8);
+    } else {
+        *value = read_be(bplist->data + offset + 1, size);
+    }
+    return 0;
+}
+
+int
+bplist_get_real(const bplist_t *bplist, uint64_t obj, double *value)
+{
+    uint64_t offset = object_offset(bplist, obj);
+    uint8_t marker;
+    uint64_t bits;
+
+    assert(value);
+
+    if (!offset) {
+        return -1;
+    }
+    marker = bplist->data[offset];
+    if (marker == (BPLIST_TYPE_REAL | 2) && offset + 5 <= bplist->offtab) {
+        uint32_t bits32 = (uint32_t)read_be(bplist->data + offset + 1, 4);
+        float f;
+        memcpy(&f, &bits32, sizeof(f));
+        *value = f;
+        return 0;
+    }
+    if ((marker == (BPLIST_TYPE_REAL | 3) || marker == (BPLIST_TYPE_DATE | 3)) &&
+        offset + 9 <= bplist->offtab) {
+        bits = read_be(bplist->data + offset + 1, 8);
+        memcpy(value, &bits, sizeof(*value));
+        return 0;
+    }
+    /* Senders are not consistent about volume and positions, accept integers */
+    if ((marker & 0xF0) == BPLIST_TYPE_INTEGER) {
+        if (bplist_get_uint(bplist, obj, &bits) < 0) {
+            return -1;
+        }
+        *value = (double)(int64_t)bits;
+        return 0;
+    }
+    return -1;
+}
+
+int
+bplist_get_data(const bplist_t *bplist, uint64_t obj, const uint8_t **value, uint64_t *valuelen)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    assert(value);
+    assert(valuelen);
+
+    if (object_header(bplist, obj, &type, &payload, &count) < 0 || type != BPLIST_TYPE_DATA) {
+        return -1;
+    }
+    if (!payload_fits(bplist, payload, count, 1)) {
+        return -1;
+    }
+    *value = bplist->data + payload;
+    *valuelen = count;
+    return 0;
+}
+
+int
+bplist_get_ascii(const bplist_t *bplist, uint64_t obj, const char **value, uint64_t *valuelen)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    assert(value);
+    assert(valuelen);
+
+    if (object_header(bplist, obj, &type, &payload, &count) < 0 || type != BPLIST_TYPE_STRING) {
+        return -1;
+    }
+    if (!payload_fits(bplist, payload, count, 1)) {
+        return -1;
+    }
+    *value = (const char *)bplist->data + payload;
+    *valuelen = count;
+    return 0;
+}
+
+uint64_t
+bplist_string_size(const bplist_t *bplist, uint64_t obj)
+{
+    uint8_t type;
+    uint64_t payload, count;
+
+    if (object_header(bplist, obj, &type, &payload, &count) < 0) {
+        return 0;
+    }
+    if (type == BPLIST_TYPE_STRING && payload_fits(bplist, payload, count, 1)) {
+        return count + 1;
+    }
+    /* A UTF-16 unit is at most 3 bytes of UTF-8, a surrogate pair 4 */
+    if (type == BPLIST_TYPE_UNICODE && payload_fits(bplist, payload, count, 2)) {
+        return count * 3 + 1;
+    }
+    return 0;
+}
+
+int
+bplist_copy_string(const bplist_t *bplist, uint64_t obj, char *dst, int dstlen)
+{
+    uint8_t type;
+    uint64_t payload, count, i;
+    const uint8_t *src;
+    int len = 0;
+
+    assert(dst);
+    assert(dstlen > 0);
+
+    dst[0] = '\0';
+    if (object_header(bplist, obj, &type, &payload, &count) < 0) {
+        return -1;
+    }
+    src = bplist->data + payload;
+    if (type == BPLIST_TYPE_STRING) {
+        if (!payload_fits(bplist, payload, count, 1)) {
+            return -1;
+        }
+        len = (int)(count < (uint64_t)dstlen - 1 ? count : (uint64_t)dstlen - 1);
+        memcpy(dst, src, len);
+        dst[len] = '\0';
+        return len;
+    }
+    if (type != BPLIST_TYPE_UNICODE || !payload_fits(bplist, payload, count, 2)) {
+        return -1;
+    }
+
+    /* UTF-16BE to UTF-8, never splitting a character at the end */
+    for (i = 0; i < count; i++) {
+        uint32_t cp = (uint32_t)read_be(src + 2 * i, 2);
+        char utf8[4];
+        int n;
+
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < count) {
+            uint32_t lo = (uint32_t)read_be(src + 2 * (i + 1), 2);
+            if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                i++;
+            }
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+        if (cp < 0x80) {
+            utf8[0] = (char)cp;
+            n = 1;
+        } else if (cp < 0x800) {
+            utf8[0] = (char)(0xC0 | (cp >> 6));
+            utf8[1] = (char)(0x80 | (cp & 0x3F));
+            n = 2;
+        } else if (cp < 0x10000) {
+            utf8[0] = (char)(0xE0 | (cp >> 12));
+            utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            utf8[2] = (char)(0x80 | (cp & 0x3F));
+            n = 3;
+        } else {
+            utf8[0] = (char)(0xF0 | (cp >> 18));
+            utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            utf8[3] = (char)(0x80 | (cp & 0x3F));
+            n = 4;
+        }
+        if (len + n > dstlen - 1) {
+            break;
+        }
+        memcpy(dst + len, utf8, n);
+        len += n;
+    }
+    dst[len] = '\0';
+    return len;
+}
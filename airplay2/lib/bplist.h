@@ -0,0 +1,69 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stdint.h>
+
+/* Read-only cursor over a bplist00 buffer. Nothing is copied or allocated,
+ * objects are addressed by their index in the offset table and every
+ * pointer handed out points into the buffer given to bplist_init, so it is
+ * only valid as long as that buffer is. */
+
+#define BPLIST_TYPE_PRIMITIVE   0x00
+#define BPLIST_TYPE_INTEGER     0x10
+#define BPLIST_TYPE_REAL        0x20
+#define BPLIST_TYPE_DATE        0x30
+#define BPLIST_TYPE_DATA        0x40
+#define BPLIST_TYPE_STRING      0x50
+#define BPLIST_TYPE_UNICODE     0x60
+#define BPLIST_TYPE_UID         0x80
+#define BPLIST_TYPE_ARRAY       0xA0
+#define BPLIST_TYPE_DICT        0xD0
+#define BPLIST_TYPE_INVALID     0xFF
+
+/* Returned by lookups that found nothing, every getter rejects it */
+#define BPLIST_NONE ((uint64_t)-1)
+
+typedef struct bplist_s {
+    const uint8_t *data;
+    uint64_t datalen;
+    uint64_t offtab;
+    uint8_t offsize;
+    uint8_t refsize;
+    uint64_t objects;
+    uint64_t root;
+} bplist_t;
+
+int bplist_init(bplist_t *bplist, const void *data, uint64_t datalen);
+uint64_t bplist_root(const bplist_t *bplist);
+
+uint8_t bplist_get_type(const bplist_t *bplist, uint64_t obj);
+uint64_t bplist_get_count(const bplist_t *bplist, uint64_t obj);
+uint64_t bplist_array_get(const bplist_t *bplist, uint64_t array, uint64_t idx);
+uint64_t bplist_dict_get(const bplist_t *bplist, uint64_t dict, const char *key);
+
+int bplist_get_bool(const bplist_t *bplist, uint64_t obj, int *value);
+int bplist_get_uint(const bplist_t *bplist, uint64_t obj, uint64_t *value);
+int bplist_get_real(const bplist_t *bplist, uint64_t obj, double *value);
+int bplist_get_data(const bplist_t *bplist, uint64_t obj, const uint8_t **value, uint64_t *valuelen);
+/* Borrowed, not NUL terminated, only works on ASCII strings */
+int bplist_get_ascii(const bplist_t *bplist, uint64_t obj, const char **value, uint64_t *valuelen);
+/* Copies an ASCII or UTF-16 string as NUL terminated UTF-8, truncating to
+ * fit. Returns the length written or -1. */
+int bplist_copy_string(const bplist_t *bplist, uint64_t obj, char *dst, int dstlen);
+/* Buffer size bplist_copy_string needs for the whole string, 0 if obj is
+ * not a string */
+uint64_t bplist_string_size(const bplist_t *bplist, uint64_t obj);
+
+#endif
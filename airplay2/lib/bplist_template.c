@@ -0,0 +1,576 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bplist_template.h"
+#include "bplist.h"
+
+typedef struct bplist_template_node_s {
+    uint8_t type;
+    int parent;
+    char *key;
+
+    uint64_t uint_value;
+    uint8_t width;
+    double real_value;
+    uint8_t *bytes;
+    uint32_t byteslen;
+
+    /* Object indexes and payload position once compiled */
+    uint64_t keyobj;
+    uint32_t payload;
+} bplist_template_node_t;
+
+struct bplist_template_s {
+    bplist_template_node_t *nodes;
+    int count;
+    int capacity;
+
+    uint8_t *data;
+    uint32_t datalen;
+    uint32_t datacap;
+    int compiled;
+    /* A failed add leaves the skeleton incomplete, compile refuses it */
+    int failed;
+};
+
+static int
+buffer_put(bplist_template_t *tpl, const void *src, uint32_t len)
+{
+    if (tpl->datalen + len > tpl->datacap) {
+        uint32_t cap = tpl->datacap ? tpl->datacap : 256;
+        uint8_t *data;
+
+        while (cap < tpl->datalen + len) {
+            cap *= 2;
+        }
+        data = realloc(tpl->data, cap);
+        if (!data) {
+            return -1;
+        }
+        tpl->data = data;
+        tpl->datacap = cap;
+    }
+    memcpy(tpl->data + tpl->datalen, src, len);
+    tpl->datalen += len;
+    return 0;
+}
+
+static int
+buffer_put_be(bplist_template_t *tpl, uint64_t value, uint8_t width)
+{
+    uint8_t bytes[8];
+    int i;
+
+    for (i = width - 1; i >= 0; i--) {
+        bytes[i] = (uint8_t)value;
+        value >>= 8;
+    }
+    return buffer_put(tpl, bytes, width);
+}
+
+static void
+write_be(uint8_t *dst, uint64_t value, uint8_t width)
+{
+    int i;
+
+    for (i = width - 1; i >= 0; i--) {
+        dst[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+static uint8_t
+width_log2(uint8_t width)
+{
+    switch (width) {
+    case 1: return 0;
+    case 2: return 1;
+    case 4: return 2;
+    default: return 3;
+    }
+}
+
+/* Marker byte, with the length as a following integer object past 14 */
+static int
+buffer_put_marker(bplist_template_t *tpl, uint8_t type, uint64_t count)
+{
+    uint8_t marker;
+
+    if (count < 15) {
+        marker = type | (uint8_t)count;
+        return buffer_put(tpl, &marker, 1);
+    }
+    marker = type | 0x0F;
+    if (buffer_put(tpl, &marker, 1) < 0) {
+        return -1;
+    }
+    if (count < 0x100) {
+        marker = BPLIST_TYPE_INTEGER | 0;
+        return buffer_put(tpl, &marker, 1) < 0 ? -1 : buffer_put_be(tpl, count, 1);
+    } else if (count < 0x10000) {
+        marker = BPLIST_TYPE_INTEGER | 1;
+        return buffer_put(tpl, &marker, 1) < 0 ? -1 : buffer_put_be(tpl, count, 2);
+    }
+    marker = BPLIST_TYPE_INTEGER | 2;
+    return buffer_put(tpl, &marker, 1) < 0 ? -1 : buffer_put_be(tpl, count, 4);
+}
+
+static int
+add_node(bplist_template_t *tpl, int parent, const char *key, uint8_t type)
+{
+    bplist_template_node_t *node;
+    uint8_t ptype;
+
+    assert(tpl);
+
+    if (tpl->compiled || tpl->failed) {
+        return -1;
+    }
+    tpl->failed = 1;
+    /* Only the root has no parent */
+    if (parent < 0 ? tpl->count != 0 : parent >= tpl->count) {
+        return -1;
+    }
+    if (parent >= 0) {
+        ptype = tpl->nodes[parent].type;
+        if (ptype != BPLIST_TYPE_DICT && ptype != BPLIST_TYPE_ARRAY) {
+            return -1;
+        }
+        if (ptype == BPLIST_TYPE_DICT && !key) {
+            return -1;
+        }
+        if (ptype == BPLIST_TYPE_ARRAY) {
+            key = NULL;
+        }
+    }
+    if (tpl->count == tpl->capacity) {
+        int capacity = tpl->capacity ? tpl->capacity * 2 : 16;
+        node = realloc(tpl->nodes, capacity * sizeof(bplist_template_node_t));
+        if (!node) {
+            return -1;
+        }
+        tpl->nodes = node;
+        tpl->capacity = capacity;
+    }
+    node = &tpl->nodes[tpl->count];
+    memset(node, 0, sizeof(bplist_template_node_t));
+    node->type = type;
+    node->parent = parent;
+    if (key) {
+        node->key = strdup(key);
+        if (!node->key) {
+            return -1;
+        }
+    }
+    tpl->failed = 0;
+    return tpl->count++;
+}
+
+bplist_template_t *
+bplist_template_init(void)
+{
+    bplist_template_t *tpl;
+
+    tpl = calloc(1, sizeof(bplist_template_t));
+    if (!tpl) {
+        return NULL;
+    }
+    if (add_node(tpl, -1, NULL, BPLIST_TYPE_DICT) != BPLIST_TEMPLATE_ROOT) {
+        bplist_template_destroy(tpl);
+        return NULL;
+    }
+    return tpl;
+}
+
+int
+bplist_template_add_dict(bplist_template_t *tpl, int parent, const char *key)
+{
+    return add_node(tpl, parent, key, BPLIST_TYPE_DICT);
+}
+
+int
+bplist_template_add_array(bplist_template_t *tpl, int parent, const char *key)
+{
+    return add_node(tpl, parent, key, BPLIST_TYPE_ARRAY);
+}
+
+int
+bplist_template_add_bool(bplist_template_t *tpl, int parent, const char *key, int value)
+{
+    int slot = add_node(tpl, parent, key, BPLIST_TYPE_PRIMITIVE);
+    if (slot >= 0) {
+        tpl->nodes[slot].uint_value = value ? 1 : 0;
+    }
+    return slot;
+}
+
+int
+bplist_template_add_uint(bplist_template_t *tpl, int parent, const char *key, uint64_t value, int width)
+{
+    int slot;
+
+    if ((width != 1 && width != 2 && width != 4 && width != 8) ||
+        (width < 8 && (value >> (8 * width)))) {
+        tpl->failed = 1;
+        return -1;
+    }
+    slot = add_node(tpl, parent, key, BPLIST_TYPE_INTEGER);
+    if (slot >= 0) {
+        tpl->nodes[slot].uint_value = value;
+        tpl->nodes[slot].width = (uint8_t)width;
+    }
+    return slot;
+}
+
+int
+bplist_template_add_real(bplist_template_t *tpl, int parent, const char *key, double value)
+{
+    int slot = add_node(tpl, parent, key, BPLIST_TYPE_REAL);
+    if (slot >= 0) {
+        tpl->nodes[slot].real_value = value;
+    }
+    return slot;
+}
+
+static int
+add_bytes(bplist_template_t *tpl, int parent, const char *key, uint8_t type, const void *value, uint32_t valuelen)
+{
+    int slot = add_node(tpl, parent, key, type);
+    if (slot < 0) {
+        return -1;
+    }
+    tpl->nodes[slot].bytes = malloc(valuelen ? valuelen : 1);
+    if (!tpl->nodes[slot].bytes) {
+        tpl->failed = 1;
+        return -1;
+    }
+    memcpy(tpl->nodes[slot].bytes, value, valuelen);
+    tpl->nodes[slot].byteslen = valuelen;
+    return slot;
+}
+
+int
+bplist_template_add_data(bplist_template_t *tpl, int parent, const char *key, const uint8_t *value, uint32_t valuelen)
+{
+    assert(value || !valuelen);
+    return add_bytes(tpl, parent, key, BPLIST_TYPE_DATA, value, valuelen);
+}
+
+/* UTF-8 to UTF-16BE, invalid sequences become U+FFFD. dst holds at least
+ * 2 bytes per input byte. Returns the number of bytes written. */
+static uint32_t
+utf8_to_utf16be(const uint8_t *src, uint32_t srclen, uint8_t *dst)
+{
+    uint32_t i = 0, len = 0;
+
+    while (i < srclen) {
+        uint32_t cp = src[i], need = 0, k;
+
+        if (cp >= 0xF0 && cp < 0xF8) {
+            cp &= 0x07; need = 3;
+        } else if (cp >= 0xE0) {
+            cp &= 0x0F; need = 2;
+        } else if (cp >= 0xC0) {
+            cp &= 0x1F; need = 1;
+        } else if (cp >= 0x80) {
+            cp = 0xFFFD;
+        }
+        i++;
+        for (k = 0; k < need; k++, i++) {
+            if (i >= srclen || (src[i] & 0xC0) != 0x80) {
+                cp = 0xFFFD;
+                break;
+            }
+            cp = (cp << 6) | (src[i] & 0x3F);
+        }
+        if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            cp = 0xFFFD;
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            write_be(dst + len, 0xD800 | (cp >> 10), 2);
+            write_be(dst + len + 2, 0xDC00 | (cp & 0x3FF), 2);
+            len += 4;
+        } else {
+            write_be(dst + len, cp, 2);
+            len += 2;
+        }
+    }
+    return len;
+}
+
+int
+bplist_template_add_string(bplist_template_t *tpl, int parent, const char *key, const char *value)
+{
+    uint32_t valuelen, i;
+    uint8_t *utf16;
+    int slot;
+
+    assert(value);
+
+    valuelen = (uint32_t)strlen(value);
+    for (i = 0; i < valuelen; i++) {
+        if ((uint8_t)value[i] >= 0x80) {
+            break;
+        }
+    }
+    if (i == valuelen) {
+        return add_bytes(tpl, parent, key, BPLIST_TYPE_STRING, value, valuelen);
+    }
+
+    /* Names may be localized, those are stored as UTF-16 */
+    utf16 = malloc(2 * valuelen);
+    if (!utf16) {
+        tpl->failed = 1;
+        return -1;
+    }
+    slot = add_bytes(tpl, parent, key, BPLIST_TYPE_UNICODE, utf16,
+                     utf8_to_utf16be((const uint8_t *)value, valuelen, utf16));
+    free(utf16);
+    return slot;
+}
+
+static int
+compile_node(bplist_template_t *tpl, int idx, uint8_t refsize)
+{
+    bplist_template_node_t *node = &tpl->nodes[idx];
+    uint64_t children = 0;
+    uint8_t marker;
+    uint64_t bits;
+    int i;
+
+    switch (node->type) {
+    case BPLIST_TYPE_PRIMITIVE:
+        marker = node->uint_value ? 0x09 : 0x08;
+        return buffer_put(tpl, &marker, 1);
+    case BPLIST_TYPE_INTEGER:
+        marker = BPLIST_TYPE_INTEGER | width_log2(node->width);
+        if (buffer_put(tpl, &marker, 1) < 0) {
+            return -1;
+        }
+        node->payload = tpl->datalen;
+        return buffer_put_be(tpl, node->uint_value, node->width);
+    case BPLIST_TYPE_REAL:
+        marker = BPLIST_TYPE_REAL | 3;
+        memcpy(&bits, &node->real_value, sizeof(bits));
+        if (buffer_put(tpl, &marker, 1) < 0) {
+            return -1;
+        }
+        return buffer_put_be(tpl, bits, 8);
+    case BPLIST_TYPE_UNICODE:
+        /* Counted in UTF-16 units */
+        if (buffer_put_marker(tpl, node->type, node->byteslen / 2) < 0) {
+            return -1;
+        }
+        node->payload = tpl->datalen;
+        return buffer_put(tpl, node->bytes, node->byteslen);
+    case BPLIST_TYPE_DATA:
+    case BPLIST_TYPE_STRING:
+        if (buffer_put_marker(tpl, node->type, node->byteslen) < 0) {
+            return -1;
+        }
+        node->payload = tpl->datalen;
+        return buffer_put(tpl, node->bytes, node->byteslen);
+    }
+
+    for (i = idx + 1; i < tpl->count; i++) {
+        if (tpl->nodes[i].parent == idx) {
+            children++;
+        }
+    }
+    if (buffer_put_marker(tpl, node->type, children) < 0) {
+        return -1;
+    }
+    /* A dict lists all of its key references before the value references */
+    if (node->type == BPLIST_TYPE_DICT) {
+        for (i = idx + 1; i < tpl->count; i++) {
+            if (tpl->nodes[i].parent == idx && buffer_put_be(tpl, tpl->nodes[i].keyobj, refsize) < 0) {
+                return -1;
+            }
+        }
+    }
+    for (i = idx + 1; i < tpl->count; i++) {
+        if (tpl->nodes[i].parent == idx && buffer_put_be(tpl, i, refsize) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+bplist_template_compile(bplist_template_t *tpl)
+{
+    uint64_t *offsets;
+    uint64_t objects, offtab;
+    uint8_t refsize, offsize;
+    uint8_t trailer[32];
+    int i;
+
+    assert(tpl);
+
+    if (tpl->compiled) {
+        return 0;
+    }
+    if (tpl->failed) {
+        return -1;
+    }
+
+    /* Slots are objects 0..count-1, the keys of dict members follow */
+    objects = tpl->count;
+    for (i = 0; i < tpl->count; i++) {
+        if (tpl->nodes[i].key) {
+            tpl->nodes[i].keyobj = objects++;
+        }
+    }
+    refsize = objects < 0x100 ? 1 : (objects < 0x10000 ? 2 : 4);
+
+    offsets = malloc(objects * sizeof(uint64_t));
+    if (!offsets) {
+        return -1;
+    }
+    tpl->datalen = 0;
+    if (buffer_put(tpl, "bplist00", 8) < 0) {
+        free(offsets);
+        return -1;
+    }
+    for (i = 0; i < tpl->count; i++) {
+        offsets[i] = tpl->datalen;
+        if (compile_node(tpl, i, refsize) < 0) {
+            free(offsets);
+            return -1;
+        }
+    }
+    for (i = 0; i < tpl->count; i++) {
+        bplist_template_node_t *node = &tpl->nodes[i];
+        if (!node->key) {
+            continue;
+        }
+        offsets[node->keyobj] = tpl->datalen;
+        if (buffer_put_marker(tpl, BPLIST_TYPE_STRING, strlen(node->key)) < 0 ||
+            buffer_put(tpl, node->key, (uint32_t)strlen(node->key)) < 0) {
+            free(offsets);
+            return -1;
+        }
+    }
+
+    offtab = tpl->datalen;
+    offsize = offtab < 0x100 ? 1 : (offtab < 0x10000 ? 2 : 4);
+    for (i = 0; i < (int)objects; i++) {
+        if (buffer_put_be(tpl, offsets[i], offsize) < 0) {
+            free(offsets);
+            return -1;
+        }
+    }
+    free(offsets);
+
+    memset(trailer, 0, sizeof(trailer));
+    trailer[6] = offsize;
+    trailer[7] = refsize;
+    write_be(trailer + 8, objects, 8);
+    write_be(trailer + 16, BPLIST_TEMPLATE_ROOT, 8);
+    write_be(trailer + 24, offtab, 8);
+    if (buffer_put(tpl, trailer, sizeof(trailer)) < 0) {
+        return -1;
+    }
+    tpl->compiled = 1;
+    return 0;
+}
+
+int
+bplist_template_set_uint(bplist_template_t *tpl, int slot, uint64_t value)
+{
+    bplist_template_node_t *node;
+
+    assert(tpl);
+
+    if (slot < 0 || slot >= tpl->count || tpl->nodes[slot].type != BPLIST_TYPE_INTEGER) {
+        return -1;
+    }
+    node = &tpl->nodes[slot];
+    if (node->width < 8 && (value >> (8 * node->width))) {
+        return -1;
+    }
+    node->uint_value = value;
+    if (tpl->compiled) {
+        write_be(tpl->data + node->payload, value, node->width);
+    }
+    return 0;
+}
+
+static int
+set_bytes(bplist_template_t *tpl, int slot, uint8_t type, const void *value, uint32_t valuelen)
+{
+    bplist_template_node_t *node;
+
+    if (slot < 0 || slot >= tpl->count || tpl->nodes[slot].type != type) {
+        return -1;
+    }
+    node = &tpl->nodes[slot];
+    if (node->byteslen != valuelen) {
+        return -1;
+    }
+    memcpy(node->bytes, value, valuelen);
+    if (tpl->compiled) {
+        memcpy(tpl->data + node->payload, value, valuelen);
+    }
+    return 0;
+}
+
+int
+bplist_template_set_data(bplist_template_t *tpl, int slot, const uint8_t *value, uint32_t valuelen)
+{
+    assert(tpl);
+    assert(value || !valuelen);
+    return set_bytes(tpl, slot, BPLIST_TYPE_DATA, value, valuelen);
+}
+
+int
+bplist_template_set_string(bplist_template_t *tpl, int slot, const char *value)
+{
+    assert(tpl);
+    assert(value);
+    return set_bytes(tpl, slot, BPLIST_TYPE_STRING, value, (uint32_t)strlen(value));
+}
+
+const char *
+bplist_template_get_data(bplist_template_t *tpl, int *datalen)
+{
+    assert(tpl);
+    assert(datalen);
+
+    if (!tpl->compiled) {
+        *datalen = 0;
+        return NULL;
+    }
+    *datalen = (int)tpl->datalen;
+    return (const char *)tpl->data;
+}
+
+void
+bplist_template_destroy(bplist_template_t *tpl)
+{
+    int i;
+
+    if (tpl) {
+        for (i = 0; i < tpl->count; i++) {
+            free(tpl->nodes[i].key);
+            free(tpl->nodes[i].bytes);
+        }
+        free(tpl->nodes);
+        free(tpl->data);
+        free(tpl);
+    }
+}
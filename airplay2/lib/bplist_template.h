@@ -0,0 +1,59 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef BPLIST_TEMPLATE_H
+#define BPLIST_TEMPLATE_H
+
+#include <stdint.h>
+
+/* Binary plist serialized once and patched in place afterwards.
+ *
+ * The skeleton is described with the add functions, each returning a slot
+ * id, then bplist_template_compile lays it out. Integers keep the width
+ * given at creation and strings/data keep their length, so the set
+ * functions only overwrite bytes inside the compiled buffer and never
+ * allocate. The template is not locked, callers patch and read it from
+ * one thread. */
+
+#define BPLIST_TEMPLATE_ROOT 0
+
+typedef struct bplist_template_s bplist_template_t;
+
+/* Creates a template whose root object (slot BPLIST_TEMPLATE_ROOT) is a dict */
+bplist_template_t *bplist_template_init(void);
+
+/* key is required when parent is a dict and ignored for arrays.
+ * Return the new slot id or -1. */
+int bplist_template_add_dict(bplist_template_t *tpl, int parent, const char *key);
+int bplist_template_add_array(bplist_template_t *tpl, int parent, const char *key);
+int bplist_template_add_bool(bplist_template_t *tpl, int parent, const char *key, int value);
+/* width is the encoded size in bytes: 1, 2, 4 or 8 */
+int bplist_template_add_uint(bplist_template_t *tpl, int parent, const char *key, uint64_t value, int width);
+int bplist_template_add_real(bplist_template_t *tpl, int parent, const char *key, double value);
+int bplist_template_add_data(bplist_template_t *tpl, int parent, const char *key, const uint8_t *value, uint32_t valuelen);
+/* UTF-8, anything beyond ASCII is stored as UTF-16 and cannot be set later */
+int bplist_template_add_string(bplist_template_t *tpl, int parent, const char *key, const char *value);
+
+int bplist_template_compile(bplist_template_t *tpl);
+
+/* Fail when the value does not fit the width or length of the slot, string
+ * slots take ASCII of the same length */
+int bplist_template_set_uint(bplist_template_t *tpl, int slot, uint64_t value);
+int bplist_template_set_data(bplist_template_t *tpl, int slot, const uint8_t *value, uint32_t valuelen);
+int bplist_template_set_string(bplist_template_t *tpl, int slot, const char *value);
+
+/* Borrowed, valid until the template is destroyed */
+const char *bplist_template_get_data(bplist_template_t *tpl, int *datalen);
+
+void bplist_template_destroy(bplist_template_t *tpl);
+
+#endif
@@ -0,0 +1,318 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "buffered_audio.h"
+#include "threads.h"
+
+/* Decoding starts again when less than LOW is decoded ahead of the playhead
+ * and goes on until HIGH is, so it runs in short bursts */
+#define BUFFERED_AUDIO_LOW_US   100000
+#define BUFFERED_AUDIO_HIGH_US  300000
+
+/* Every record is a header and the packet, padded to the next header */
+typedef struct {
+    unsigned int seqnum;
+    unsigned int rtp;
+    int len;
+} record_t;
+
+#define RECORD_WRAP   (-1)
+#define RECORD_SIZE(len) ((int)sizeof(record_t) + (((len) + 3) & ~3))
+
+struct buffered_audio_s {
+    mutex_handle_t mutex;
+
+    unsigned char *data;
+    int size;
+    /* head is the oldest record, tail where the next one goes. used counts
+     * the records and the end of the ring skipped when one did not fit */
+    int head;
+    int tail;
+    int used;
+    int count;
+    /* Bumped when a flush removes records, so pop knows next is stale */
+    unsigned int generation;
+    unsigned int next_generation;
+
+    int frame_samples;
+    int sample_rate;
+
+    /* Packets that arrive before flush_until are dropped */
+    int flushing;
+    int flush_from;
+    unsigned int flush_until;
+
+    int anchored;
+    int rate;
+    unsigned int anchor_rtp;
+    uint64_t anchor_network_us;
+    uint64_t anchor_local_us;
+
+    /* rtp up to which packets went out, while bursting */
+    int bursting;
+    int decoded_valid;
+    unsigned int decoded_rtp;
+};
+
+/* Sequence numbers of buffered audio are 24 bit */
+static int
+seqnum_cmp(unsigned int s1, unsigned int s2)
+{
+    return (int)((s1 - s2) << 8) >> 8;
+}
+
+static record_t *
+record_at(buffered_audio_t *ba, int pos)
+{
+    return (record_t *)(ba->data + pos);
+}
+
+/* Skips the end of the ring when the next record is at its start */
+static void
+buffered_audio_skip_wrap(buffered_audio_t *ba)
+{
+    if (ba->count > 0 && (ba->size - ba->head < (int)sizeof(record_t) ||
+                          record_at(ba, ba->head)->len == RECORD_WRAP)) {
+        ba->used -= ba->size - ba->head;
+        ba->head = 0;
+    }
+}
+
+static void
+buffered_audio_drop_head(buffered_audio_t *ba)
+{
+    int size = RECORD_SIZE(record_at(ba, ba->head)->len);
+
+    ba->head += size;
+    ba->used -= size;
+    ba->count--;
+    if (ba->count == 0) {
+        ba->head = ba->tail = ba->used = 0;
+    } else {
+        buffered_audio_skip_wrap(ba);
+    }
+}
+
+buffered_audio_t *
+buffered_audio_init(int size, int frame_samples, int sample_rate)
+{
+    buffered_audio_t *ba;
+
+    assert(frame_samples > 0 && sample_rate > 0);
+    ba = calloc(1, sizeof(buffered_audio_t));
+    if (!ba) {
+        return NULL;
+    }
+    ba->size = size & ~3;
+    ba->data = malloc(ba->size);
+    if (!ba->data) {
+        free(ba);
+        return NULL;
+    }
+    ba->frame_samples = frame_samples;
+    ba->sample_rate = sample_rate;
+    MUTEX_CREATE(ba->mutex);
+    return ba;
+}
+
+void
+buffered_audio_destroy(buffered_audio_t *ba)
+{
+    if (ba) {
+        MUTEX_DESTROY(ba->mutex);
+        free(ba->data);
+        free(ba);
+    }
+}
+
+int
+buffered_audio_put(buffered_audio_t *ba, unsigned int seqnum, unsigned int rtp,
+                   const unsigned char *data, int len)
+{
+    int size = RECORD_SIZE(len);
+    int pos = -1;
+    record_t *record;
+
+    if (len < 0 || size > ba->size / 2) {
+        return -1;
+    }
+    MUTEX_LOCK(ba->mutex);
+    if (ba->flushing) {
+        if (seqnum_cmp(seqnum, ba->flush_until) < 0 &&
+            (ba->flush_from < 0 || seqnum_cmp(seqnum, ba->flush_from) >= 0)) {
+            MUTEX_UNLOCK(ba->mutex);
+            return 1;
+        }
+        if (seqnum_cmp(seqnum, ba->flush_until) >= 0) {
+            ba->flushing = 0;
+        }
+    }
+
+    if (ba->count == 0) {
+        pos = 0;
+    } else if (ba->tail > ba->head) {
+        if (ba->size - ba->tail >= size) {
+            pos = ba->tail;
+        } else if (ba->head >= size) {
+            /* Does not fit before the end, start over at the beginning */
+            if (ba->size - ba->tail >= (int)sizeof(record_t)) {
+                record_at(ba, ba->tail)->len = RECORD_WRAP;
+            }
+            ba->used += ba->size - ba->tail;
+            pos = 0;
+        }
+    } else if (ba->head - ba->tail >= size) {
+        pos = ba->tail;
+    }
+    if (pos < 0) {
+        MUTEX_UNLOCK(ba->mutex);
+        return 0;
+    }
+
+    record = record_at(ba, pos);
+    record->seqnum = seqnum & 0xffffff;
+    record->rtp = rtp;
+    record->len = len;
+    memcpy(record + 1, data, len);
+    ba->tail = pos + size;
+    ba->used += size;
+    ba->count++;
+    MUTEX_UNLOCK(ba->mutex);
+    return 1;
+}
+
+int
+buffered_audio_next(buffered_audio_t *ba, uint64_t now_us, buffered_audio_packet_t *packet)
+{
+    unsigned int playhead;
+    uint64_t elapsed;
+    record_t *record;
+
+    MUTEX_LOCK(ba->mutex);
+    if (!ba->anchored || ba->rate == 0) {
+        MUTEX_UNLOCK(ba->mutex);
+        return 0;
+    }
+    elapsed = now_us > ba->anchor_local_us ? now_us - ba->anchor_local_us : 0;
+    playhead = ba->anchor_rtp + (unsigned int)(elapsed * ba->sample_rate / 1000000);
+
+    /* What ends before the playhead is too late to be heard */
+    while (ba->count > 0) {
+        record = record_at(ba, ba->head);
+        if ((int)(record->rtp + ba->frame_samples - playhead) > 0) {
+            break;
+        }
+        buffered_audio_drop_head(ba);
+    }
+    if (ba->count == 0) {
+        ba->bursting = 0;
+        MUTEX_UNLOCK(ba->mutex);
+        return 0;
+    }
+
+    if (!ba->bursting) {
+        if (ba->decoded_valid && (int)(ba->decoded_rtp - playhead) >=
+            (int)((uint64_t)BUFFERED_AUDIO_LOW_US * ba->sample_rate / 1000000)) {
+            MUTEX_UNLOCK(ba->mutex);
+            return 0;
+        }
+        ba->bursting = 1;
+    }
+    if ((int)(record->rtp - playhead) >
+        (int)((uint64_t)BUFFERED_AUDIO_HIGH_US * ba->sample_rate / 1000000)) {
+        ba->bursting = 0;
+        MUTEX_UNLOCK(ba->mutex);
+        return 0;
+    }
+
+    packet->data = (const unsigned char *)(record + 1);
+    packet->len = record->len;
+    packet->seqnum = record->seqnum;
+    packet->rtp = record->rtp;
+    packet->ntp_pts = ba->anchor_network_us +
+        (int64_t)(int)(record->rtp - ba->anchor_rtp) * 1000000 / ba->sample_rate;
+    ba->next_generation = ba->generation;
+    MUTEX_UNLOCK(ba->mutex);
+    return 1;
+}
+
+void
+buffered_audio_pop(buffered_audio_t *ba)
+{
+    MUTEX_LOCK(ba->mutex);
+    if (ba->count > 0 && ba->next_generation == ba->generation) {
+        ba->decoded_rtp = record_at(ba, ba->head)->rtp + ba->frame_samples;
+        ba->decoded_valid = 1;
+        buffered_audio_drop_head(ba);
+    }
+    MUTEX_UNLOCK(ba->mutex);
+}
+
+void
+buffered_audio_set_anchor(buffered_audio_t *ba, int rate, unsigned int rtp,
+                          uint64_t network_us, uint64_t now_us)
+{
+    MUTEX_LOCK(ba->mutex);
+    ba->anchored = 1;
+    ba->rate = rate;
+    ba->anchor_rtp = rtp;
+    ba->anchor_network_us = network_us;
+    ba->anchor_local_us = now_us;
+    ba->bursting = 0;
+    ba->decoded_valid = 0;
+    MUTEX_UNLOCK(ba->mutex);
+}
+
+void
+buffered_audio_flush(buffered_audio_t *ba, int from_seq, unsigned int until_seq)
+{
+    int pos, used = 0, count = 0;
+
+    MUTEX_LOCK(ba->mutex);
+    /* Records are in sequence, keep the ones before from_seq */
+    pos = ba->head;
+    while (from_seq >= 0 && count < ba->count) {
+        record_t *record;
+
+        if (ba->size - pos < (int)sizeof(record_t) || record_at(ba, pos)->len == RECORD_WRAP) {
+            used += ba->size - pos;
+            pos = 0;
+        }
+        record = record_at(ba, pos);
+        if (seqnum_cmp(record->seqnum, from_seq) >= 0) {
+            break;
+        }
+        used += RECORD_SIZE(record->len);
+        pos += RECORD_SIZE(record->len);
+        count++;
+    }
+    if (count < ba->count) {
+        ba->generation++;
+    }
+    if (count == 0) {
+        ba->head = ba->tail = ba->used = ba->count = 0;
+    } else {
+        ba->tail = pos;
+        ba->used = used;
+        ba->count = count;
+    }
+    ba->flushing = 1;
+    ba->flush_from = from_seq;
+    ba->flush_until = until_seq & 0xffffff;
+    ba->bursting = 0;
+    ba->decoded_valid = 0;
+    MUTEX_UNLOCK(ba->mutex);
+}
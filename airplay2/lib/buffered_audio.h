@@ -0,0 +1,57 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef BUFFERED_AUDIO_H
+#define BUFFERED_AUDIO_H
+
+#include <stdint.h>
+
+/* Compressed packets of a buffered audio stream (type 103), which the sender
+ * pushes over TCP far ahead of time. They stay compressed in one ring and are
+ * only decoded a little ahead of the playhead the rate anchor sets.
+ *
+ * put, next and pop belong to the thread reading the stream, anchor and
+ * flush may come from any thread. */
+
+typedef struct buffered_audio_s buffered_audio_t;
+
+typedef struct {
+    const unsigned char *data;
+    int len;
+    unsigned int seqnum;
+    unsigned int rtp;
+    /* When to play it on the sender clock in us */
+    uint64_t ntp_pts;
+} buffered_audio_packet_t;
+
+buffered_audio_t *buffered_audio_init(int size, int frame_samples, int sample_rate);
+void buffered_audio_destroy(buffered_audio_t *ba);
+
+/* Stores a decrypted packet. Returns 1 if it was stored or dropped by a
+ * flush, 0 if the ring is full for now and -1 if it can never fit. */
+int buffered_audio_put(buffered_audio_t *ba, unsigned int seqnum, unsigned int rtp,
+                       const unsigned char *data, int len);
+/* Next packet to decode at now_us, the data stays valid until pop. Drops
+ * what is already late and returns 0 until the decoded audio runs low, then
+ * keeps returning packets until it is far enough ahead again. */
+int buffered_audio_next(buffered_audio_t *ba, uint64_t now_us, buffered_audio_packet_t *packet);
+void buffered_audio_pop(buffered_audio_t *ba);
+
+/* rtp plays at network_us on the sender clock, which is now_us here. Rate 0
+ * pauses. */
+void buffered_audio_set_anchor(buffered_audio_t *ba, int rate, unsigned int rtp,
+                               uint64_t network_us, uint64_t now_us);
+/* Drops the stored packets from from_seq on, all of them if it is -1, and
+ * the packets that still arrive before until_seq. */
+void buffered_audio_flush(buffered_audio_t *ba, int from_seq, unsigned int until_seq);
+
+#endif
@@ -0,0 +1,233 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <string.h>
+
+#include "chacha20_poly1305.h"
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+static uint32_t
+load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void
+chacha20_block(const uint32_t *state, uint8_t *out)
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, state, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        store32_le(out + i * 4, x[i] + state[i]);
+    }
+}
+
+static void
+chacha20_init(uint32_t *state, const uint8_t *key, const uint8_t *nonce, uint32_t counter)
+{
+    int i;
+
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) {
+        state[4 + i] = load32_le(key + i * 4);
+    }
+    state[12] = counter;
+    state[13] = load32_le(nonce);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
+}
+
+/* Poly1305 in 26 bit limbs. The AEAD pads everything it authenticates to
+ * 16 bytes, so there are only full blocks. */
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+} poly1305_t;
+
+static void
+poly1305_init(poly1305_t *st, const uint8_t *key)
+{
+    st->r[0] = load32_le(key + 0) & 0x3ffffff;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+    memset(st->h, 0, sizeof(st->h));
+    st->pad[0] = load32_le(key + 16);
+    st->pad[1] = load32_le(key + 20);
+    st->pad[2] = load32_le(key + 24);
+    st->pad[3] = load32_le(key + 28);
+}
+
+static void
+poly1305_blocks(poly1305_t *st, const uint8_t *m, int len)
+{
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint8_t block[16];
+
+    while (len > 0) {
+        uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        if (len < 16) {
+            memset(block, 0, sizeof(block));
+            memcpy(block, m, len);
+            m = block;
+            len = 16;
+        }
+        h0 += load32_le(m + 0) & 0x3ffffff;
+        h1 += (load32_le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(m + 12) >> 8) | (1 << 24);
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+static void
+poly1305_finish(poly1305_t *st, uint8_t *mac)
+{
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t g0, g1, g2, g3, g4, c, mask;
+    uint64_t f;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* h - p, taken when it does not go negative */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    f = (uint64_t)h0 + st->pad[0]; store32_le(mac + 0, (uint32_t)f);
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); store32_le(mac + 4, (uint32_t)f);
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); store32_le(mac + 8, (uint32_t)f);
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); store32_le(mac + 12, (uint32_t)f);
+}
+
+int
+chacha20_poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+                          const uint8_t *aad, int aadlen,
+                          const uint8_t *in, int len, const uint8_t *tag,
+                          uint8_t *out)
+{
+    uint32_t state[16];
+    uint8_t block[64];
+    uint8_t mac[16];
+    poly1305_t poly;
+    uint8_t diff = 0;
+    int i, pos;
+
+    /* The one time Poly1305 key is the first block of the key stream */
+    chacha20_init(state, key, nonce, 0);
+    chacha20_block(state, block);
+    poly1305_init(&poly, block);
+
+    poly1305_blocks(&poly, aad, aadlen);
+    poly1305_blocks(&poly, in, len);
+    store32_le(block + 0, (uint32_t)aadlen);
+    store32_le(block + 4, 0);
+    store32_le(block + 8, (uint32_t)len);
+    store32_le(block + 12, 0);
+    poly1305_blocks(&poly, block, 16);
+    poly1305_finish(&poly, mac);
+
+    for (i = 0; i < CHACHA20_POLY1305_TAG_LEN; i++) {
+        diff |= mac[i] ^ tag[i];
+    }
+    if (diff) {
+        return -1;
+    }
+
+    for (pos = 0; pos < len; pos += 64) {
+        int n = len - pos < 64 ? len - pos : 64;
+        state[12] = 1 + pos / 64;
+        chacha20_block(state, block);
+        for (i = 0; i < n; i++) {
+            out[pos + i] = in[pos + i] ^ block[i];
+        }
+    }
+    return 0;
+}
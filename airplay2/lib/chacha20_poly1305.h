@@ -0,0 +1,36 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef CHACHA20_POLY1305_H
+#define CHACHA20_POLY1305_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+
+#define CHACHA20_POLY1305_KEY_LEN       32
+#define CHACHA20_POLY1305_NONCE_LEN     12
+#define CHACHA20_POLY1305_TAG_LEN       16
+
+/* RFC 8439 AEAD, what buffered audio packets are sealed with. Checks the
+ * tag over aad and the ciphertext first and only decrypts when it matches,
+ * in may be the same as out. Returns 0 on success, -1 if the tag does not
+ * match. */
+int chacha20_poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+                              const uint8_t *aad, int aadlen,
+                              const uint8_t *in, int len, const uint8_t *tag,
+                              uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
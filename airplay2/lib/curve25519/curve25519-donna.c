@@ -48,6 +48,11 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "curve25519.h"
+
+/* 64-bit targets build curve25519-donna-c64.c instead */
+#ifndef CURVE25519_FE51
+
 #ifdef _MSC_VER
 #define inline __inline
 #endif
@@ -858,3 +863,5 @@ curve25519_donna(u8 *mypublic, const u8 *secret, const u8 *basepoint) {
   fcontract(mypublic, z);
   return 0;
 }
+
+#endif /* CURVE25519_FE51 */
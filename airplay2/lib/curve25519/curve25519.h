@@ -1,6 +1,15 @@
 #ifndef CURVE25519_DONNA_H
 #define CURVE25519_DONNA_H
 
+/* 64-bit targets use radix 2^51 limbs with 128-bit products
+ * (curve25519-donna-c64.c), others the 32-bit limbs of curve25519-donna.c.
+ * Define CURVE25519_NO_FE51 to force the 32-bit code. */
+#if !defined(CURVE25519_NO_FE51) && !defined(CURVE25519_FE51)
+#if defined(__SIZEOF_INT128__) || defined(_M_X64) || defined(_M_ARM64)
+#define CURVE25519_FE51
+#endif
+#endif
+
 static const unsigned char kCurve25519BasePoint[32] = { 9 };
 
 int curve25519_donna(unsigned char *mypublic, const unsigned char *secret, const unsigned char *basepoint);
@@ -12,14 +12,6 @@
  *  Lesser General Public License for more details.
  */
 
-/* These defines allow us to compile on iOS */
-#ifndef __has_feature
-# define __has_feature(x) 0
-#endif
-#ifndef __has_extension
-# define __has_extension __has_feature
-#endif
-
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -33,103 +25,27 @@
 #include "dnssdint.h"
 #include "global.h"
 #include "compat.h"
+#include "netutils.h"
 #include "utils.h"
+#include "mdns.h"
 
 #define MAX_DEVICEID 18
 #define MAX_SERVNAME 256
 
-#if defined(HAVE_LIBDL) && !defined(__APPLE__)
-# define USE_LIBDL 1
-#else
-# define USE_LIBDL 0
-#endif
-
-#if defined(WIN32) || USE_LIBDL
-# ifdef WIN32
-#  include <stdint.h>
-#  if !defined(EFI32) && !defined(EFI64)
-#   define DNSSD_STDCALL __stdcall
-#  else
-#   define DNSSD_STDCALL
-#  endif
-# else
-#  include <dlfcn.h>
-#  define DNSSD_STDCALL
-# endif
-
-typedef struct _DNSServiceRef_t *DNSServiceRef;
-typedef union _TXTRecordRef_t { char PrivateData[16]; char *ForceNaturalAlignment; } TXTRecordRef;
-
-typedef uint32_t DNSServiceFlags;
-typedef int32_t  DNSServiceErrorType;
-
-typedef void (DNSSD_STDCALL *DNSServiceRegisterReply)
-    (
-    DNSServiceRef                       sdRef,
-    DNSServiceFlags                     flags,
-    DNSServiceErrorType                 errorCode,
-    const char                          *name,
-    const char                          *regtype,
-    const char                          *domain,
-    void                                *context
-    );
-
-#else
-# include <dns_sd.h>
-# define DNSSD_STDCALL
-#endif
-
-typedef DNSServiceErrorType (DNSSD_STDCALL *DNSServiceRegister_t)
-    (
-    DNSServiceRef                       *sdRef,
-    DNSServiceFlags                     flags,
-    uint32_t                            interfaceIndex,
-    const char                          *name,
-    const char                          *regtype,
-    const char                          *domain,
-    const char                          *host,
-    uint16_t                            port,
-    uint16_t                            txtLen,
-    const void                          *txtRecord,
-    DNSServiceRegisterReply             callBack,
-    void                                *context
-    );
-typedef void (DNSSD_STDCALL *DNSServiceRefDeallocate_t)(DNSServiceRef sdRef);
-typedef void (DNSSD_STDCALL *TXTRecordCreate_t)
-    (
-    TXTRecordRef     *txtRecord,
-    uint16_t         bufferLen,
-    void             *buffer
-    );
-typedef void (DNSSD_STDCALL *TXTRecordDeallocate_t)(TXTRecordRef *txtRecord);
-typedef DNSServiceErrorType (DNSSD_STDCALL *TXTRecordSetValue_t)
-    (
-    TXTRecordRef     *txtRecord,
-    const char       *key,
-    uint8_t          valueSize,
-    const void       *value
-    );
-typedef uint16_t (DNSSD_STDCALL *TXTRecordGetLength_t)(const TXTRecordRef *txtRecord);
-typedef const void * (DNSSD_STDCALL *TXTRecordGetBytesPtr_t)(const TXTRecordRef *txtRecord);
-
-
+/* Services are answered by the embedded responder in mdns.c, no Bonjour
+ * installation is needed. */
 struct dnssd_s {
-#ifdef WIN32
-	HMODULE module;
-#elif USE_LIBDL
-	void *module;
-#endif
+	mdns_t *mdns;
 
-	DNSServiceRegister_t       DNSServiceRegister;
-	DNSServiceRefDeallocate_t  DNSServiceRefDeallocate;
-	TXTRecordCreate_t          TXTRecordCreate;
-	TXTRecordSetValue_t        TXTRecordSetValue;
-	TXTRecordGetLength_t       TXTRecordGetLength;
-	TXTRecordGetBytesPtr_t     TXTRecordGetBytesPtr;
-	TXTRecordDeallocate_t      TXTRecordDeallocate;
+	int raopService;
+	uint8_t raopTxt[MDNS_TXT_SIZE];
+	int raopTxtLen;
 
-	DNSServiceRef raopService;
-	DNSServiceRef airplayService;
+	int airplayService;
+	uint8_t airplayTxt[MDNS_TXT_SIZE];
+	int airplayTxtLen;
+
+	char features[32];
 };
 
 
@@ -146,63 +62,21 @@ dnssd_init(int *error)
 		if (error) *error = DNSSD_ERROR_OUTOFMEM;
 		return NULL;
 	}
+	dnssd->raopService = -1;
+	dnssd->airplayService = -1;
+	strcpy(dnssd->features, "0x5A7FFFF7,0x1E");
 
-#ifdef WIN32
-	dnssd->module = LoadLibraryA("dnssd.dll");
-	if (!dnssd->module) {
-		if (error) *error = DNSSD_ERROR_LIBNOTFOUND;
+	if (netutils_init() < 0) {
+		if (error) *error = DNSSD_ERROR_SOCKET;
 		free(dnssd);
 		return NULL;
 	}
-	dnssd->DNSServiceRegister = (DNSServiceRegister_t)GetProcAddress(dnssd->module, "DNSServiceRegister");
-	dnssd->DNSServiceRefDeallocate = (DNSServiceRefDeallocate_t)GetProcAddress(dnssd->module, "DNSServiceRefDeallocate");
-	dnssd->TXTRecordCreate = (TXTRecordCreate_t)GetProcAddress(dnssd->module, "TXTRecordCreate");
-	dnssd->TXTRecordSetValue = (TXTRecordSetValue_t)GetProcAddress(dnssd->module, "TXTRecordSetValue");
-	dnssd->TXTRecordGetLength = (TXTRecordGetLength_t)GetProcAddress(dnssd->module, "TXTRecordGetLength");
-	dnssd->TXTRecordGetBytesPtr = (TXTRecordGetBytesPtr_t)GetProcAddress(dnssd->module, "TXTRecordGetBytesPtr");
-	dnssd->TXTRecordDeallocate = (TXTRecordDeallocate_t)GetProcAddress(dnssd->module, "TXTRecordDeallocate");
-
-	if (!dnssd->DNSServiceRegister || !dnssd->DNSServiceRefDeallocate || !dnssd->TXTRecordCreate ||
-	    !dnssd->TXTRecordSetValue || !dnssd->TXTRecordGetLength || !dnssd->TXTRecordGetBytesPtr ||
-	    !dnssd->TXTRecordDeallocate) {
-		if (error) *error = DNSSD_ERROR_PROCNOTFOUND;
-		FreeLibrary(dnssd->module);
+	dnssd->mdns = mdns_init(NULL, 0);
+	if (!dnssd->mdns) {
+		if (error) *error = DNSSD_ERROR_SOCKET;
 		free(dnssd);
 		return NULL;
 	}
-#elif USE_LIBDL
-	dnssd->module = dlopen("libdns_sd.so", RTLD_LAZY);
-	if (!dnssd->module) {
-		if (error) *error = DNSSD_ERROR_LIBNOTFOUND;
-		free(dnssd);
-		return NULL;
-	}
-	dnssd->DNSServiceRegister = (DNSServiceRegister_t)dlsym(dnssd->module, "DNSServiceRegister");
-	dnssd->DNSServiceRefDeallocate = (DNSServiceRefDeallocate_t)dlsym(dnssd->module, "DNSServiceRefDeallocate");
-	dnssd->TXTRecordCreate = (TXTRecordCreate_t)dlsym(dnssd->module, "TXTRecordCreate");
-	dnssd->TXTRecordSetValue = (TXTRecordSetValue_t)dlsym(dnssd->module, "TXTRecordSetValue");
-	dnssd->TXTRecordGetLength = (TXTRecordGetLength_t)dlsym(dnssd->module, "TXTRecordGetLength");
-	dnssd->TXTRecordGetBytesPtr = (TXTRecordGetBytesPtr_t)dlsym(dnssd->module, "TXTRecordGetBytesPtr");
-	dnssd->TXTRecordDeallocate = (TXTRecordDeallocate_t)dlsym(dnssd->module, "TXTRecordDeallocate");
-
-	if (!dnssd->DNSServiceRegister || !dnssd->DNSServiceRefDeallocate || !dnssd->TXTRecordCreate ||
-	    !dnssd->TXTRecordSetValue || !dnssd->TXTRecordGetLength || !dnssd->TXTRecordGetBytesPtr ||
-	    !dnssd->TXTRecordDeallocate) {
-		if (error) *error = DNSSD_ERROR_PROCNOTFOUND;
-		dlclose(dnssd->module);
-		free(dnssd);
-		return NULL;
-	}
-#else
-	dnssd->DNSServiceRegister = &DNSServiceRegister;
-	dnssd->DNSServiceRefDeallocate = &DNSServiceRefDeallocate;
-	dnssd->TXTRecordCreate = &TXTRecordCreate;
-	dnssd->TXTRecordSetValue = &TXTRecordSetValue;
-	dnssd->TXTRecordGetLength = &TXTRecordGetLength;
-	dnssd->TXTRecordGetBytesPtr = &TXTRecordGetBytesPtr;
-	dnssd->TXTRecordDeallocate = &TXTRecordDeallocate;
-#endif
-
 	return dnssd;
 }
 
@@ -210,31 +84,31 @@ void
 dnssd_destroy(dnssd_t *dnssd)
 {
 	if (dnssd) {
-#ifdef WIN32
-		FreeLibrary(dnssd->module);
-#elif USE_LIBDL
-		dlclose(dnssd->module);
-#endif
+		mdns_destroy(dnssd->mdns);
 		free(dnssd);
 	}
 }
-static void __stdcall MyRegisterServiceReply
-(
-	DNSServiceRef                       sdRef,
-	DNSServiceFlags                     flags,
-	DNSServiceErrorType                 errorCode,
-	const char* name,
-	const char* regtype,
-	const char* domain,
-	void* context
-)
+
+/* The host name is the hardware address, the same for both services */
+static int
+dnssd_set_host(dnssd_t *dnssd, const char *hwaddr, int hwaddrlen)
 {
+	char host[MAX_SERVNAME];
+
+	if (dnssd->raopService >= 0 || dnssd->airplayService >= 0) {
+		return 0;
+	}
+	if (utils_hwaddr_raop(host, sizeof(host), hwaddr, hwaddrlen) < 0) {
+		return -1;
+	}
+	return mdns_set_host(dnssd->mdns, host);
 }
 
 int
 dnssd_register_raop(dnssd_t *dnssd, const char *name, unsigned short port, const char *hwaddr, int hwaddrlen, int password)
 {
-	TXTRecordRef txtRecord;
+	uint8_t *txt = dnssd->raopTxt;
+	int *txtlen = &dnssd->raopTxtLen;
 	char servname[MAX_SERVNAME];
 	int ret;
 
@@ -242,123 +116,160 @@ dnssd_register_raop(dnssd_t *dnssd, const char *name, unsigned short port, const
 	assert(name);
 	assert(hwaddr);
 
-	dnssd->TXTRecordCreate(&txtRecord, 0, NULL);
-	dnssd->TXTRecordSetValue(&txtRecord, "txtvers", strlen(RAOP_TXTVERS), RAOP_TXTVERS);
-	dnssd->TXTRecordSetValue(&txtRecord, "ch", strlen(RAOP_CH), RAOP_CH);
-	dnssd->TXTRecordSetValue(&txtRecord, "cn", strlen(RAOP_CN), RAOP_CN);
-	dnssd->TXTRecordSetValue(&txtRecord, "et", strlen(RAOP_ET), RAOP_ET);
-	dnssd->TXTRecordSetValue(&txtRecord, "sv", strlen(RAOP_SV), RAOP_SV);
-	dnssd->TXTRecordSetValue(&txtRecord, "da", strlen(RAOP_DA), RAOP_DA);
-	dnssd->TXTRecordSetValue(&txtRecord, "sr", strlen(RAOP_SR), RAOP_SR);
-	dnssd->TXTRecordSetValue(&txtRecord, "ss", strlen(RAOP_SS), RAOP_SS);
-	if (password) {
-		dnssd->TXTRecordSetValue(&txtRecord, "pw", strlen("true"), "true");
-	} else {
-		dnssd->TXTRecordSetValue(&txtRecord, "pw", strlen("false"), "false");
+	if (dnssd->raopService >= 0) {
+		return -1;
+	}
+
+	*txtlen = 0;
+	ret = 0;
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "txtvers", RAOP_TXTVERS);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "ch", RAOP_CH);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "cn", RAOP_CN);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "et", RAOP_ET);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "sv", RAOP_SV);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "da", RAOP_DA);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "sr", RAOP_SR);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "ss", RAOP_SS);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "pw", password ? "true" : "false");
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "vn", RAOP_VN);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "tp", RAOP_TP);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "md", RAOP_MD);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "vs", GLOBAL_VERSION);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "sm", RAOP_SM);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "ek", RAOP_EK);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "sf", RAOP_SF);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "am", GLOBAL_MODEL);
+	if (ret < 0) {
+		return -1;
 	}
-	dnssd->TXTRecordSetValue(&txtRecord, "vn", strlen(RAOP_VN), RAOP_VN);
-	dnssd->TXTRecordSetValue(&txtRecord, "tp", strlen(RAOP_TP), RAOP_TP);
-	dnssd->TXTRecordSetValue(&txtRecord, "md", strlen(RAOP_MD), RAOP_MD);
-	dnssd->TXTRecordSetValue(&txtRecord, "vs", strlen(GLOBAL_VERSION), GLOBAL_VERSION);
-	dnssd->TXTRecordSetValue(&txtRecord, "sm", strlen(RAOP_SM), RAOP_SM);
-	dnssd->TXTRecordSetValue(&txtRecord, "ek", strlen(RAOP_EK), RAOP_EK);
-	dnssd->TXTRecordSetValue(&txtRecord, "sf", strlen(RAOP_SF), RAOP_SF);
-	dnssd->TXTRecordSetValue(&txtRecord, "am", strlen(GLOBAL_MODEL), GLOBAL_MODEL);
 
 	/* Convert hardware address to string */
 	ret = utils_hwaddr_raop(servname, sizeof(servname), hwaddr, hwaddrlen);
 	if (ret < 0) {
-		/* FIXME: handle better */
 		return -1;
 	}
 
 	/* Check that we have bytes for 'hw@name' format */
 	if (sizeof(servname) < strlen(servname)+1+strlen(name)+1) {
-		/* FIXME: handle better */
 		return -2;
 	}
 
 	strncat(servname, "@", sizeof(servname)-strlen(servname)-1);
 	strncat(servname, name, sizeof(servname)-strlen(servname)-1);
 
-//	int len = dnssd->TXTRecordGetLength(&txtRecord) + 1;
-//	char* txt = malloc(len);
-//	txt[len - 1] = '\0';
-//	memcpy(txt, dnssd->TXTRecordGetBytesPtr(&txtRecord), len);
+	if (dnssd_set_host(dnssd, hwaddr, hwaddrlen) < 0) {
+		return -1;
+	}
 	/* Register the service */
-	ret = dnssd->DNSServiceRegister(&dnssd->raopService, 0, 0,
-	                          servname, "_raop._tcp",
-	                          NULL, NULL,
-	                          htons(port),
-	                          dnssd->TXTRecordGetLength(&txtRecord),
-	                          dnssd->TXTRecordGetBytesPtr(&txtRecord),
-		MyRegisterServiceReply, NULL);
-
-	/* Deallocate TXT record */
-	dnssd->TXTRecordDeallocate(&txtRecord);
-	return 1;
+	dnssd->raopService = mdns_add_service(dnssd->mdns, servname, "_raop._tcp", port, txt, *txtlen);
+	if (dnssd->raopService < 0) {
+		return -1;
+	}
+	return 0;
 }
 
 int
 dnssd_register_airplay(dnssd_t *dnssd, const char *name, unsigned short port, const char *hwaddr, int hwaddrlen)
 {
-	TXTRecordRef txtRecord;
+	uint8_t *txt = dnssd->airplayTxt;
+	int *txtlen = &dnssd->airplayTxtLen;
 	char deviceid[3*MAX_HWADDR_LEN];
-	char features[16];
 	int ret;
 
 	assert(dnssd);
 	assert(name);
 	assert(hwaddr);
 
+	if (dnssd->airplayService >= 0) {
+		return -1;
+	}
+
 	/* Convert hardware address to string */
 	ret = utils_hwaddr_airplay(deviceid, sizeof(deviceid), hwaddr, hwaddrlen);
 	if (ret < 0) {
-		/* FIXME: handle better */
 		return -1;
 	}
 
-	features[sizeof(features)-1] = '\0';
-	snprintf(features, sizeof(features)-1, "0x%x", GLOBAL_FEATURES);
-
-	dnssd->TXTRecordCreate(&txtRecord, 0, NULL);
-	dnssd->TXTRecordSetValue(&txtRecord, "srcvers", strlen(GLOBAL_VERSION), GLOBAL_VERSION);
-	dnssd->TXTRecordSetValue(&txtRecord, "deviceid", strlen(deviceid), deviceid);
-	dnssd->TXTRecordSetValue(&txtRecord, "features", strlen("0x5A7FFFF7, 0x1E"), "0x5A7FFFF7,0x1E");
-	dnssd->TXTRecordSetValue(&txtRecord, "model", strlen(GLOBAL_MODEL), GLOBAL_MODEL);
-	dnssd->TXTRecordSetValue(&txtRecord, "flags", strlen(RAOP_SF), RAOP_SF);
-	dnssd->TXTRecordSetValue(&txtRecord, "vv", strlen(RAOP_VV), RAOP_VV);
-
-//	int len = dnssd->TXTRecordGetLength(&txtRecord) + 1;
-//	char* txt = malloc(len);
-//	txt[len - 1] = '\0';
-//	memcpy(txt, dnssd->TXTRecordGetBytesPtr(&txtRecord), len);
+	*txtlen = 0;
+	ret = 0;
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "srcvers", GLOBAL_VERSION);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "deviceid", deviceid);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "features", dnssd->features);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "model", GLOBAL_MODEL);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "flags", RAOP_SF);
+	ret |= mdns_txt_set(txt, txtlen, MDNS_TXT_SIZE, "vv", RAOP_VV);
+	if (ret < 0) {
+		return -1;
+	}
 
+	if (dnssd_set_host(dnssd, hwaddr, hwaddrlen) < 0) {
+		return -1;
+	}
 	/* Register the service */
-	ret = dnssd->DNSServiceRegister(&dnssd->airplayService, 0, 0,
-	                          name, "_airplay._tcp",
-	                          NULL, NULL,
-	                          htons(port),
-	                          dnssd->TXTRecordGetLength(&txtRecord),
-	                          dnssd->TXTRecordGetBytesPtr(&txtRecord),
-	                          MyRegisterServiceReply, NULL);
-
-	/* Deallocate TXT record */
-	dnssd->TXTRecordDeallocate(&txtRecord);
+	dnssd->airplayService = mdns_add_service(dnssd->mdns, name, "_airplay._tcp", port, txt, *txtlen);
+	if (dnssd->airplayService < 0) {
+		return -1;
+	}
 	return 0;
 }
 
+int
+dnssd_set_features(dnssd_t *dnssd, uint64_t features)
+{
+	assert(dnssd);
+
+	/* Low word, high word */
+	snprintf(dnssd->features, sizeof(dnssd->features), "0x%X,0x%X",
+	         (unsigned int)(features & 0xffffffff), (unsigned int)(features >> 32));
+	if (dnssd->airplayService < 0) {
+		return 0;
+	}
+	return dnssd_set_airplay_txt(dnssd, "features", dnssd->features);
+}
+
+int
+dnssd_set_raop_txt(dnssd_t *dnssd, const char *key, const char *value)
+{
+	assert(dnssd);
+	assert(key);
+	assert(value);
+
+	if (dnssd->raopService < 0) {
+		return -1;
+	}
+	if (mdns_txt_set(dnssd->raopTxt, &dnssd->raopTxtLen, MDNS_TXT_SIZE, key, value) < 0) {
+		return -1;
+	}
+	return mdns_set_txt(dnssd->mdns, dnssd->raopService, dnssd->raopTxt, dnssd->raopTxtLen);
+}
+
+int
+dnssd_set_airplay_txt(dnssd_t *dnssd, const char *key, const char *value)
+{
+	assert(dnssd);
+	assert(key);
+	assert(value);
+
+	if (dnssd->airplayService < 0) {
+		return -1;
+	}
+	if (mdns_txt_set(dnssd->airplayTxt, &dnssd->airplayTxtLen, MDNS_TXT_SIZE, key, value) < 0) {
+		return -1;
+	}
+	return mdns_set_txt(dnssd->mdns, dnssd->airplayService, dnssd->airplayTxt, dnssd->airplayTxtLen);
+}
+
 void
 dnssd_unregister_raop(dnssd_t *dnssd)
 {
 	assert(dnssd);
 
-	if (!dnssd->raopService) {
+	if (dnssd->raopService < 0) {
 		return;
 	}
 
-	dnssd->DNSServiceRefDeallocate(dnssd->raopService);
-	dnssd->raopService = NULL;
+	mdns_remove_service(dnssd->mdns, dnssd->raopService);
+	dnssd->raopService = -1;
 }
 
 void
@@ -366,10 +277,10 @@ dnssd_unregister_airplay(dnssd_t *dnssd)
 {
 	assert(dnssd);
 
-	if (!dnssd->airplayService) {
+	if (dnssd->airplayService < 0) {
 		return;
 	}
 
-	dnssd->DNSServiceRefDeallocate(dnssd->airplayService);
-	dnssd->airplayService = NULL;
+	mdns_remove_service(dnssd->mdns, dnssd->airplayService);
+	dnssd->airplayService = -1;
 }
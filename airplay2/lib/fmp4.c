@@ -0,0 +1,920 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "fmp4.h"
+
+#define FMP4_VIDEO_TRACK        1
+#define FMP4_AUDIO_TRACK        2
+#define FMP4_VIDEO_TIMESCALE    90000
+#define FMP4_FRAGMENT_SECONDS   2
+/* Duration of the last frame when the session ends, 1/30s */
+#define FMP4_LAST_DURATION      3000
+#define FMP4_MAX_PARAM_SET      256
+
+#define FMP4_SAMPLE_SYNC        0x02000000      /* depends on nothing */
+#define FMP4_SAMPLE_NON_SYNC    0x01010000      /* depends on others, not a sync sample */
+
+typedef struct fmp4_buf_s {
+    unsigned char *data;
+    int len;
+    int size;
+    int error;
+} fmp4_buf_t;
+
+/* Samples of the fragment being built */
+typedef struct fmp4_samples_s {
+    fmp4_buf_t data;
+    fmp4_buf_t table;           /* uint32_t size, duration, flags per sample */
+    int count;
+    uint64_t base_time;         /* decode time of the first sample */
+    uint64_t next_time;         /* decode time of the next sample */
+} fmp4_samples_t;
+
+struct fmp4_s {
+    fmp4_write_t write;
+    void *cls;
+    int max_fragment;
+
+    unsigned char sps[FMP4_MAX_PARAM_SET];
+    int sps_len;
+    unsigned char pps[FMP4_MAX_PARAM_SET];
+    int pps_len;
+
+    unsigned char audio_config[64];
+    int audio_config_len;
+    int sample_rate;
+    int channels;
+    int frame_samples;
+
+    int started;
+    uint64_t start_ntp;
+    int audio_started;
+    uint32_t sequence;
+
+    fmp4_samples_t video;
+    fmp4_samples_t audio;
+    fmp4_buf_t out;
+};
+
+static void
+buf_reserve(fmp4_buf_t *buf, int len)
+{
+    unsigned char *data;
+    int size;
+
+    if (buf->error || buf->len + len <= buf->size) {
+        return;
+    }
+    size = buf->size ? buf->size : 4096;
+    while (size < buf->len + len) {
+        size *= 2;
+    }
+    data = realloc(buf->data, size);
+    if (!data) {
+        buf->error = 1;
+        return;
+    }
+    buf->data = data;
+    buf->size = size;
+}
+
+static void
+put_bytes(fmp4_buf_t *buf, const void *data, int len)
+{
+    buf_reserve(buf, len);
+    if (!buf->error) {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+}
+
+static void
+put_zeros(fmp4_buf_t *buf, int len)
+{
+    buf_reserve(buf, len);
+    if (!buf->error) {
+        memset(buf->data + buf->len, 0, len);
+        buf->len += len;
+    }
+}
+
+static void
+put_u8(fmp4_buf_t *buf, uint8_t value)
+{
+    put_bytes(buf, &value, 1);
+}
+
+static void
+put_u16(fmp4_buf_t *buf, uint16_t value)
+{
+    unsigned char b[2] = { (unsigned char)(value >> 8), (unsigned char)value };
+    put_bytes(buf, b, 2);
+}
+
+static void
+put_u24(fmp4_buf_t *buf, uint32_t value)
+{
+    unsigned char b[3] = { (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value };
+    put_bytes(buf, b, 3);
+}
+
+static void
+put_u32(fmp4_buf_t *buf, uint32_t value)
+{
+    unsigned char b[4] = { (unsigned char)(value >> 24), (unsigned char)(value >> 16),
+                           (unsigned char)(value >> 8), (unsigned char)value };
+    put_bytes(buf, b, 4);
+}
+
+static void
+put_u64(fmp4_buf_t *buf, uint64_t value)
+{
+    put_u32(buf, (uint32_t)(value >> 32));
+    put_u32(buf, (uint32_t)value);
+}
+
+static void
+set_u32(fmp4_buf_t *buf, int pos, uint32_t value)
+{
+    if (!buf->error) {
+        buf->data[pos] = value >> 24;
+        buf->data[pos + 1] = value >> 16;
+        buf->data[pos + 2] = value >> 8;
+        buf->data[pos + 3] = value;
+    }
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Returns the offset of the box, see box_end */
+static int
+box_begin(fmp4_buf_t *buf, const char *type)
+{
+    int pos = buf->len;
+
+    put_u32(buf, 0);
+    put_bytes(buf, type, 4);
+    return pos;
+}
+
+static int
+fullbox_begin(fmp4_buf_t *buf, const char *type, int version, uint32_t flags)
+{
+    int pos = box_begin(buf, type);
+
+    put_u8(buf, version);
+    put_u24(buf, flags);
+    return pos;
+}
+
+static void
+box_end(fmp4_buf_t *buf, int pos)
+{
+    set_u32(buf, pos, buf->len - pos);
+}
+
+/* Next NAL of an Annex B buffer, returns 0 at the end */
+static int
+nal_next(const unsigned char *data, int len, int *pos, const unsigned char **nal, int *nal_len)
+{
+    int i = *pos;
+    int start, end;
+
+    while (i + 3 <= len && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)) {
+        i++;
+    }
+    if (i + 3 > len) {
+        return 0;
+    }
+    start = i + 3;
+    for (i = start; i + 3 <= len; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            break;
+        }
+    }
+    if (i + 3 > len) {
+        i = len;
+    }
+    /* The leading zero of a 4 byte start code is not part of the NAL */
+    end = i;
+    while (end > start && data[end - 1] == 0) {
+        end--;
+    }
+    *nal = data + start;
+    *nal_len = end - start;
+    *pos = i;
+    return 1;
+}
+
+typedef struct fmp4_bits_s {
+    unsigned char data[FMP4_MAX_PARAM_SET];
+    int len;
+    int pos;
+} fmp4_bits_t;
+
+static int
+bits_read(fmp4_bits_t *bits, int n)
+{
+    int value = 0;
+
+    while (n-- > 0) {
+        int bit = 0;
+
+        if (bits->pos < bits->len * 8) {
+            bit = (bits->data[bits->pos >> 3] >> (7 - (bits->pos & 7))) & 1;
+        }
+        bits->pos++;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+static int
+bits_ue(fmp4_bits_t *bits)
+{
+    int zeros = 0;
+
+    while (bits_read(bits, 1) == 0 && zeros < 31 && bits->pos < bits->len * 8) {
+        zeros++;
+    }
+    return (1 << zeros) - 1 + bits_read(bits, zeros);
+}
+
+static int
+bits_se(fmp4_bits_t *bits)
+{
+    int value = bits_ue(bits);
+
+    return (value & 1) ? (value + 1) / 2 : -(value / 2);
+}
+
+/* Picture size from the SPS, H.264 7.3.2.1.1 */
+static void
+sps_get_size(const unsigned char *sps, int sps_len, int *width, int *height, int *chroma_format)
+{
+    fmp4_bits_t bits;
+    int profile, chroma = 1;
+    int poc_type, frame_mbs_only;
+    int width_mbs, height_units;
+    int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    int crop_x, crop_y;
+    int i, j;
+
+    /* Drop the emulation prevention bytes */
+    bits.len = 0;
+    bits.pos = 0;
+    for (i = 1; i < sps_len && bits.len < FMP4_MAX_PARAM_SET; i++) {
+        if (i >= 3 && sps[i] == 3 && sps[i - 1] == 0 && sps[i - 2] == 0) {
+            continue;
+        }
+        bits.data[bits.len++] = sps[i];
+    }
+
+    profile = bits_read(&bits, 8);
+    bits_read(&bits, 16);
+    bits_ue(&bits);
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135) {
+        chroma = bits_ue(&bits);
+        if (chroma == 3) {
+            bits_read(&bits, 1);
+        }
+        bits_ue(&bits);
+        bits_ue(&bits);
+        bits_read(&bits, 1);
+        if (bits_read(&bits, 1)) {
+            for (i = 0; i < (chroma != 3 ? 8 : 12); i++) {
+                if (bits_read(&bits, 1)) {
+                    int size = i < 6 ? 16 : 64;
+                    int last = 8, next = 8;
+
+                    for (j = 0; j < size && next != 0; j++) {
+                        next = (last + bits_se(&bits) + 256) % 256;
+                        last = next ? next : last;
+                    }
+                }
+            }
+        }
+    }
+    bits_ue(&bits);
+    poc_type = bits_ue(&bits);
+    if (poc_type == 0) {
+        bits_ue(&bits);
+    } else if (poc_type == 1) {
+        int cycle;
+
+        bits_read(&bits, 1);
+        bits_se(&bits);
+        bits_se(&bits);
+        cycle = bits_ue(&bits);
+        for (i = 0; i < cycle && i < 256; i++) {
+            bits_se(&bits);
+        }
+    }
+    bits_ue(&bits);
+    bits_read(&bits, 1);
+    width_mbs = bits_ue(&bits) + 1;
+    height_units = bits_ue(&bits) + 1;
+    frame_mbs_only = bits_read(&bits, 1);
+    if (!frame_mbs_only) {
+        bits_read(&bits, 1);
+    }
+    bits_read(&bits, 1);
+    if (bits_read(&bits, 1)) {
+        crop_left = bits_ue(&bits);
+        crop_right = bits_ue(&bits);
+        crop_top = bits_ue(&bits);
+        crop_bottom = bits_ue(&bits);
+    }
+
+    crop_x = (chroma == 1 || chroma == 2) ? 2 : 1;
+    crop_y = (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    *width = width_mbs * 16 - crop_x * (crop_left + crop_right);
+    *height = (2 - frame_mbs_only) * height_units * 16 - crop_y * (crop_top + crop_bottom);
+    *chroma_format = chroma;
+    (void)profile;
+}
+
+static void
+write_matrix(fmp4_buf_t *buf)
+{
+    put_u32(buf, 0x00010000); put_u32(buf, 0); put_u32(buf, 0);
+    put_u32(buf, 0); put_u32(buf, 0x00010000); put_u32(buf, 0);
+    put_u32(buf, 0); put_u32(buf, 0); put_u32(buf, 0x40000000);
+}
+
+static void
+write_track_header(fmp4_buf_t *buf, int track, int audio, int width, int height)
+{
+    int tkhd = fullbox_begin(buf, "tkhd", 0, 3);
+
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_u32(buf, track);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_zeros(buf, 8);
+    put_u16(buf, 0);
+    put_u16(buf, 0);
+    put_u16(buf, audio ? 0x0100 : 0);
+    put_u16(buf, 0);
+    write_matrix(buf);
+    put_u32(buf, width << 16);
+    put_u32(buf, height << 16);
+    box_end(buf, tkhd);
+}
+
+static void
+write_media_header(fmp4_buf_t *buf, uint32_t timescale, const char *handler, const char *name)
+{
+    int box;
+
+    box = fullbox_begin(buf, "mdhd", 0, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_u32(buf, timescale);
+    put_u32(buf, 0);
+    put_u16(buf, 0x55c4);       /* und */
+    put_u16(buf, 0);
+    box_end(buf, box);
+
+    box = fullbox_begin(buf, "hdlr", 0, 0);
+    put_u32(buf, 0);
+    put_bytes(buf, handler, 4);
+    put_zeros(buf, 12);
+    put_bytes(buf, name, (int)strlen(name) + 1);
+    box_end(buf, box);
+}
+
+/* dinf and the empty sample tables around the sample entry */
+static int
+write_stbl_begin(fmp4_buf_t *buf)
+{
+    int dinf, dref, url, stbl, stsd;
+
+    dinf = box_begin(buf, "dinf");
+    dref = fullbox_begin(buf, "dref", 0, 0);
+    put_u32(buf, 1);
+    url = fullbox_begin(buf, "url ", 0, 1);
+    box_end(buf, url);
+    box_end(buf, dref);
+    box_end(buf, dinf);
+
+    stbl = box_begin(buf, "stbl");
+    stsd = fullbox_begin(buf, "stsd", 0, 0);
+    put_u32(buf, 1);
+    (void)stsd;
+    return stbl;
+}
+
+static void
+write_stbl_end(fmp4_buf_t *buf, int stbl)
+{
+    int box;
+
+    /* stsd is the first child of stbl */
+    box_end(buf, stbl + 8);
+
+    box = fullbox_begin(buf, "stts", 0, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+    box = fullbox_begin(buf, "stsc", 0, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+    box = fullbox_begin(buf, "stsz", 0, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+    box = fullbox_begin(buf, "stco", 0, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+    box_end(buf, stbl);
+}
+
+static void
+write_video_track(fmp4_t *fmp4, fmp4_buf_t *buf)
+{
+    int width = 0, height = 0, chroma = 1;
+    int trak, mdia, minf, box, stbl, entry;
+    int profile = fmp4->sps[1];
+
+    sps_get_size(fmp4->sps, fmp4->sps_len, &width, &height, &chroma);
+
+    trak = box_begin(buf, "trak");
+    write_track_header(buf, FMP4_VIDEO_TRACK, 0, width, height);
+    mdia = box_begin(buf, "mdia");
+    write_media_header(buf, FMP4_VIDEO_TIMESCALE, "vide", "VideoHandler");
+    minf = box_begin(buf, "minf");
+    box = fullbox_begin(buf, "vmhd", 0, 1);
+    put_zeros(buf, 8);
+    box_end(buf, box);
+    stbl = write_stbl_begin(buf);
+
+    /* avc3: parameter sets may also come in band, with every keyframe */
+    entry = box_begin(buf, "avc3");
+    put_zeros(buf, 6);
+    put_u16(buf, 1);
+    put_zeros(buf, 16);
+    put_u16(buf, width);
+    put_u16(buf, height);
+    put_u32(buf, 0x00480000);
+    put_u32(buf, 0x00480000);
+    put_u32(buf, 0);
+    put_u16(buf, 1);
+    put_zeros(buf, 32);
+    put_u16(buf, 0x0018);
+    put_u16(buf, 0xffff);
+    box = box_begin(buf, "avcC");
+    put_u8(buf, 1);
+    put_bytes(buf, fmp4->sps + 1, 3);
+    put_u8(buf, 0xff);
+    put_u8(buf, 0xe1);
+    put_u16(buf, fmp4->sps_len);
+    put_bytes(buf, fmp4->sps, fmp4->sps_len);
+    put_u8(buf, 1);
+    put_u16(buf, fmp4->pps_len);
+    put_bytes(buf, fmp4->pps, fmp4->pps_len);
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244) {
+        put_u8(buf, 0xfc | chroma);
+        put_u8(buf, 0xf8);
+        put_u8(buf, 0xf8);
+        put_u8(buf, 0);
+    }
+    box_end(buf, box);
+    box_end(buf, entry);
+
+    write_stbl_end(buf, stbl);
+    box_end(buf, minf);
+    box_end(buf, mdia);
+    box_end(buf, trak);
+}
+
+static void
+put_descriptor(fmp4_buf_t *buf, int tag, int len)
+{
+    put_u8(buf, tag);
+    put_u8(buf, 0x80 | ((len >> 21) & 0x7f));
+    put_u8(buf, 0x80 | ((len >> 14) & 0x7f));
+    put_u8(buf, 0x80 | ((len >> 7) & 0x7f));
+    put_u8(buf, len & 0x7f);
+}
+
+static void
+write_audio_track(fmp4_t *fmp4, fmp4_buf_t *buf)
+{
+    int trak, mdia, minf, box, stbl, entry;
+    int dsi_len = 5 + fmp4->audio_config_len;
+    int dcd_len = 13 + dsi_len;
+    int es_len = 3 + 5 + dcd_len + 5 + 1;
+
+    trak = box_begin(buf, "trak");
+    write_track_header(buf, FMP4_AUDIO_TRACK, 1, 0, 0);
+    mdia = box_begin(buf, "mdia");
+    write_media_header(buf, fmp4->sample_rate, "soun", "SoundHandler");
+    minf = box_begin(buf, "minf");
+    box = fullbox_begin(buf, "smhd", 0, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+    stbl = write_stbl_begin(buf);
+
+    entry = box_begin(buf, "mp4a");
+    put_zeros(buf, 6);
+    put_u16(buf, 1);
+    put_zeros(buf, 8);
+    put_u16(buf, fmp4->channels);
+    put_u16(buf, 16);
+    put_u32(buf, 0);
+    put_u32(buf, (uint32_t)fmp4->sample_rate << 16);
+    box = fullbox_begin(buf, "esds", 0, 0);
+    put_descriptor(buf, 0x03, es_len);
+    put_u16(buf, FMP4_AUDIO_TRACK);
+    put_u8(buf, 0);
+    put_descriptor(buf, 0x04, dcd_len);
+    put_u8(buf, 0x40);          /* MPEG-4 audio */
+    put_u8(buf, 0x15);          /* audio stream */
+    put_u24(buf, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_descriptor(buf, 0x05, fmp4->audio_config_len);
+    put_bytes(buf, fmp4->audio_config, fmp4->audio_config_len);
+    put_descriptor(buf, 0x06, 1);
+    put_u8(buf, 0x02);
+    box_end(buf, box);
+    box_end(buf, entry);
+
+    write_stbl_end(buf, stbl);
+    box_end(buf, minf);
+    box_end(buf, mdia);
+    box_end(buf, trak);
+}
+
+static void
+write_trex(fmp4_buf_t *buf, int track)
+{
+    int box = fullbox_begin(buf, "trex", 0, 0);
+
+    put_u32(buf, track);
+    put_u32(buf, 1);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    box_end(buf, box);
+}
+
+static void
+fmp4_write_init(fmp4_t *fmp4)
+{
+    fmp4_buf_t *buf = &fmp4->out;
+    int box, moov, mvex;
+
+    buf->len = 0;
+    box = box_begin(buf, "ftyp");
+    put_bytes(buf, "iso6", 4);
+    put_u32(buf, 0);
+    put_bytes(buf, "iso6iso5mp41", 12);
+    box_end(buf, box);
+
+    moov = box_begin(buf, "moov");
+    box = fullbox_begin(buf, "mvhd", 0, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 0);
+    put_u32(buf, 1000);
+    put_u32(buf, 0);
+    put_u32(buf, 0x00010000);
+    put_u16(buf, 0x0100);
+    put_zeros(buf, 10);
+    write_matrix(buf);
+    put_zeros(buf, 24);
+    put_u32(buf, FMP4_AUDIO_TRACK + 1);
+    box_end(buf, box);
+
+    write_video_track(fmp4, buf);
+    if (fmp4->audio_config_len) {
+        write_audio_track(fmp4, buf);
+    }
+    mvex = box_begin(buf, "mvex");
+    write_trex(buf, FMP4_VIDEO_TRACK);
+    if (fmp4->audio_config_len) {
+        write_trex(buf, FMP4_AUDIO_TRACK);
+    }
+    box_end(buf, mvex);
+    box_end(buf, moov);
+
+    if (!buf->error) {
+        fmp4->write(fmp4->cls, buf->data, buf->len, FMP4_INIT);
+    }
+}
+
+/* Returns the offset of the data offset field of trun */
+static int
+write_traf(fmp4_buf_t *buf, int track, fmp4_samples_t *samples, int with_flags)
+{
+    int traf, box, data_offset, i;
+
+    traf = box_begin(buf, "traf");
+    box = fullbox_begin(buf, "tfhd", 0, 0x020000);     /* default-base-is-moof */
+    put_u32(buf, track);
+    box_end(buf, box);
+    box = fullbox_begin(buf, "tfdt", 1, 0);
+    put_u64(buf, samples->base_time);
+    box_end(buf, box);
+    box = fullbox_begin(buf, "trun", 0, with_flags ? 0x000701 : 0x000301);
+    put_u32(buf, samples->count);
+    data_offset = buf->len;
+    put_u32(buf, 0);
+    for (i = 0; i < samples->count; i++) {
+        const unsigned char *entry = samples->table.data + i * 12;
+
+        put_u32(buf, get_u32(entry + 4));
+        put_u32(buf, get_u32(entry));
+        if (with_flags) {
+            put_u32(buf, get_u32(entry + 8));
+        }
+    }
+    box_end(buf, box);
+    box_end(buf, traf);
+    return data_offset;
+}
+
+static void
+samples_add(fmp4_samples_t *samples, int size, uint32_t duration, uint32_t flags)
+{
+    unsigned char entry[12];
+
+    entry[0] = size >> 24; entry[1] = size >> 16; entry[2] = size >> 8; entry[3] = size;
+    entry[4] = duration >> 24; entry[5] = duration >> 16; entry[6] = duration >> 8; entry[7] = duration;
+    entry[8] = flags >> 24; entry[9] = flags >> 16; entry[10] = flags >> 8; entry[11] = flags;
+    put_bytes(&samples->table, entry, 12);
+    samples->count++;
+}
+
+static void
+samples_set_duration(fmp4_samples_t *samples, int index, uint32_t duration)
+{
+    if (!samples->table.error) {
+        set_u32(&samples->table, index * 12 + 4, duration);
+    }
+}
+
+static void
+samples_reset(fmp4_samples_t *samples)
+{
+    samples->data.len = 0;
+    samples->data.error = 0;
+    samples->table.len = 0;
+    samples->table.error = 0;
+    samples->count = 0;
+    samples->base_time = samples->next_time;
+}
+
+/* One moof and mdat with the buffered video (if with_video) and audio */
+static void
+fmp4_flush(fmp4_t *fmp4, int with_video)
+{
+    fmp4_buf_t *buf = &fmp4->out;
+    fmp4_samples_t *video = with_video && fmp4->video.count ? &fmp4->video : NULL;
+    fmp4_samples_t *audio = fmp4->audio.count ? &fmp4->audio : NULL;
+    int moof, box, mdat_size;
+    int video_offset = -1, audio_offset = -1;
+    int flags = 0;
+
+    if (!video && !audio) {
+        return;
+    }
+    if ((video && (video->data.error || video->table.error)) ||
+        (audio && (audio->data.error || audio->table.error))) {
+        /* Out of memory, the fragment is lost */
+        goto done;
+    }
+    if (video && (get_u32(video->table.data + 8) & 0x00010000) == 0) {
+        flags = FMP4_KEYFRAME;
+    }
+
+    buf->len = 0;
+    moof = box_begin(buf, "moof");
+    box = fullbox_begin(buf, "mfhd", 0, 0);
+    put_u32(buf, ++fmp4->sequence);
+    box_end(buf, box);
+    if (video) {
+        video_offset = write_traf(buf, FMP4_VIDEO_TRACK, video, 1);
+    }
+    if (audio) {
+        audio_offset = write_traf(buf, FMP4_AUDIO_TRACK, audio, 0);
+    }
+    box_end(buf, moof);
+
+    mdat_size = 8 + (video ? video->data.len : 0) + (audio ? audio->data.len : 0);
+    if (video) {
+        set_u32(buf, video_offset, buf->len - moof + 8);
+    }
+    if (audio) {
+        set_u32(buf, audio_offset, buf->len - moof + 8 + (video ? video->data.len : 0));
+    }
+    put_u32(buf, mdat_size);
+    put_bytes(buf, "mdat", 4);
+    if (video) {
+        put_bytes(buf, video->data.data, video->data.len);
+    }
+    if (audio) {
+        put_bytes(buf, audio->data.data, audio->data.len);
+    }
+    if (!buf->error) {
+        fmp4->write(fmp4->cls, buf->data, buf->len, flags);
+    }
+    buf->error = 0;
+
+done:
+    if (video) {
+        samples_reset(video);
+    }
+    if (audio) {
+        samples_reset(audio);
+    }
+}
+
+static void
+put_nal(fmp4_buf_t *buf, const unsigned char *nal, int len)
+{
+    put_u32(buf, len);
+    put_bytes(buf, nal, len);
+}
+
+int
+fmp4_write_video(fmp4_t *fmp4, const unsigned char *data, int len, uint64_t ntp_pts)
+{
+    fmp4_samples_t *video = &fmp4->video;
+    const unsigned char *nal;
+    int nal_len, pos = 0;
+    int has_slice = 0, idr = 0, has_sps = 0;
+    uint64_t time;
+    int size;
+
+    assert(fmp4);
+
+    while (nal_next(data, len, &pos, &nal, &nal_len)) {
+        int type = nal_len > 0 ? nal[0] & 0x1f : 0;
+
+        if (type == 7 && nal_len <= FMP4_MAX_PARAM_SET) {
+            memcpy(fmp4->sps, nal, nal_len);
+            fmp4->sps_len = nal_len;
+            has_sps = 1;
+        } else if (type == 8 && nal_len <= FMP4_MAX_PARAM_SET) {
+            memcpy(fmp4->pps, nal, nal_len);
+            fmp4->pps_len = nal_len;
+        } else if (type >= 1 && type <= 5) {
+            has_slice = 1;
+            idr |= (type == 5);
+        }
+    }
+    if (!has_slice) {
+        return 0;
+    }
+    if (!fmp4->started) {
+        if (!idr || fmp4->sps_len < 4 || fmp4->pps_len == 0) {
+            return -1;
+        }
+        fmp4->started = 1;
+        fmp4->start_ntp = ntp_pts;
+        fmp4_write_init(fmp4);
+    }
+
+    time = ntp_pts > fmp4->start_ntp ? (ntp_pts - fmp4->start_ntp) * FMP4_VIDEO_TIMESCALE / 1000000 : 0;
+    if (video->count > 0) {
+        if (time <= video->next_time) {
+            time = video->next_time + 1;
+        }
+        /* The duration of a frame is known once the next one arrives */
+        samples_set_duration(video, video->count - 1, (uint32_t)(time - video->next_time));
+        video->next_time = time;
+        if (idr || time - video->base_time >= FMP4_FRAGMENT_SECONDS * FMP4_VIDEO_TIMESCALE ||
+            video->data.len + len + 2 * FMP4_MAX_PARAM_SET > fmp4->max_fragment) {
+            fmp4_flush(fmp4, 1);
+        }
+    } else {
+        video->base_time = time;
+    }
+    video->next_time = time;
+
+    /* Length prefixed NALs, parameter sets in front of every keyframe */
+    size = video->data.len;
+    if (idr && !has_sps) {
+        put_nal(&video->data, fmp4->sps, fmp4->sps_len);
+        put_nal(&video->data, fmp4->pps, fmp4->pps_len);
+    }
+    pos = 0;
+    while (nal_next(data, len, &pos, &nal, &nal_len)) {
+        if (nal_len > 0) {
+            put_nal(&video->data, nal, nal_len);
+        }
+    }
+    size = video->data.len - size;
+    samples_add(video, size, 0, idr ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC);
+    return 0;
+}
+
+int
+fmp4_write_audio(fmp4_t *fmp4, const unsigned char *data, int len, uint64_t ntp_pts)
+{
+    fmp4_samples_t *audio = &fmp4->audio;
+
+    assert(fmp4);
+
+    if (!fmp4->audio_config_len || !fmp4->started) {
+        return -1;
+    }
+    if (!fmp4->audio_started) {
+        if (len <= 0 || ntp_pts == 0 || ntp_pts < fmp4->start_ntp) {
+            return -1;
+        }
+        fmp4->audio_started = 1;
+        audio->next_time = (ntp_pts - fmp4->start_ntp) * fmp4->sample_rate / 1000000;
+        audio->base_time = audio->next_time;
+    }
+    if (len <= 0) {
+        /* A gap, the previous frame lasts longer */
+        if (audio->count > 0 && !audio->table.error) {
+            uint32_t duration = get_u32(audio->table.data + (audio->count - 1) * 12 + 4);
+
+            samples_set_duration(audio, audio->count - 1, duration + fmp4->frame_samples);
+        } else {
+            audio->base_time += fmp4->frame_samples;
+        }
+        audio->next_time += fmp4->frame_samples;
+        return 0;
+    }
+    if (audio->count > 0 &&
+        (audio->next_time - audio->base_time >= (uint64_t)FMP4_FRAGMENT_SECONDS * fmp4->sample_rate ||
+         audio->data.len + len > fmp4->max_fragment)) {
+        fmp4_flush(fmp4, 0);
+    }
+    put_bytes(&audio->data, data, len);
+    samples_add(audio, len, fmp4->frame_samples, 0);
+    audio->next_time += fmp4->frame_samples;
+    return 0;
+}
+
+fmp4_t *
+fmp4_init(const unsigned char *audio_config, int audio_config_len, int sample_rate, int channels,
+          int frame_samples, int max_fragment, fmp4_write_t write, void *cls)
+{
+    fmp4_t *fmp4;
+
+    assert(write);
+
+    if (audio_config && (audio_config_len <= 0 || audio_config_len > (int)sizeof(fmp4->audio_config) ||
+                         sample_rate <= 0 || channels <= 0 || frame_samples <= 0)) {
+        return NULL;
+    }
+    fmp4 = calloc(1, sizeof(fmp4_t));
+    if (!fmp4) {
+        return NULL;
+    }
+    fmp4->write = write;
+    fmp4->cls = cls;
+    fmp4->max_fragment = max_fragment;
+    if (audio_config) {
+        memcpy(fmp4->audio_config, audio_config, audio_config_len);
+        fmp4->audio_config_len = audio_config_len;
+        fmp4->sample_rate = sample_rate;
+        fmp4->channels = channels;
+        fmp4->frame_samples = frame_samples;
+    }
+    return fmp4;
+}
+
+void
+fmp4_destroy(fmp4_t *fmp4)
+{
+    if (!fmp4) {
+        return;
+    }
+    if (fmp4->video.count > 0) {
+        samples_set_duration(&fmp4->video, fmp4->video.count - 1, FMP4_LAST_DURATION);
+    }
+    fmp4_flush(fmp4, 1);
+
+    free(fmp4->video.data.data);
+    free(fmp4->video.table.data);
+    free(fmp4->audio.data.data);
+    free(fmp4->audio.table.data);
+    free(fmp4->out.data);
+    free(fmp4);
+}
@@ -23,6 +23,7 @@
 struct http_response_s {
 	int complete;
 	int disconnect;
+	int upgrade;
 
 	char *data;
 	int data_size;
@@ -153,6 +154,22 @@ http_response_get_disconnect(http_response_t *response)
 	return response->disconnect;
 }
 
+void
+http_response_set_upgrade(http_response_t *response, int upgrade)
+{
+	assert(response);
+
+	response->upgrade = !!upgrade;
+}
+
+int
+http_response_get_upgrade(http_response_t *response)
+{
+	assert(response);
+
+	return response->upgrade;
+}
+
 const char *
 http_response_get_data(http_response_t *response, int *datalen)
 {
@@ -25,6 +25,11 @@ void http_response_finish(http_response_t *response, const char *data, int datal
 void http_response_set_disconnect(http_response_t *response, int disconnect);
 int http_response_get_disconnect(http_response_t *response);
 
+/* After this response the connection no longer carries requests from the
+ * client, httpd pushes data from conn_event on it instead */
+void http_response_set_upgrade(http_response_t *response, int upgrade);
+int http_response_get_upgrade(http_response_t *response);
+
 const char *http_response_get_data(http_response_t *response, int *datalen);
 
 void http_response_destroy(http_response_t *response);
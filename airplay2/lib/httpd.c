@@ -18,6 +18,7 @@
 #include <assert.h>
 
 #include "httpd.h"
+#include "raop.h"
 #include "netutils.h"
 #include "http_request.h"
 #include "compat.h"
@@ -29,6 +30,12 @@ struct http_connection_s {
 	int socket_fd;
 	void *user_data;
 	http_request_t *request;
+	/* Switched protocols, conn_event is polled for what to push */
+	int upgraded;
+	/* Event still being sent, the socket is non-blocking once upgraded */
+	char event[2048];
+	int event_len;
+	int event_sent;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -124,6 +131,9 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
 	httpd->connections[i].socket_fd = fd;
 	httpd->connections[i].connected = 1;
 	httpd->connections[i].user_data = user_data;
+	httpd->connections[i].upgraded = 0;
+	httpd->connections[i].event_len = 0;
+	httpd->connections[i].event_sent = 0;
 	return 0;
 }
 
@@ -181,6 +191,69 @@ httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
 	httpd->open_connections--;
 }
 
+static void
+httpd_upgrade_connection(httpd_t *httpd, http_connection_t *connection)
+{
+#if defined(WIN32)
+	u_long nonblocking = 1;
+#else
+	int nonblocking = 1;
+#endif
+
+	/* Events are pushed from this thread, a peer that stops reading
+	 * must not stall the other connections */
+	if (ioctlsocket(connection->socket_fd, FIONBIO, &nonblocking) == -1) {
+		logger_log(httpd->logger, LOGGER_WARNING, "Error making socket %d non-blocking", connection->socket_fd);
+	}
+	connection->upgraded = 1;
+	connection->event_len = 0;
+	connection->event_sent = 0;
+}
+
+/* Sends what the upgraded connections have to push, returns how many of
+ * them are open. An event the socket can't take yet is kept and finished
+ * on a later pass before the next one is polled. */
+static int
+httpd_push_events(httpd_t *httpd)
+{
+	int upgraded = 0;
+	int i;
+
+	for (i=0; i<httpd->max_connections; i++) {
+		http_connection_t *connection = &httpd->connections[i];
+
+		if (!connection->connected || !connection->upgraded) {
+			continue;
+		}
+		upgraded++;
+		if (!httpd->callbacks.conn_event) {
+			continue;
+		}
+		if (connection->event_sent == connection->event_len) {
+			connection->event_len = httpd->callbacks.conn_event(connection->user_data,
+			                                                    connection->event, sizeof(connection->event));
+			connection->event_sent = 0;
+		}
+		while (connection->event_sent < connection->event_len) {
+			int ret = send(connection->socket_fd, connection->event+connection->event_sent,
+			               connection->event_len-connection->event_sent, 0);
+			if (ret == -1) {
+				if (SOCKET_GET_ERROR() == SOCKET_ERRORNAME(EAGAIN)) {
+					break;
+				}
+				/* Whatever part went out can't be taken back, the
+				 * stream is only usable again on a new connection */
+				logger_log(httpd->logger, LOGGER_INFO, "Error in sending event, disconnecting");
+				httpd_remove_connection(httpd, connection);
+				upgraded--;
+				break;
+			}
+			connection->event_sent += ret;
+		}
+	}
+	return upgraded;
+}
+
 static THREAD_RETVAL
 httpd_thread(void *arg)
 {
@@ -189,11 +262,13 @@ httpd_thread(void *arg)
 	int i;
 
 	assert(httpd);
+	raop_apply_thread_policy(RAOP_THREAD_CONTROL);
 
 	while (1) {
 		fd_set rfds;
 		struct timeval tv;
 		int nfds=0;
+		int upgraded;
 		int ret;
 
 		MUTEX_LOCK(httpd->run_mutex);
@@ -203,9 +278,16 @@ httpd_thread(void *arg)
 		}
 		MUTEX_UNLOCK(httpd->run_mutex);
 
+		upgraded = httpd_push_events(httpd);
+
 		/* Set timeout value to 5ms */
 		tv.tv_sec = 1;
 		tv.tv_usec = 5000;
+		if (upgraded) {
+			/* Events go out between the selects */
+			tv.tv_sec = 0;
+			tv.tv_usec = 50000;
+		}
 
 		/* Get the correct nfds value and set rfds */
 		FD_ZERO(&rfds);
@@ -286,6 +368,13 @@ httpd_thread(void *arg)
 				httpd_remove_connection(httpd, connection);
 				continue;
 			}
+			if (connection->upgraded) {
+				/* Only the client's replies to the events come back */
+				if (ret == -1 && SOCKET_GET_ERROR() != SOCKET_ERRORNAME(EAGAIN)) {
+					httpd_remove_connection(httpd, connection);
+				}
+				continue;
+			}
 
 			/* Parse HTTP request from data read from connection */
 			http_request_add_data(connection->request, buffer, ret);
@@ -323,6 +412,9 @@ httpd_thread(void *arg)
 						written += ret;
 					}
 
+					if (http_response_get_upgrade(response)) {
+						httpd_upgrade_connection(httpd, connection);
+					}
 					if (http_response_get_disconnect(response)) {
 						logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
 						httpd_remove_connection(httpd, connection);
@@ -361,6 +453,7 @@ httpd_thread(void *arg)
 	}
 
 	logger_log(httpd->logger, LOGGER_INFO, "Exiting HTTP thread: %d", httpd->thread);
+	raop_revert_thread_policy();
 
 	return 0;
 }
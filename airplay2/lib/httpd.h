@@ -26,6 +26,9 @@ struct httpd_callbacks_s {
 	void* (*conn_init)(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen);
 	void  (*conn_request)(void *ptr, http_request_t *request, http_response_t **response);
 	void  (*conn_destroy)(void *ptr);
+	/* Optional, polled on upgraded connections. Fills buffer with what to
+	 * send to the client and returns its length, 0 for nothing. */
+	int   (*conn_event)(void *ptr, char *buffer, int size);
 };
 typedef struct httpd_callbacks_s httpd_callbacks_t;
 
@@ -0,0 +1,1072 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mdns.h"
+#include "raop.h"
+#include "compat.h"
+
+#ifndef WIN32
+#include <ifaddrs.h>
+#include <net/if.h>
+#endif
+
+#define MDNS_PORT               5353
+#define MDNS_GROUP              0xE00000FB      /* 224.0.0.251 */
+#define MDNS_MAX_SERVICES       4
+#define MDNS_MAX_ADDRS          8
+#define MDNS_NAME_SIZE          256
+#define MDNS_PACKET_SIZE        1472
+#define MDNS_RECV_SIZE          9000
+
+#define MDNS_TYPE_A             1
+#define MDNS_TYPE_PTR           12
+#define MDNS_TYPE_TXT           16
+#define MDNS_TYPE_SRV           33
+#define MDNS_TYPE_ANY           255
+#define MDNS_CLASS_IN           1
+#define MDNS_CLASS_FLUSH        0x8000          /* unique record, in answers */
+#define MDNS_CLASS_QU           0x8000          /* unicast reply wanted, in questions */
+#define MDNS_FLAGS_RESPONSE     0x8400          /* QR and AA */
+
+#define MDNS_TTL_HOST           120
+#define MDNS_TTL_SERVICE        4500
+
+#define MDNS_PROBES             3
+#define MDNS_PROBE_MS           250
+#define MDNS_ANNOUNCES          2
+#define MDNS_ANNOUNCE_MS        1000
+/* An answer is multicast at most once a second, RFC 6762 6.2 */
+#define MDNS_RATE_MS            1000
+#define MDNS_IDLE_MS            250
+
+#define MDNS_STATE_FREE         0
+#define MDNS_STATE_PROBING      1
+#define MDNS_STATE_ANNOUNCING   2
+#define MDNS_STATE_READY        3
+
+typedef struct mdns_packet_s {
+    uint8_t data[MDNS_PACKET_SIZE];
+    int len;                    /* -1 once something did not fit */
+    uint64_t sent_ms;
+} mdns_packet_t;
+
+typedef struct mdns_service_s {
+    int state;
+    int count;                  /* probes or announcements sent */
+    uint64_t next_ms;
+    int suffix;                 /* " (n)" added after a conflict, 0 if none */
+
+    char instance[64];
+    char type[64];
+    unsigned short port;
+    uint8_t txt[MDNS_TXT_SIZE];
+    int txtlen;
+
+    uint8_t instance_name[MDNS_NAME_SIZE];
+    int instance_namelen;
+    uint8_t type_name[MDNS_NAME_SIZE];
+    int type_namelen;
+
+    mdns_packet_t answer;       /* PTR, SRV, TXT and the host A records */
+    mdns_packet_t enumeration;  /* _services._dns-sd._udp.local PTR */
+    mdns_packet_t probe;
+} mdns_service_t;
+
+struct mdns_s {
+    int sock;
+    uint32_t addrs[MDNS_MAX_ADDRS];
+    int naddrs;
+
+    char host[64];
+    int host_suffix;
+    uint8_t host_name[MDNS_NAME_SIZE];
+    int host_namelen;
+    mdns_packet_t host_answer;
+    uint8_t services_name[MDNS_NAME_SIZE];
+    int services_namelen;
+
+    mdns_service_t services[MDNS_MAX_SERVICES];
+
+    /* Everything above is guarded by mutex */
+    int running;
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+};
+
+static uint64_t
+mdns_now_ms(void)
+{
+    return raop_clock_us() / 1000;
+}
+
+/* Cuts s to at most maxlen bytes without splitting a UTF-8 sequence */
+static void
+utf8_truncate(char *s, int maxlen)
+{
+    int len = (int)strlen(s);
+
+    if (len <= maxlen) {
+        return;
+    }
+    len = maxlen;
+    while (len > 0 && ((unsigned char)s[len] & 0xC0) == 0x80) {
+        len--;
+    }
+    s[len] = '\0';
+}
+
+static int
+name_append_label(uint8_t *name, int namelen, const char *label, int labellen)
+{
+    if (namelen < 0 || labellen <= 0 || labellen > 63 || namelen + 1 + labellen + 1 > MDNS_NAME_SIZE) {
+        return -1;
+    }
+    name[namelen] = (uint8_t)labellen;
+    memcpy(name + namelen + 1, label, labellen);
+    return namelen + 1 + labellen;
+}
+
+/* Appends dot separated labels and the root label, returns the full length */
+static int
+name_append_dotted(uint8_t *name, int namelen, const char *dotted)
+{
+    while (namelen >= 0 && *dotted) {
+        const char *dot = strchr(dotted, '.');
+
+        if (!dot) {
+            dot = dotted + strlen(dotted);
+        }
+        namelen = name_append_label(name, namelen, dotted, (int)(dot - dotted));
+        dotted = *dot ? dot + 1 : dot;
+    }
+    if (namelen < 0) {
+        return -1;
+    }
+    name[namelen] = 0;
+    return namelen + 1;
+}
+
+/* Names are compared in wire format, labels ASCII case insensitive */
+static int
+name_equal(const uint8_t *a, int alen, const uint8_t *b, int blen)
+{
+    int i;
+
+    if (alen != blen) {
+        return 0;
+    }
+    for (i = 0; i < alen; i++) {
+        uint8_t ca = a[i], cb = b[i];
+
+        if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+        if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+        if (ca != cb) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Reads a possibly compressed name as uncompressed wire format. Returns the
+ * offset after the name or -1. */
+static int
+read_name(const uint8_t *pkt, int pktlen, int offset, uint8_t *name, int *namelen)
+{
+    int len = 0, end = -1, jumps = 0;
+
+    while (1) {
+        uint8_t c;
+
+        if (offset >= pktlen) {
+            return -1;
+        }
+        c = pkt[offset];
+        if ((c & 0xC0) == 0xC0) {
+            if (offset + 1 >= pktlen || ++jumps > 16) {
+                return -1;
+            }
+            if (end < 0) {
+                end = offset + 2;
+            }
+            offset = ((c & 0x3F) << 8) | pkt[offset + 1];
+            continue;
+        }
+        if ((c & 0xC0) || offset + 1 + c > pktlen || len + 1 + c > MDNS_NAME_SIZE) {
+            return -1;
+        }
+        memcpy(name + len, pkt + offset, 1 + c);
+        len += 1 + c;
+        offset += 1 + c;
+        if (c == 0) {
+            break;
+        }
+    }
+    *namelen = len;
+    return end < 0 ? offset : end;
+}
+
+static void
+put_bytes(mdns_packet_t *pkt, const void *data, int len)
+{
+    if (pkt->len < 0 || pkt->len + len > MDNS_PACKET_SIZE) {
+        pkt->len = -1;
+        return;
+    }
+    memcpy(pkt->data + pkt->len, data, len);
+    pkt->len += len;
+}
+
+static void
+put_u16(mdns_packet_t *pkt, uint16_t value)
+{
+    uint8_t b[2];
+
+    b[0] = value >> 8;
+    b[1] = value & 0xff;
+    put_bytes(pkt, b, 2);
+}
+
+static void
+put_u32(mdns_packet_t *pkt, uint32_t value)
+{
+    put_u16(pkt, value >> 16);
+    put_u16(pkt, value & 0xffff);
+}
+
+static void
+put_header(mdns_packet_t *pkt, uint16_t flags, int qdcount, int ancount, int nscount)
+{
+    pkt->len = 0;
+    put_u16(pkt, 0);
+    put_u16(pkt, flags);
+    put_u16(pkt, qdcount);
+    put_u16(pkt, ancount);
+    put_u16(pkt, nscount);
+    put_u16(pkt, 0);
+}
+
+/* Returns the offset of rdlength, see end_record */
+static int
+put_record(mdns_packet_t *pkt, const uint8_t *name, int namelen, uint16_t type, uint16_t rrclass, uint32_t ttl)
+{
+    int pos;
+
+    put_bytes(pkt, name, namelen);
+    put_u16(pkt, type);
+    put_u16(pkt, rrclass);
+    put_u32(pkt, ttl);
+    pos = pkt->len;
+    put_u16(pkt, 0);
+    return pos;
+}
+
+static void
+end_record(mdns_packet_t *pkt, int pos)
+{
+    int rdlen;
+
+    if (pkt->len < 0 || pos < 0) {
+        return;
+    }
+    rdlen = pkt->len - pos - 2;
+    pkt->data[pos] = rdlen >> 8;
+    pkt->data[pos + 1] = rdlen & 0xff;
+}
+
+static void
+put_host_records(mdns_t *mdns, mdns_packet_t *pkt, uint16_t rrclass, uint32_t ttl)
+{
+    int i;
+
+    for (i = 0; i < mdns->naddrs; i++) {
+        int pos = put_record(pkt, mdns->host_name, mdns->host_namelen, MDNS_TYPE_A, rrclass, ttl);
+        put_bytes(pkt, &mdns->addrs[i], 4);
+        end_record(pkt, pos);
+    }
+}
+
+static void
+put_service_records(mdns_t *mdns, mdns_service_t *service, mdns_packet_t *pkt, uint16_t flush, int goodbye)
+{
+    int pos;
+
+    pos = put_record(pkt, service->type_name, service->type_namelen, MDNS_TYPE_PTR,
+                     MDNS_CLASS_IN, goodbye ? 0 : MDNS_TTL_SERVICE);
+    put_bytes(pkt, service->instance_name, service->instance_namelen);
+    end_record(pkt, pos);
+
+    pos = put_record(pkt, service->instance_name, service->instance_namelen, MDNS_TYPE_SRV,
+                     MDNS_CLASS_IN | flush, goodbye ? 0 : MDNS_TTL_HOST);
+    put_u16(pkt, 0);
+    put_u16(pkt, 0);
+    put_u16(pkt, service->port);
+    put_bytes(pkt, mdns->host_name, mdns->host_namelen);
+    end_record(pkt, pos);
+
+    pos = put_record(pkt, service->instance_name, service->instance_namelen, MDNS_TYPE_TXT,
+                     MDNS_CLASS_IN | flush, goodbye ? 0 : MDNS_TTL_SERVICE);
+    if (service->txtlen > 0) {
+        put_bytes(pkt, service->txt, service->txtlen);
+    } else {
+        put_bytes(pkt, "", 1);
+    }
+    end_record(pkt, pos);
+}
+
+static int
+mdns_build_host(mdns_t *mdns)
+{
+    char label[64];
+
+    if (mdns->host_suffix) {
+        snprintf(label, sizeof(label), "%s-%d", mdns->host, mdns->host_suffix);
+    } else {
+        snprintf(label, sizeof(label), "%s", mdns->host);
+    }
+    mdns->host_namelen = name_append_label(mdns->host_name, 0, label, (int)strlen(label));
+    mdns->host_namelen = name_append_dotted(mdns->host_name, mdns->host_namelen, "local");
+    if (mdns->host_namelen < 0) {
+        return -1;
+    }
+    put_header(&mdns->host_answer, MDNS_FLAGS_RESPONSE, 0, mdns->naddrs, 0);
+    put_host_records(mdns, &mdns->host_answer, MDNS_CLASS_FLUSH, MDNS_TTL_HOST);
+    return mdns->host_answer.len < 0 ? -1 : 0;
+}
+
+/* Serializes the names and every packet of a service */
+static int
+mdns_build_service(mdns_t *mdns, mdns_service_t *service)
+{
+    char label[64];
+    char dotted[80];
+    int pos;
+
+    snprintf(label, sizeof(label), "%s", service->instance);
+    if (service->suffix) {
+        char suffix[16];
+
+        snprintf(suffix, sizeof(suffix), " (%d)", service->suffix);
+        utf8_truncate(label, 63 - (int)strlen(suffix));
+        strncat(label, suffix, sizeof(label) - strlen(label) - 1);
+    }
+    snprintf(dotted, sizeof(dotted), "%s.local", service->type);
+    service->type_namelen = name_append_dotted(service->type_name, 0, dotted);
+    service->instance_namelen = name_append_label(service->instance_name, 0, label, (int)strlen(label));
+    service->instance_namelen = name_append_dotted(service->instance_name, service->instance_namelen, dotted);
+    if (service->type_namelen < 0 || service->instance_namelen < 0) {
+        return -1;
+    }
+
+    put_header(&service->answer, MDNS_FLAGS_RESPONSE, 0, 3 + mdns->naddrs, 0);
+    put_service_records(mdns, service, &service->answer, MDNS_CLASS_FLUSH, 0);
+    put_host_records(mdns, &service->answer, MDNS_CLASS_FLUSH, MDNS_TTL_HOST);
+
+    put_header(&service->enumeration, MDNS_FLAGS_RESPONSE, 0, 1, 0);
+    pos = put_record(&service->enumeration, mdns->services_name, mdns->services_namelen,
+                     MDNS_TYPE_PTR, MDNS_CLASS_IN, MDNS_TTL_SERVICE);
+    put_bytes(&service->enumeration, service->type_name, service->type_namelen);
+    end_record(&service->enumeration, pos);
+
+    /* The proposed records go in the authority section, without the flush bit */
+    put_header(&service->probe, 0, 2, 0, 3 + mdns->naddrs);
+    put_bytes(&service->probe, service->instance_name, service->instance_namelen);
+    put_u16(&service->probe, MDNS_TYPE_ANY);
+    put_u16(&service->probe, MDNS_CLASS_IN | MDNS_CLASS_QU);
+    put_bytes(&service->probe, mdns->host_name, mdns->host_namelen);
+    put_u16(&service->probe, MDNS_TYPE_ANY);
+    put_u16(&service->probe, MDNS_CLASS_IN | MDNS_CLASS_QU);
+    put_service_records(mdns, service, &service->probe, 0, 0);
+    put_host_records(mdns, &service->probe, 0, MDNS_TTL_HOST);
+
+    if (service->answer.len < 0 || service->enumeration.len < 0 || service->probe.len < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+mdns_send(mdns_t *mdns, mdns_packet_t *pkt)
+{
+    struct sockaddr_in saddr;
+    int i;
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(MDNS_GROUP);
+    saddr.sin_port = htons(MDNS_PORT);
+
+    /* Once per interface, the group is link local */
+    for (i = 0; i < mdns->naddrs || i == 0; i++) {
+        if (mdns->naddrs > 0) {
+            struct in_addr iface;
+
+            iface.s_addr = mdns->addrs[i];
+            setsockopt(mdns->sock, IPPROTO_IP, IP_MULTICAST_IF, (const char *)&iface, sizeof(iface));
+        }
+        sendto(mdns->sock, (const char *)pkt->data, pkt->len, 0, (struct sockaddr *)&saddr, sizeof(saddr));
+    }
+    pkt->sent_ms = mdns_now_ms();
+}
+
+/* Legacy unicast query (source port not 5353), RFC 6762 6.7. The reply
+ * carries the query id and repeats the questions. */
+static void
+mdns_send_legacy(mdns_t *mdns, const mdns_packet_t *answer, const uint8_t *query, int questionslen,
+                 int qdcount, const struct sockaddr_in *to)
+{
+    mdns_packet_t reply;
+    int ancount = (answer->data[6] << 8) | answer->data[7];
+    int offset, i;
+
+    put_header(&reply, MDNS_FLAGS_RESPONSE, qdcount, ancount, 0);
+    reply.data[0] = query[0];
+    reply.data[1] = query[1];
+    put_bytes(&reply, query + 12, questionslen);
+    offset = reply.len;
+    put_bytes(&reply, answer->data + 12, answer->len - 12);
+    if (reply.len < 0) {
+        return;
+    }
+    /* Our records have uncompressed names. No flush bit and at most 10s TTL
+     * for resolvers that do not know mDNS. */
+    for (i = 0; i < ancount && offset < reply.len; i++) {
+        while (offset < reply.len && reply.data[offset]) {
+            offset += 1 + reply.data[offset];
+        }
+        offset++;
+        if (offset + 10 > reply.len) {
+            break;
+        }
+        reply.data[offset + 2] &= 0x7f;
+        if (reply.data[offset + 4] || reply.data[offset + 5] || reply.data[offset + 6] || reply.data[offset + 7] > 10) {
+            reply.data[offset + 4] = reply.data[offset + 5] = reply.data[offset + 6] = 0;
+            reply.data[offset + 7] = 10;
+        }
+        offset += 10 + ((reply.data[offset + 8] << 8) | reply.data[offset + 9]);
+    }
+    if (reply.len > 0) {
+        sendto(mdns->sock, (const char *)reply.data, reply.len, 0, (const struct sockaddr *)to, sizeof(*to));
+    }
+}
+
+static void
+mdns_restart_probing(mdns_service_t *service, uint64_t now)
+{
+    service->state = MDNS_STATE_PROBING;
+    service->count = 0;
+    service->next_ms = now + MDNS_PROBE_MS;
+}
+
+/* Someone else answers for one of our unique names with other data */
+static void
+mdns_check_conflicts(mdns_t *mdns, const uint8_t *pkt, int len, int offset, int qdcount, int records)
+{
+    uint8_t name[MDNS_NAME_SIZE], target[MDNS_NAME_SIZE];
+    int namelen, targetlen;
+    uint64_t now = mdns_now_ms();
+    int i, j;
+
+    for (i = 0; i < qdcount; i++) {
+        offset = read_name(pkt, len, offset, name, &namelen);
+        if (offset < 0 || offset + 4 > len) {
+            return;
+        }
+        offset += 4;
+    }
+    for (i = 0; i < records; i++) {
+        uint16_t type;
+        int rdlen, rdata;
+
+        offset = read_name(pkt, len, offset, name, &namelen);
+        if (offset < 0 || offset + 10 > len) {
+            return;
+        }
+        type = (pkt[offset] << 8) | pkt[offset + 1];
+        rdlen = (pkt[offset + 8] << 8) | pkt[offset + 9];
+        rdata = offset + 10;
+        if (rdata + rdlen > len) {
+            return;
+        }
+        offset = rdata + rdlen;
+
+        if (type == MDNS_TYPE_SRV && rdlen >= 7) {
+            for (j = 0; j < MDNS_MAX_SERVICES; j++) {
+                mdns_service_t *service = &mdns->services[j];
+                uint16_t port = (pkt[rdata + 4] << 8) | pkt[rdata + 5];
+
+                if (service->state == MDNS_STATE_FREE ||
+                    !name_equal(name, namelen, service->instance_name, service->instance_namelen)) {
+                    continue;
+                }
+                if (read_name(pkt, len, rdata + 6, target, &targetlen) < 0) {
+                    continue;
+                }
+                if (port != service->port || !name_equal(target, targetlen, mdns->host_name, mdns->host_namelen)) {
+                    service->suffix = service->suffix ? service->suffix + 1 : 2;
+                    if (mdns_build_service(mdns, service) == 0) {
+                        mdns_restart_probing(service, now);
+                    } else {
+                        service->state = MDNS_STATE_FREE;
+                    }
+                }
+            }
+        } else if (type == MDNS_TYPE_A && rdlen == 4 &&
+                   name_equal(name, namelen, mdns->host_name, mdns->host_namelen)) {
+            uint32_t addr;
+            int ours = 0;
+
+            memcpy(&addr, pkt + rdata, 4);
+            for (j = 0; j < mdns->naddrs; j++) {
+                ours |= (mdns->addrs[j] == addr);
+            }
+            if (ours || mdns->host_suffix >= 99) {
+                continue;
+            }
+            mdns->host_suffix = mdns->host_suffix ? mdns->host_suffix + 1 : 2;
+            mdns_build_host(mdns);
+            for (j = 0; j < MDNS_MAX_SERVICES; j++) {
+                mdns_service_t *service = &mdns->services[j];
+
+                if (service->state != MDNS_STATE_FREE) {
+                    if (mdns_build_service(mdns, service) == 0) {
+                        mdns_restart_probing(service, now);
+                    } else {
+                        service->state = MDNS_STATE_FREE;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+mdns_handle_packet(mdns_t *mdns, const uint8_t *pkt, int len, const struct sockaddr_in *from)
+{
+    uint8_t name[MDNS_NAME_SIZE];
+    int namelen;
+    int send_answer[MDNS_MAX_SERVICES];
+    int send_enumeration[MDNS_MAX_SERVICES];
+    int send_host = 0;
+    int legacy = (ntohs(from->sin_port) != MDNS_PORT);
+    uint16_t flags;
+    int qdcount, records;
+    int offset = 12;
+    uint64_t now = mdns_now_ms();
+    int i, j;
+
+    if (len < 12) {
+        return;
+    }
+    flags = (pkt[2] << 8) | pkt[3];
+    qdcount = (pkt[4] << 8) | pkt[5];
+    records = ((pkt[6] << 8) | pkt[7]) + ((pkt[8] << 8) | pkt[9]) + ((pkt[10] << 8) | pkt[11]);
+    if (flags & 0x8000) {
+        mdns_check_conflicts(mdns, pkt, len, offset, qdcount, records);
+        return;
+    }
+    if (flags & 0x7800) {
+        /* Not a standard query */
+        return;
+    }
+
+    memset(send_answer, 0, sizeof(send_answer));
+    memset(send_enumeration, 0, sizeof(send_enumeration));
+    for (i = 0; i < qdcount; i++) {
+        uint16_t type;
+
+        offset = read_name(pkt, len, offset, name, &namelen);
+        if (offset < 0 || offset + 4 > len) {
+            return;
+        }
+        type = (pkt[offset] << 8) | pkt[offset + 1];
+        offset += 4;
+
+        for (j = 0; j < MDNS_MAX_SERVICES; j++) {
+            mdns_service_t *service = &mdns->services[j];
+
+            /* Unique names are only answered once probed */
+            if (service->state != MDNS_STATE_ANNOUNCING && service->state != MDNS_STATE_READY) {
+                continue;
+            }
+            if ((type == MDNS_TYPE_PTR || type == MDNS_TYPE_ANY) &&
+                name_equal(name, namelen, service->type_name, service->type_namelen)) {
+                send_answer[j] = 1;
+            }
+            if ((type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT || type == MDNS_TYPE_ANY) &&
+                name_equal(name, namelen, service->instance_name, service->instance_namelen)) {
+                send_answer[j] = 1;
+            }
+            if ((type == MDNS_TYPE_PTR || type == MDNS_TYPE_ANY) &&
+                name_equal(name, namelen, mdns->services_name, mdns->services_namelen)) {
+                send_enumeration[j] = 1;
+            }
+            if ((type == MDNS_TYPE_A || type == MDNS_TYPE_ANY) &&
+                name_equal(name, namelen, mdns->host_name, mdns->host_namelen)) {
+                send_host = 1;
+            }
+        }
+    }
+
+    for (j = 0; j < MDNS_MAX_SERVICES; j++) {
+        mdns_service_t *service = &mdns->services[j];
+
+        if (send_answer[j]) {
+            if (legacy) {
+                mdns_send_legacy(mdns, &service->answer, pkt, offset - 12, qdcount, from);
+            } else if (now - service->answer.sent_ms >= MDNS_RATE_MS) {
+                mdns_send(mdns, &service->answer);
+            }
+            /* The answer holds the A records too */
+            send_host = 0;
+        }
+        if (send_enumeration[j]) {
+            if (legacy) {
+                mdns_send_legacy(mdns, &service->enumeration, pkt, offset - 12, qdcount, from);
+            } else if (now - service->enumeration.sent_ms >= MDNS_RATE_MS) {
+                mdns_send(mdns, &service->enumeration);
+            }
+        }
+    }
+    if (send_host) {
+        if (legacy) {
+            mdns_send_legacy(mdns, &mdns->host_answer, pkt, offset - 12, qdcount, from);
+        } else if (now - mdns->host_answer.sent_ms >= MDNS_RATE_MS) {
+            mdns_send(mdns, &mdns->host_answer);
+        }
+    }
+}
+
+/* Sends the probes and announcements that are due, returns the time to
+ * the next one */
+static int
+mdns_run_timers(mdns_t *mdns)
+{
+    uint64_t now = mdns_now_ms();
+    uint64_t wait = MDNS_IDLE_MS;
+    int i;
+
+    for (i = 0; i < MDNS_MAX_SERVICES; i++) {
+        mdns_service_t *service = &mdns->services[i];
+
+        if (service->state == MDNS_STATE_PROBING && now >= service->next_ms) {
+            if (service->count < MDNS_PROBES) {
+                mdns_send(mdns, &service->probe);
+                service->count++;
+                service->next_ms = now + MDNS_PROBE_MS;
+            } else {
+                service->state = MDNS_STATE_ANNOUNCING;
+                service->count = 0;
+            }
+        }
+        if (service->state == MDNS_STATE_ANNOUNCING && now >= service->next_ms) {
+            mdns_send(mdns, &service->answer);
+            mdns_send(mdns, &service->enumeration);
+            service->count++;
+            service->next_ms = now + MDNS_ANNOUNCE_MS;
+            if (service->count >= MDNS_ANNOUNCES) {
+                service->state = MDNS_STATE_READY;
+            }
+        }
+        if ((service->state == MDNS_STATE_PROBING || service->state == MDNS_STATE_ANNOUNCING) &&
+            service->next_ms - now < wait) {
+            wait = service->next_ms - now;
+        }
+    }
+    return (int)wait;
+}
+
+static THREAD_RETVAL
+mdns_thread(void *arg)
+{
+    mdns_t *mdns = arg;
+    uint8_t *buffer;
+
+    raop_apply_thread_policy(RAOP_THREAD_CONTROL);
+    buffer = malloc(MDNS_RECV_SIZE);
+    assert(buffer);
+    while (1) {
+        struct sockaddr_in saddr;
+        socklen_t saddrlen = sizeof(saddr);
+        struct timeval tv;
+        fd_set rfds;
+        int wait, ret;
+
+        MUTEX_LOCK(mdns->mutex);
+        if (!mdns->running) {
+            MUTEX_UNLOCK(mdns->mutex);
+            break;
+        }
+        wait = mdns_run_timers(mdns);
+        MUTEX_UNLOCK(mdns->mutex);
+
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+        FD_ZERO(&rfds);
+        FD_SET(mdns->sock, &rfds);
+        ret = select(mdns->sock + 1, &rfds, NULL, NULL, &tv);
+        if (ret <= 0) {
+            continue;
+        }
+        ret = recvfrom(mdns->sock, (char *)buffer, MDNS_RECV_SIZE, 0, (struct sockaddr *)&saddr, &saddrlen);
+        if (ret <= 0 || saddr.sin_family != AF_INET) {
+            continue;
+        }
+        MUTEX_LOCK(mdns->mutex);
+        mdns_handle_packet(mdns, buffer, ret, &saddr);
+        MUTEX_UNLOCK(mdns->mutex);
+    }
+    free(buffer);
+    raop_revert_thread_policy();
+    return 0;
+}
+
+static int
+mdns_add_address(uint32_t *addrs, int naddrs, uint32_t addr)
+{
+    int i;
+
+    if ((ntohl(addr) >> 24) == 127 || addr == 0 || naddrs >= MDNS_MAX_ADDRS) {
+        return naddrs;
+    }
+    for (i = 0; i < naddrs; i++) {
+        if (addrs[i] == addr) {
+            return naddrs;
+        }
+    }
+    addrs[naddrs] = addr;
+    return naddrs + 1;
+}
+
+static int
+mdns_find_addresses(uint32_t *addrs)
+{
+    int naddrs = 0;
+#ifdef WIN32
+    char hostname[256];
+    struct addrinfo hints, *result, *ai;
+
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+        return 0;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(hostname, NULL, &hints, &result) != 0) {
+        return 0;
+    }
+    for (ai = result; ai; ai = ai->ai_next) {
+        naddrs = mdns_add_address(addrs, naddrs, ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr);
+    }
+    freeaddrinfo(result);
+#else
+    struct ifaddrs *ifaddrs, *ifa;
+
+    if (getifaddrs(&ifaddrs) != 0) {
+        return 0;
+    }
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            (ifa->ifa_flags & IFF_UP) && !(ifa->ifa_flags & IFF_LOOPBACK)) {
+            naddrs = mdns_add_address(addrs, naddrs, ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr);
+        }
+    }
+    freeifaddrs(ifaddrs);
+#endif
+    return naddrs;
+}
+
+static int
+mdns_open_socket(mdns_t *mdns)
+{
+    struct sockaddr_in saddr;
+    struct ip_mreq mreq;
+    int reuse = 1, ttl = 255, loop = 1;
+    int joined = 0;
+    int sock, i;
+
+    sock = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == -1) {
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&reuse, sizeof(reuse));
+#endif
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    saddr.sin_port = htons(MDNS_PORT);
+    if (bind(sock, (struct sockaddr *)&saddr, sizeof(saddr)) == -1) {
+        closesocket(sock);
+        return -1;
+    }
+
+    mreq.imr_multiaddr.s_addr = htonl(MDNS_GROUP);
+    for (i = 0; i < mdns->naddrs; i++) {
+        mreq.imr_interface.s_addr = mdns->addrs[i];
+        joined += (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&mreq, sizeof(mreq)) == 0);
+    }
+    if (!joined) {
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&mreq, sizeof(mreq)) != 0) {
+            closesocket(sock);
+            return -1;
+        }
+    }
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&ttl, sizeof(ttl));
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *)&loop, sizeof(loop));
+    return sock;
+}
+
+mdns_t *
+mdns_init(const uint32_t *addrs, int naddrs)
+{
+    mdns_t *mdns;
+    int i;
+
+    mdns = calloc(1, sizeof(mdns_t));
+    if (!mdns) {
+        return NULL;
+    }
+    if (addrs && naddrs > 0) {
+        for (i = 0; i < naddrs && i < MDNS_MAX_ADDRS; i++) {
+            mdns->addrs[i] = addrs[i];
+        }
+        mdns->naddrs = i;
+    } else {
+        mdns->naddrs = mdns_find_addresses(mdns->addrs);
+    }
+    mdns->services_namelen = name_append_dotted(mdns->services_name, 0, "_services._dns-sd._udp.local");
+    strcpy(mdns->host, "AirPlay");
+    if (mdns_build_host(mdns) < 0) {
+        free(mdns);
+        return NULL;
+    }
+
+    mdns->sock = mdns_open_socket(mdns);
+    if (mdns->sock == -1) {
+        free(mdns);
+        return NULL;
+    }
+    srand((unsigned int)raop_clock_us());
+
+    MUTEX_CREATE(mdns->mutex);
+    mdns->running = 1;
+    THREAD_CREATE(mdns->thread, mdns_thread, mdns);
+    return mdns;
+}
+
+int
+mdns_set_host(mdns_t *mdns, const char *label)
+{
+    int ret = 0;
+    int i;
+
+    assert(mdns);
+    assert(label);
+
+    MUTEX_LOCK(mdns->mutex);
+    for (i = 0; i < MDNS_MAX_SERVICES; i++) {
+        if (mdns->services[i].state != MDNS_STATE_FREE) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        snprintf(mdns->host, sizeof(mdns->host), "%s", label);
+        utf8_truncate(mdns->host, 59);
+        mdns->host_suffix = 0;
+        ret = mdns_build_host(mdns);
+    }
+    MUTEX_UNLOCK(mdns->mutex);
+    return ret;
+}
+
+int
+mdns_add_service(mdns_t *mdns, const char *instance, const char *type, unsigned short port,
+                 const uint8_t *txt, int txtlen)
+{
+    mdns_service_t *service = NULL;
+    int i;
+
+    assert(mdns);
+    assert(instance);
+    assert(type);
+
+    if (txtlen < 0 || txtlen > MDNS_TXT_SIZE || strlen(type) >= sizeof(service->type)) {
+        return -1;
+    }
+    MUTEX_LOCK(mdns->mutex);
+    for (i = 0; i < MDNS_MAX_SERVICES; i++) {
+        if (mdns->services[i].state == MDNS_STATE_FREE) {
+            service = &mdns->services[i];
+            break;
+        }
+    }
+    if (!service) {
+        MUTEX_UNLOCK(mdns->mutex);
+        return -1;
+    }
+    memset(service, 0, sizeof(mdns_service_t));
+    snprintf(service->instance, sizeof(service->instance), "%s", instance);
+    utf8_truncate(service->instance, 63);
+    strcpy(service->type, type);
+    service->port = port;
+    memcpy(service->txt, txt, txtlen);
+    service->txtlen = txtlen;
+    if (mdns_build_service(mdns, service) < 0) {
+        service->state = MDNS_STATE_FREE;
+        MUTEX_UNLOCK(mdns->mutex);
+        return -1;
+    }
+    /* RFC 6762 8.1, a random 0-250ms before the first probe */
+    service->state = MDNS_STATE_PROBING;
+    service->next_ms = mdns_now_ms() + rand() % MDNS_PROBE_MS;
+    MUTEX_UNLOCK(mdns->mutex);
+    return i;
+}
+
+int
+mdns_set_txt(mdns_t *mdns, int id, const uint8_t *txt, int txtlen)
+{
+    mdns_service_t *service;
+    int ret = -1;
+
+    assert(mdns);
+
+    if (id < 0 || id >= MDNS_MAX_SERVICES || txtlen < 0 || txtlen > MDNS_TXT_SIZE) {
+        return -1;
+    }
+    MUTEX_LOCK(mdns->mutex);
+    service = &mdns->services[id];
+    if (service->state != MDNS_STATE_FREE) {
+        memcpy(service->txt, txt, txtlen);
+        service->txtlen = txtlen;
+        ret = mdns_build_service(mdns, service);
+        if (ret < 0) {
+            service->state = MDNS_STATE_FREE;
+        } else if (service->state != MDNS_STATE_PROBING) {
+            /* The name is already ours, just tell the caches */
+            service->state = MDNS_STATE_ANNOUNCING;
+            service->count = 0;
+            service->next_ms = mdns_now_ms();
+        }
+    }
+    MUTEX_UNLOCK(mdns->mutex);
+    return ret;
+}
+
+static void
+mdns_goodbye(mdns_t *mdns, mdns_service_t *service)
+{
+    mdns_packet_t goodbye;
+
+    if (service->state == MDNS_STATE_ANNOUNCING || service->state == MDNS_STATE_READY) {
+        put_header(&goodbye, MDNS_FLAGS_RESPONSE, 0, 3, 0);
+        put_service_records(mdns, service, &goodbye, MDNS_CLASS_FLUSH, 1);
+        if (goodbye.len > 0) {
+            mdns_send(mdns, &goodbye);
+        }
+    }
+    service->state = MDNS_STATE_FREE;
+}
+
+void
+mdns_remove_service(mdns_t *mdns, int id)
+{
+    assert(mdns);
+
+    if (id < 0 || id >= MDNS_MAX_SERVICES) {
+        return;
+    }
+    MUTEX_LOCK(mdns->mutex);
+    mdns_goodbye(mdns, &mdns->services[id]);
+    MUTEX_UNLOCK(mdns->mutex);
+}
+
+void
+mdns_destroy(mdns_t *mdns)
+{
+    int i;
+
+    if (!mdns) {
+        return;
+    }
+    MUTEX_LOCK(mdns->mutex);
+    mdns->running = 0;
+    MUTEX_UNLOCK(mdns->mutex);
+    THREAD_JOIN(mdns->thread);
+
+    for (i = 0; i < MDNS_MAX_SERVICES; i++) {
+        mdns_goodbye(mdns, &mdns->services[i]);
+    }
+    closesocket(mdns->sock);
+    MUTEX_DESTROY(mdns->mutex);
+    free(mdns);
+}
+
+static int
+txt_key_equal(const uint8_t *entry, int entrylen, const char *key, int keylen)
+{
+    int i;
+
+    if (entrylen < keylen || (entrylen > keylen && entry[keylen] != '=')) {
+        return 0;
+    }
+    for (i = 0; i < keylen; i++) {
+        uint8_t a = entry[i], b = (uint8_t)key[i];
+
+        if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+        if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+        if (a != b) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+mdns_txt_set(uint8_t *txt, int *txtlen, int txtsize, const char *key, const char *value)
+{
+    int keylen = (int)strlen(key);
+    int valuelen = (int)strlen(value);
+    int pos = 0;
+
+    if (keylen == 0 || keylen + 1 + valuelen > 255) {
+        return -1;
+    }
+    while (pos < *txtlen) {
+        int entrylen = txt[pos];
+
+        if (pos + 1 + entrylen > *txtlen) {
+            return -1;
+        }
+        if (txt_key_equal(txt + pos + 1, entrylen, key, keylen)) {
+            memmove(txt + pos, txt + pos + 1 + entrylen, *txtlen - pos - 1 - entrylen);
+            *txtlen -= 1 + entrylen;
+            continue;
+        }
+        pos += 1 + entrylen;
+    }
+    if (*txtlen + 1 + keylen + 1 + valuelen > txtsize) {
+        return -1;
+    }
+    txt[*txtlen] = (uint8_t)(keylen + 1 + valuelen);
+    memcpy(txt + *txtlen + 1, key, keylen);
+    txt[*txtlen + 1 + keylen] = '=';
+    memcpy(txt + *txtlen + 2 + keylen, value, valuelen);
+    *txtlen += 1 + keylen + 1 + valuelen;
+    return 0;
+}
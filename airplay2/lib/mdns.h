@@ -0,0 +1,53 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef MDNS_H
+#define MDNS_H
+
+#include <stdint.h>
+
+/* Minimal multicast DNS responder (RFC 6762 / 6763) on one IPv4 socket.
+ *
+ * Every service owns a PTR, SRV and TXT record plus the A records of the
+ * host. The responses are serialized whenever a service or its TXT changes
+ * and sent as they are, so answering a query is a lookup and a sendto.
+ * Services are probed three times 250ms apart, then announced twice. A
+ * name taken by another responder gets a " (2)" style suffix.
+ *
+ * Not implemented: IPv6, known-answer suppression and the simultaneous
+ * probe tie-break. */
+
+#define MDNS_TXT_SIZE 512
+
+typedef struct mdns_s mdns_t;
+
+/* addrs are the IPv4 addresses in network order announced for the host and
+ * used as multicast interfaces. With naddrs 0 the non-loopback interfaces
+ * are looked up. */
+mdns_t *mdns_init(const uint32_t *addrs, int naddrs);
+/* Host label, .local is appended. Only before the first service. */
+int mdns_set_host(mdns_t *mdns, const char *label);
+
+/* type is like "_raop._tcp". Returns the service id or -1. */
+int mdns_add_service(mdns_t *mdns, const char *instance, const char *type, unsigned short port,
+                     const uint8_t *txt, int txtlen);
+/* Swaps the TXT record and re-announces it, no new probing */
+int mdns_set_txt(mdns_t *mdns, int service, const uint8_t *txt, int txtlen);
+/* Sends the goodbye records */
+void mdns_remove_service(mdns_t *mdns, int service);
+
+void mdns_destroy(mdns_t *mdns);
+
+/* Adds or replaces key=value in a TXT record, returns -1 if it does not fit */
+int mdns_txt_set(uint8_t *txt, int *txtlen, int txtsize, const char *key, const char *value);
+
+#endif
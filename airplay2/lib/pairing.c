@@ -21,13 +21,29 @@
 #include "ed25519/ed25519.h"
 #include "ed25519/sha512.h"
 #include "aes_ctr.h"
+#include "threads.h"
+#include "raop.h"
 
 #define SALT_KEY "Pair-Verify-AES-Key"
 #define SALT_IV "Pair-Verify-AES-IV"
 
+/* Ephemeral ECDH keys generated ahead of pair-verify. Define
+ * PAIRING_NO_KEYGEN to leave the pool empty and make every key inline. */
+#define PAIRING_EPHEMERAL_KEYS 4
+
 struct pairing_s {
 	unsigned char ed_private[64];
 	unsigned char ed_public[32];
+
+	/* Filled by pairing_keygen_thread so the httpd thread only has to
+	 * compute the shared secret during a handshake */
+	thread_handle_t keygen_thread;
+	mutex_handle_t keygen_mutex;
+	cond_handle_t keygen_cond;
+	int keygen_running;
+	int ephemeral_count;
+	unsigned char ephemeral_private[PAIRING_EPHEMERAL_KEYS][32];
+	unsigned char ephemeral_public[PAIRING_EPHEMERAL_KEYS][32];
 };
 
 typedef enum {
@@ -39,6 +55,7 @@ typedef enum {
 
 struct pairing_session_s {
 	status_t status;
+	pairing_t *pairing;
 
 	unsigned char ed_private[64];
 	unsigned char ed_ours[32];
@@ -78,6 +95,72 @@ pairing_init_generate()
 	return pairing_init_seed(seed);
 }
 
+static int
+pairing_create_ephemeral(unsigned char ecdh_priv[32], unsigned char ecdh_pub[32])
+{
+	if (ed25519_create_seed(ecdh_priv)) {
+		return -1;
+	}
+	curve25519_donna(ecdh_pub, ecdh_priv, kCurve25519BasePoint);
+	return 0;
+}
+
+#ifndef PAIRING_NO_KEYGEN
+static THREAD_RETVAL
+pairing_keygen_thread(void *arg)
+{
+	pairing_t *pairing = arg;
+	unsigned char ecdh_priv[32];
+	unsigned char ecdh_pub[32];
+
+	raop_apply_thread_policy(RAOP_THREAD_CONTROL);
+	MUTEX_LOCK(pairing->keygen_mutex);
+	while (pairing->keygen_running) {
+		if (pairing->ephemeral_count == PAIRING_EPHEMERAL_KEYS) {
+			COND_WAIT(pairing->keygen_cond, pairing->keygen_mutex);
+			continue;
+		}
+		MUTEX_UNLOCK(pairing->keygen_mutex);
+		if (pairing_create_ephemeral(ecdh_priv, ecdh_pub) < 0) {
+			MUTEX_LOCK(pairing->keygen_mutex);
+			break;
+		}
+		MUTEX_LOCK(pairing->keygen_mutex);
+		memcpy(pairing->ephemeral_private[pairing->ephemeral_count], ecdh_priv, 32);
+		memcpy(pairing->ephemeral_public[pairing->ephemeral_count], ecdh_pub, 32);
+		pairing->ephemeral_count++;
+	}
+	MUTEX_UNLOCK(pairing->keygen_mutex);
+	memset(ecdh_priv, 0, sizeof(ecdh_priv));
+	raop_revert_thread_policy();
+	return 0;
+}
+#endif
+
+/* Takes a pregenerated key, or makes one in place when the pool is empty */
+static int
+pairing_take_ephemeral(pairing_t *pairing, unsigned char ecdh_priv[32], unsigned char ecdh_pub[32])
+{
+	int taken = 0;
+
+	if (pairing) {
+		MUTEX_LOCK(pairing->keygen_mutex);
+		if (pairing->ephemeral_count > 0) {
+			pairing->ephemeral_count--;
+			memcpy(ecdh_priv, pairing->ephemeral_private[pairing->ephemeral_count], 32);
+			memcpy(ecdh_pub, pairing->ephemeral_public[pairing->ephemeral_count], 32);
+			memset(pairing->ephemeral_private[pairing->ephemeral_count], 0, 32);
+			taken = 1;
+		}
+		MUTEX_UNLOCK(pairing->keygen_mutex);
+		COND_SIGNAL(pairing->keygen_cond);
+	}
+	if (taken) {
+		return 0;
+	}
+	return pairing_create_ephemeral(ecdh_priv, ecdh_pub);
+}
+
 pairing_t *
 pairing_init_seed(const unsigned char seed[32])
 {
@@ -89,6 +172,13 @@ pairing_init_seed(const unsigned char seed[32])
 	}
 
 	ed25519_create_keypair(pairing->ed_public, pairing->ed_private, seed);
+
+	MUTEX_CREATE(pairing->keygen_mutex);
+	COND_CREATE(pairing->keygen_cond);
+	pairing->keygen_running = 1;
+#ifndef PAIRING_NO_KEYGEN
+	THREAD_CREATE(pairing->keygen_thread, pairing_keygen_thread, pairing);
+#endif
 	return pairing;
 }
 
@@ -121,6 +211,7 @@ pairing_session_init(pairing_t *pairing)
 	if (!session) {
 		return NULL;
 	}
+	session->pairing = pairing;
 	memcpy(session->ed_private, pairing->ed_private, 64);
 	memcpy(session->ed_ours, pairing->ed_public, 32);
 	session->status = STATUS_INITIAL;
@@ -155,14 +246,14 @@ pairing_session_handshake(pairing_session_t *session, const unsigned char ecdh_k
 	if (session->status == STATUS_FINISHED) {
 		return -1;
 	}
-	if (ed25519_create_seed(ecdh_priv)) {
+	if (pairing_take_ephemeral(session->pairing, ecdh_priv, session->ecdh_ours)) {
 		return -2;
 	}
 
 	memcpy(session->ecdh_theirs, ecdh_key, 32);
 	memcpy(session->ed_theirs, ed_key, 32);
-	curve25519_donna(session->ecdh_ours, ecdh_priv, kCurve25519BasePoint);
 	curve25519_donna(session->ecdh_secret, ecdh_priv, session->ecdh_theirs);
+	memset(ecdh_priv, 0, sizeof(ecdh_priv));
 
 	session->status = STATUS_HANDSHAKE;
 	return 0;
@@ -252,5 +343,17 @@ pairing_session_destroy(pairing_session_t *session)
 void
 pairing_destroy(pairing_t *pairing)
 {
+	if (pairing) {
+		MUTEX_LOCK(pairing->keygen_mutex);
+		pairing->keygen_running = 0;
+		MUTEX_UNLOCK(pairing->keygen_mutex);
+		COND_SIGNAL(pairing->keygen_cond);
+		if (pairing->keygen_thread) {
+			THREAD_JOIN(pairing->keygen_thread);
+		}
+		COND_DESTROY(pairing->keygen_cond);
+		MUTEX_DESTROY(pairing->keygen_mutex);
+		memset(pairing, 0, sizeof(pairing_t));
+	}
 	free(pairing);
 }
@@ -14,8 +14,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include "raop.h"
 #include "raop_rtp.h"
@@ -29,6 +31,8 @@
 #include "logger.h"
 #include "compat.h"
 #include "raop_rtp_mirror.h"
+#include "bplist_template.h"
+#include "chacha20_poly1305.h"
 // #include <android/log.h>
 
 struct raop_s {
@@ -43,6 +47,21 @@ struct raop_s {
 	httpd_t *httpd;
 
     unsigned short port;
+
+	/* Prebuilt replies, see raop_handlers.h */
+	bplist_template_t *info;
+	bplist_template_t *setup_mirror;
+	int setup_mirror_data_port;
+	int setup_mirror_event_port;
+	int setup_mirror_timing_port;
+	bplist_template_t *setup_audio;
+	int setup_audio_data_port;
+	int setup_audio_control_port;
+	int setup_audio_timing_port;
+	bplist_template_t *setup_buffered;
+	int setup_buffered_data_port;
+
+	int video_format;
 };
 
 struct raop_conn_s {
@@ -58,9 +77,58 @@ struct raop_conn_s {
 	unsigned char *remote;
 	int remotelen;
 
+	/* Set by a handler whose response_data must not be freed */
+	int response_borrowed;
+
+	/* Phase stamps of this connection, see conn_phase */
+	uint64_t phase_us[RAOP_PHASE_RECORD + 1];
+	char remote_name[128];
+	char remote_device_id[128];
+	int identified;
 };
 typedef struct raop_conn_s raop_conn_t;
 
+/* Stamps a phase the first time it completes. The sender only names itself
+ * in SETUP 1, earlier stamps are kept until conn_identify reports them. */
+static void
+conn_phase(raop_conn_t *conn, int phase)
+{
+	raop_callbacks_t *callbacks = &conn->raop->callbacks;
+
+	assert(phase >= 0 && phase <= RAOP_PHASE_RECORD);
+	if (conn->phase_us[phase]) {
+		return;
+	}
+	conn->phase_us[phase] = raop_clock_us();
+	if (conn->identified && callbacks->connection_phase) {
+		callbacks->connection_phase(callbacks->cls, phase, conn->phase_us[phase],
+		                            conn->remote_name, conn->remote_device_id);
+	}
+}
+
+static void
+conn_identify(raop_conn_t *conn, const char *remote_name, const char *remote_device_id)
+{
+	raop_callbacks_t *callbacks = &conn->raop->callbacks;
+	int phase;
+
+	if (conn->identified) {
+		return;
+	}
+	strncpy(conn->remote_name, remote_name, sizeof(conn->remote_name) - 1);
+	strncpy(conn->remote_device_id, remote_device_id, sizeof(conn->remote_device_id) - 1);
+	conn->identified = 1;
+	if (!callbacks->connection_phase) {
+		return;
+	}
+	for (phase = 0; phase <= RAOP_PHASE_RECORD; phase++) {
+		if (conn->phase_us[phase]) {
+			callbacks->connection_phase(callbacks->cls, phase, conn->phase_us[phase],
+			                            conn->remote_name, conn->remote_device_id);
+		}
+	}
+}
+
 #include "raop_handlers.h"
 
 static void *
@@ -172,6 +240,10 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
 		handler = &raop_handler_feedback;
 	} else if (!strcmp(method, "RECORD")) {
         handler = &raop_handler_record;
+	} else if (!strcmp(method, "SETRATEANCHORTIME")) {
+		handler = &raop_handler_setrateanchortime;
+	} else if (!strcmp(method, "FLUSHBUFFERED")) {
+		handler = &raop_handler_flushbuffered;
 	} else if (!strcmp(method, "FLUSH")) {
 		const char *rtpinfo;
 		int next_seq = -1;
@@ -202,11 +274,12 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response)
   //          conn->raop_rtp_mirror = NULL;
   //      }
 	}
+	conn->response_borrowed = 0;
 	if (handler != NULL) {
 		handler(conn, request, *response, &response_data, &response_datalen);
 	}
 	http_response_finish(*response, response_data, response_datalen);
-	if (response_data) {
+	if (response_data && !conn->response_borrowed) {
 		free(response_data);
 		response_data = NULL;
 		response_datalen = 0;
@@ -233,6 +306,24 @@ conn_destroy(void *ptr)
 	free(conn);
 }
 
+uint64_t
+raop_clock_us(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+	       (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 raop_t *
 raop_init(int max_clients, raop_callbacks_t *callbacks)
 {
@@ -240,6 +331,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks)
 	pairing_t *pairing;
 	httpd_t *httpd;
 	httpd_callbacks_t httpd_cbs;
+	raop_info_t info;
 
 	assert(callbacks);
 	assert(max_clients > 0);
@@ -287,6 +379,13 @@ raop_init(int max_clients, raop_callbacks_t *callbacks)
 	memcpy(&raop->callbacks, callbacks, sizeof(raop_callbacks_t));
 	raop->pairing = pairing;
 	raop->httpd = httpd;
+
+	raop_info_init(&info);
+	raop->info = raop_build_info_template(&info);
+	if (!raop->info || raop_build_setup_templates(raop) < 0) {
+		raop_destroy(raop);
+		return NULL;
+	}
 	return raop;
 }
 
@@ -298,6 +397,10 @@ raop_destroy(raop_t *raop)
 
 		pairing_destroy(raop->pairing);
 		httpd_destroy(raop->httpd);
+		bplist_template_destroy(raop->info);
+		bplist_template_destroy(raop->setup_mirror);
+		bplist_template_destroy(raop->setup_audio);
+		bplist_template_destroy(raop->setup_buffered);
 		logger_destroy(raop->logger);
 		free(raop);
 
@@ -322,6 +425,83 @@ raop_set_log_level(raop_t *raop, int level)
 	logger_set_level(raop->logger, level);
 }
 
+int
+raop_set_pairing_seed(raop_t *raop, const unsigned char seed[32])
+{
+	pairing_t *pairing;
+
+	assert(raop);
+	assert(seed);
+
+	if (httpd_is_running(raop->httpd)) {
+		return -1;
+	}
+	pairing = pairing_init_seed(seed);
+	if (!pairing) {
+		return -1;
+	}
+	pairing_destroy(raop->pairing);
+	raop->pairing = pairing;
+	return 0;
+}
+
+void
+raop_get_public_key(raop_t *raop, unsigned char public_key[32])
+{
+	assert(raop);
+
+	pairing_get_public_key(raop->pairing, public_key);
+}
+
+void
+raop_info_init(raop_info_t *info)
+{
+	/* The values the receiver has always advertised */
+	static const unsigned char pk[32] = {
+		0xb0, 0x77, 0x27, 0xd6, 0xf6, 0xcd, 0x6e, 0x08, 0xb5, 0x8e, 0xde, 0x52, 0x5e, 0xc3, 0xcd, 0xea,
+		0xa2, 0x52, 0xad, 0x9f, 0x68, 0x3f, 0xeb, 0x21, 0x2e, 0xf8, 0xa2, 0x05, 0x24, 0x65, 0x54, 0xe7
+	};
+
+	assert(info);
+
+	memset(info, 0, sizeof(raop_info_t));
+	strncpy(info->name, "AppleTV", sizeof(info->name) - 1);
+	strncpy(info->deviceid, "aa:54:01:af:c3:c1", sizeof(info->deviceid) - 1);
+	strncpy(info->model, "AppleTV2,1", sizeof(info->model) - 1);
+	strncpy(info->source_version, "220.68", sizeof(info->source_version) - 1);
+	strncpy(info->pi, "2e388006-13ba-4041-9a67-25dd4a43d536", sizeof(info->pi) - 1);
+	strncpy(info->display_uuid, "e0ff8a27-6738-3d56-8a16-cc53aacee925", sizeof(info->display_uuid) - 1);
+	memcpy(info->pk, pk, sizeof(pk));
+	info->features = 0x1e5a7ffff7ULL;
+	info->status_flags = 4;
+	info->display_width = 1920;
+	info->display_height = 1080;
+	info->display_refresh_rate = 60;
+	info->display_max_fps = 30;
+	info->display_overscanned = 0;
+	info->display_features = 14;
+}
+
+int
+raop_set_info(raop_t *raop, const raop_info_t *info)
+{
+	bplist_template_t *tpl;
+
+	assert(raop);
+	assert(info);
+
+	if (httpd_is_running(raop->httpd)) {
+		return -1;
+	}
+	tpl = raop_build_info_template(info);
+	if (!tpl) {
+		return -1;
+	}
+	bplist_template_destroy(raop->info);
+	raop->info = tpl;
+	return 0;
+}
+
 void
 raop_set_port(raop_t *raop, unsigned short port)
 {
@@ -329,6 +509,13 @@ raop_set_port(raop_t *raop, unsigned short port)
     raop->port = port;
 }
 
+void
+raop_set_video_format(raop_t *raop, int format)
+{
+    assert(raop);
+    raop->video_format = format;
+}
+
 unsigned short
 raop_get_port(raop_t *raop)
 {
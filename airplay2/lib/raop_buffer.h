@@ -26,10 +26,18 @@ raop_buffer_t *raop_buffer_init(logger_t *logger,
                                 const unsigned char *aeskey,
                                 const unsigned char *aesiv,
 								const unsigned char *ecdh_secret);
+/* Switches to the codec of the SETUP stream, AUDIO_CODEC_AAC_ELD until then.
+ * Drops everything queued, only call it while nothing is queued or dequeued. */
+int raop_buffer_set_codec(raop_buffer_t *raop_buffer, int codec, int frame_samples, int sample_rate);
 
 int raop_buffer_queue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, raop_callbacks_t *callbacks);
 const void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, int *length, unsigned int* pts, int no_resend, 
-    uint32_t* sample_rate, uint16_t* channels, uint16_t* bits_per_sample);
+    uint32_t* sample_rate, uint16_t* channels, uint16_t* bits_per_sample,
+    const unsigned char **encoded, int *encodedlen);
+/* Decodes one packet that is already decrypted, for streams that are
+ * reordered elsewhere. The PCM is valid until the next call. */
+const void *raop_buffer_decode(raop_buffer_t *raop_buffer, unsigned char *data, int len, int *length,
+    uint32_t *sample_rate, uint16_t *channels, uint16_t *bits_per_sample);
 void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 void raop_buffer_destroy(raop_buffer_t *raop_buffer);
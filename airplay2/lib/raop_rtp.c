@@ -27,6 +27,9 @@
 #include "byteutils.h"
 #include "mirror_buffer.h"
 #include "stream.h"
+#include "trace.h"
+#include "buffered_audio.h"
+#include "chacha20_poly1305.h"
 
 #ifdef WIN32
 #include <WinSock2.h>
@@ -37,6 +40,13 @@
 
 #define NO_FLUSH (-42)
 
+/* Framed packets of a buffered audio stream, the 2 byte length counts itself.
+ * After the RTP header the payload is sealed with the stream key, the RTP
+ * timestamp and SSRC as aad, followed by the tag and the last 8 nonce bytes */
+#define RAOP_BUFFERED_FRAME_LEN 65536
+#define RAOP_BUFFERED_HEADER_LEN 12
+#define RAOP_BUFFERED_TRAILER_LEN (CHACHA20_POLY1305_TAG_LEN + 8)
+
 struct h264codec_s {
     unsigned char compatibility;
     short lengthofPPS;
@@ -63,8 +73,8 @@ struct raop_rtp_s {
     /* Remote address as sockaddr */
     struct sockaddr_storage remote_saddr;
     socklen_t remote_saddr_len;
-    const char remoteName[128];
-    const char remoteDeviceId[128];
+    char remoteName[128];
+    char remoteDeviceId[128];
 
     /* MUTEX LOCKED VARIABLES START */
     /* These variables only edited mutex locked */
@@ -85,6 +95,11 @@ struct raop_rtp_s {
     int progress_changed;
 
     int flush;
+    int audio_codec;
+    int audio_frame_samples;
+    int audio_sample_rate;
+    /* Stream type 103, only the buffered thread runs */
+    int buffered;
     thread_handle_t thread;
     thread_handle_t thread_time;
     mutex_handle_t run_mutex;
@@ -108,6 +123,15 @@ struct raop_rtp_s {
     struct sockaddr_storage control_saddr;
     socklen_t control_saddr_len;
     unsigned short control_seqnum;
+
+    /* Last sync packet: RTP timestamp playing at sync_ntp (us, sender clock) */
+    int sync_valid;
+    unsigned int sync_rtp;
+    uint64_t sync_ntp;
+
+    /* Buffered audio, set up while the session is stopped */
+    buffered_audio_t *buffered_audio;
+    unsigned char shk[CHACHA20_POLY1305_KEY_LEN];
 };
 
 static int
@@ -167,15 +191,19 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const unsigned char
     memset(raop_rtp->remoteName, 0, 128);
 	memset(raop_rtp->remoteDeviceId, 0, 128);
     if (remoteName != NULL) {
-        strncpy(raop_rtp->remoteName, remoteName, min(128, strlen(remoteName)));
+        strncpy(raop_rtp->remoteName, remoteName, sizeof(raop_rtp->remoteName) - 1);
     }
 	if (remoteDeviceId != NULL) {
-		strncpy(raop_rtp->remoteDeviceId, remoteDeviceId, min(128, strlen(remoteDeviceId)));
+		strncpy(raop_rtp->remoteDeviceId, remoteDeviceId, sizeof(raop_rtp->remoteDeviceId) - 1);
 	}
 
     raop_rtp->running = 0;
     raop_rtp->joined = 1;
     raop_rtp->flush = NO_FLUSH;
+    raop_rtp->audio_codec = AUDIO_CODEC_AAC_ELD;
+    raop_rtp->audio_frame_samples = AAC_ELD_FRAME_SAMPLES;
+    raop_rtp->audio_sample_rate = 44100;
+    raop_rtp->csock = raop_rtp->tsock = raop_rtp->dsock = -1;
 
     MUTEX_CREATE(raop_rtp->run_mutex);
     MUTEX_CREATE(raop_rtp->time_mutex);
@@ -383,6 +411,7 @@ raop_rtp_thread_time(void *arg)
 {
     raop_rtp_t *raop_rtp = arg;
     assert(raop_rtp);
+    raop_apply_thread_policy(RAOP_THREAD_TIMING);
     struct sockaddr_storage saddr;
     socklen_t saddrlen;
     unsigned char packet[128];
@@ -437,6 +466,7 @@ raop_rtp_thread_time(void *arg)
     }
 
     logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting UDP raop_rtp_thread_time thread");
+    raop_revert_thread_policy();
     return 0;
 }
 
@@ -445,6 +475,10 @@ raop_rtp_thread_udp(void *arg)
 {
     raop_rtp_t *raop_rtp = arg;
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp");
+    TRACE_THREAD_NAME("audio");
+    if (raop_apply_thread_policy(RAOP_THREAD_AUDIO) > 0) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "Audio thread runs with a lower priority than configured");
+    }
     unsigned char packet[RAOP_PACKET_LEN];
     unsigned int packetlen;
     struct sockaddr_storage saddr;
@@ -500,8 +534,12 @@ raop_rtp_thread_udp(void *arg)
                 assert(ret >= 0);
 
             } else if (type_c == 0x54) {
-                // TODO: ʱ
-
+                // ͬ: 4-7 ǰӦŵrtpʱ, 8-15 ӦķͶNTPʱ
+                if (packetlen >= 20) {
+                    raop_rtp->sync_rtp = (unsigned int)byteutils_read_int(packet, 4);
+                    raop_rtp->sync_ntp = byteutils_read_timeStamp(packet, 8);
+                    raop_rtp->sync_valid = 1;
+                }
             } else {
                 logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp unknown packet");
             }
@@ -526,19 +564,33 @@ raop_rtp_thread_udp(void *arg)
                 uint32_t sample_rate = 0;
                 uint16_t channels = 0;
                 uint16_t bits_per_sample = 0;
+                const unsigned char *encoded = NULL;
+                int encodedlen = 0;
 
+                TRACE_SPAN_BEGIN(queue);
                 buf_ret = raop_buffer_queue(raop_rtp->buffer, packet, packetlen, &raop_rtp->callbacks);
+                TRACE_SPAN_END_ARG(queue, "raop_buffer_queue", packetlen);
                 assert(buf_ret >= 0);
                 /* Decode all frames in queue */
-                while ((audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, &pts, no_resend, &sample_rate, &channels, &bits_per_sample))) {
+                while ((audiobuf = raop_buffer_dequeue(raop_rtp->buffer, &audiobuflen, &pts, no_resend, &sample_rate, &channels, &bits_per_sample, &encoded, &encodedlen))) {
                     pcm_data_struct pcm_data;
                     pcm_data.data_len = audiobuflen;
-                    pcm_data.data = audiobuf;
+                    pcm_data.data = (unsigned short *)audiobuf;
                     pcm_data.pts = pts;
                     pcm_data.sample_rate = sample_rate;
                     pcm_data.channels = channels;
                     pcm_data.bits_per_sample = bits_per_sample;
+                    pcm_data.ntp_pts = 0;
+                    pcm_data.encoded = encoded;
+                    pcm_data.encoded_len = encodedlen;
+                    pcm_data.codec = raop_rtp->audio_codec;
+                    if (raop_rtp->sync_valid && sample_rate > 0) {
+                        int64_t delta = (int32_t)(pts - raop_rtp->sync_rtp);
+                        pcm_data.ntp_pts = raop_rtp->sync_ntp + delta * 1000000 / (int64_t)sample_rate;
+                    }
+                    TRACE_SPAN_BEGIN(audio_process);
                     raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, &pcm_data, raop_rtp->remoteName, raop_rtp->remoteDeviceId);
+                    TRACE_SPAN_END(audio_process, "audio_process");
                 }
                 /* Handle possible resend requests */
                 if (!no_resend) {
@@ -549,6 +601,183 @@ raop_rtp_thread_udp(void *arg)
         }
     }
     logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting UDP raop_rtp_thread_udp thread");
+    raop_revert_thread_policy();
+    return 0;
+}
+
+/* Decodes the buffered packets that are due, see buffered_audio_next */
+static void
+raop_rtp_decode_buffered(raop_rtp_t *raop_rtp)
+{
+    buffered_audio_packet_t packet;
+
+    while (buffered_audio_next(raop_rtp->buffered_audio, raop_clock_us(), &packet)) {
+        pcm_data_struct pcm_data;
+        uint32_t sample_rate = 0;
+        uint16_t channels = 0;
+        uint16_t bits_per_sample = 0;
+        int audiobuflen = 0;
+
+        pcm_data.data = (unsigned short *)raop_buffer_decode(raop_rtp->buffer, (unsigned char *)packet.data, packet.len,
+                                                             &audiobuflen, &sample_rate, &channels, &bits_per_sample);
+        pcm_data.data_len = audiobuflen;
+        pcm_data.pts = packet.rtp;
+        pcm_data.sample_rate = sample_rate;
+        pcm_data.channels = channels;
+        pcm_data.bits_per_sample = bits_per_sample;
+        pcm_data.ntp_pts = packet.ntp_pts;
+        pcm_data.encoded = packet.data;
+        pcm_data.encoded_len = packet.len;
+        pcm_data.codec = raop_rtp->audio_codec;
+        TRACE_SPAN_BEGIN(audio_process);
+        raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, &pcm_data, raop_rtp->remoteName, raop_rtp->remoteDeviceId);
+        TRACE_SPAN_END(audio_process, "audio_process");
+        buffered_audio_pop(raop_rtp->buffered_audio);
+    }
+}
+
+/* Opens one sealed packet in place, returns the payload length or -1 */
+static int
+raop_rtp_open_buffered(raop_rtp_t *raop_rtp, unsigned char *packet, int packetlen)
+{
+    unsigned char nonce[CHACHA20_POLY1305_NONCE_LEN];
+    int payloadlen = packetlen - RAOP_BUFFERED_HEADER_LEN - RAOP_BUFFERED_TRAILER_LEN;
+
+    if (payloadlen < 0) {
+        return -1;
+    }
+    memset(nonce, 0, 4);
+    memcpy(nonce + 4, packet + packetlen - 8, 8);
+    if (chacha20_poly1305_decrypt(raop_rtp->shk, nonce, packet + 4, 8,
+                                  packet + RAOP_BUFFERED_HEADER_LEN, payloadlen,
+                                  packet + RAOP_BUFFERED_HEADER_LEN + payloadlen,
+                                  packet + RAOP_BUFFERED_HEADER_LEN) < 0) {
+        return -1;
+    }
+    return payloadlen;
+}
+
+static THREAD_RETVAL
+raop_rtp_thread_buffered(void *arg)
+{
+    raop_rtp_t *raop_rtp = arg;
+    unsigned char *frame;
+    int stream_fd = -1;
+    int readlen = 0;
+    int framelen = 0;
+    /* A packet that is read but did not fit in the ring yet */
+    int pending = 0;
+    unsigned int seqnum = 0, rtp = 0;
+    int payloadlen = 0;
+
+    assert(raop_rtp);
+    TRACE_THREAD_NAME("audio");
+    if (raop_apply_thread_policy(RAOP_THREAD_AUDIO) > 0) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "Audio thread runs with a lower priority than configured");
+    }
+    frame = malloc(RAOP_BUFFERED_FRAME_LEN);
+    assert(frame);
+
+    while (1) {
+        fd_set rfds;
+        struct timeval tv;
+        int nfds, ret;
+
+        /* Check if we are still running and process callbacks */
+        if (raop_rtp_process_events(raop_rtp, NULL)) {
+            break;
+        }
+        raop_rtp_decode_buffered(raop_rtp);
+
+        /* Nothing is read while the ring is full, so TCP holds the sender back */
+        if (pending) {
+            ret = buffered_audio_put(raop_rtp->buffered_audio, seqnum, rtp,
+                                     frame + 2 + RAOP_BUFFERED_HEADER_LEN, payloadlen);
+            if (ret == 0) {
+                sleepms(5);
+                continue;
+            }
+            pending = 0;
+        }
+
+        /* Set timeout value to 5ms */
+        tv.tv_sec = 0;
+        tv.tv_usec = 5000;
+
+        FD_ZERO(&rfds);
+        if (stream_fd == -1) {
+            FD_SET(raop_rtp->dsock, &rfds);
+            nfds = raop_rtp->dsock+1;
+        } else {
+            FD_SET(stream_fd, &rfds);
+            nfds = stream_fd+1;
+        }
+        ret = select(nfds, &rfds, NULL, NULL, &tv);
+        if (ret == 0) {
+            /* Timeout happened */
+            continue;
+        } else if (ret == -1) {
+            logger_log(raop_rtp->logger, LOGGER_ERR, "Error in buffered audio select");
+            break;
+        }
+
+        if (stream_fd == -1) {
+            struct sockaddr_storage saddr;
+            socklen_t saddrlen = sizeof(saddr);
+
+            stream_fd = accept(raop_rtp->dsock, (struct sockaddr *)&saddr, &saddrlen);
+            if (stream_fd == -1) {
+                logger_log(raop_rtp->logger, LOGGER_ERR, "Error in buffered audio accept %d", SOCKET_GET_ERROR());
+                break;
+            }
+            logger_log(raop_rtp->logger, LOGGER_INFO, "Buffered audio connected");
+            readlen = framelen = 0;
+            continue;
+        }
+
+        /* The length first, then the rest of the frame */
+        ret = recv(stream_fd, (char *)frame + readlen, (framelen ? framelen : 2) - readlen, 0);
+        if (ret <= 0) {
+            logger_log(raop_rtp->logger, LOGGER_INFO, "Buffered audio disconnected");
+            closesocket(stream_fd);
+            stream_fd = -1;
+            continue;
+        }
+        readlen += ret;
+        if (!framelen) {
+            if (readlen < 2) {
+                continue;
+            }
+            framelen = (frame[0] << 8) | frame[1];
+            if (framelen < 2 + RAOP_BUFFERED_HEADER_LEN + RAOP_BUFFERED_TRAILER_LEN) {
+                logger_log(raop_rtp->logger, LOGGER_ERR, "Invalid buffered audio frame length %d", framelen);
+                closesocket(stream_fd);
+                stream_fd = -1;
+                readlen = framelen = 0;
+                continue;
+            }
+        }
+        if (readlen < framelen) {
+            continue;
+        }
+
+        seqnum = (frame[3] << 16) | (frame[4] << 8) | frame[5];
+        rtp = (unsigned int)byteutils_read_int(frame + 2, 4);
+        payloadlen = raop_rtp_open_buffered(raop_rtp, frame + 2, framelen - 2);
+        if (payloadlen < 0) {
+            logger_log(raop_rtp->logger, LOGGER_WARNING, "Buffered audio packet %u does not authenticate", seqnum);
+        } else {
+            pending = 1;
+        }
+        readlen = framelen = 0;
+    }
+
+    if (stream_fd != -1) {
+        closesocket(stream_fd);
+    }
+    free(frame);
+    logger_log(raop_rtp->logger, LOGGER_INFO, "Exiting TCP raop_rtp_thread_buffered thread");
+    raop_revert_thread_policy();
     return 0;
 }
 
@@ -592,6 +821,84 @@ raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_r
     MUTEX_UNLOCK(raop_rtp->run_mutex);
 }
 
+int
+raop_rtp_set_audio_format(raop_rtp_t *raop_rtp, int codec, int frame_samples, int sample_rate)
+{
+    int ret = -1;
+
+    assert(raop_rtp);
+
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    /* The audio thread owns the buffer once it runs */
+    if (!raop_rtp->running && raop_rtp->joined) {
+        ret = raop_buffer_set_codec(raop_rtp->buffer, codec, frame_samples, sample_rate);
+        if (ret == 0) {
+            raop_rtp->audio_codec = codec;
+            raop_rtp->audio_frame_samples = frame_samples;
+            raop_rtp->audio_sample_rate = sample_rate;
+        }
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    return ret;
+}
+
+void
+raop_rtp_start_buffered(raop_rtp_t *raop_rtp, const unsigned char *shk, unsigned short *data_lport, int *buffer_size)
+{
+    unsigned short dport = 0;
+    int dsock;
+
+    assert(raop_rtp);
+
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (raop_rtp->running || !raop_rtp->joined) {
+        MUTEX_UNLOCK(raop_rtp->run_mutex);
+        return;
+    }
+    raop_rtp->buffered_audio = buffered_audio_init(RAOP_BUFFERED_AUDIO_SIZE, raop_rtp->audio_frame_samples,
+                                                   raop_rtp->audio_sample_rate);
+    dsock = netutils_init_socket(&dport, 0, 0);
+    if (!raop_rtp->buffered_audio || dsock == -1 || listen(dsock, 1) < 0) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "Initializing buffered audio failed");
+        if (dsock != -1) closesocket(dsock);
+        buffered_audio_destroy(raop_rtp->buffered_audio);
+        raop_rtp->buffered_audio = NULL;
+        MUTEX_UNLOCK(raop_rtp->run_mutex);
+        return;
+    }
+    memcpy(raop_rtp->shk, shk, sizeof(raop_rtp->shk));
+    raop_rtp->dsock = dsock;
+    raop_rtp->data_lport = dport;
+    if (data_lport) *data_lport = dport;
+    if (buffer_size) *buffer_size = RAOP_BUFFERED_AUDIO_SIZE;
+
+    raop_rtp->running = 1;
+    raop_rtp->joined = 0;
+    raop_rtp->buffered = 1;
+    THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_buffered, raop_rtp);
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_set_anchor(raop_rtp_t *raop_rtp, int rate, unsigned int rtp, uint64_t network_us)
+{
+    assert(raop_rtp);
+
+    if (raop_rtp->buffered_audio) {
+        buffered_audio_set_anchor(raop_rtp->buffered_audio, rate, rtp, network_us, raop_clock_us());
+    }
+}
+
+void
+raop_rtp_flush_buffered(raop_rtp_t *raop_rtp, int from_seq, unsigned int until_seq)
+{
+    assert(raop_rtp);
+
+    if (raop_rtp->buffered_audio) {
+        buffered_audio_flush(raop_rtp->buffered_audio, from_seq, until_seq);
+    }
+}
+
 void
 raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 {
@@ -711,15 +1018,21 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
     /* Join the thread */
     THREAD_JOIN(raop_rtp->thread);
 
-    MUTEX_LOCK(raop_rtp->time_mutex);
-    COND_SIGNAL(raop_rtp->time_cond);
-    MUTEX_UNLOCK(raop_rtp->time_mutex);
+    if (!raop_rtp->buffered) {
+        MUTEX_LOCK(raop_rtp->time_mutex);
+        COND_SIGNAL(raop_rtp->time_cond);
+        MUTEX_UNLOCK(raop_rtp->time_mutex);
 
-    THREAD_JOIN(raop_rtp->thread_time);
+        THREAD_JOIN(raop_rtp->thread_time);
+    }
     
     if (raop_rtp->csock != -1) closesocket(raop_rtp->csock);
     if (raop_rtp->tsock != -1) closesocket(raop_rtp->tsock);
     if (raop_rtp->dsock != -1) closesocket(raop_rtp->dsock);
+    raop_rtp->csock = raop_rtp->tsock = raop_rtp->dsock = -1;
+    buffered_audio_destroy(raop_rtp->buffered_audio);
+    raop_rtp->buffered_audio = NULL;
+    raop_rtp->buffered = 0;
 
     /* Flush buffer into initial state */
     raop_buffer_flush(raop_rtp->buffer, -1);
@@ -22,6 +22,8 @@
 #define RAOP_AESIV_LEN  16
 #define RAOP_AESKEY_LEN 16
 #define RAOP_PACKET_LEN 32768
+/* Compressed audio a buffered stream may send ahead, as advertised */
+#define RAOP_BUFFERED_AUDIO_SIZE (4 * 1024 * 1024)
 
 typedef struct raop_rtp_s raop_rtp_t;
 typedef struct h264codec_s h264codec_t;
@@ -33,6 +35,14 @@ raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, const u
 
 void raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport, unsigned short timing_rport,
                      unsigned short *control_lport, unsigned short *timing_lport, unsigned short *data_lport);
+/* Codec of the SETUP stream, before raop_rtp_start_audio */
+int raop_rtp_set_audio_format(raop_rtp_t *raop_rtp, int codec, int frame_samples, int sample_rate);
+
+/* Buffered audio (stream type 103) over TCP instead, sealed with shk. The
+ * sender starts it with raop_rtp_set_anchor. */
+void raop_rtp_start_buffered(raop_rtp_t *raop_rtp, const unsigned char *shk, unsigned short *data_lport, int *buffer_size);
+void raop_rtp_set_anchor(raop_rtp_t *raop_rtp, int rate, unsigned int rtp, uint64_t network_us);
+void raop_rtp_flush_buffered(raop_rtp_t *raop_rtp, int from_seq, unsigned int until_seq);
 
 void raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume);
 void raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen);
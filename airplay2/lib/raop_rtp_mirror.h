@@ -14,7 +14,8 @@ typedef struct h264codec_s h264codec_t;
 
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, const unsigned char *remote, int remotelen,
 	const char* remoteName, const char* remoteDeviceId,
-	const unsigned char* aeskey, const unsigned char* ecdh_secret, unsigned short timing_rport);
+	const unsigned char* aeskey, const unsigned char* ecdh_secret, unsigned short timing_rport,
+	int video_format);
 void raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t streamConnectionID);
 void raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned short mirror_timing_rport, unsigned short * mirror_timing_lport,
                       unsigned short *mirror_data_lport);
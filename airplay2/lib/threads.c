@@ -0,0 +1,373 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+
+#include "threads.h"
+#include "raop.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* Pinning of the default policies, resolved against the CPUs of the process
+ * when a thread starts */
+#define THREAD_AFFINITY_NONE    0
+#define THREAD_AFFINITY_AUDIO   1       /* the last CPU */
+#define THREAD_AFFINITY_VIDEO   2       /* every CPU but the last */
+
+typedef struct {
+	raop_thread_policy_t policy;
+	int affinity_auto;
+} thread_role_t;
+
+static thread_role_t thread_roles[RAOP_THREAD_ROLE_COUNT] = {
+	{ { RAOP_SCHED_FIFO, 10, 0, "raop-audio" }, THREAD_AFFINITY_AUDIO },
+	{ { RAOP_SCHED_FIFO, 5, 0, "raop-timing" }, THREAD_AFFINITY_AUDIO },
+	{ { RAOP_SCHED_OTHER, 0, 0, "raop-mirror" }, THREAD_AFFINITY_VIDEO },
+	{ { RAOP_SCHED_OTHER, 0, 0, "raop-decode" }, THREAD_AFFINITY_VIDEO },
+	{ { RAOP_SCHED_OTHER, 0, 0, "raop-control" }, THREAD_AFFINITY_NONE },
+};
+
+/* CPUs the process may run on, the first 64 of them */
+static uint64_t
+thread_process_cpus(void)
+{
+#if defined(WIN32)
+	DWORD_PTR process_mask, system_mask;
+
+	if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+		return process_mask;
+	}
+#elif defined(__linux__)
+	cpu_set_t set;
+	uint64_t mask = 0;
+	int i;
+
+	if (sched_getaffinity(getpid(), sizeof(set), &set) == 0) {
+		for (i = 0; i < 64; i++) {
+			if (CPU_ISSET(i, &set)) {
+				mask |= 1ULL << i;
+			}
+		}
+		return mask;
+	}
+#endif
+	return 0;
+}
+
+static uint64_t
+thread_auto_affinity(int affinity_auto)
+{
+	uint64_t cpus, last;
+	int count = 0;
+
+	if (affinity_auto == THREAD_AFFINITY_NONE) {
+		return 0;
+	}
+	cpus = thread_process_cpus();
+	for (last = cpus; last; last &= last - 1) {
+		count++;
+	}
+	/* Keep at least two CPUs for video */
+	if (count < 3) {
+		return 0;
+	}
+	last = 1ULL << 63;
+	while (!(cpus & last)) {
+		last >>= 1;
+	}
+	return affinity_auto == THREAD_AFFINITY_AUDIO ? last : cpus & ~last;
+}
+
+#if defined(WIN32)
+
+typedef HANDLE (WINAPI *av_set_mm_thread_characteristics_t)(LPCWSTR task, LPDWORD index);
+typedef BOOL (WINAPI *av_set_mm_thread_priority_t)(HANDLE handle, int priority);
+typedef BOOL (WINAPI *av_revert_mm_thread_characteristics_t)(HANDLE handle);
+typedef HRESULT (WINAPI *set_thread_description_t)(HANDLE thread, PCWSTR description);
+
+#define THREAD_AVRT_PRIORITY_HIGH       1
+#define THREAD_AVRT_PRIORITY_CRITICAL   2
+
+/* avrt.dll is loaded at the first use and kept, so the library does not
+ * link it */
+static INIT_ONCE thread_avrt_once = INIT_ONCE_STATIC_INIT;
+static av_set_mm_thread_characteristics_t thread_avrt_set_characteristics;
+static av_set_mm_thread_priority_t thread_avrt_set_priority;
+static av_revert_mm_thread_characteristics_t thread_avrt_revert_characteristics;
+
+/* MMCSS task of the calling thread, until raop_revert_thread_policy */
+static __declspec(thread) HANDLE thread_avrt_task;
+
+static BOOL CALLBACK
+thread_avrt_init(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	HMODULE avrt = LoadLibraryA("avrt.dll");
+
+	(void)once;
+	(void)param;
+	(void)context;
+	if (!avrt) {
+		return TRUE;
+	}
+	thread_avrt_set_characteristics =
+		(av_set_mm_thread_characteristics_t)GetProcAddress(avrt, "AvSetMmThreadCharacteristicsW");
+	thread_avrt_set_priority =
+		(av_set_mm_thread_priority_t)GetProcAddress(avrt, "AvSetMmThreadPriority");
+	thread_avrt_revert_characteristics =
+		(av_revert_mm_thread_characteristics_t)GetProcAddress(avrt, "AvRevertMmThreadCharacteristics");
+	if (!thread_avrt_set_characteristics || !thread_avrt_set_priority || !thread_avrt_revert_characteristics) {
+		thread_avrt_set_characteristics = NULL;
+		FreeLibrary(avrt);
+	}
+	return TRUE;
+}
+
+static void
+thread_revert_sched(void)
+{
+	if (thread_avrt_task) {
+		thread_avrt_revert_characteristics(thread_avrt_task);
+		thread_avrt_task = NULL;
+	}
+}
+
+static int
+thread_apply_sched(int role, const raop_thread_policy_t *policy)
+{
+	int priority;
+
+	/* A thread applying a second policy leaves the task of the first */
+	thread_revert_sched();
+	if (policy->sched != RAOP_SCHED_OTHER) {
+		/* MMCSS boosts the thread the way realtime classes do elsewhere */
+		InitOnceExecuteOnce(&thread_avrt_once, thread_avrt_init, NULL, NULL);
+		if (thread_avrt_set_characteristics) {
+			LPCWSTR task = role == RAOP_THREAD_AUDIO || role == RAOP_THREAD_TIMING ? L"Pro Audio" : L"Playback";
+			DWORD index = 0;
+
+			thread_avrt_task = thread_avrt_set_characteristics(task, &index);
+			if (thread_avrt_task) {
+				thread_avrt_set_priority(thread_avrt_task, policy->priority >= 50 ? THREAD_AVRT_PRIORITY_CRITICAL :
+				                                                                    THREAD_AVRT_PRIORITY_HIGH);
+				return 0;
+			}
+		}
+		SetThreadPriority(GetCurrentThread(), policy->priority >= 50 ? THREAD_PRIORITY_TIME_CRITICAL :
+		                                                               THREAD_PRIORITY_HIGHEST);
+		return 1;
+	}
+
+	if (policy->priority == 0) {
+		return 0;
+	} else if (policy->priority <= -10) {
+		priority = THREAD_PRIORITY_HIGHEST;
+	} else if (policy->priority < 0) {
+		priority = THREAD_PRIORITY_ABOVE_NORMAL;
+	} else if (policy->priority < 10) {
+		priority = THREAD_PRIORITY_BELOW_NORMAL;
+	} else {
+		priority = THREAD_PRIORITY_LOWEST;
+	}
+	return SetThreadPriority(GetCurrentThread(), priority) ? 0 : 1;
+}
+
+static int
+thread_apply_affinity(uint64_t affinity)
+{
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)affinity) ? 0 : 1;
+}
+
+static void
+thread_apply_name(const char *name)
+{
+	/* Windows 10 1607 and later */
+	set_thread_description_t set_description =
+		(set_thread_description_t)GetProcAddress(GetModuleHandleA("kernel32.dll"), "SetThreadDescription");
+	WCHAR wname[sizeof(((raop_thread_policy_t *)0)->name)];
+	int i;
+
+	if (!set_description) {
+		return;
+	}
+	for (i = 0; i < (int)(sizeof(wname) / sizeof(wname[0])) - 1 && name[i]; i++) {
+		wname[i] = (unsigned char)name[i];
+	}
+	wname[i] = 0;
+	set_description(GetCurrentThread(), wname);
+}
+
+#else
+
+/* Nice values are per thread on Linux, elsewhere they would renice the
+ * whole process */
+static int
+thread_apply_nice(int nice)
+{
+#if defined(__linux__)
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	struct rlimit rl;
+
+	if (setpriority(PRIO_PROCESS, tid, nice) == 0) {
+		return 0;
+	}
+	/* RLIMIT_NICE allows down to 20 - rlim_cur without privileges */
+	if (nice < 0 && getrlimit(RLIMIT_NICE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+	    20 - (int)rl.rlim_cur > nice && 20 - (int)rl.rlim_cur < 0) {
+		setpriority(PRIO_PROCESS, tid, 20 - (int)rl.rlim_cur);
+	}
+#endif
+	return 1;
+}
+
+static int
+thread_apply_sched(int role, const raop_thread_policy_t *policy)
+{
+	struct sched_param param;
+	int sched;
+
+	(void)role;
+	if (policy->sched == RAOP_SCHED_OTHER) {
+		return policy->priority ? thread_apply_nice(policy->priority) : 0;
+	}
+
+	sched = policy->sched == RAOP_SCHED_FIFO ? SCHED_FIFO : SCHED_RR;
+#ifdef SCHED_RESET_ON_FORK
+	/* Like rtkit grants it, children do not inherit realtime */
+	sched |= SCHED_RESET_ON_FORK;
+#endif
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = policy->priority;
+	if (pthread_setschedparam(pthread_self(), sched, &param) == 0) {
+		return 0;
+	}
+#ifdef RLIMIT_RTPRIO
+	{
+		/* Without CAP_SYS_NICE a process may still go up to RLIMIT_RTPRIO,
+		 * which is how rtkit and pam_limits hand out realtime */
+		struct rlimit rl;
+
+		if (getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur > 0 && rl.rlim_cur != RLIM_INFINITY &&
+		    (int)rl.rlim_cur < policy->priority) {
+			param.sched_priority = (int)rl.rlim_cur;
+			if (pthread_setschedparam(pthread_self(), sched, &param) == 0) {
+				return 1;
+			}
+		}
+	}
+#endif
+	thread_apply_nice(-10);
+	return 1;
+}
+
+static void
+thread_revert_sched(void)
+{
+	/* The scheduling class ends with the thread */
+}
+
+static int
+thread_apply_affinity(uint64_t affinity)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < 64; i++) {
+		if (affinity & (1ULL << i)) {
+			CPU_SET(i, &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : 1;
+#else
+	(void)affinity;
+	return 1;
+#endif
+}
+
+static void
+thread_apply_name(const char *name)
+{
+#if defined(__APPLE__)
+	pthread_setname_np(name);
+#elif defined(__linux__)
+	pthread_setname_np(pthread_self(), name);
+#else
+	(void)name;
+#endif
+}
+
+#endif
+
+void
+raop_get_thread_policy(int role, raop_thread_policy_t *policy)
+{
+	if (role < 0 || role >= RAOP_THREAD_ROLE_COUNT) {
+		memset(policy, 0, sizeof(*policy));
+		return;
+	}
+	*policy = thread_roles[role].policy;
+	if (thread_roles[role].affinity_auto != THREAD_AFFINITY_NONE) {
+		policy->affinity = thread_auto_affinity(thread_roles[role].affinity_auto);
+	}
+}
+
+int
+raop_set_thread_policy(int role, const raop_thread_policy_t *policy)
+{
+	if (role < 0 || role >= RAOP_THREAD_ROLE_COUNT || policy->sched < RAOP_SCHED_OTHER ||
+	    policy->sched > RAOP_SCHED_RR) {
+		return -1;
+	}
+	thread_roles[role].policy = *policy;
+	thread_roles[role].policy.name[sizeof(policy->name) - 1] = '\0';
+	thread_roles[role].affinity_auto = THREAD_AFFINITY_NONE;
+	return 0;
+}
+
+int
+raop_apply_thread_policy(int role)
+{
+	raop_thread_policy_t policy;
+	int ret;
+
+	if (role < 0 || role >= RAOP_THREAD_ROLE_COUNT) {
+		return -1;
+	}
+	raop_get_thread_policy(role, &policy);
+	if (policy.name[0]) {
+		thread_apply_name(policy.name);
+	}
+	ret = thread_apply_sched(role, &policy);
+	if (policy.affinity && thread_apply_affinity(policy.affinity)) {
+		ret = 1;
+	}
+	return ret;
+}
+
+void
+raop_revert_thread_policy(void)
+{
+	thread_revert_sched();
+}
@@ -39,6 +39,9 @@ typedef HANDLE cond_handle_t;
 #define COND_CREATE(handle) handle = CreateEvent(NULL, FALSE, FALSE, NULL)
 #define COND_SIGNAL(handle) if (handle != NULL) { SetEvent(handle); }
 #define COND_DESTROY(handle) if (handle != NULL) { CloseHandle(handle); handle = NULL;}
+/* The event stays set until a waiter consumes it, so releasing the mutex
+ * first cannot lose a signal */
+#define COND_WAIT(handle, mutex) do { MUTEX_UNLOCK(mutex); WaitForSingleObject(handle, INFINITE); MUTEX_LOCK(mutex); } while(0)
 
 int pthread_cond_timedwait(cond_handle_t* __cond, mutex_handle_t* __mutex, const struct timespec* __timeout);
 
@@ -68,6 +71,7 @@ typedef pthread_cond_t cond_handle_t;
 #define COND_CREATE(handle) pthread_cond_init(&(handle), NULL)
 #define COND_SIGNAL(handle) pthread_cond_signal(&(handle))
 #define COND_DESTROY(handle) pthread_cond_destroy(&(handle))
+#define COND_WAIT(handle, mutex) pthread_cond_wait(&(handle), &(mutex))
 
 #endif
 
@@ -0,0 +1,342 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#include "trace.h"
+#include "compat.h"
+
+#ifdef AIRPLAY_TRACE
+
+/* A slot is handed back when its thread exits and taken by the next thread
+ * that records, so the limit is on threads alive at once. Buffers are kept
+ * for reuse. Threads past the limit do not record. */
+#define TRACE_MAX_THREADS           64
+#define TRACE_EVENTS_PER_THREAD     16384
+
+#if defined(WIN32)
+#define TRACE_TLS                   __declspec(thread)
+#define TRACE_LOAD(p)               InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define TRACE_STORE(p, v)           InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define TRACE_INCREMENT(p)          InterlockedIncrement((volatile LONG *)(p))
+#define TRACE_LOAD_PTR(p)           InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define TRACE_STORE_PTR(p, v)       InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#define TRACE_TRY_LOCK(p)           (InterlockedCompareExchange((volatile LONG *)(p), 1, 0) == 0)
+#define TRACE_YIELD()               Sleep(0)
+#else
+#define TRACE_TLS                   __thread
+#define TRACE_LOAD(p)               __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE(p, v)           __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define TRACE_INCREMENT(p)          __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define TRACE_LOAD_PTR(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE_PTR(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define TRACE_TRY_LOCK(p)           (__atomic_exchange_n((p), 1, __ATOMIC_ACQUIRE) == 0)
+#define TRACE_YIELD()               sched_yield()
+#endif
+
+typedef struct trace_event_s {
+    const char *name;
+    uint64_t begin_us;
+    uint64_t end_us;
+    int64_t arg;
+} trace_event_t;
+
+/* Only the owning thread writes events and count. An event is filled in
+ * before count is raised past it, so the dump never reads a partial one. */
+typedef struct trace_thread_s {
+    int in_use;
+    long generation;
+    long count;
+    int tid;
+    const char *name;
+    trace_event_t events[TRACE_EVENTS_PER_THREAD];
+} trace_thread_t;
+
+static trace_thread_t *trace_threads[TRACE_MAX_THREADS];
+static long trace_nthreads;
+static long trace_generation;
+
+/* Guards claiming and releasing slots against each other and against
+ * trace_dump, so a slot is never reused while it is being written out.
+ * Taken once per thread start and exit, recording does not touch it. */
+static long trace_lock;
+
+static TRACE_TLS trace_thread_t *trace_current;
+static TRACE_TLS int trace_no_slot;
+
+static void
+trace_slots_lock(void)
+{
+    while (!TRACE_TRY_LOCK(&trace_lock)) {
+        TRACE_YIELD();
+    }
+}
+
+static void
+trace_slots_unlock(void)
+{
+    TRACE_STORE(&trace_lock, 0);
+}
+
+static void
+trace_release(void *arg)
+{
+    trace_thread_t *thread = arg;
+
+    if (thread) {
+        trace_slots_lock();
+        thread->in_use = 0;
+        trace_slots_unlock();
+    }
+}
+
+/* The slot of a thread goes back when the thread exits. Threads are not
+ * all created by the library, so this hangs off thread exit itself rather
+ * than off the thread functions. */
+#if defined(WIN32)
+static DWORD trace_exit_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE trace_exit_once = INIT_ONCE_STATIC_INIT;
+
+static void NTAPI
+trace_release_fls(void *arg)
+{
+    trace_release(arg);
+}
+
+static BOOL CALLBACK
+trace_exit_init(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    trace_exit_key = FlsAlloc(trace_release_fls);
+    return TRUE;
+}
+
+static void
+trace_on_exit(trace_thread_t *thread)
+{
+    InitOnceExecuteOnce(&trace_exit_once, trace_exit_init, NULL, NULL);
+    if (trace_exit_key != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(trace_exit_key, thread);
+    }
+}
+#else
+static pthread_key_t trace_exit_key;
+static pthread_once_t trace_exit_once = PTHREAD_ONCE_INIT;
+static int trace_exit_ok;
+
+static void
+trace_exit_init(void)
+{
+    trace_exit_ok = pthread_key_create(&trace_exit_key, trace_release) == 0;
+}
+
+static void
+trace_on_exit(trace_thread_t *thread)
+{
+    pthread_once(&trace_exit_once, trace_exit_init);
+    if (trace_exit_ok) {
+        pthread_setspecific(trace_exit_key, thread);
+    }
+}
+#endif
+
+static trace_thread_t *
+trace_thread(void)
+{
+    trace_thread_t *thread = NULL;
+    long nthreads;
+    long idx;
+
+    if (trace_current || trace_no_slot) {
+        return trace_current;
+    }
+    trace_slots_lock();
+    nthreads = TRACE_LOAD(&trace_nthreads);
+    for (idx = 0; idx < nthreads; idx++) {
+        if (!trace_threads[idx]->in_use) {
+            /* Its spans are dropped, the tid now names this thread */
+            thread = trace_threads[idx];
+            TRACE_STORE(&thread->count, 0);
+            TRACE_STORE_PTR(&thread->name, NULL);
+            break;
+        }
+    }
+    if (!thread && nthreads < TRACE_MAX_THREADS) {
+        thread = calloc(1, sizeof(trace_thread_t));
+        if (thread) {
+            thread->tid = (int)nthreads + 1;
+            TRACE_STORE_PTR(&trace_threads[nthreads], thread);
+            TRACE_STORE(&trace_nthreads, nthreads + 1);
+        }
+    }
+    if (thread) {
+        thread->in_use = 1;
+        TRACE_STORE(&thread->generation, TRACE_LOAD(&trace_generation));
+    }
+    trace_slots_unlock();
+
+    if (!thread) {
+        trace_no_slot = 1;
+        return NULL;
+    }
+    trace_on_exit(thread);
+    trace_current = thread;
+    return thread;
+}
+
+void
+trace_thread_name(const char *name)
+{
+    trace_thread_t *thread = trace_thread();
+
+    if (thread) {
+        TRACE_STORE_PTR(&thread->name, name);
+    }
+}
+
+void
+trace_span(const char *name, uint64_t begin_us, int64_t arg)
+{
+    trace_thread_t *thread = trace_thread();
+    trace_event_t *event;
+    long generation;
+    long count;
+
+    if (!thread) {
+        return;
+    }
+    generation = TRACE_LOAD(&trace_generation);
+    if (thread->generation != generation) {
+        /* trace_start ran since the last span, count must be reset before
+         * the dump can see the new generation */
+        TRACE_STORE(&thread->count, 0);
+        TRACE_STORE(&thread->generation, generation);
+    }
+    count = thread->count;
+    if (count >= TRACE_EVENTS_PER_THREAD) {
+        return;
+    }
+    event = &thread->events[count];
+    event->name = name;
+    event->begin_us = begin_us;
+    event->end_us = raop_clock_us();
+    event->arg = arg;
+    TRACE_STORE(&thread->count, count + 1);
+}
+
+int
+trace_start(void)
+{
+    TRACE_INCREMENT(&trace_generation);
+    return 0;
+}
+
+static void
+trace_write_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*str >= 0x20) {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/* Spans still being added while this runs are either in or out, never torn.
+ * Not to be called at the same time as trace_start. */
+int
+trace_dump(const char *path)
+{
+    FILE *file;
+    long generation = TRACE_LOAD(&trace_generation);
+    long nthreads;
+    const char *sep = "";
+    long i, j;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+    trace_slots_lock();
+    nthreads = TRACE_LOAD(&trace_nthreads);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (i = 0; i < nthreads; i++) {
+        trace_thread_t *thread = TRACE_LOAD_PTR(&trace_threads[i]);
+        const char *name;
+        long count;
+
+        if (!thread || TRACE_LOAD(&thread->generation) != generation) {
+            continue;
+        }
+        count = TRACE_LOAD(&thread->count);
+        name = TRACE_LOAD_PTR(&thread->name);
+        if (name) {
+            fprintf(file, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":",
+                    sep, thread->tid);
+            trace_write_string(file, name);
+            fprintf(file, "}}");
+            sep = ",";
+        }
+        for (j = 0; j < count; j++) {
+            const trace_event_t *event = &thread->events[j];
+
+            fprintf(file, "%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"name\":",
+                    sep, thread->tid, (unsigned long long)event->begin_us,
+                    (unsigned long long)(event->end_us - event->begin_us));
+            trace_write_string(file, event->name);
+            if (event->arg >= 0) {
+                fprintf(file, ",\"args\":{\"arg\":%lld}", (long long)event->arg);
+            }
+            fputc('}', file);
+            sep = ",";
+        }
+    }
+    trace_slots_unlock();
+    fprintf(file, "\n]}\n");
+    if (fclose(file)) {
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+void
+trace_thread_name(const char *name)
+{
+}
+
+void
+trace_span(const char *name, uint64_t begin_us, int64_t arg)
+{
+}
+
+int
+trace_start(void)
+{
+    return -1;
+}
+
+int
+trace_dump(const char *path)
+{
+    return -1;
+}
+
+#endif
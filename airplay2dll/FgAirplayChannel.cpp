@@ -1,17 +1,48 @@
 #include "FgAirplayChannel.h"
 #include "CAutoLock.h"
+#include "raop.h"
+#include "trace.h"
 
-FgAirplayChannel::FgAirplayChannel(IAirServerCallback* pCallback)
+// Degradation ladder of full decoding, see EFgDegradeLevel
+#define FG_DEGRADE_LAG_US		200000		// behind the sender before stepping down
+#define FG_DEGRADE_CALM_LAG_US	50000		// at most this behind to step back up
+#define FG_DEGRADE_HOLD_FRAMES	30			// frames a step gets to take effect
+#define FG_DEGRADE_CALM_FRAMES	120			// frames of headroom before stepping back up
+#define FG_DEGRADE_RELAPSE_US	10000000	// stepping down this soon after doubles them
+#define FG_DEGRADE_ANCHOR_US	60000000	// lag is measured afresh this often, for clock drift
+
+FgAirplayChannel::FgAirplayChannel(IAirServerCallback* pCallback, FgMediaHub* pHub)
 : m_nRef(1)
 , m_pCallback(pCallback)
+, m_pHub(pHub)
 , m_pCodec(NULL)
 , m_pCodecCtx(NULL)
-, m_pSwsCtx(NULL)
+, m_pScaler(NULL)
 , m_bCodecOpened(false)
+, m_nCodec(FG_VIDEO_CODEC_H264)
 , m_fScaleRatio(1.0f)
+, m_nPixelFormat(FG_PIXEL_FORMAT_I420)
+, m_nDecodeMode(FG_DECODE_FULL)
+, m_llLastOutputPts(0)
+, m_ullFirstFrameUs(0)
+, m_bAdaptiveDecode(true)
+, m_nDegradeLevel(FG_DEGRADE_NONE)
+, m_bWaitIdr(false)
+, m_bSkippedRefs(false)
+, m_llDecodeAvgUs(0)
+, m_llFrameAvgUs(0)
+, m_llLastPts(0)
+, m_ullAnchorUs(0)
+, m_llAnchorPts(0)
+, m_llLagAtStepUs(0)
+, m_nHoldFrames(0)
+, m_nCalmFrames(0)
+, m_nCalmNeeded(FG_DEGRADE_CALM_FRAMES)
+, m_ullStepUpUs(0)
+, m_ullStepDownUs(0)
 {
 	memset(&m_sVideoFrameOri, 0, sizeof(SFgVideoFrame));
-	memset(&m_sVideoFrameScale, 0, sizeof(SFgVideoFrame));
+	memset(&m_sPreview, 0, sizeof(SFgPreviewConfig));
 
 	m_mutexAudio = CreateMutex(NULL, FALSE, NULL);
 	m_mutexVideo = CreateMutex(NULL, FALSE, NULL);
@@ -25,12 +56,6 @@ FgAirplayChannel::~FgAirplayChannel()
 		delete[] m_sVideoFrameOri.data;
 		m_sVideoFrameOri.data = NULL;
 	}
-	if (m_sVideoFrameScale.data)
-	{
-		delete[] m_sVideoFrameScale.data;
-		m_sVideoFrameScale.data = NULL;
-	}
-
 	unInitFFmpeg();
 
 	CloseHandle(m_mutexAudio);
@@ -54,18 +79,39 @@ long FgAirplayChannel::release()
 	return (m_nRef > 1 ? m_nRef : 1);
 }
 
-int FgAirplayChannel::initFFmpeg(const void* privatedata, int privatedatalen) {
+int FgAirplayChannel::initFFmpeg(const SFgH264Data* config) {
+	bool bReopen = (m_pCodec != NULL && m_nCodec != config->codec);
+	if (m_bCodecOpened && config->format == VIDEO_FORMAT_AVCC &&
+		(m_pCodecCtx->extradata_size != config->size ||
+		memcmp(m_pCodecCtx->extradata, config->data, config->size) != 0)) {
+		// A new avcC/hvcC record only reaches the decoder as extradata
+		bReopen = true;
+	}
+	if (bReopen) {
+		// Start over, with the other decoder if the sender switched codecs
+		if (m_pCodecCtx->extradata) {
+			av_freep(&m_pCodecCtx->extradata);
+		}
+		avcodec_free_context(&m_pCodecCtx);
+		m_pCodec = NULL;
+		m_bCodecOpened = false;
+	}
 	if (m_pCodec == NULL) {
-		m_pCodec = avcodec_find_decoder(AV_CODEC_ID_H264);
+		m_nCodec = config->codec;
+		m_pCodec = avcodec_find_decoder(m_nCodec == FG_VIDEO_CODEC_H265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
 		m_pCodecCtx = avcodec_alloc_context3(m_pCodec);
 	}
 	if (m_pCodec == NULL) {
 		return -1;
 	}
+	if (m_bCodecOpened) {
+		// Later Annex B parameter sets are decoded in band
+		return 0;
+	}
 
-	m_pCodecCtx->extradata = (uint8_t*)av_malloc(privatedatalen);
-	m_pCodecCtx->extradata_size = privatedatalen;
-	memcpy(m_pCodecCtx->extradata, privatedata, privatedatalen);
+	m_pCodecCtx->extradata = (uint8_t*)av_mallocz(config->size + AV_INPUT_BUFFER_PADDING_SIZE);
+	m_pCodecCtx->extradata_size = config->size;
+	memcpy(m_pCodecCtx->extradata, config->data, config->size);
 	m_pCodecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
 
 	int res = avcodec_open2(m_pCodecCtx, m_pCodec, NULL);
@@ -91,10 +137,10 @@ void FgAirplayChannel::unInitFFmpeg()
 		avcodec_free_context(&m_pCodecCtx);
 		m_pCodecCtx = NULL;
 	}
-	if (m_pSwsCtx)
+	if (m_pScaler)
 	{
-		sws_freeContext(m_pSwsCtx);
-		m_pSwsCtx = NULL;
+		delete m_pScaler;
+		m_pScaler = NULL;
 	}
 }
 
@@ -104,16 +150,151 @@ float FgAirplayChannel::setScale(float fRatio)
 	return m_fScaleRatio;
 }
 
+int FgAirplayChannel::setPixelFormat(int pixelFormat)
+{
+	m_nPixelFormat = pixelFormat;
+	return m_nPixelFormat;
+}
+
+void FgAirplayChannel::setDecodeMode(int mode, const SFgPreviewConfig* preview)
+{
+	CAutoLock oLock(m_mutexVideo, "setDecodeMode");
+	m_nDecodeMode = mode;
+	if (preview) {
+		m_sPreview = *preview;
+	}
+	m_llLastOutputPts = 0;
+}
+
 int FgAirplayChannel::decodeH264Data(SFgH264Data* data, const char* remoteName, const char* remoteDeviceId) {
+	int decodeMode;
+	SFgPreviewConfig preview;
+	{
+		CAutoLock oLock(m_mutexVideo, "decodeH264Data");
+		decodeMode = m_nDecodeMode;
+		preview = m_sPreview;
+	}
+	bool bPreview = (decodeMode == FG_DECODE_PREVIEW);
+
+	unsigned long long ullStartUs = raop_clock_us();
+	int ret = decodePicture(data, bPreview, preview, remoteName, remoteDeviceId);
+	if (ret == 0 && !bPreview && m_bAdaptiveDecode && m_bCodecOpened &&
+		!(data->is_key && data->format == VIDEO_FORMAT_AVCC)) {
+		adaptDecode((long long)(raop_clock_us() - ullStartUs), data->pts, remoteName, remoteDeviceId);
+	}
+	return ret;
+}
+
+void FgAirplayChannel::adaptDecode(long long costUs, long long pts, const char* remoteName, const char* remoteDeviceId)
+{
+	unsigned long long ullNowUs = raop_clock_us();
+
+	m_llDecodeAvgUs = m_llDecodeAvgUs == 0 ? costUs : (m_llDecodeAvgUs * 7 + costUs) / 8;
+	if (m_llLastPts != 0 && pts > m_llLastPts) {
+		long long intervalUs = min(pts - m_llLastPts, 1000000LL);
+		m_llFrameAvgUs = m_llFrameAvgUs == 0 ? intervalUs : (m_llFrameAvgUs * 7 + intervalUs) / 8;
+	}
+
+	// How much longer the frames since the anchor took here than on the
+	// sender. The anchor is the frame that was least behind, so the lag is
+	// what waits in the socket and grows while decoding cannot keep up.
+	long long lagUs = -1;
+	if (m_ullAnchorUs != 0 && pts >= m_llLastPts) {
+		lagUs = (long long)(ullNowUs - m_ullAnchorUs) - (pts - m_llAnchorPts);
+	}
+	if (lagUs < 0 || (lagUs < FG_DEGRADE_CALM_LAG_US && ullNowUs - m_ullAnchorUs > FG_DEGRADE_ANCHOR_US)) {
+		m_ullAnchorUs = ullNowUs;
+		m_llAnchorPts = pts;
+		lagUs = 0;
+	}
+	m_llLastPts = pts;
+
+	int level = m_nDegradeLevel;
+	if (m_nHoldFrames > 0) {
+		m_nHoldFrames--;
+	}
+	else if (lagUs > FG_DEGRADE_LAG_US) {
+		// Judged once per hold: a level that won back a quarter of the lag
+		// since then gets another hold, otherwise the next step is taken
+		if (lagUs <= m_llLagAtStepUs * 3 / 4) {
+			m_nHoldFrames = FG_DEGRADE_HOLD_FRAMES;
+			m_llLagAtStepUs = lagUs;
+		}
+		else if (level < FG_DEGRADE_LEVEL_COUNT - 1) {
+			level++;
+			m_nHoldFrames = FG_DEGRADE_HOLD_FRAMES;
+			m_llLagAtStepUs = lagUs;
+			if (m_ullStepUpUs != 0 && ullNowUs - m_ullStepUpUs < FG_DEGRADE_RELAPSE_US) {
+				m_nCalmNeeded = min(m_nCalmNeeded * 2, FG_DEGRADE_CALM_FRAMES * 16);
+			}
+			m_ullStepDownUs = ullNowUs;
+		}
+		m_nCalmFrames = 0;
+	}
+	else if (lagUs < FG_DEGRADE_CALM_LAG_US && m_llDecodeAvgUs < m_llFrameAvgUs / 2) {
+		if (level > FG_DEGRADE_NONE && ++m_nCalmFrames >= m_nCalmNeeded) {
+			if (m_ullStepUpUs > m_ullStepDownUs) {
+				// The last step up held
+				m_nCalmNeeded = max(m_nCalmNeeded / 2, FG_DEGRADE_CALM_FRAMES);
+			}
+			level--;
+			m_nHoldFrames = FG_DEGRADE_HOLD_FRAMES;
+			m_llLagAtStepUs = 0;
+			m_nCalmFrames = 0;
+			m_ullStepUpUs = ullNowUs;
+		}
+	}
+	else {
+		m_nCalmFrames = 0;
+	}
+
+	if (level != m_nDegradeLevel) {
+		SFgDecodeLoad load;
+		load.level = level;
+		load.previousLevel = m_nDegradeLevel;
+		load.decodeUs = (unsigned int)m_llDecodeAvgUs;
+		load.frameUs = (unsigned int)m_llFrameAvgUs;
+		load.lagUs = (unsigned int)lagUs;
+		m_nDegradeLevel = level;
+		if (m_pCallback != NULL) {
+			m_pCallback->decodeLevelChanged(&load, remoteName, remoteDeviceId);
+		}
+	}
+}
+
+int FgAirplayChannel::decodePicture(SFgH264Data* data, bool bPreview, const SFgPreviewConfig& preview,
+	const char* remoteName, const char* remoteDeviceId)
+{
 	int ret = 0;
+	bool bKeyframesOnly = bPreview ? preview.keyframesOnly != 0 : m_nDegradeLevel >= FG_DEGRADE_KEYFRAMES_ONLY;
+	if (bKeyframesOnly) {
+		m_bSkippedRefs = true;
+	}
+	else if (m_bSkippedRefs) {
+		// The skipped pictures are missing as references, whether keyframes
+		// only mode ended by promotion from preview or by stepping up
+		m_bSkippedRefs = false;
+		m_bWaitIdr = true;
+	}
+	if (data->is_idr) {
+		m_bWaitIdr = false;
+	}
+	if ((bKeyframesOnly || m_bWaitIdr) && !data->is_key && !data->is_idr) {
+		// Not even worth parsing
+		return 0;
+	}
 	if (!m_bCodecOpened && !data->is_key) {
 		return 0;
 	}
 	if (data->is_key) {
-		ret = initFFmpeg(data->data, data->size);
+		ret = initFFmpeg(data);
 		if (ret < 0) {
 			return ret;
 		}
+		if (data->format == VIDEO_FORMAT_AVCC) {
+			// The record is not a picture, the pictures carry NAL lengths
+			return 0;
+		}
 	}
 	if (!m_bCodecOpened) {
 		return 0;
@@ -125,110 +306,107 @@ int FgAirplayChannel::decodeH264Data(SFgH264Data* data, const char* remoteName,
 
 	pFrame = av_frame_alloc();
 
+	if (bPreview) {
+		m_pCodecCtx->skip_frame = preview.keyframesOnly ? AVDISCARD_NONKEY : AVDISCARD_NONREF;
+		// Reference pictures keep their deblocking, full decoding may
+		// predict from them after a promotion
+		m_pCodecCtx->skip_loop_filter = AVDISCARD_NONREF;
+	}
+	else {
+		m_pCodecCtx->skip_frame = m_nDegradeLevel >= FG_DEGRADE_KEYFRAMES_ONLY ? AVDISCARD_NONKEY :
+			m_nDegradeLevel >= FG_DEGRADE_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+		m_pCodecCtx->skip_loop_filter = m_nDegradeLevel >= FG_DEGRADE_SKIP_LOOP_FILTER ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	}
+
 	av_new_packet(packet, data->size);
 	memcpy(packet->data, data->data, data->size);
+	packet->pts = data->pts;
 
+	TRACE_SPAN_BEGIN(send_packet);
 	ret = avcodec_send_packet(this->m_pCodecCtx, packet);
+	TRACE_SPAN_END_ARG(send_packet, "avcodec_send_packet", data->size);
+	TRACE_SPAN_BEGIN(receive_frame);
 	frameFinished = avcodec_receive_frame(this->m_pCodecCtx, pFrame);
+	TRACE_SPAN_END(receive_frame, "avcodec_receive_frame");
 
 	av_packet_unref(packet);
 
+	if (frameFinished == 0 && bPreview && preview.fps > 0.0f && m_llLastOutputPts != 0 &&
+		pFrame->pts > m_llLastOutputPts &&
+		pFrame->pts - m_llLastOutputPts < (long long)(1000000 / preview.fps)) {
+		// Thumbnail rate limit
+		frameFinished = -1;
+	}
+
 	// Did we get a video frame?
 	if (frameFinished == 0)
 	{
-		if (m_sVideoFrameOri.width != pFrame->width ||
-			m_sVideoFrameOri.height != pFrame->height) {
-			if (m_sVideoFrameOri.data)
-			{
-				delete[] m_sVideoFrameOri.data;
-				m_sVideoFrameOri.data = NULL;
+		if (m_ullFirstFrameUs == 0) {
+			m_ullFirstFrameUs = raop_clock_us();
+		}
+		m_llLastOutputPts = pFrame->pts;
+		float fScaleRatio = m_fScaleRatio;
+		if (!bPreview && m_nDegradeLevel >= FG_DEGRADE_REDUCED_SCALE) {
+			fScaleRatio *= 0.5f;
+		}
+		if (bPreview && preview.width > 0 && preview.height > 0) {
+			if (m_pScaler == NULL) {
+				m_pScaler = new FgVideoScaler(m_pCallback, m_pHub);
 			}
+			m_pScaler->setOutput(1.0f, m_nPixelFormat, preview.width, preview.height);
+			m_pScaler->submit(pFrame, remoteName, remoteDeviceId);
 		}
-
-		m_sVideoFrameOri.width = pFrame->width;
-		m_sVideoFrameOri.height = pFrame->height;
-		m_sVideoFrameOri.pts = pFrame->pts;
-		m_sVideoFrameOri.isKey = pFrame->key_frame;
-		int ySize = pFrame->linesize[0] * pFrame->height;
-		int uSize = pFrame->linesize[1] * pFrame->height >> 1;
-		int vSize = pFrame->linesize[2] * pFrame->height >> 1;
-		m_sVideoFrameOri.dataTotalLen = ySize + uSize + vSize;
-		m_sVideoFrameOri.dataLen[0] = ySize;
-		m_sVideoFrameOri.dataLen[1] = uSize;
-		m_sVideoFrameOri.dataLen[2] = vSize;
-		if (!m_sVideoFrameOri.data)
-		{
-			m_sVideoFrameOri.data = new uint8_t[m_sVideoFrameOri.dataTotalLen];
+		else if (fScaleRatio < 0.9999f || fScaleRatio > 1.0001f || m_nPixelFormat != FG_PIXEL_FORMAT_I420) {
+			// Scaling and conversion run on the scaler's own threads
+			if (m_pScaler == NULL) {
+				m_pScaler = new FgVideoScaler(m_pCallback, m_pHub);
+			}
+			m_pScaler->setOutput(fScaleRatio, m_nPixelFormat);
+			m_pScaler->submit(pFrame, remoteName, remoteDeviceId);
 		}
-		memcpy(m_sVideoFrameOri.data, pFrame->data[0], ySize);
-		memcpy(m_sVideoFrameOri.data + ySize, pFrame->data[1], uSize);
-		memcpy(m_sVideoFrameOri.data + ySize + uSize, pFrame->data[2], vSize);
-		m_sVideoFrameOri.pitch[0] = pFrame->linesize[0];
-		m_sVideoFrameOri.pitch[1] = pFrame->linesize[1];
-		m_sVideoFrameOri.pitch[2] = pFrame->linesize[2];
-
-		if (m_pCallback != NULL)
-		{
-			if (m_fScaleRatio < 0.9999f || m_fScaleRatio > 1.0001f) {
-				scaleH264Data(&m_sVideoFrameOri);
-				m_pCallback->outputVideo(&m_sVideoFrameScale, remoteName, remoteDeviceId);
+		else {
+			if (m_sVideoFrameOri.width != pFrame->width ||
+				m_sVideoFrameOri.height != pFrame->height) {
+				if (m_sVideoFrameOri.data)
+				{
+					delete[] m_sVideoFrameOri.data;
+					m_sVideoFrameOri.data = NULL;
+				}
+			}
+
+			m_sVideoFrameOri.width = pFrame->width;
+			m_sVideoFrameOri.height = pFrame->height;
+			m_sVideoFrameOri.pts = pFrame->pts;
+			m_sVideoFrameOri.isKey = pFrame->key_frame;
+			m_sVideoFrameOri.pixelFormat = FG_PIXEL_FORMAT_I420;
+			int ySize = pFrame->linesize[0] * pFrame->height;
+			int uSize = pFrame->linesize[1] * pFrame->height >> 1;
+			int vSize = pFrame->linesize[2] * pFrame->height >> 1;
+			m_sVideoFrameOri.dataTotalLen = ySize + uSize + vSize;
+			m_sVideoFrameOri.dataLen[0] = ySize;
+			m_sVideoFrameOri.dataLen[1] = uSize;
+			m_sVideoFrameOri.dataLen[2] = vSize;
+			if (!m_sVideoFrameOri.data)
+			{
+				m_sVideoFrameOri.data = new uint8_t[m_sVideoFrameOri.dataTotalLen];
 			}
-			else {
+			memcpy(m_sVideoFrameOri.data, pFrame->data[0], ySize);
+			memcpy(m_sVideoFrameOri.data + ySize, pFrame->data[1], uSize);
+			memcpy(m_sVideoFrameOri.data + ySize + uSize, pFrame->data[2], vSize);
+			m_sVideoFrameOri.pitch[0] = pFrame->linesize[0];
+			m_sVideoFrameOri.pitch[1] = pFrame->linesize[1];
+			m_sVideoFrameOri.pitch[2] = pFrame->linesize[2];
+
+			if (m_pCallback != NULL)
+			{
+				TRACE_SPAN_BEGIN(output);
 				m_pCallback->outputVideo(&m_sVideoFrameOri, remoteName, remoteDeviceId);
+				TRACE_SPAN_END(output, "outputVideo");
 			}
+			m_pHub->publishVideoFrame(&m_sVideoFrameOri, remoteName, remoteDeviceId);
 		}
 	}
 	av_frame_free(&pFrame);
 
 	return 0;
 }
-
-int FgAirplayChannel::scaleH264Data(SFgVideoFrame* pSrcFrame)
-{
-	int nScreenWidth = pSrcFrame->width * m_fScaleRatio;
-	int nScreenHeight = pSrcFrame->height * m_fScaleRatio;
-	if (m_pSwsCtx && m_sVideoFrameScale.width != nScreenWidth || m_sVideoFrameScale.height != nScreenHeight)
-	{
-		sws_freeContext(m_pSwsCtx);
-		m_pSwsCtx = NULL;
-	}
-	if (!m_pSwsCtx)
-	{
-		m_pSwsCtx = sws_getContext(pSrcFrame->width, pSrcFrame->height, AV_PIX_FMT_YUV420P,
-			nScreenWidth, nScreenHeight, AV_PIX_FMT_YUV420P, SWS_BICUBIC /*SWS_POINT*/,
-			NULL, NULL, NULL);
-	}
-	if (m_sVideoFrameScale.width != nScreenWidth || m_sVideoFrameScale.height != nScreenHeight)
-	{
-		delete[] m_sVideoFrameScale.data;
-		m_sVideoFrameScale.data = NULL;
-	}
-
-	m_sVideoFrameScale.width = nScreenWidth;
-	m_sVideoFrameScale.height = nScreenHeight;
-	m_sVideoFrameScale.pts = pSrcFrame->pts;
-	m_sVideoFrameScale.isKey = pSrcFrame->isKey;
-	m_sVideoFrameScale.pitch[0] = ((nScreenWidth + 15) >> 4) << 4;
-	m_sVideoFrameScale.pitch[1] = (((nScreenWidth >> 1) + 15) >> 4) << 4;
-	m_sVideoFrameScale.pitch[2] = m_sVideoFrameScale.pitch[1];
-
-	int ySize = m_sVideoFrameScale.pitch[0] * nScreenHeight;
-	int uSize = m_sVideoFrameScale.pitch[1] * nScreenHeight >> 1;
-	int vSize = m_sVideoFrameScale.pitch[2] * nScreenHeight >> 1;
-	m_sVideoFrameScale.dataTotalLen = ySize + uSize + vSize;
-	m_sVideoFrameScale.dataLen[0] = ySize;
-	m_sVideoFrameScale.dataLen[1] = uSize;
-	m_sVideoFrameScale.dataLen[2] = vSize;
-	if (!m_sVideoFrameScale.data) {
-		m_sVideoFrameScale.data = new uint8_t[m_sVideoFrameScale.dataTotalLen];
-	}
-
-	const uint8_t* srcSlice[3] = { pSrcFrame->data, pSrcFrame->data + pSrcFrame->dataLen[0], pSrcFrame->data + pSrcFrame->dataLen[0] + pSrcFrame->dataLen[1] };
-	const uint8_t* dst[3] = { m_sVideoFrameScale.data,
-		m_sVideoFrameScale.data + m_sVideoFrameScale.dataLen[0],
-		m_sVideoFrameScale.data + m_sVideoFrameScale.dataLen[0] + m_sVideoFrameScale.dataLen[1] };
-	sws_scale(m_pSwsCtx, (const uint8_t* const*)srcSlice, (const int*)pSrcFrame->pitch, 0,
-		pSrcFrame->height, (uint8_t* const*)dst, (const int*)m_sVideoFrameScale.pitch);
-
-	return 0;
-}
@@ -1,6 +1,8 @@
 #pragma once
 #include <queue>
 #include "Airplay2Head.h"
+#include "FgVideoScaler.h"
+#include "FgMediaHub.h"
 
 extern "C"
 {
@@ -14,11 +16,14 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
-// H264 data for decoding
+// Mirror stream data for decoding, H.264 or H.265
 typedef struct SFgH264Data {
-	int pts;
+	long long pts;
 	int size;
-	int is_key;
+	int is_key;		// parameter sets
+	int is_idr;		// a picture to start decoding with
+	int codec;		// EFgVideoCodec
+	int format;		// VIDEO_FORMAT_*
 	int width;
 	int height;
 	unsigned char* data;
@@ -30,35 +35,73 @@ typedef std::queue<SFgH264Data*> FgH264DataQueue;
 class FgAirplayChannel
 {
 public:
-	FgAirplayChannel(IAirServerCallback* pCallback);
+	FgAirplayChannel(IAirServerCallback* pCallback, FgMediaHub* pHub);
 	~FgAirplayChannel();
 
 public:
 	long addRef();
 	long release();
 
-	int initFFmpeg(const void* privatedata, int privatedatalen);
+	int initFFmpeg(const SFgH264Data* config);
 	void unInitFFmpeg();
 	float setScale(float fRatio);
+	int setPixelFormat(int pixelFormat);
+	void setDecodeMode(int mode, const SFgPreviewConfig* preview);
+	// Set before the first frame, lets a full decoding channel degrade under load
+	void setAdaptiveDecode(bool bAdaptive) { m_bAdaptiveDecode = bAdaptive; }
 	int decodeH264Data(SFgH264Data* data, const char* remoteName, const char* remoteDeviceId);
-	int scaleH264Data(SFgVideoFrame* ppFrame);
+	// raop_clock_us of the first decoded picture, 0 until then
+	unsigned long long firstFrameUs() const { return m_ullFirstFrameUs; }
+
+protected:
+	int decodePicture(SFgH264Data* data, bool bPreview, const SFgPreviewConfig& preview,
+		const char* remoteName, const char* remoteDeviceId);
+	void adaptDecode(long long costUs, long long pts, const char* remoteName, const char* remoteDeviceId);
 
 protected:
 	long m_nRef;
 
 	FgH264DataQueue			m_h264Queue;
 	IAirServerCallback*		m_pCallback;
+	FgMediaHub*				m_pHub;
 
 	AVCodec*				m_pCodec;
 	AVCodecContext*			m_pCodecCtx;
-	SwsContext*				m_pSwsCtx;
+	FgVideoScaler*			m_pScaler;
 	bool					m_bCodecOpened;
+	int						m_nCodec;
 
 	void*					m_mutexAudio;
 	void*					m_mutexVideo;
 
 	SFgVideoFrame			m_sVideoFrameOri;
-	SFgVideoFrame			m_sVideoFrameScale;
 	float					m_fScaleRatio;
+	int						m_nPixelFormat;
+
+	// Written by setDecodeMode under m_mutexVideo, read by the decode thread
+	int						m_nDecodeMode;
+	SFgPreviewConfig		m_sPreview;
+	long long				m_llLastOutputPts;
+	unsigned long long		m_ullFirstFrameUs;
+
+	// Degradation ladder, only touched by the decode thread
+	bool					m_bAdaptiveDecode;
+	int						m_nDegradeLevel;
+	bool					m_bWaitIdr;
+	// Pictures were skipped by preview or degradation keyframes only mode
+	bool					m_bSkippedRefs;
+	long long				m_llDecodeAvgUs;
+	long long				m_llFrameAvgUs;
+	long long				m_llLastPts;
+	// Local time and pts of the frame the lag is measured from
+	unsigned long long		m_ullAnchorUs;
+	long long				m_llAnchorPts;
+	// Lag when the current hold started, the next one must beat it by a quarter
+	long long				m_llLagAtStepUs;
+	int						m_nHoldFrames;
+	int						m_nCalmFrames;
+	int						m_nCalmNeeded;
+	unsigned long long		m_ullStepUpUs;
+	unsigned long long		m_ullStepDownUs;
 };
 
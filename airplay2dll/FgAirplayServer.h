@@ -8,8 +8,10 @@
 #include "airplay.h"
 #include "raop.h"
 #include "FgAirplayChannel.h"
+#include "FgMediaHub.h"
 
 typedef std::map<std::string, FgAirplayChannel*> FgAirplayChannelMap;
+typedef std::map<std::string, SFgConnectionTimeline> FgConnectionTimelineMap;
 
 class FgAirplayServer
 {
@@ -19,13 +21,26 @@ public:
 
 	int start(const char serverName[AIRPLAY_NAME_LEN], 
 		unsigned int raopPort, unsigned int airplayPort,
-		IAirServerCallback* callback);
+		IAirServerCallback* callback, const SFgServerOptions* options);
 	void stop();
 	float setScale(float fRatio);
+	int setPixelFormat(int pixelFormat);
+	int setDecodeMode(const char* remoteDeviceId, int mode, const SFgPreviewConfig* preview);
+	int getPhaseStats(SFgPhaseHistogram stats[FG_PHASE_COUNT], bool bReset);
+	int setPlaybackState(int state, double duration, double position, double rate);
+	int subscribe(const char* remoteDeviceId, const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber);
+	int unsubscribe(int subscription);
+	int getSubscriberStats(int subscription, SFgSubscriberStats* stats);
+	int pollOpen(const char* remoteDeviceId, const SFgPollConfig* config);
+	int pollClose(int poll);
+	int pollVideo(int poll, SFgVideoFrame** frame, unsigned int timeoutMs);
+	int pollAudio(int poll, SFgAudioFrame** frame, unsigned int timeoutMs);
+	int getPollStats(int poll, SFgPollStats* stats);
 
 protected:
 	void clearChannels();
 	FgAirplayChannel* getChannel(const char* remoteDeviceId);
+	void finishTimeline(const char* remoteName, const char* remoteDeviceId, unsigned long long firstFrameUs);
 
 	static void connected(void* cls, const char* remoteName, const char* remoteDeviceId);
 	static void disconnected(void* cls, const char* remoteName, const char* remoteDeviceId);
@@ -38,6 +53,7 @@ protected:
 	static void audio_flush(void* cls, void* session, const char* remoteName, const char* remoteDeviceId);
 	static void audio_destroy(void* cls, void* session, const char* remoteName, const char* remoteDeviceId);
 	static void video_process(void* cls, h264_decode_struct* data, const char* remoteName, const char* remoteDeviceId);
+	static void connection_phase(void* cls, int phase, uint64_t time_us, const char* remoteName, const char* remoteDeviceId);
 	static void log_callback(void* cls, int level, const char* msg);
 
 	static void ap_video_play(void* cls, char* url, double volume, double start_pos);
@@ -58,6 +74,17 @@ protected:
 	void*					m_mutexMap;
 
 	float					m_fScaleRatio;
+	int						m_nPixelFormat;
+	int						m_nDecodeMode;
+	bool					m_bAdaptiveDecode;
+	SFgPreviewConfig		m_sPreview;
 	FgAirplayChannelMap		m_mapChannel;
+
+	// Sessions still collecting phases, and the histograms of finished ones
+	FgConnectionTimelineMap	m_mapTimeline;
+	SFgPhaseHistogram		m_sPhaseStats[FG_PHASE_COUNT];
+
+	// Subscribers next to m_pCallback, outlives the channels
+	FgMediaHub*				m_pHub;
 };
 
@@ -0,0 +1,33 @@
+#pragma once
+#include <Windows.h>
+#include "Airplay2Def.h"
+
+// Payload capacity of a pooled block. Covers one decoded packet of every
+// codec the receiver produces (ELD 480, ALAC 352, AAC-LC 1024 samples,
+// stereo 16 bit) so the steady state never touches the heap.
+#define FG_AUDIO_BLOCK_CAPACITY		8192
+// Free blocks kept around for reuse; anything above is returned to the heap.
+#define FG_AUDIO_POOL_MAX_FREE		256
+
+// Refcounted, recyclable storage for PCM frames that a consumer wants to keep
+// after IAirServerCallback::outputAudio returned.
+class FgAudioFramePool
+{
+public:
+	static FgAudioFramePool* instance();
+
+	SFgAudioFrame* retain(const SFgAudioFrame* frame);
+	void addRef(SFgAudioFrame* frame);
+	void release(SFgAudioFrame* frame);
+
+protected:
+	FgAudioFramePool();
+	~FgAudioFramePool();
+
+	struct SBlock;
+	SBlock* allocBlock(unsigned int dataLen);
+	void freeBlock(SBlock* block);
+
+protected:
+	SLIST_HEADER			m_freeList;
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include <Windows.h>
+#include <deque>
+#include <map>
+#include <string>
+#include "Airplay2Head.h"
+
+#define FG_HUB_DEFAULT_MAX_ITEMS	64
+#define FG_HUB_DEFAULT_POLL_VIDEO	4
+#define FG_HUB_DEFAULT_POLL_AUDIO	32
+
+// What a queued item carries
+typedef enum EFgHubItemKind {
+	FG_HUB_VIDEO_PACKET = 0,
+	FG_HUB_VIDEO_FRAME,
+	FG_HUB_AUDIO_PACKET,
+	FG_HUB_AUDIO_FRAME,
+	FG_HUB_DISCONNECTED,
+} EFgHubItemKind;
+
+// One published packet or frame. Every queue it is in holds a reference,
+// the media itself is copied once however many subscribers there are.
+typedef struct SFgHubItem {
+	volatile LONG	nRef;
+	int				kind;
+	void*			media;			// SFgMediaPacket, SFgVideoFrame or pooled SFgAudioFrame
+	unsigned int	bytes;
+	bool			isKey;
+	char			remoteName[AIRPLAY_NAME_LEN];
+	char			remoteDeviceId[32];
+} SFgHubItem;
+
+typedef std::deque<SFgHubItem*> FgHubItemQueue;
+
+// Video packet state of a subscriber, per sender
+#define FG_HUB_WAIT_KEY			0x01	// skipping up to the next IDR
+#define FG_HUB_CONFIG_LOST		0x02	// the last config never made it into the queue
+
+class FgMediaHub;
+
+typedef struct SFgSubscription {
+	FgMediaHub*				pOwner;
+	int						id;
+	std::string				strDeviceId;	// empty for every sender
+	SFgSubscribeConfig		config;
+	IAirServerSubscriber*	pSubscriber;
+	HANDLE					hThread;
+	HANDLE					hEvent;
+	bool					bQuit;
+
+	// Below here protected by the hub mutex
+	FgHubItemQueue			queue;
+	SFgSubscriberStats		stats;
+	std::map<std::string, int>	mapVideoState;
+} SFgSubscription;
+
+typedef std::map<int, SFgSubscription*> FgSubscriptionMap;
+
+// Frames of one kind waiting for fgServerPoll*, oldest at head
+typedef struct SFgPollRing {
+	SFgHubItem**		items;
+	unsigned int		head;
+	unsigned int		count;
+	HANDLE				hNotEmpty;		// manual reset, set while count > 0
+	HANDLE				hNotFull;		// manual reset, set while count < capacity
+	SFgPollRingStats	stats;
+} SFgPollRing;
+
+// A poll is referenced by the map and by every thread inside a call on it,
+// so closing it only has to wake them up.
+typedef struct SFgPoll {
+	volatile LONG		nRef;
+	int					id;
+	std::string			strDeviceId;
+	SFgPollConfig		config;
+	HANDLE				hClosed;		// manual reset
+
+	// Below here protected by the hub mutex
+	bool				bClosed;
+	SFgPollRing			video;
+	SFgPollRing			audio;
+} SFgPoll;
+
+typedef std::map<int, SFgPoll*> FgPollMap;
+typedef std::map<std::string, SFgHubItem*> FgHubItemMap;
+
+// Fan-out of the sessions to the subscribers registered with fgServerSubscribe.
+// The publish calls come from the receive and decode threads and never wait
+// for a subscriber: they only take references and append to bounded queues,
+// each subscription has its own delivery thread.
+class FgMediaHub
+{
+public:
+	FgMediaHub();
+	~FgMediaHub();
+
+	int subscribe(const char* remoteDeviceId, const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber);
+	int unsubscribe(int id);
+	int getStats(int id, SFgSubscriberStats* stats);
+
+	int pollOpen(const char* remoteDeviceId, const SFgPollConfig* config);
+	int pollClose(int id);
+	int pollVideo(int id, SFgVideoFrame** frame, unsigned int timeoutMs);
+	int pollAudio(int id, SFgAudioFrame** frame, unsigned int timeoutMs);
+	int getPollStats(int id, SFgPollStats* stats);
+	// Wakes up decoding threads waiting for a FG_POLL_BLOCK ring
+	void closePolls();
+
+	void publishVideoPacket(const unsigned char* data, int len, bool bConfig, bool bKey, int codec,
+		unsigned long long ntpPts, const char* remoteName, const char* remoteDeviceId);
+	void publishVideoFrame(const SFgVideoFrame* frame, const char* remoteName, const char* remoteDeviceId);
+	void publishAudioPacket(const unsigned char* data, int len, int codec, unsigned long long ntpPts,
+		const char* remoteName, const char* remoteDeviceId);
+	void publishAudioFrame(const SFgAudioFrame* frame, const char* remoteName, const char* remoteDeviceId);
+	void publishDisconnected(const char* remoteName, const char* remoteDeviceId);
+
+	// Refcounted copies behind fgMediaPacket* / fgVideoFrame*
+	static SFgMediaPacket* retainPacket(int type, int isKey, int codec, unsigned long long ntpPts,
+		const unsigned char* data, unsigned int dataLen);
+	static void addRefPacket(SFgMediaPacket* packet);
+	static void releasePacket(SFgMediaPacket* packet);
+	static SFgVideoFrame* retainVideoFrame(const SFgVideoFrame* frame);
+	static void addRefVideoFrame(SFgVideoFrame* frame);
+	static void releaseVideoFrame(SFgVideoFrame* frame);
+
+protected:
+	bool hasSubscriber(unsigned int media, const char* remoteDeviceId);
+	SFgHubItem* newItem(int kind, void* media, unsigned int bytes, bool isKey,
+		const char* remoteName, const char* remoteDeviceId);
+	static void releaseItem(SFgHubItem* item);
+	void publish(SFgHubItem* item, unsigned int media);
+	void enqueue(SFgSubscription* sub, SFgHubItem* item);
+	bool makeRoom(SFgSubscription* sub, unsigned int count, unsigned int bytes);
+
+	static bool initRing(SFgPollRing* ring, unsigned int capacity);
+	static void clearRing(SFgPollRing* ring);
+	static void releasePoll(SFgPoll* poll);
+	SFgPoll* findPoll(int id);
+	static bool pushRing(SFgPoll* poll, SFgPollRing* ring, SFgHubItem* item);
+	static SFgHubItem* popRing(SFgPollRing* ring);
+	void publishPolls(SFgHubItem* item, unsigned int media);
+	SFgHubItem* pollItem(int id, int kind, unsigned int timeoutMs, int* result);
+
+	static DWORD WINAPI deliveryThread(LPVOID param);
+	void deliveryLoop(SFgSubscription* sub);
+	void deliver(SFgSubscription* sub, SFgHubItem* item);
+
+protected:
+	HANDLE					m_mutexHub;
+	int						m_nNextId;
+	FgSubscriptionMap		m_mapSubscription;
+	FgPollMap				m_mapPoll;
+	// Last video config of every sender, for subscribers that join or drop
+	FgHubItemMap			m_mapConfig;
+};
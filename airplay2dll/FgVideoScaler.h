@@ -0,0 +1,99 @@
+#pragma once
+#include <Windows.h>
+#include <string>
+#include "Airplay2Head.h"
+#include "FgMediaHub.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+}
+
+#define FG_SCALE_MAX_WORKERS	4
+// Filters tried from best to cheapest when the stage falls behind
+#define FG_SCALE_FILTER_LEVELS	4
+
+class FgVideoScaler;
+
+typedef struct SFgScaleWorker {
+	FgVideoScaler*	pOwner;
+	HANDLE			hThread;
+	HANDLE			hStart;
+	HANDLE			hDone;
+	SwsContext*		pSwsCtx;
+	int				srcY;
+	int				srcH;
+	int				dstY;
+	int				dstH;
+} SFgScaleWorker;
+
+// Scaling / colour conversion stage of a channel.
+// Runs on its own thread so the decoder never waits on it. A 1:1 format
+// conversion is split into horizontal bands converted in parallel by a small
+// worker pool. Resizing needs the rows around every output line, so it runs
+// through one context on the scaler thread.
+class FgVideoScaler
+{
+public:
+	FgVideoScaler(IAirServerCallback* pCallback, FgMediaHub* pHub);
+	~FgVideoScaler();
+
+	// A non-zero box overrides fRatio, the picture is fitted inside it
+	void setOutput(float fRatio, int pixelFormat, unsigned int boxWidth = 0, unsigned int boxHeight = 0);
+	// Takes a reference on frame. A frame still waiting to be scaled is
+	// replaced, which also tells the stage it is not keeping up.
+	void submit(AVFrame* frame, const char* remoteName, const char* remoteDeviceId);
+	int currentFilter();
+
+protected:
+	static DWORD WINAPI scaleThread(LPVOID param);
+	static DWORD WINAPI workerThread(LPVOID param);
+	void scaleLoop();
+	void scaleFrame(AVFrame* frame);
+	void scaleBand(SFgScaleWorker* worker);
+	bool prepare(AVFrame* frame, int dstWidth, int dstHeight, int pixelFormat);
+	void freeContexts();
+	void adaptFilter(long long costUs, long long intervalUs, bool dropped);
+
+protected:
+	IAirServerCallback*		m_pCallback;
+	FgMediaHub*				m_pHub;
+	HANDLE					m_hThread;
+	HANDLE					m_hEvent;
+	HANDLE					m_mutexJob;
+	volatile bool			m_bQuit;
+
+	// Mailbox between the decoder and the scaling thread
+	AVFrame*				m_pPending;
+	std::string				m_strRemoteName;
+	std::string				m_strRemoteDeviceId;
+	bool					m_bDropped;
+
+	float					m_fScaleRatio;
+	int						m_nPixelFormat;
+	unsigned int			m_nBoxWidth;
+	unsigned int			m_nBoxHeight;
+
+	int						m_nWorkers;
+	SFgScaleWorker			m_workers[FG_SCALE_MAX_WORKERS];
+	AVFrame*				m_pSrcFrame;
+	uint8_t*				m_dstPlanes[4];
+	int						m_dstStrides[4];
+
+	// Geometry the worker contexts were built for
+	int						m_nSrcWidth;
+	int						m_nSrcHeight;
+	int						m_nDstFormat;
+	int						m_nFilterLevel;
+	int						m_nCtxFilterLevel;
+
+	// Load tracking for the filter ladder
+	long long				m_llCostAvgUs;
+	long long				m_llLastPts;
+	int						m_nCalmFrames;
+
+	SFgVideoFrame			m_sVideoFrame;
+	unsigned int			m_nDataCapacity;
+};
@@ -3,17 +3,26 @@
 #define AIRPLAY_NAME_LEN 128
 
 typedef struct SFgAudioFrame {
-	unsigned long long pts;
+	unsigned long long pts;			// RTP timestamp of the first sample
 	unsigned int sampleRate;
 	unsigned short channels;
 	unsigned short bitsPerSample;
 	unsigned int dataLen;
 	unsigned char* data;
+	unsigned long long ntpPts;		// Play time on the sender NTP clock (us), 0 until known
 } SFgAudioFrame;
 
+// Pixel layout of SFgVideoFrame::data
+typedef enum EFgPixelFormat {
+	FG_PIXEL_FORMAT_I420 = 0,	// Y, U, V planes
+	FG_PIXEL_FORMAT_NV12,		// Y plane, interleaved UV plane
+	FG_PIXEL_FORMAT_BGRA,		// single packed plane
+	FG_PIXEL_FORMAT_RGBA,		// single packed plane
+} EFgPixelFormat;
+
 // Decoded video frame
 typedef struct SFgVideoFrame {
-	unsigned long long pts;
+	unsigned long long pts;			// Capture time on the sender NTP clock (us)
 	int isKey;
 	unsigned int width;
 	unsigned int height;
@@ -21,4 +30,217 @@ typedef struct SFgVideoFrame {
 	unsigned int dataLen[3];
 	unsigned int dataTotalLen;
 	unsigned char* data;
+	int pixelFormat;				// EFgPixelFormat, unused pitch/dataLen entries are 0
 }SFgVideoFrame;
+
+// State of the player started by IAirServerCallback::videoPlay
+typedef enum EFgPlaybackState {
+	FG_PLAYBACK_PLAYING = 0,
+	FG_PLAYBACK_PAUSED,
+	FG_PLAYBACK_LOADING,
+	FG_PLAYBACK_STOPPED,
+} EFgPlaybackState;
+
+// How a mirroring channel decodes its stream
+typedef enum EFgDecodeMode {
+	FG_DECODE_FULL = 0,			// every frame, delivered at full rate
+	FG_DECODE_PREVIEW,			// thumbnail: skipped frames, limited size and rate
+} EFgDecodeMode;
+
+// Steps a full decoding channel takes when it cannot keep up, each one on top
+// of the ones before. It steps back once the load has dropped for a while.
+typedef enum EFgDegradeLevel {
+	FG_DEGRADE_NONE = 0,
+	FG_DEGRADE_SKIP_LOOP_FILTER,	// no deblocking on non-reference frames
+	FG_DEGRADE_SKIP_NONREF,			// non-reference frames are not decoded
+	FG_DEGRADE_KEYFRAMES_ONLY,		// only IDR pictures are decoded
+	FG_DEGRADE_REDUCED_SCALE,		// delivered at half the size
+	FG_DEGRADE_LEVEL_COUNT
+} EFgDegradeLevel;
+
+// Load of a channel when its EFgDegradeLevel changed, averages in us
+typedef struct SFgDecodeLoad {
+	int level;					// EFgDegradeLevel
+	int previousLevel;
+	unsigned int decodeUs;		// decoding and delivering one frame
+	unsigned int frameUs;		// between frames of the stream
+	unsigned int lagUs;			// behind the sender's pace
+} SFgDecodeLoad;
+
+typedef struct SFgPreviewConfig {
+	unsigned int width;			// thumbnail box, the picture is fitted inside
+	unsigned int height;
+	float fps;					// delivered frames per second, 0 for no limit
+	int keyframesOnly;			// decode IDR frames only (AVDISCARD_NONKEY) instead of
+								// skipping non-reference frames (AVDISCARD_NONREF).
+								// Mirroring senders send few IDRs, tiles then refresh rarely.
+} SFgPreviewConfig;
+
+// The display advertised to senders in /info, fgServerStartEx. Senders
+// encode the mirror stream for it, so asking for the size and rate that is
+// actually shown saves network, decryption and decoding instead of scaling
+// the frames down afterwards. 0 keeps the default of a field.
+typedef struct SFgServerOptions {
+	unsigned int displayWidth;		// pixels, default 1920
+	unsigned int displayHeight;		// pixels, default 1080
+	unsigned int refreshRate;		// Hz, default 60
+	unsigned int maxFps;			// default 30
+	int overscanned;				// the display crops its edges
+	unsigned long long features;	// AirPlay feature bits, for /info and mDNS
+	int hevc;						// let senders mirror in H.265
+	int annexB;						// video packets as Annex B, see EFgPacketType
+	int bufferedAudio;				// offer buffered audio over TCP, needs PTP senders
+	int fixedQuality;				// never degrade decoding to keep up, see EFgDegradeLevel
+} SFgServerOptions;
+
+// Connection phases of a mirroring session, in the order a sender normally
+// goes through them
+typedef enum EFgConnectionPhase {
+	FG_PHASE_INFO = 0,			// GET /info answered
+	FG_PHASE_PAIR_SETUP,
+	FG_PHASE_PAIR_VERIFY,
+	FG_PHASE_FP_SETUP,			// FairPlay handshake done
+	FG_PHASE_SETUP_SESSION,		// SETUP 1, keys
+	FG_PHASE_SETUP_MIRROR,		// SETUP 2, video stream
+	FG_PHASE_SETUP_AUDIO,		// SETUP 3, audio stream
+	FG_PHASE_RECORD,
+	FG_PHASE_MIRROR_ACCEPT,		// mirror data connection accepted
+	FG_PHASE_MIRROR_SPS_PPS,	// first codec header received
+	FG_PHASE_MIRROR_IDR,		// first IDR received
+	FG_PHASE_FIRST_FRAME,		// first picture out of the decoder
+	FG_PHASE_COUNT,
+} EFgConnectionPhase;
+
+// When each phase completed, in microseconds of a monotonic clock.
+// 0 for phases the session did not go through.
+typedef struct SFgConnectionTimeline {
+	unsigned long long phaseUs[FG_PHASE_COUNT];
+} SFgConnectionTimeline;
+
+#define FG_PHASE_HISTOGRAM_BUCKETS 16
+
+// Time from the earliest phase of a session to one phase, over the sessions
+// that reached their first decoded frame. bucket[0] counts samples under 1ms,
+// bucket[i] those in [2^(i-1), 2^i) ms and the last bucket everything longer.
+typedef struct SFgPhaseHistogram {
+	unsigned int count;
+	unsigned int bucket[FG_PHASE_HISTOGRAM_BUCKETS];
+	unsigned long long totalUs;
+	unsigned long long maxUs;
+} SFgPhaseHistogram;
+
+// Compressed media of a session as the sender sent it. Video is AVCC unless
+// SFgServerOptions::annexB is set: pictures as NALs with 4 byte big endian
+// lengths, the config as the avcC or hvcC record.
+typedef enum EFgPacketType {
+	FG_PACKET_VIDEO_CONFIG = 0,	// parameter sets (H.265 also VPS)
+	FG_PACKET_VIDEO,			// one picture
+	FG_PACKET_AUDIO,			// one audio frame, see EFgAudioCodec
+} EFgPacketType;
+
+// Codec of the mirror stream, H.265 only with SFgServerOptions::hevc
+typedef enum EFgVideoCodec {
+	FG_VIDEO_CODEC_H264 = 0,
+	FG_VIDEO_CODEC_H265,
+} EFgVideoCodec;
+
+// Codec of the audio stream, as the sender SETUP it. Mirroring is AAC-ELD.
+typedef enum EFgAudioCodec {
+	FG_AUDIO_CODEC_ALAC = 2,
+	FG_AUDIO_CODEC_AAC_LC = 4,	// raw access units
+	FG_AUDIO_CODEC_AAC_ELD = 8,	// raw access units
+} EFgAudioCodec;
+
+typedef struct SFgMediaPacket {
+	int type;					// EFgPacketType
+	int isKey;					// config and IDR pictures, every audio packet
+	unsigned long long ntpPts;	// Sender NTP clock (us)
+	unsigned int dataLen;
+	unsigned char* data;
+	int codec;					// EFgVideoCodec or EFgAudioCodec
+} SFgMediaPacket;
+
+// What a subscriber receives, any combination
+#define FG_SUBSCRIBE_VIDEO_PACKETS	0x01
+#define FG_SUBSCRIBE_VIDEO_FRAMES	0x02	// as delivered to outputVideo
+#define FG_SUBSCRIBE_AUDIO_PACKETS	0x04
+#define FG_SUBSCRIBE_AUDIO_FRAMES	0x08	// as delivered to outputAudio
+
+// What happens to a subscriber whose queue is full. Other subscribers and
+// the receive threads are never held up either way.
+typedef enum EFgDropPolicy {
+	FG_DROP_NEWEST = 0,			// the new item is dropped
+	FG_DROP_OLDEST,				// queued items make room, oldest first
+	FG_DROP_TO_KEYFRAME,		// like FG_DROP_NEWEST, then video packets are skipped
+								// up to the next IDR so a decoder can carry on
+} EFgDropPolicy;
+
+typedef struct SFgSubscribeConfig {
+	unsigned int media;			// FG_SUBSCRIBE_* flags
+	unsigned int maxItems;		// queue limit, 0 for the default of 64
+	unsigned int maxBytes;		// 0 for no byte limit
+	int dropPolicy;				// EFgDropPolicy
+} SFgSubscribeConfig;
+
+typedef struct SFgSubscriberStats {
+	unsigned long long delivered;
+	unsigned long long dropped;
+	unsigned int queuedItems;
+	unsigned int queuedBytes;
+} SFgSubscriberStats;
+
+// What a poll ring does when the consumer falls behind
+typedef enum EFgPollPolicy {
+	FG_POLL_OVERWRITE_OLDEST = 0,	// the oldest frame makes room, decoding never waits
+	FG_POLL_BLOCK,					// decoding of the sender waits for room, at most
+									// blockTimeoutMs, then the new frame is dropped
+} EFgPollPolicy;
+
+#define FG_POLL_INFINITE	0xFFFFFFFF
+
+typedef struct SFgPollConfig {
+	unsigned int media;			// FG_SUBSCRIBE_VIDEO_FRAMES and/or FG_SUBSCRIBE_AUDIO_FRAMES
+	unsigned int videoFrames;	// ring size, 0 for the default of 4
+	unsigned int audioFrames;	// ring size, 0 for the default of 32
+	int policy;					// EFgPollPolicy
+	unsigned int blockTimeoutMs;// FG_POLL_BLOCK only, FG_POLL_INFINITE waits until polled
+} SFgPollConfig;
+
+typedef struct SFgPollRingStats {
+	unsigned int capacity;
+	unsigned int queued;
+	unsigned long long polled;
+	unsigned long long overwritten;	// FG_POLL_OVERWRITE_OLDEST
+	unsigned long long dropped;		// FG_POLL_BLOCK timeouts
+} SFgPollRingStats;
+
+typedef struct SFgPollStats {
+	SFgPollRingStats video;
+	SFgPollRingStats audio;
+} SFgPollStats;
+
+// Threads of a session, by what they do
+typedef enum EFgThreadRole {
+	FG_THREAD_AUDIO = 0,	// audio receive and decode
+	FG_THREAD_TIMING,		// NTP timing exchange
+	FG_THREAD_MIRROR,		// mirror receive and decode
+	FG_THREAD_DECODE,		// scaling
+	FG_THREAD_CONTROL,		// RTSP, mDNS and pairing
+	FG_THREAD_ROLE_COUNT
+} EFgThreadRole;
+
+typedef enum EFgThreadSched {
+	FG_SCHED_OTHER = 0,		// priority is a nice value
+	FG_SCHED_FIFO,			// realtime, MMCSS on Windows
+	FG_SCHED_RR
+} EFgThreadSched;
+
+// Audio and timing default to FG_SCHED_FIFO on the last CPU, mirror and
+// decode to the other CPUs. Without the privileges for realtime the threads
+// fall back to the highest priority they may take.
+typedef struct SFgThreadPolicy {
+	int sched;						// EFgThreadSched
+	int priority;					// 1-99 realtime, -20-19 nice
+	unsigned long long affinity;	// CPU mask, 0 for any
+	char name[16];					// thread name, empty keeps it
+} SFgThreadPolicy;
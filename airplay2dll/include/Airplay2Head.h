@@ -13,6 +13,8 @@ class IAirServerCallback {
 public:
 	virtual void connected(const char* remoteName, const char* remoteDeviceId) = 0;
 	virtual void disconnected(const char* remoteName, const char* remoteDeviceId) = 0;
+	// data points into the receiver's own buffers and is only valid until the
+	// call returns; use fgAudioFrameRetain to keep it longer.
 	virtual void outputAudio(SFgAudioFrame* data, const char* remoteName, const char* remoteDeviceId) = 0;
 	virtual void outputVideo(SFgVideoFrame* data, const char* remoteName, const char* remoteDeviceId) = 0;
 
@@ -20,11 +22,99 @@ public:
 	virtual void videoGetPlayInfo(double* duration, double* position, double* rate) = 0;
 
 	virtual void log(int level, const char* msg) = 0;
+
+	// Phases of a mirroring session, reported once its first frame is decoded
+	virtual void connectionTimeline(const SFgConnectionTimeline* timeline, const char* remoteName, const char* remoteDeviceId) {}
+	// A full decoding channel changed its EFgDegradeLevel, on the decode thread
+	virtual void decodeLevelChanged(const SFgDecodeLoad* load, const char* remoteName, const char* remoteDeviceId) {}
+};
+
+// An extra consumer of the sessions, see fgServerSubscribe. Every subscriber
+// is called on its own thread, in the order the media arrived. The buffers
+// are shared with the other subscribers and must not be modified; they stay
+// valid until the call returns, the AddRef functions below keep them longer.
+class IAirServerSubscriber {
+public:
+	virtual void onVideoPacket(SFgMediaPacket* packet, const char* remoteName, const char* remoteDeviceId) {}
+	virtual void onVideoFrame(SFgVideoFrame* frame, const char* remoteName, const char* remoteDeviceId) {}
+	virtual void onAudioPacket(SFgMediaPacket* packet, const char* remoteName, const char* remoteDeviceId) {}
+	virtual void onAudioFrame(SFgAudioFrame* frame, const char* remoteName, const char* remoteDeviceId) {}
+	// After the last media of the session, never dropped
+	virtual void onDisconnected(const char* remoteName, const char* remoteDeviceId) {}
 };
 
 AIRPLAY2_API void* fgServerStart(const char serverName[AIRPLAY_NAME_LEN], 
 	unsigned int raopPort, unsigned int airplayPort,
 	IAirServerCallback* callback);
+// The same with the advertised display and features, options may be NULL.
+// Both return NULL when the server could not start.
+AIRPLAY2_API void* fgServerStartEx(const char serverName[AIRPLAY_NAME_LEN],
+	unsigned int raopPort, unsigned int airplayPort,
+	IAirServerCallback* callback, const SFgServerOptions* options);
 AIRPLAY2_API void fgServerStop(void* handle);
 
 AIRPLAY2_API float fgServerScale(void* handle, float fRatio);
+// Selects the EFgPixelFormat delivered to outputVideo, returns the format in use
+AIRPLAY2_API int fgServerSetPixelFormat(void* handle, int pixelFormat);
+// Switches a channel between full and preview decoding at runtime. A NULL
+// remoteDeviceId applies to every channel and to channels connecting later.
+// preview may be NULL for FG_DECODE_FULL. After a keyframesOnly preview no
+// picture is delivered until the sender's next IDR.
+AIRPLAY2_API int fgServerSetDecodeMode(void* handle, const char* remoteDeviceId,
+	int mode, const SFgPreviewConfig* preview);
+// Copies the per-phase connection latency histograms, reset clears them afterwards
+AIRPLAY2_API int fgServerGetPhaseStats(void* handle, SFgPhaseHistogram stats[FG_PHASE_COUNT], int reset);
+// The player reports its EFgPlaybackState when it changes, times in seconds.
+// Senders are then answered and notified from it, videoGetPlayInfo is only
+// called until the first report.
+AIRPLAY2_API int fgServerSetPlaybackState(void* handle, int state, double duration, double position, double rate);
+
+// Adds a subscriber for one sender, or for every sender when remoteDeviceId
+// is NULL. Each gets its own bounded queue and delivery thread, so a slow
+// subscriber only drops its own items. Returns the subscription id, -1 on error.
+AIRPLAY2_API int fgServerSubscribe(void* handle, const char* remoteDeviceId,
+	const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber);
+// Waits for a call in progress, so not from inside the subscriber's callbacks.
+// Queued items are discarded.
+AIRPLAY2_API int fgServerUnsubscribe(void* handle, int subscription);
+AIRPLAY2_API int fgServerGetSubscriberStats(void* handle, int subscription, SFgSubscriberStats* stats);
+
+// Pull alternative to outputVideo / outputAudio: the decoded frames of one
+// sender are kept in bounded rings, one for video and one for audio, that
+// the caller drains from its own threads. Frames are shared with the
+// subscribers, not copied per poll. Returns the poll id, -1 on error.
+AIRPLAY2_API int fgServerPollOpen(void* handle, const char* remoteDeviceId, const SFgPollConfig* config);
+// Wakes up waiting poll calls, queued frames are discarded
+AIRPLAY2_API int fgServerPollClose(void* handle, int poll);
+// Waits up to timeoutMs (0 only checks, FG_POLL_INFINITE) for the oldest
+// frame. Returns 0 with a frame for fgVideoFrameRelease / fgAudioFrameRelease,
+// 1 on timeout, -1 on error or when the poll was closed meanwhile.
+AIRPLAY2_API int fgServerPollVideo(void* handle, int poll, SFgVideoFrame** frame, unsigned int timeoutMs);
+AIRPLAY2_API int fgServerPollAudio(void* handle, int poll, SFgAudioFrame** frame, unsigned int timeoutMs);
+AIRPLAY2_API int fgServerGetPollStats(void* handle, int poll, SFgPollStats* stats);
+
+// Copies a frame received in outputAudio into a pooled, refcounted block
+// (refcount 1). Only frames returned from here may be passed to
+// fgAudioFrameAddRef / fgAudioFrameRelease.
+AIRPLAY2_API SFgAudioFrame* fgAudioFrameRetain(const SFgAudioFrame* frame);
+AIRPLAY2_API void fgAudioFrameAddRef(SFgAudioFrame* frame);
+AIRPLAY2_API void fgAudioFrameRelease(SFgAudioFrame* frame);
+
+// The same for packets and video frames received by a subscriber.
+// fgVideoFrameRetain also copies a frame received in outputVideo.
+AIRPLAY2_API void fgMediaPacketAddRef(SFgMediaPacket* packet);
+AIRPLAY2_API void fgMediaPacketRelease(SFgMediaPacket* packet);
+AIRPLAY2_API SFgVideoFrame* fgVideoFrameRetain(const SFgVideoFrame* frame);
+AIRPLAY2_API void fgVideoFrameAddRef(SFgVideoFrame* frame);
+AIRPLAY2_API void fgVideoFrameRelease(SFgVideoFrame* frame);
+
+// Pipeline tracing, only records when built with AIRPLAY_TRACE defined.
+// fgTraceStart drops earlier spans, fgTraceDump writes Chrome trace JSON
+// for chrome://tracing or ui.perfetto.dev. Both return -1 without tracing.
+AIRPLAY2_API int fgTraceStart();
+AIRPLAY2_API int fgTraceDump(const char* path);
+
+// Scheduling of the library threads by EFgThreadRole, process wide. Set
+// before fgServerStart, threads already running keep their policy.
+AIRPLAY2_API int fgSetThreadPolicy(int role, const SFgThreadPolicy* policy);
+AIRPLAY2_API int fgGetThreadPolicy(int role, SFgThreadPolicy* policy);
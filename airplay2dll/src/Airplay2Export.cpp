@@ -1,12 +1,25 @@
 #include "Airplay2Head.h"
 #include "FgAirplayServer.h"
+#include "FgAudioFramePool.h"
+#include "FgMediaHub.h"
+#include "trace.h"
 
 void* fgServerStart(const char serverName[AIRPLAY_NAME_LEN], 
 	unsigned int raopPort, unsigned int airplayPort,
 	IAirServerCallback* callback) 
+{
+	return fgServerStartEx(serverName, raopPort, airplayPort, callback, NULL);
+}
+
+void* fgServerStartEx(const char serverName[AIRPLAY_NAME_LEN],
+	unsigned int raopPort, unsigned int airplayPort,
+	IAirServerCallback* callback, const SFgServerOptions* options)
 {
 	FgAirplayServer* pServer = new FgAirplayServer();
-	pServer->start(serverName, raopPort, airplayPort, callback);
+	if (pServer->start(serverName, raopPort, airplayPort, callback, options) != 0) {
+		delete pServer;
+		return NULL;
+	}
 	return pServer;
 }
 
@@ -30,3 +43,207 @@ float fgServerScale(void* handle, float fRatio)
 
 	return 1.0f;
 }
+
+int fgServerSetPixelFormat(void* handle, int pixelFormat)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->setPixelFormat(pixelFormat);
+	}
+
+	return FG_PIXEL_FORMAT_I420;
+}
+
+int fgServerSetDecodeMode(void* handle, const char* remoteDeviceId,
+	int mode, const SFgPreviewConfig* preview)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->setDecodeMode(remoteDeviceId, mode, preview);
+	}
+
+	return -1;
+}
+
+int fgServerGetPhaseStats(void* handle, SFgPhaseHistogram stats[FG_PHASE_COUNT], int reset)
+{
+	if (handle != NULL && stats != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->getPhaseStats(stats, reset != 0);
+	}
+
+	return -1;
+}
+
+int fgServerSetPlaybackState(void* handle, int state, double duration, double position, double rate)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->setPlaybackState(state, duration, position, rate);
+	}
+
+	return -1;
+}
+
+int fgServerSubscribe(void* handle, const char* remoteDeviceId,
+	const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->subscribe(remoteDeviceId, config, subscriber);
+	}
+
+	return -1;
+}
+
+int fgServerUnsubscribe(void* handle, int subscription)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->unsubscribe(subscription);
+	}
+
+	return -1;
+}
+
+int fgServerGetSubscriberStats(void* handle, int subscription, SFgSubscriberStats* stats)
+{
+	if (handle != NULL && stats != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->getSubscriberStats(subscription, stats);
+	}
+
+	return -1;
+}
+
+int fgServerPollOpen(void* handle, const char* remoteDeviceId, const SFgPollConfig* config)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->pollOpen(remoteDeviceId, config);
+	}
+
+	return -1;
+}
+
+int fgServerPollClose(void* handle, int poll)
+{
+	if (handle != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->pollClose(poll);
+	}
+
+	return -1;
+}
+
+int fgServerPollVideo(void* handle, int poll, SFgVideoFrame** frame, unsigned int timeoutMs)
+{
+	if (handle != NULL && frame != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->pollVideo(poll, frame, timeoutMs);
+	}
+
+	return -1;
+}
+
+int fgServerPollAudio(void* handle, int poll, SFgAudioFrame** frame, unsigned int timeoutMs)
+{
+	if (handle != NULL && frame != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->pollAudio(poll, frame, timeoutMs);
+	}
+
+	return -1;
+}
+
+int fgServerGetPollStats(void* handle, int poll, SFgPollStats* stats)
+{
+	if (handle != NULL && stats != NULL) {
+		FgAirplayServer* pServer = (FgAirplayServer*)handle;
+		return pServer->getPollStats(poll, stats);
+	}
+
+	return -1;
+}
+
+SFgAudioFrame* fgAudioFrameRetain(const SFgAudioFrame* frame)
+{
+	return FgAudioFramePool::instance()->retain(frame);
+}
+
+void fgAudioFrameAddRef(SFgAudioFrame* frame)
+{
+	FgAudioFramePool::instance()->addRef(frame);
+}
+
+void fgAudioFrameRelease(SFgAudioFrame* frame)
+{
+	FgAudioFramePool::instance()->release(frame);
+}
+
+void fgMediaPacketAddRef(SFgMediaPacket* packet)
+{
+	FgMediaHub::addRefPacket(packet);
+}
+
+void fgMediaPacketRelease(SFgMediaPacket* packet)
+{
+	FgMediaHub::releasePacket(packet);
+}
+
+SFgVideoFrame* fgVideoFrameRetain(const SFgVideoFrame* frame)
+{
+	return FgMediaHub::retainVideoFrame(frame);
+}
+
+void fgVideoFrameAddRef(SFgVideoFrame* frame)
+{
+	FgMediaHub::addRefVideoFrame(frame);
+}
+
+void fgVideoFrameRelease(SFgVideoFrame* frame)
+{
+	FgMediaHub::releaseVideoFrame(frame);
+}
+
+int fgTraceStart()
+{
+	return trace_start();
+}
+
+int fgTraceDump(const char* path)
+{
+	if (path == NULL) {
+		return -1;
+	}
+	return trace_dump(path);
+}
+
+int fgSetThreadPolicy(int role, const SFgThreadPolicy* policy)
+{
+	raop_thread_policy_t p;
+
+	if (policy == NULL) {
+		return -1;
+	}
+	p.sched = policy->sched;
+	p.priority = policy->priority;
+	p.affinity = policy->affinity;
+	memcpy(p.name, policy->name, sizeof(p.name));
+	return raop_set_thread_policy(role, &p);
+}
+
+int fgGetThreadPolicy(int role, SFgThreadPolicy* policy)
+{
+	raop_thread_policy_t p;
+
+	if (policy == NULL || role < 0 || role >= FG_THREAD_ROLE_COUNT) {
+		return -1;
+	}
+	raop_get_thread_policy(role, &p);
+	policy->sched = p.sched;
+	policy->priority = p.priority;
+	policy->affinity = p.affinity;
+	memcpy(policy->name, p.name, sizeof(policy->name));
+	return 0;
+}
@@ -7,9 +7,21 @@
 #ifdef WIN32
 #include   "iphlpapi.h"  
 #pragma   comment(lib,   "iphlpapi.lib   ")  
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
 #endif
 
 BOOL GetMacAddress(char strMac[6]);
+BOOL LoadPairingSeed(unsigned char seed[32]);
+
+// The library phases come first, the DLL only adds the decoded frame
+static_assert(RAOP_PHASE_COUNT == FG_PHASE_FIRST_FRAME, "EFgConnectionPhase out of sync with RAOP_PHASE_*");
+
+static const char* s_szPhaseName[FG_PHASE_COUNT] = {
+	"info", "pair_setup", "pair_verify", "fp_setup",
+	"setup_session", "setup_mirror", "setup_audio", "record",
+	"mirror_accept", "mirror_sps_pps", "mirror_idr", "first_frame",
+};
 
 FgAirplayServer::FgAirplayServer()
 	: m_pCallback(NULL)
@@ -17,7 +29,12 @@ FgAirplayServer::FgAirplayServer()
 	, m_pAirplay(NULL)
 	, m_pRaop(NULL)
 	, m_fScaleRatio(1.0f)
+	, m_nPixelFormat(FG_PIXEL_FORMAT_I420)
+	, m_nDecodeMode(FG_DECODE_FULL)
+	, m_bAdaptiveDecode(true)
 {
+	memset(&m_sPreview, 0, sizeof(SFgPreviewConfig));
+	memset(m_sPhaseStats, 0, sizeof(m_sPhaseStats));
 	memset(&m_stAirplayCB, 0, sizeof(airplay_callbacks_t));
 	memset(&m_stRaopCB, 0, sizeof(raop_callbacks_t));
 	m_stAirplayCB.cls = this;
@@ -40,8 +57,10 @@ FgAirplayServer::FgAirplayServer()
 	m_stRaopCB.audio_flush = audio_flush;
 	// m_stRaopCB.audio_destroy = audio_destroy;
 	m_stRaopCB.video_process = video_process;
+	m_stRaopCB.connection_phase = connection_phase;
 
 	m_mutexMap = CreateMutex(NULL, FALSE, NULL);
+	m_pHub = new FgMediaHub();
 }
 
 FgAirplayServer::~FgAirplayServer()
@@ -49,15 +68,17 @@ FgAirplayServer::~FgAirplayServer()
 	m_pCallback = NULL;
 
 	clearChannels();
+	delete m_pHub;
 
 	CloseHandle(m_mutexMap);
 }
 
 int FgAirplayServer::start(const char serverName[AIRPLAY_NAME_LEN], 
 	unsigned int raopPort, unsigned int airplayPort,
-	IAirServerCallback* callback)
+	IAirServerCallback* callback, const SFgServerOptions* options)
 {
 	m_pCallback = callback;
+	m_bAdaptiveDecode = !(options && options->fixedQuality);
 
 	unsigned short raop_port = raopPort;
 	unsigned short airplay_port = airplayPort;
@@ -68,12 +89,18 @@ int FgAirplayServer::start(const char serverName[AIRPLAY_NAME_LEN],
 	do {
 
 		GetMacAddress(hwaddr);
+		// ʹñݣͶȻϵն
+		unsigned char seed[32];
+		BOOL bSeed = LoadPairingSeed(seed);
 
 		m_pAirplay = airplay_init(10, &m_stAirplayCB, pemstr, &ret);
 		if (m_pAirplay == NULL) {
 			ret = -1;
 			break;
 		}
+		if (bSeed) {
+			airplay_set_pairing_seed(m_pAirplay, seed);
+		}
 		ret = airplay_start(m_pAirplay, &airplay_port, hwaddr, sizeof(hwaddr), NULL);
 		if (ret < 0) {
 			break;
@@ -89,6 +116,38 @@ int FgAirplayServer::start(const char serverName[AIRPLAY_NAME_LEN],
 
 		raop_set_log_level(m_pRaop, RAOP_LOG_DEBUG);
 		raop_set_log_callback(m_pRaop, &log_callback, this);
+
+		if (bSeed) {
+			raop_set_pairing_seed(m_pRaop, seed);
+		}
+		SecureZeroMemory(seed, sizeof(seed));
+
+		// /info reports the same identity as the mDNS records
+		raop_info_t info;
+		raop_info_init(&info);
+		raop_get_public_key(m_pRaop, info.pk);
+		strncpy_s(info.name, sizeof(info.name), serverName, _TRUNCATE);
+		sprintf_s(info.deviceid, sizeof(info.deviceid), "%02x:%02x:%02x:%02x:%02x:%02x",
+			(unsigned char)hwaddr[0], (unsigned char)hwaddr[1], (unsigned char)hwaddr[2],
+			(unsigned char)hwaddr[3], (unsigned char)hwaddr[4], (unsigned char)hwaddr[5]);
+		if (options) {
+			if (options->displayWidth) info.display_width = options->displayWidth;
+			if (options->displayHeight) info.display_height = options->displayHeight;
+			if (options->refreshRate) info.display_refresh_rate = options->refreshRate;
+			if (options->maxFps) info.display_max_fps = options->maxFps;
+			if (options->features) info.features = options->features;
+			info.display_overscanned = options->overscanned;
+			if (options->hevc) info.features |= RAOP_FEATURE_SCREEN_MULTI_CODEC;
+			if (options->bufferedAudio) info.features |= RAOP_FEATURE_BUFFERED_AUDIO;
+		}
+		raop_set_video_format(m_pRaop, (options && options->annexB) ? VIDEO_FORMAT_ANNEXB : VIDEO_FORMAT_AVCC);
+		if (raop_set_info(m_pRaop, &info) < 0) {
+			raop_log_err(m_pRaop, "Invalid display options %ux%u@%u",
+				info.display_width, info.display_height, info.display_refresh_rate);
+			ret = -1;
+			break;
+		}
+
 		ret = raop_start(m_pRaop, &raop_port);
 		if (ret < 0) {
 			break;
@@ -100,6 +159,7 @@ int FgAirplayServer::start(const char serverName[AIRPLAY_NAME_LEN],
 			ret = -1;
 			break;
 		}
+		dnssd_set_features(m_pDnsSd, info.features);
 		ret = dnssd_register_raop(m_pDnsSd, serverName, raop_port, hwaddr, sizeof(hwaddr), 0);
 		if (ret < 0) {
 			break;
@@ -116,11 +176,14 @@ int FgAirplayServer::start(const char serverName[AIRPLAY_NAME_LEN],
 		stop();
 	}
 
-	return 0;
+	return ret;
 }
 
 void FgAirplayServer::stop()
 {
+	// A decoding thread may be waiting for a FG_POLL_BLOCK ring
+	m_pHub->closePolls();
+
 	if (m_pDnsSd) {
 		dnssd_unregister_airplay(m_pDnsSd);
 		dnssd_unregister_raop(m_pDnsSd);
@@ -148,14 +211,83 @@ float FgAirplayServer::setScale(float fRatio)
 {
 	m_fScaleRatio = min(10, max(0.1, fRatio));
 
+	CAutoLock oLock(m_mutexMap, "setScale");
 	FgAirplayChannelMap::iterator it;
 	for (it = m_mapChannel.begin(); it != m_mapChannel.end(); ++it)
 	{
-		it->second->setScale(m_fScaleRatio);
+		if (it->second) {
+			it->second->setScale(m_fScaleRatio);
+		}
 	}
 	return m_fScaleRatio;
 }
 
+int FgAirplayServer::setPlaybackState(int state, double duration, double position, double rate)
+{
+	if (m_pAirplay == NULL || state < FG_PLAYBACK_PLAYING || state > FG_PLAYBACK_STOPPED) {
+		return -1;
+	}
+
+	airplay_playback_state_t playback;
+	playback.state = state;
+	playback.duration = duration;
+	playback.position = position;
+	playback.rate = rate;
+	airplay_set_playback_state(m_pAirplay, &playback);
+	return 0;
+}
+
+int FgAirplayServer::setPixelFormat(int pixelFormat)
+{
+	if (pixelFormat < FG_PIXEL_FORMAT_I420 || pixelFormat > FG_PIXEL_FORMAT_RGBA) {
+		return m_nPixelFormat;
+	}
+	m_nPixelFormat = pixelFormat;
+
+	CAutoLock oLock(m_mutexMap, "setPixelFormat");
+	FgAirplayChannelMap::iterator it;
+	for (it = m_mapChannel.begin(); it != m_mapChannel.end(); ++it)
+	{
+		if (it->second) {
+			it->second->setPixelFormat(m_nPixelFormat);
+		}
+	}
+	return m_nPixelFormat;
+}
+
+int FgAirplayServer::setDecodeMode(const char* remoteDeviceId, int mode, const SFgPreviewConfig* preview)
+{
+	if (mode != FG_DECODE_FULL && mode != FG_DECODE_PREVIEW) {
+		return -1;
+	}
+	if (mode == FG_DECODE_PREVIEW && preview == NULL) {
+		return -1;
+	}
+
+	CAutoLock oLock(m_mutexMap, "setDecodeMode");
+	if (remoteDeviceId == NULL) {
+		m_nDecodeMode = mode;
+		if (preview) {
+			m_sPreview = *preview;
+		}
+		FgAirplayChannelMap::iterator it;
+		for (it = m_mapChannel.begin(); it != m_mapChannel.end(); ++it)
+		{
+			if (it->second) {
+				it->second->setDecodeMode(mode, preview);
+			}
+		}
+		return 0;
+	}
+
+	FgAirplayChannelMap::iterator it = m_mapChannel.find(remoteDeviceId);
+	if (it == m_mapChannel.end() || it->second == NULL) {
+		return -1;
+	}
+	it->second->setDecodeMode(mode, preview);
+	return 0;
+}
+
 void FgAirplayServer::clearChannels()
 {
 	CAutoLock oLock(m_mutexMap, "clearChannels");
@@ -173,7 +305,11 @@ FgAirplayChannel* FgAirplayServer::getChannel(const char* remoteDeviceId)
 	FgAirplayChannel* pChannel = m_mapChannel[deviceId];
 	if (NULL == pChannel)
 	{
-		pChannel = new FgAirplayChannel(m_pCallback);
+		pChannel = new FgAirplayChannel(m_pCallback, m_pHub);
+		pChannel->setScale(m_fScaleRatio);
+		pChannel->setPixelFormat(m_nPixelFormat);
+		pChannel->setDecodeMode(m_nDecodeMode, &m_sPreview);
+		pChannel->setAdaptiveDecode(m_bAdaptiveDecode);
 		m_mapChannel[deviceId] = pChannel;
 	}
 
@@ -208,9 +344,11 @@ void FgAirplayServer::disconnected(void* cls, const char* remoteName, const char
 	{
 		pServer->m_pCallback->disconnected(remoteName, remoteDeviceId);
 	}
+	pServer->m_pHub->publishDisconnected(remoteName, remoteDeviceId);
 
 	CAutoLock oLock(pServer->m_mutexMap, "disconnected");
 	std::string deviceId(remoteDeviceId);
+	pServer->m_mapTimeline.erase(deviceId);
 	FgAirplayChannel* pChannel = pServer->m_mapChannel[std::string(remoteDeviceId)];
 	if (pChannel) {
 		pServer->m_mapChannel.erase(deviceId);
@@ -247,20 +385,25 @@ void FgAirplayServer::audio_process(void* cls, pcm_data_struct* data, const char
 		return;
 	}
 
+	// The PCM is handed out straight from the raop_buffer entry, it stays
+	// valid until the callback returns. Use fgAudioFrameRetain to keep it.
+	SFgAudioFrame frame;
+	frame.bitsPerSample = data->bits_per_sample;
+	frame.channels = data->channels;
+	frame.pts = data->pts;
+	frame.sampleRate = data->sample_rate;
+	frame.dataLen = data->data_len;
+	frame.data = (unsigned char*)data->data;
+	frame.ntpPts = data->ntp_pts;
+
 	if (pServer->m_pCallback != NULL)
 	{
-		SFgAudioFrame* frame = new SFgAudioFrame();
-		frame->bitsPerSample = data->bits_per_sample;
-		frame->channels = data->channels;
-		frame->pts = data->pts;
-		frame->sampleRate = data->sample_rate;
-		frame->dataLen = data->data_len;
-		frame->data = new uint8_t[frame->dataLen];
-		memcpy(frame->data, data->data, frame->dataLen);
-
-		pServer->m_pCallback->outputAudio(frame, remoteName, remoteDeviceId);
-		delete[] frame->data;
-		delete frame;
+		pServer->m_pCallback->outputAudio(&frame, remoteName, remoteDeviceId);
+	}
+	pServer->m_pHub->publishAudioFrame(&frame, remoteName, remoteDeviceId);
+	if (data->encoded != NULL)
+	{
+		pServer->m_pHub->publishAudioPacket(data->encoded, data->encoded_len, data->codec, data->ntp_pts, remoteName, remoteDeviceId);
 	}
 }
 
@@ -284,9 +427,15 @@ void FgAirplayServer::video_process(void* cls, h264_decode_struct* h264data, con
 	{
 		return;
 	}
+	pServer->m_pHub->publishVideoPacket(h264data->data, h264data->data_len, h264data->frame_type == 0,
+		h264data->is_key != 0, h264data->codec, h264data->ntp_pts, remoteName, remoteDeviceId);
 
 	SFgH264Data* pData = new SFgH264Data();
 	memset(pData, 0, sizeof(SFgH264Data));
+	pData->pts = h264data->ntp_pts;
+	pData->codec = h264data->codec;
+	pData->format = h264data->format;
+	pData->is_idr = h264data->is_key;
 
 	if (h264data->frame_type == 0)
 	{
@@ -313,12 +462,152 @@ void FgAirplayServer::video_process(void* cls, h264_decode_struct* h264data, con
 	if (pChannel)
 	{
 		pChannel->decodeH264Data(pData, remoteName, remoteDeviceId);
+		unsigned long long ullFirstFrameUs = pChannel->firstFrameUs();
 		pChannel->release();
+		if (ullFirstFrameUs != 0) {
+			pServer->finishTimeline(remoteName, remoteDeviceId, ullFirstFrameUs);
+		}
 	}
 	delete[] pData->data;
 	delete pData;
 }
 
+void FgAirplayServer::connection_phase(void* cls, int phase, uint64_t time_us, const char* remoteName, const char* remoteDeviceId)
+{
+	FgAirplayServer* pServer = (FgAirplayServer*)cls;
+	if (!pServer || phase < 0 || phase >= RAOP_PHASE_COUNT)
+	{
+		return;
+	}
+
+	CAutoLock oLock(pServer->m_mutexMap, "connection_phase");
+	SFgConnectionTimeline& timeline = pServer->m_mapTimeline[std::string(remoteDeviceId)];
+	if (timeline.phaseUs[FG_PHASE_FIRST_FRAME] != 0) {
+		// Already reported. A handshake phase means the sender started over,
+		// late phases such as SETUP 3 of the same session are dropped.
+		if (phase > FG_PHASE_SETUP_SESSION) {
+			return;
+		}
+		memset(&timeline, 0, sizeof(timeline));
+	}
+	else if (timeline.phaseUs[phase] != 0) {
+		// A new session before the last one decoded anything
+		memset(&timeline, 0, sizeof(timeline));
+	}
+	timeline.phaseUs[phase] = time_us;
+}
+
+void FgAirplayServer::finishTimeline(const char* remoteName, const char* remoteDeviceId, unsigned long long firstFrameUs)
+{
+	SFgConnectionTimeline timeline;
+	unsigned long long ullStartUs = 0;
+	{
+		CAutoLock oLock(m_mutexMap, "finishTimeline");
+		FgConnectionTimelineMap::iterator it = m_mapTimeline.find(remoteDeviceId);
+		if (it == m_mapTimeline.end() ||
+			it->second.phaseUs[FG_PHASE_FIRST_FRAME] != 0 ||
+			it->second.phaseUs[FG_PHASE_MIRROR_IDR] == 0) {
+			return;
+		}
+		it->second.phaseUs[FG_PHASE_FIRST_FRAME] = max(firstFrameUs, it->second.phaseUs[FG_PHASE_MIRROR_IDR]);
+		timeline = it->second;
+
+		for (int i = 0; i < FG_PHASE_COUNT; i++) {
+			if (timeline.phaseUs[i] != 0 && (ullStartUs == 0 || timeline.phaseUs[i] < ullStartUs)) {
+				ullStartUs = timeline.phaseUs[i];
+			}
+		}
+		for (int i = 0; i < FG_PHASE_COUNT; i++) {
+			if (timeline.phaseUs[i] == 0) {
+				continue;
+			}
+			unsigned long long ullUs = timeline.phaseUs[i] - ullStartUs;
+			unsigned long long ullMs = ullUs / 1000;
+			int nBucket = 0;
+			while (nBucket < FG_PHASE_HISTOGRAM_BUCKETS - 1 && ullMs >= (1ULL << nBucket)) {
+				nBucket++;
+			}
+			SFgPhaseHistogram& stats = m_sPhaseStats[i];
+			stats.count++;
+			stats.bucket[nBucket]++;
+			stats.totalUs += ullUs;
+			stats.maxUs = max(stats.maxUs, ullUs);
+		}
+	}
+
+	// One line of JSON per session, milliseconds since its earliest phase
+	char szEvent[1024];
+	int nLen = sprintf_s(szEvent, sizeof(szEvent), "{\"event\":\"connection_timeline\",\"deviceId\":\"%s\",\"phases\":{", remoteDeviceId);
+	bool bFirst = true;
+	for (int i = 0; i < FG_PHASE_COUNT && nLen > 0; i++) {
+		if (timeline.phaseUs[i] == 0) {
+			continue;
+		}
+		nLen += sprintf_s(szEvent + nLen, sizeof(szEvent) - nLen, "%s\"%s\":%.1f", bFirst ? "" : ",",
+			s_szPhaseName[i], (timeline.phaseUs[i] - ullStartUs) / 1000.0);
+		bFirst = false;
+	}
+	if (nLen > 0) {
+		sprintf_s(szEvent + nLen, sizeof(szEvent) - nLen, "}}");
+	}
+
+	if (m_pCallback != NULL)
+	{
+		m_pCallback->log(RAOP_LOG_INFO, szEvent);
+		m_pCallback->connectionTimeline(&timeline, remoteName, remoteDeviceId);
+	}
+}
+
+int FgAirplayServer::getPhaseStats(SFgPhaseHistogram stats[FG_PHASE_COUNT], bool bReset)
+{
+	CAutoLock oLock(m_mutexMap, "getPhaseStats");
+	memcpy(stats, m_sPhaseStats, sizeof(m_sPhaseStats));
+	if (bReset) {
+		memset(m_sPhaseStats, 0, sizeof(m_sPhaseStats));
+	}
+	return 0;
+}
+
+int FgAirplayServer::subscribe(const char* remoteDeviceId, const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber)
+{
+	return m_pHub->subscribe(remoteDeviceId, config, subscriber);
+}
+
+int FgAirplayServer::unsubscribe(int subscription)
+{
+	return m_pHub->unsubscribe(subscription);
+}
+
+int FgAirplayServer::getSubscriberStats(int subscription, SFgSubscriberStats* stats)
+{
+	return m_pHub->getStats(subscription, stats);
+}
+
+int FgAirplayServer::pollOpen(const char* remoteDeviceId, const SFgPollConfig* config)
+{
+	return m_pHub->pollOpen(remoteDeviceId, config);
+}
+
+int FgAirplayServer::pollClose(int poll)
+{
+	return m_pHub->pollClose(poll);
+}
+
+int FgAirplayServer::pollVideo(int poll, SFgVideoFrame** frame, unsigned int timeoutMs)
+{
+	return m_pHub->pollVideo(poll, frame, timeoutMs);
+}
+
+int FgAirplayServer::pollAudio(int poll, SFgAudioFrame** frame, unsigned int timeoutMs)
+{
+	return m_pHub->pollAudio(poll, frame, timeoutMs);
+}
+
+int FgAirplayServer::getPollStats(int poll, SFgPollStats* stats)
+{
+	return m_pHub->getPollStats(poll, stats);
+}
+
 void FgAirplayServer::ap_video_play(void* cls, char* url, double volume, double start_pos)
 {
 	FgAirplayServer* pServer = (FgAirplayServer*)cls;
@@ -395,4 +684,35 @@ BOOL GetMacAddress(char strMac[6])
 
 	GlobalFree(pAdapterInfo);
 	return   TRUE;
-}
\ No newline at end of file
+}
+
+// ݵӱ %APPDATA%\FgAirplay\pairing.keyûоһ
+BOOL LoadPairingSeed(unsigned char seed[32])
+{
+	char path[MAX_PATH];
+	DWORD len = GetEnvironmentVariableA("APPDATA", path, MAX_PATH);
+	if (len == 0 || len >= MAX_PATH - 32) {
+		return FALSE;
+	}
+	strcat_s(path, MAX_PATH, "\\FgAirplay");
+	CreateDirectoryA(path, NULL);
+	strcat_s(path, MAX_PATH, "\\pairing.key");
+
+	FILE* fp = NULL;
+	if (fopen_s(&fp, path, "rb") == 0 && fp != NULL) {
+		size_t read = fread(seed, 1, 32, fp);
+		fclose(fp);
+		if (read == 32) {
+			return TRUE;
+		}
+	}
+
+	if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, seed, 32, BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+		return FALSE;
+	}
+	if (fopen_s(&fp, path, "wb") == 0 && fp != NULL) {
+		fwrite(seed, 1, 32, fp);
+		fclose(fp);
+	}
+	return TRUE;
+}
@@ -0,0 +1,98 @@
+#include "FgAudioFramePool.h"
+#include <malloc.h>
+#include <string.h>
+
+struct FgAudioFramePool::SBlock {
+	SLIST_ENTRY		entry;		// must stay first, the list needs it aligned
+	SFgAudioFrame	frame;
+	volatile LONG	nRef;
+	unsigned int	capacity;
+};
+
+FgAudioFramePool* FgAudioFramePool::instance()
+{
+	static FgAudioFramePool s_pool;
+	return &s_pool;
+}
+
+FgAudioFramePool::FgAudioFramePool()
+{
+	InitializeSListHead(&m_freeList);
+}
+
+FgAudioFramePool::~FgAudioFramePool()
+{
+	PSLIST_ENTRY pEntry;
+	while ((pEntry = InterlockedPopEntrySList(&m_freeList)) != NULL)
+	{
+		_aligned_free(pEntry);
+	}
+}
+
+FgAudioFramePool::SBlock* FgAudioFramePool::allocBlock(unsigned int dataLen)
+{
+	SBlock* block = NULL;
+	if (dataLen <= FG_AUDIO_BLOCK_CAPACITY) {
+		block = (SBlock*)InterlockedPopEntrySList(&m_freeList);
+	}
+	if (block == NULL) {
+		unsigned int capacity = max(dataLen, FG_AUDIO_BLOCK_CAPACITY);
+		block = (SBlock*)_aligned_malloc(sizeof(SBlock) + capacity, MEMORY_ALLOCATION_ALIGNMENT);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->capacity = capacity;
+	}
+	block->nRef = 1;
+	block->frame.data = (unsigned char*)(block + 1);
+	return block;
+}
+
+void FgAudioFramePool::freeBlock(SBlock* block)
+{
+	if (block->capacity == FG_AUDIO_BLOCK_CAPACITY &&
+		QueryDepthSList(&m_freeList) < FG_AUDIO_POOL_MAX_FREE) {
+		InterlockedPushEntrySList(&m_freeList, &block->entry);
+		return;
+	}
+	_aligned_free(block);
+}
+
+SFgAudioFrame* FgAudioFramePool::retain(const SFgAudioFrame* frame)
+{
+	if (frame == NULL) {
+		return NULL;
+	}
+	SBlock* block = allocBlock(frame->dataLen);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->frame.pts = frame->pts;
+	block->frame.sampleRate = frame->sampleRate;
+	block->frame.channels = frame->channels;
+	block->frame.bitsPerSample = frame->bitsPerSample;
+	block->frame.dataLen = frame->dataLen;
+	block->frame.ntpPts = frame->ntpPts;
+	memcpy(block->frame.data, frame->data, frame->dataLen);
+	return &block->frame;
+}
+
+void FgAudioFramePool::addRef(SFgAudioFrame* frame)
+{
+	if (frame == NULL) {
+		return;
+	}
+	SBlock* block = CONTAINING_RECORD(frame, SBlock, frame);
+	InterlockedIncrement(&block->nRef);
+}
+
+void FgAudioFramePool::release(SFgAudioFrame* frame)
+{
+	if (frame == NULL) {
+		return;
+	}
+	SBlock* block = CONTAINING_RECORD(frame, SBlock, frame);
+	if (InterlockedDecrement(&block->nRef) == 0) {
+		freeBlock(block);
+	}
+}
@@ -0,0 +1,783 @@
+#include "FgMediaHub.h"
+#include <vector>
+#include "FgAudioFramePool.h"
+#include "CAutoLock.h"
+#include "trace.h"
+
+struct SFgPacketBlock {
+	SFgMediaPacket	packet;
+	volatile LONG	nRef;
+};
+
+struct SFgVideoFrameBlock {
+	SFgVideoFrame	frame;
+	volatile LONG	nRef;
+};
+
+FgMediaHub::FgMediaHub()
+	: m_nNextId(1)
+{
+	m_mutexHub = CreateMutex(NULL, FALSE, NULL);
+}
+
+FgMediaHub::~FgMediaHub()
+{
+	closePolls();
+	while (true) {
+		int id;
+		{
+			CAutoLock oLock(m_mutexHub, "~FgMediaHub");
+			if (m_mapSubscription.empty()) {
+				break;
+			}
+			id = m_mapSubscription.begin()->first;
+		}
+		unsubscribe(id);
+	}
+	for (FgHubItemMap::iterator it = m_mapConfig.begin(); it != m_mapConfig.end(); ++it) {
+		releaseItem(it->second);
+	}
+	m_mapConfig.clear();
+	CloseHandle(m_mutexHub);
+}
+
+int FgMediaHub::subscribe(const char* remoteDeviceId, const SFgSubscribeConfig* config, IAirServerSubscriber* subscriber)
+{
+	if (config == NULL || subscriber == NULL || config->media == 0 ||
+		config->dropPolicy < FG_DROP_NEWEST || config->dropPolicy > FG_DROP_TO_KEYFRAME) {
+		return -1;
+	}
+
+	SFgSubscription* sub = new SFgSubscription();
+	sub->pOwner = this;
+	sub->strDeviceId = remoteDeviceId ? remoteDeviceId : "";
+	sub->config = *config;
+	if (sub->config.maxItems == 0) {
+		sub->config.maxItems = FG_HUB_DEFAULT_MAX_ITEMS;
+	}
+	sub->pSubscriber = subscriber;
+	sub->bQuit = false;
+	memset(&sub->stats, 0, sizeof(SFgSubscriberStats));
+	sub->hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	sub->hThread = CreateThread(NULL, 0, deliveryThread, sub, 0, NULL);
+	if (sub->hEvent == NULL || sub->hThread == NULL) {
+		if (sub->hThread) {
+			CloseHandle(sub->hThread);
+		}
+		if (sub->hEvent) {
+			CloseHandle(sub->hEvent);
+		}
+		delete sub;
+		return -1;
+	}
+
+	CAutoLock oLock(m_mutexHub, "subscribe");
+	sub->id = m_nNextId++;
+	m_mapSubscription[sub->id] = sub;
+	return sub->id;
+}
+
+int FgMediaHub::unsubscribe(int id)
+{
+	SFgSubscription* sub = NULL;
+	{
+		CAutoLock oLock(m_mutexHub, "unsubscribe");
+		FgSubscriptionMap::iterator it = m_mapSubscription.find(id);
+		if (it == m_mapSubscription.end()) {
+			return -1;
+		}
+		sub = it->second;
+		m_mapSubscription.erase(it);
+		sub->bQuit = true;
+	}
+	SetEvent(sub->hEvent);
+	WaitForSingleObject(sub->hThread, INFINITE);
+	CloseHandle(sub->hThread);
+	CloseHandle(sub->hEvent);
+
+	while (!sub->queue.empty()) {
+		releaseItem(sub->queue.front());
+		sub->queue.pop_front();
+	}
+	delete sub;
+	return 0;
+}
+
+int FgMediaHub::getStats(int id, SFgSubscriberStats* stats)
+{
+	CAutoLock oLock(m_mutexHub, "getStats");
+	FgSubscriptionMap::iterator it = m_mapSubscription.find(id);
+	if (it == m_mapSubscription.end()) {
+		return -1;
+	}
+	*stats = it->second->stats;
+	stats->queuedItems = (unsigned int)it->second->queue.size();
+	return 0;
+}
+
+bool FgMediaHub::hasSubscriber(unsigned int media, const char* remoteDeviceId)
+{
+	CAutoLock oLock(m_mutexHub, "hasSubscriber");
+	for (FgSubscriptionMap::iterator it = m_mapSubscription.begin(); it != m_mapSubscription.end(); ++it) {
+		SFgSubscription* sub = it->second;
+		if ((sub->config.media & media) &&
+			(sub->strDeviceId.empty() || sub->strDeviceId == remoteDeviceId)) {
+			return true;
+		}
+	}
+	for (FgPollMap::iterator it = m_mapPoll.begin(); it != m_mapPoll.end(); ++it) {
+		if ((it->second->config.media & media) && it->second->strDeviceId == remoteDeviceId) {
+			return true;
+		}
+	}
+	return false;
+}
+
+SFgHubItem* FgMediaHub::newItem(int kind, void* media, unsigned int bytes, bool isKey,
+	const char* remoteName, const char* remoteDeviceId)
+{
+	SFgHubItem* item = new SFgHubItem();
+	item->nRef = 1;
+	item->kind = kind;
+	item->media = media;
+	item->bytes = bytes;
+	item->isKey = isKey;
+	strncpy_s(item->remoteName, sizeof(item->remoteName), remoteName ? remoteName : "", _TRUNCATE);
+	strncpy_s(item->remoteDeviceId, sizeof(item->remoteDeviceId), remoteDeviceId ? remoteDeviceId : "", _TRUNCATE);
+	return item;
+}
+
+void FgMediaHub::releaseItem(SFgHubItem* item)
+{
+	if (InterlockedDecrement(&item->nRef) != 0) {
+		return;
+	}
+	switch (item->kind) {
+	case FG_HUB_VIDEO_PACKET:
+	case FG_HUB_AUDIO_PACKET:
+		releasePacket((SFgMediaPacket*)item->media);
+		break;
+	case FG_HUB_VIDEO_FRAME:
+		releaseVideoFrame((SFgVideoFrame*)item->media);
+		break;
+	case FG_HUB_AUDIO_FRAME:
+		FgAudioFramePool::instance()->release((SFgAudioFrame*)item->media);
+		break;
+	}
+	delete item;
+}
+
+void FgMediaHub::publishVideoPacket(const unsigned char* data, int len, bool bConfig, bool bKey, int codec,
+	unsigned long long ntpPts,
+	const char* remoteName, const char* remoteDeviceId)
+{
+	// Configs are kept even without subscribers, a later one starts with it
+	if (len <= 0 || (!bConfig && !hasSubscriber(FG_SUBSCRIBE_VIDEO_PACKETS, remoteDeviceId))) {
+		return;
+	}
+	bool isKey = bConfig || bKey;
+	SFgMediaPacket* packet = retainPacket(bConfig ? FG_PACKET_VIDEO_CONFIG : FG_PACKET_VIDEO,
+		isKey, codec, ntpPts, data, len);
+	if (packet == NULL) {
+		return;
+	}
+	SFgHubItem* item = newItem(FG_HUB_VIDEO_PACKET, packet, len, isKey, remoteName, remoteDeviceId);
+	if (bConfig) {
+		CAutoLock oLock(m_mutexHub, "publishVideoPacket");
+		SFgHubItem*& config = m_mapConfig[std::string(item->remoteDeviceId)];
+		if (config) {
+			releaseItem(config);
+		}
+		InterlockedIncrement(&item->nRef);
+		config = item;
+	}
+	publish(item, FG_SUBSCRIBE_VIDEO_PACKETS);
+	releaseItem(item);
+}
+
+void FgMediaHub::publishVideoFrame(const SFgVideoFrame* frame, const char* remoteName, const char* remoteDeviceId)
+{
+	if (!hasSubscriber(FG_SUBSCRIBE_VIDEO_FRAMES, remoteDeviceId)) {
+		return;
+	}
+	// The one copy all subscribers share, made outside the hub lock
+	SFgVideoFrame* copy = retainVideoFrame(frame);
+	if (copy == NULL) {
+		return;
+	}
+	SFgHubItem* item = newItem(FG_HUB_VIDEO_FRAME, copy, copy->dataTotalLen, copy->isKey != 0, remoteName, remoteDeviceId);
+	publish(item, FG_SUBSCRIBE_VIDEO_FRAMES);
+	publishPolls(item, FG_SUBSCRIBE_VIDEO_FRAMES);
+	releaseItem(item);
+}
+
+void FgMediaHub::publishAudioPacket(const unsigned char* data, int len, int codec, unsigned long long ntpPts,
+	const char* remoteName, const char* remoteDeviceId)
+{
+	if (len <= 0 || !hasSubscriber(FG_SUBSCRIBE_AUDIO_PACKETS, remoteDeviceId)) {
+		return;
+	}
+	SFgMediaPacket* packet = retainPacket(FG_PACKET_AUDIO, 1, codec, ntpPts, data, len);
+	if (packet == NULL) {
+		return;
+	}
+	SFgHubItem* item = newItem(FG_HUB_AUDIO_PACKET, packet, len, true, remoteName, remoteDeviceId);
+	publish(item, FG_SUBSCRIBE_AUDIO_PACKETS);
+	releaseItem(item);
+}
+
+void FgMediaHub::publishAudioFrame(const SFgAudioFrame* frame, const char* remoteName, const char* remoteDeviceId)
+{
+	if (!hasSubscriber(FG_SUBSCRIBE_AUDIO_FRAMES, remoteDeviceId)) {
+		return;
+	}
+	SFgAudioFrame* copy = FgAudioFramePool::instance()->retain(frame);
+	if (copy == NULL) {
+		return;
+	}
+	SFgHubItem* item = newItem(FG_HUB_AUDIO_FRAME, copy, copy->dataLen, true, remoteName, remoteDeviceId);
+	publish(item, FG_SUBSCRIBE_AUDIO_FRAMES);
+	publishPolls(item, FG_SUBSCRIBE_AUDIO_FRAMES);
+	releaseItem(item);
+}
+
+void FgMediaHub::publishDisconnected(const char* remoteName, const char* remoteDeviceId)
+{
+	SFgHubItem* item = newItem(FG_HUB_DISCONNECTED, NULL, 0, true, remoteName, remoteDeviceId);
+	{
+		CAutoLock oLock(m_mutexHub, "publishDisconnected");
+		FgHubItemMap::iterator it = m_mapConfig.find(std::string(item->remoteDeviceId));
+		if (it != m_mapConfig.end()) {
+			releaseItem(it->second);
+			m_mapConfig.erase(it);
+		}
+	}
+	publish(item, ~0u);
+	releaseItem(item);
+}
+
+void FgMediaHub::publish(SFgHubItem* item, unsigned int media)
+{
+	CAutoLock oLock(m_mutexHub, "publish");
+	for (FgSubscriptionMap::iterator it = m_mapSubscription.begin(); it != m_mapSubscription.end(); ++it) {
+		SFgSubscription* sub = it->second;
+		if ((sub->config.media & media) &&
+			(sub->strDeviceId.empty() || sub->strDeviceId == item->remoteDeviceId)) {
+			enqueue(sub, item);
+		}
+	}
+}
+
+// Frees up room for count items of bytes according to the drop policy, false
+// if the new items have to be dropped instead. Called with the hub mutex held.
+bool FgMediaHub::makeRoom(SFgSubscription* sub, unsigned int count, unsigned int bytes)
+{
+	if (count > sub->config.maxItems) {
+		return false;
+	}
+	while (sub->queue.size() + count > sub->config.maxItems ||
+		(sub->config.maxBytes > 0 && sub->stats.queuedBytes + bytes > sub->config.maxBytes)) {
+		if (sub->config.dropPolicy != FG_DROP_OLDEST) {
+			return false;
+		}
+		// Disconnect notices stay, the oldest media item goes
+		FgHubItemQueue::iterator it = sub->queue.begin();
+		while (it != sub->queue.end() && (*it)->kind == FG_HUB_DISCONNECTED) {
+			++it;
+		}
+		if (it == sub->queue.end()) {
+			return false;
+		}
+		SFgHubItem* old = *it;
+		sub->queue.erase(it);
+		sub->stats.queuedBytes -= old->bytes;
+		sub->stats.dropped++;
+		if (old->kind == FG_HUB_VIDEO_PACKET && ((SFgMediaPacket*)old->media)->type == FG_PACKET_VIDEO_CONFIG) {
+			sub->mapVideoState[std::string(old->remoteDeviceId)] |= FG_HUB_CONFIG_LOST;
+		}
+		releaseItem(old);
+	}
+	return true;
+}
+
+void FgMediaHub::enqueue(SFgSubscription* sub, SFgHubItem* item)
+{
+	if (item->kind == FG_HUB_DISCONNECTED) {
+		sub->mapVideoState.erase(std::string(item->remoteDeviceId));
+		InterlockedIncrement(&item->nRef);
+		sub->queue.push_back(item);
+		SetEvent(sub->hEvent);
+		return;
+	}
+
+	int* pState = NULL;
+	bool bConfig = false;
+	if (item->kind == FG_HUB_VIDEO_PACKET) {
+		std::string deviceId(item->remoteDeviceId);
+		// A sender new to this subscriber starts at a config or IDR
+		if (sub->mapVideoState.find(deviceId) == sub->mapVideoState.end()) {
+			sub->mapVideoState[deviceId] = FG_HUB_WAIT_KEY | FG_HUB_CONFIG_LOST;
+		}
+		pState = &sub->mapVideoState[deviceId];
+		bConfig = ((SFgMediaPacket*)item->media)->type == FG_PACKET_VIDEO_CONFIG;
+		if ((*pState & FG_HUB_WAIT_KEY) && !item->isKey) {
+			sub->stats.dropped++;
+			return;
+		}
+	}
+
+	// The decoder needs the parameter sets in front of the IDR
+	SFgHubItem* config = NULL;
+	if (pState && !bConfig && item->isKey && (*pState & FG_HUB_CONFIG_LOST)) {
+		FgHubItemMap::iterator it = m_mapConfig.find(std::string(item->remoteDeviceId));
+		if (it != m_mapConfig.end()) {
+			config = it->second;
+		}
+	}
+	unsigned int bytes = item->bytes + (config ? config->bytes : 0);
+	if (!makeRoom(sub, config ? 2 : 1, bytes)) {
+		sub->stats.dropped++;
+		if (pState) {
+			if (bConfig) {
+				*pState |= FG_HUB_CONFIG_LOST;
+			}
+			if (sub->config.dropPolicy == FG_DROP_TO_KEYFRAME) {
+				*pState |= FG_HUB_WAIT_KEY;
+			}
+		}
+		return;
+	}
+	if (config) {
+		InterlockedIncrement(&config->nRef);
+		sub->queue.push_back(config);
+	}
+	if (pState) {
+		if (item->isKey) {
+			*pState &= ~FG_HUB_WAIT_KEY;
+		}
+		if (bConfig || config) {
+			*pState &= ~FG_HUB_CONFIG_LOST;
+		}
+	}
+	InterlockedIncrement(&item->nRef);
+	sub->queue.push_back(item);
+	sub->stats.queuedBytes += bytes;
+	SetEvent(sub->hEvent);
+}
+
+int FgMediaHub::pollOpen(const char* remoteDeviceId, const SFgPollConfig* config)
+{
+	const unsigned int media = FG_SUBSCRIBE_VIDEO_FRAMES | FG_SUBSCRIBE_AUDIO_FRAMES;
+	if (remoteDeviceId == NULL || config == NULL || (config->media & media) == 0 || (config->media & ~media) != 0 ||
+		config->policy < FG_POLL_OVERWRITE_OLDEST || config->policy > FG_POLL_BLOCK) {
+		return -1;
+	}
+
+	SFgPoll* poll = new SFgPoll();
+	poll->nRef = 1;
+	poll->strDeviceId = remoteDeviceId;
+	poll->config = *config;
+	poll->bClosed = false;
+	poll->hClosed = CreateEvent(NULL, TRUE, FALSE, NULL);
+	memset(&poll->video, 0, sizeof(SFgPollRing));
+	memset(&poll->audio, 0, sizeof(SFgPollRing));
+	bool bOk = (poll->hClosed != NULL);
+	if (bOk && (config->media & FG_SUBSCRIBE_VIDEO_FRAMES)) {
+		bOk = initRing(&poll->video, config->videoFrames ? config->videoFrames : FG_HUB_DEFAULT_POLL_VIDEO);
+	}
+	if (bOk && (config->media & FG_SUBSCRIBE_AUDIO_FRAMES)) {
+		bOk = initRing(&poll->audio, config->audioFrames ? config->audioFrames : FG_HUB_DEFAULT_POLL_AUDIO);
+	}
+	if (!bOk) {
+		releasePoll(poll);
+		return -1;
+	}
+
+	CAutoLock oLock(m_mutexHub, "pollOpen");
+	poll->id = m_nNextId++;
+	m_mapPoll[poll->id] = poll;
+	return poll->id;
+}
+
+int FgMediaHub::pollClose(int id)
+{
+	SFgPoll* poll = NULL;
+	{
+		CAutoLock oLock(m_mutexHub, "pollClose");
+		FgPollMap::iterator it = m_mapPoll.find(id);
+		if (it == m_mapPoll.end()) {
+			return -1;
+		}
+		poll = it->second;
+		m_mapPoll.erase(it);
+		poll->bClosed = true;
+		SetEvent(poll->hClosed);
+	}
+	releasePoll(poll);
+	return 0;
+}
+
+void FgMediaHub::closePolls()
+{
+	while (true) {
+		int id;
+		{
+			CAutoLock oLock(m_mutexHub, "closePolls");
+			if (m_mapPoll.empty()) {
+				break;
+			}
+			id = m_mapPoll.begin()->first;
+		}
+		pollClose(id);
+	}
+}
+
+int FgMediaHub::pollVideo(int id, SFgVideoFrame** frame, unsigned int timeoutMs)
+{
+	int result;
+	SFgHubItem* item = pollItem(id, FG_HUB_VIDEO_FRAME, timeoutMs, &result);
+	if (item) {
+		// The caller gets its own reference, the item goes
+		*frame = (SFgVideoFrame*)item->media;
+		addRefVideoFrame(*frame);
+		releaseItem(item);
+	}
+	return result;
+}
+
+int FgMediaHub::pollAudio(int id, SFgAudioFrame** frame, unsigned int timeoutMs)
+{
+	int result;
+	SFgHubItem* item = pollItem(id, FG_HUB_AUDIO_FRAME, timeoutMs, &result);
+	if (item) {
+		*frame = (SFgAudioFrame*)item->media;
+		FgAudioFramePool::instance()->addRef(*frame);
+		releaseItem(item);
+	}
+	return result;
+}
+
+int FgMediaHub::getPollStats(int id, SFgPollStats* stats)
+{
+	CAutoLock oLock(m_mutexHub, "getPollStats");
+	FgPollMap::iterator it = m_mapPoll.find(id);
+	if (it == m_mapPoll.end()) {
+		return -1;
+	}
+	stats->video = it->second->video.stats;
+	stats->audio = it->second->audio.stats;
+	return 0;
+}
+
+SFgPoll* FgMediaHub::findPoll(int id)
+{
+	CAutoLock oLock(m_mutexHub, "findPoll");
+	FgPollMap::iterator it = m_mapPoll.find(id);
+	if (it == m_mapPoll.end()) {
+		return NULL;
+	}
+	InterlockedIncrement(&it->second->nRef);
+	return it->second;
+}
+
+void FgMediaHub::releasePoll(SFgPoll* poll)
+{
+	if (InterlockedDecrement(&poll->nRef) != 0) {
+		return;
+	}
+	clearRing(&poll->video);
+	clearRing(&poll->audio);
+	if (poll->hClosed) {
+		CloseHandle(poll->hClosed);
+	}
+	delete poll;
+}
+
+bool FgMediaHub::initRing(SFgPollRing* ring, unsigned int capacity)
+{
+	ring->items = new SFgHubItem*[capacity];
+	ring->stats.capacity = capacity;
+	ring->hNotEmpty = CreateEvent(NULL, TRUE, FALSE, NULL);
+	ring->hNotFull = CreateEvent(NULL, TRUE, TRUE, NULL);
+	return ring->hNotEmpty != NULL && ring->hNotFull != NULL;
+}
+
+void FgMediaHub::clearRing(SFgPollRing* ring)
+{
+	while (ring->count > 0) {
+		releaseItem(popRing(ring));
+	}
+	delete[] ring->items;
+	if (ring->hNotEmpty) {
+		CloseHandle(ring->hNotEmpty);
+	}
+	if (ring->hNotFull) {
+		CloseHandle(ring->hNotFull);
+	}
+}
+
+// Called with the hub mutex held, false if a FG_POLL_BLOCK ring is full
+bool FgMediaHub::pushRing(SFgPoll* poll, SFgPollRing* ring, SFgHubItem* item)
+{
+	if (ring->count == ring->stats.capacity) {
+		if (poll->config.policy == FG_POLL_BLOCK) {
+			return false;
+		}
+		releaseItem(popRing(ring));
+		ring->stats.overwritten++;
+	}
+	InterlockedIncrement(&item->nRef);
+	ring->items[(ring->head + ring->count) % ring->stats.capacity] = item;
+	ring->count++;
+	ring->stats.queued = ring->count;
+	SetEvent(ring->hNotEmpty);
+	if (ring->count == ring->stats.capacity) {
+		ResetEvent(ring->hNotFull);
+	}
+	return true;
+}
+
+// Called with the hub mutex held on a ring that is not empty
+SFgHubItem* FgMediaHub::popRing(SFgPollRing* ring)
+{
+	SFgHubItem* item = ring->items[ring->head];
+	ring->head = (ring->head + 1) % ring->stats.capacity;
+	ring->count--;
+	ring->stats.queued = ring->count;
+	SetEvent(ring->hNotFull);
+	if (ring->count == 0) {
+		ResetEvent(ring->hNotEmpty);
+	}
+	return item;
+}
+
+void FgMediaHub::publishPolls(SFgHubItem* item, unsigned int media)
+{
+	std::vector<SFgPoll*> vecBlocked;
+	{
+		CAutoLock oLock(m_mutexHub, "publishPolls");
+		for (FgPollMap::iterator it = m_mapPoll.begin(); it != m_mapPoll.end(); ++it) {
+			SFgPoll* poll = it->second;
+			if ((poll->config.media & media) && poll->strDeviceId == item->remoteDeviceId) {
+				SFgPollRing* ring = (media == FG_SUBSCRIBE_VIDEO_FRAMES) ? &poll->video : &poll->audio;
+				if (!pushRing(poll, ring, item)) {
+					InterlockedIncrement(&poll->nRef);
+					vecBlocked.push_back(poll);
+				}
+			}
+		}
+	}
+
+	// Full FG_POLL_BLOCK rings are waited for one after the other, everyone
+	// else already has the item
+	for (size_t i = 0; i < vecBlocked.size(); i++) {
+		SFgPoll* poll = vecBlocked[i];
+		SFgPollRing* ring = (media == FG_SUBSCRIBE_VIDEO_FRAMES) ? &poll->video : &poll->audio;
+		DWORD dwStart = GetTickCount();
+		while (true) {
+			DWORD dwWait = INFINITE;
+			if (poll->config.blockTimeoutMs != FG_POLL_INFINITE) {
+				DWORD dwElapsed = GetTickCount() - dwStart;
+				dwWait = dwElapsed < poll->config.blockTimeoutMs ? poll->config.blockTimeoutMs - dwElapsed : 0;
+			}
+			HANDLE handles[2] = { ring->hNotFull, poll->hClosed };
+			DWORD ret = WaitForMultipleObjects(2, handles, FALSE, dwWait);
+
+			CAutoLock oLock(m_mutexHub, "publishPolls");
+			if (poll->bClosed || pushRing(poll, ring, item)) {
+				break;
+			}
+			if (ret == WAIT_TIMEOUT) {
+				ring->stats.dropped++;
+				break;
+			}
+		}
+		releasePoll(poll);
+	}
+}
+
+// Takes the oldest item of the kind, result is what fgServerPoll* returns
+SFgHubItem* FgMediaHub::pollItem(int id, int kind, unsigned int timeoutMs, int* result)
+{
+	SFgPoll* poll = findPoll(id);
+	if (poll == NULL) {
+		*result = -1;
+		return NULL;
+	}
+	SFgPollRing* ring = (kind == FG_HUB_VIDEO_FRAME) ? &poll->video : &poll->audio;
+	if (ring->items == NULL) {
+		releasePoll(poll);
+		*result = -1;
+		return NULL;
+	}
+
+	SFgHubItem* item = NULL;
+	DWORD dwStart = GetTickCount();
+	*result = 1;
+	while (true) {
+		{
+			CAutoLock oLock(m_mutexHub, "pollItem");
+			if (poll->bClosed) {
+				*result = -1;
+				break;
+			}
+			if (ring->count > 0) {
+				item = popRing(ring);
+				ring->stats.polled++;
+				*result = 0;
+				break;
+			}
+		}
+		DWORD dwWait = INFINITE;
+		if (timeoutMs != FG_POLL_INFINITE) {
+			DWORD dwElapsed = GetTickCount() - dwStart;
+			if (dwElapsed >= timeoutMs) {
+				break;
+			}
+			dwWait = timeoutMs - dwElapsed;
+		}
+		HANDLE handles[2] = { ring->hNotEmpty, poll->hClosed };
+		DWORD ret = WaitForMultipleObjects(2, handles, FALSE, dwWait);
+		if (ret == WAIT_OBJECT_0 + 1) {
+			// Closed, possibly by fgServerStop, so the hub is not touched again
+			*result = -1;
+			break;
+		}
+	}
+	releasePoll(poll);
+	return item;
+}
+
+DWORD WINAPI FgMediaHub::deliveryThread(LPVOID param)
+{
+	SFgSubscription* sub = (SFgSubscription*)param;
+	TRACE_THREAD_NAME("subscriber");
+	sub->pOwner->deliveryLoop(sub);
+	return 0;
+}
+
+void FgMediaHub::deliveryLoop(SFgSubscription* sub)
+{
+	while (true) {
+		WaitForSingleObject(sub->hEvent, INFINITE);
+		while (true) {
+			SFgHubItem* item = NULL;
+			{
+				CAutoLock oLock(m_mutexHub, "deliveryLoop");
+				if (sub->bQuit) {
+					return;
+				}
+				if (sub->queue.empty()) {
+					break;
+				}
+				item = sub->queue.front();
+				sub->queue.pop_front();
+				sub->stats.queuedBytes -= item->bytes;
+			}
+
+			deliver(sub, item);
+			releaseItem(item);
+
+			CAutoLock oLock(m_mutexHub, "deliveryLoop");
+			sub->stats.delivered++;
+		}
+	}
+}
+
+void FgMediaHub::deliver(SFgSubscription* sub, SFgHubItem* item)
+{
+	IAirServerSubscriber* subscriber = sub->pSubscriber;
+	TRACE_SPAN_BEGIN(deliver);
+	switch (item->kind) {
+	case FG_HUB_VIDEO_PACKET:
+		subscriber->onVideoPacket((SFgMediaPacket*)item->media, item->remoteName, item->remoteDeviceId);
+		break;
+	case FG_HUB_VIDEO_FRAME:
+		subscriber->onVideoFrame((SFgVideoFrame*)item->media, item->remoteName, item->remoteDeviceId);
+		break;
+	case FG_HUB_AUDIO_PACKET:
+		subscriber->onAudioPacket((SFgMediaPacket*)item->media, item->remoteName, item->remoteDeviceId);
+		break;
+	case FG_HUB_AUDIO_FRAME:
+		subscriber->onAudioFrame((SFgAudioFrame*)item->media, item->remoteName, item->remoteDeviceId);
+		break;
+	case FG_HUB_DISCONNECTED:
+		subscriber->onDisconnected(item->remoteName, item->remoteDeviceId);
+		break;
+	}
+	TRACE_SPAN_END_ARG(deliver, "subscriber", item->kind);
+}
+
+SFgMediaPacket* FgMediaHub::retainPacket(int type, int isKey, int codec, unsigned long long ntpPts,
+	const unsigned char* data, unsigned int dataLen)
+{
+	SFgPacketBlock* block = (SFgPacketBlock*)malloc(sizeof(SFgPacketBlock) + dataLen);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->nRef = 1;
+	block->packet.type = type;
+	block->packet.isKey = isKey;
+	block->packet.ntpPts = ntpPts;
+	block->packet.dataLen = dataLen;
+	block->packet.data = (unsigned char*)(block + 1);
+	block->packet.codec = codec;
+	memcpy(block->packet.data, data, dataLen);
+	return &block->packet;
+}
+
+void FgMediaHub::addRefPacket(SFgMediaPacket* packet)
+{
+	if (packet == NULL) {
+		return;
+	}
+	SFgPacketBlock* block = CONTAINING_RECORD(packet, SFgPacketBlock, packet);
+	InterlockedIncrement(&block->nRef);
+}
+
+void FgMediaHub::releasePacket(SFgMediaPacket* packet)
+{
+	if (packet == NULL) {
+		return;
+	}
+	SFgPacketBlock* block = CONTAINING_RECORD(packet, SFgPacketBlock, packet);
+	if (InterlockedDecrement(&block->nRef) == 0) {
+		free(block);
+	}
+}
+
+SFgVideoFrame* FgMediaHub::retainVideoFrame(const SFgVideoFrame* frame)
+{
+	if (frame == NULL) {
+		return NULL;
+	}
+	SFgVideoFrameBlock* block = (SFgVideoFrameBlock*)malloc(sizeof(SFgVideoFrameBlock) + frame->dataTotalLen);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->nRef = 1;
+	block->frame = *frame;
+	block->frame.data = (unsigned char*)(block + 1);
+	memcpy(block->frame.data, frame->data, frame->dataTotalLen);
+	return &block->frame;
+}
+
+void FgMediaHub::addRefVideoFrame(SFgVideoFrame* frame)
+{
+	if (frame == NULL) {
+		return;
+	}
+	SFgVideoFrameBlock* block = CONTAINING_RECORD(frame, SFgVideoFrameBlock, frame);
+	InterlockedIncrement(&block->nRef);
+}
+
+void FgMediaHub::releaseVideoFrame(SFgVideoFrame* frame)
+{
+	if (frame == NULL) {
+		return;
+	}
+	SFgVideoFrameBlock* block = CONTAINING_RECORD(frame, SFgVideoFrameBlock, frame);
+	if (InterlockedDecrement(&block->nRef) == 0) {
+		free(block);
+	}
+}
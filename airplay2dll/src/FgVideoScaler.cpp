@@ -0,0 +1,387 @@
+#include "FgVideoScaler.h"
+#include "CAutoLock.h"
+#include "trace.h"
+#include "raop.h"
+
+static const int s_scaleFilters[FG_SCALE_FILTER_LEVELS] = {
+	SWS_BICUBIC, SWS_BILINEAR, SWS_FAST_BILINEAR, SWS_POINT
+};
+
+static long long scalerNowUs()
+{
+	static LARGE_INTEGER s_freq = { 0 };
+	LARGE_INTEGER counter;
+	if (s_freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&s_freq);
+	}
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart / s_freq.QuadPart * 1000000 +
+		counter.QuadPart % s_freq.QuadPart * 1000000 / s_freq.QuadPart;
+}
+
+static AVPixelFormat toAVPixelFormat(int pixelFormat)
+{
+	switch (pixelFormat) {
+	case FG_PIXEL_FORMAT_NV12:
+		return AV_PIX_FMT_NV12;
+	case FG_PIXEL_FORMAT_BGRA:
+		return AV_PIX_FMT_BGRA;
+	case FG_PIXEL_FORMAT_RGBA:
+		return AV_PIX_FMT_RGBA;
+	default:
+		return AV_PIX_FMT_YUV420P;
+	}
+}
+
+FgVideoScaler::FgVideoScaler(IAirServerCallback* pCallback, FgMediaHub* pHub)
+	: m_pCallback(pCallback)
+	, m_pHub(pHub)
+	, m_hThread(NULL)
+	, m_bQuit(false)
+	, m_pPending(NULL)
+	, m_bDropped(false)
+	, m_fScaleRatio(1.0f)
+	, m_nPixelFormat(FG_PIXEL_FORMAT_I420)
+	, m_nBoxWidth(0)
+	, m_nBoxHeight(0)
+	, m_nWorkers(1)
+	, m_pSrcFrame(NULL)
+	, m_nSrcWidth(0)
+	, m_nSrcHeight(0)
+	, m_nDstFormat(-1)
+	, m_nFilterLevel(0)
+	, m_nCtxFilterLevel(-1)
+	, m_llCostAvgUs(0)
+	, m_llLastPts(0)
+	, m_nCalmFrames(0)
+	, m_nDataCapacity(0)
+{
+	memset(m_workers, 0, sizeof(m_workers));
+	memset(m_dstPlanes, 0, sizeof(m_dstPlanes));
+	memset(m_dstStrides, 0, sizeof(m_dstStrides));
+	memset(&m_sVideoFrame, 0, sizeof(SFgVideoFrame));
+
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	m_nWorkers = min(FG_SCALE_MAX_WORKERS, max(1, (int)sysInfo.dwNumberOfProcessors / 2));
+
+	m_hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_mutexJob = CreateMutex(NULL, FALSE, NULL);
+	for (int i = 0; i < m_nWorkers; i++) {
+		SFgScaleWorker* worker = &m_workers[i];
+		worker->pOwner = this;
+		worker->hStart = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker->hDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+		worker->hThread = CreateThread(NULL, 0, workerThread, worker, 0, NULL);
+	}
+	m_hThread = CreateThread(NULL, 0, scaleThread, this, 0, NULL);
+}
+
+FgVideoScaler::~FgVideoScaler()
+{
+	m_bQuit = true;
+	SetEvent(m_hEvent);
+	WaitForSingleObject(m_hThread, INFINITE);
+	CloseHandle(m_hThread);
+
+	for (int i = 0; i < m_nWorkers; i++) {
+		SFgScaleWorker* worker = &m_workers[i];
+		SetEvent(worker->hStart);
+		WaitForSingleObject(worker->hThread, INFINITE);
+		CloseHandle(worker->hThread);
+		CloseHandle(worker->hStart);
+		CloseHandle(worker->hDone);
+	}
+	freeContexts();
+
+	if (m_pPending) {
+		av_frame_free(&m_pPending);
+	}
+	delete[] m_sVideoFrame.data;
+	CloseHandle(m_hEvent);
+	CloseHandle(m_mutexJob);
+}
+
+void FgVideoScaler::setOutput(float fRatio, int pixelFormat, unsigned int boxWidth, unsigned int boxHeight)
+{
+	CAutoLock oLock(m_mutexJob, "setOutput");
+	m_fScaleRatio = fRatio;
+	m_nPixelFormat = pixelFormat;
+	m_nBoxWidth = boxWidth;
+	m_nBoxHeight = boxHeight;
+}
+
+int FgVideoScaler::currentFilter()
+{
+	return s_scaleFilters[m_nFilterLevel];
+}
+
+void FgVideoScaler::submit(AVFrame* frame, const char* remoteName, const char* remoteDeviceId)
+{
+	AVFrame* ref = av_frame_clone(frame);
+	if (ref == NULL) {
+		return;
+	}
+	{
+		CAutoLock oLock(m_mutexJob, "submit");
+		if (m_pPending) {
+			av_frame_free(&m_pPending);
+			m_bDropped = true;
+		}
+		m_pPending = ref;
+		m_strRemoteName = remoteName ? remoteName : "";
+		m_strRemoteDeviceId = remoteDeviceId ? remoteDeviceId : "";
+	}
+	SetEvent(m_hEvent);
+}
+
+DWORD WINAPI FgVideoScaler::scaleThread(LPVOID param)
+{
+	FgVideoScaler* pThis = (FgVideoScaler*)param;
+	TRACE_THREAD_NAME("scaler");
+	raop_apply_thread_policy(RAOP_THREAD_DECODE);
+	pThis->scaleLoop();
+	raop_revert_thread_policy();
+	return 0;
+}
+
+void FgVideoScaler::scaleLoop()
+{
+	while (!m_bQuit) {
+		WaitForSingleObject(m_hEvent, INFINITE);
+		AVFrame* frame = NULL;
+		bool dropped = false;
+		{
+			CAutoLock oLock(m_mutexJob, "scaleLoop");
+			frame = m_pPending;
+			m_pPending = NULL;
+			dropped = m_bDropped;
+			m_bDropped = false;
+		}
+		if (frame == NULL) {
+			continue;
+		}
+
+		long long start = scalerNowUs();
+		scaleFrame(frame);
+		long long cost = scalerNowUs() - start;
+
+		long long interval = 16667;
+		if (m_llLastPts != 0 && frame->pts > m_llLastPts) {
+			interval = min(100000LL, max(5000LL, frame->pts - m_llLastPts));
+		}
+		m_llLastPts = frame->pts;
+		adaptFilter(cost, interval, dropped);
+
+		av_frame_free(&frame);
+	}
+}
+
+void FgVideoScaler::adaptFilter(long long costUs, long long intervalUs, bool dropped)
+{
+	m_llCostAvgUs = m_llCostAvgUs == 0 ? costUs : (m_llCostAvgUs * 7 + costUs) / 8;
+
+	if (dropped || m_llCostAvgUs > intervalUs * 6 / 10) {
+		if (m_nFilterLevel < FG_SCALE_FILTER_LEVELS - 1) {
+			m_nFilterLevel++;
+			m_llCostAvgUs = 0;
+		}
+		m_nCalmFrames = 0;
+	}
+	else if (m_llCostAvgUs < intervalUs / 4) {
+		// Step back up only after a couple of seconds of headroom
+		if (++m_nCalmFrames >= 120 && m_nFilterLevel > 0) {
+			m_nFilterLevel--;
+			m_nCalmFrames = 0;
+			m_llCostAvgUs = 0;
+		}
+	}
+	else {
+		m_nCalmFrames = 0;
+	}
+}
+
+void FgVideoScaler::freeContexts()
+{
+	for (int i = 0; i < m_nWorkers; i++) {
+		if (m_workers[i].pSwsCtx) {
+			sws_freeContext(m_workers[i].pSwsCtx);
+			m_workers[i].pSwsCtx = NULL;
+		}
+	}
+	m_nCtxFilterLevel = -1;
+}
+
+bool FgVideoScaler::prepare(AVFrame* frame, int dstWidth, int dstHeight, int pixelFormat)
+{
+	if (frame->width != m_nSrcWidth || frame->height != m_nSrcHeight ||
+		dstWidth != (int)m_sVideoFrame.width || dstHeight != (int)m_sVideoFrame.height ||
+		pixelFormat != m_nDstFormat || m_nFilterLevel != m_nCtxFilterLevel) {
+		freeContexts();
+
+		// Only a 1:1 conversion can be cut into bands: a band context would
+		// neither see the rows beyond its edges nor scale by exactly the
+		// frame's ratio. Bands start on even lines so 4:2:0 chroma rows are
+		// never split.
+		int bands = 1;
+		if (dstWidth == frame->width && dstHeight == frame->height) {
+			bands = min(m_nWorkers, max(1, dstHeight / 64));
+		}
+		for (int i = 0; i < m_nWorkers; i++) {
+			SFgScaleWorker* worker = &m_workers[i];
+			if (i >= bands) {
+				worker->dstH = 0;
+				continue;
+			}
+			int y0 = (dstHeight * i / bands) & ~1;
+			int y1 = (i == bands - 1) ? dstHeight : (dstHeight * (i + 1) / bands) & ~1;
+			worker->dstY = y0;
+			worker->dstH = y1 - y0;
+			worker->srcY = y0;
+			worker->srcH = bands == 1 ? frame->height : y1 - y0;
+			worker->pSwsCtx = sws_getContext(frame->width, worker->srcH, (AVPixelFormat)frame->format,
+				dstWidth, worker->dstH, toAVPixelFormat(pixelFormat), s_scaleFilters[m_nFilterLevel],
+				NULL, NULL, NULL);
+			if (worker->pSwsCtx == NULL) {
+				freeContexts();
+				return false;
+			}
+		}
+		m_nSrcWidth = frame->width;
+		m_nSrcHeight = frame->height;
+		m_nDstFormat = pixelFormat;
+		m_nCtxFilterLevel = m_nFilterLevel;
+	}
+
+	SFgVideoFrame* out = &m_sVideoFrame;
+	memset(out->pitch, 0, sizeof(out->pitch));
+	memset(out->dataLen, 0, sizeof(out->dataLen));
+	switch (pixelFormat) {
+	case FG_PIXEL_FORMAT_NV12:
+		out->pitch[0] = ((dstWidth + 15) >> 4) << 4;
+		out->pitch[1] = out->pitch[0];
+		out->dataLen[0] = out->pitch[0] * dstHeight;
+		out->dataLen[1] = out->pitch[1] * dstHeight >> 1;
+		break;
+	case FG_PIXEL_FORMAT_BGRA:
+	case FG_PIXEL_FORMAT_RGBA:
+		out->pitch[0] = dstWidth * 4;
+		out->dataLen[0] = out->pitch[0] * dstHeight;
+		break;
+	default:
+		out->pitch[0] = ((dstWidth + 15) >> 4) << 4;
+		out->pitch[1] = (((dstWidth >> 1) + 15) >> 4) << 4;
+		out->pitch[2] = out->pitch[1];
+		out->dataLen[0] = out->pitch[0] * dstHeight;
+		out->dataLen[1] = out->pitch[1] * dstHeight >> 1;
+		out->dataLen[2] = out->pitch[2] * dstHeight >> 1;
+		break;
+	}
+	out->width = dstWidth;
+	out->height = dstHeight;
+	out->pixelFormat = pixelFormat;
+	out->dataTotalLen = out->dataLen[0] + out->dataLen[1] + out->dataLen[2];
+	if (m_nDataCapacity < out->dataTotalLen) {
+		delete[] out->data;
+		out->data = new uint8_t[out->dataTotalLen];
+		m_nDataCapacity = out->dataTotalLen;
+	}
+
+	memset(m_dstPlanes, 0, sizeof(m_dstPlanes));
+	memset(m_dstStrides, 0, sizeof(m_dstStrides));
+	m_dstPlanes[0] = out->data;
+	m_dstPlanes[1] = out->data + out->dataLen[0];
+	m_dstPlanes[2] = out->data + out->dataLen[0] + out->dataLen[1];
+	for (int i = 0; i < 3; i++) {
+		m_dstStrides[i] = out->pitch[i];
+	}
+	return true;
+}
+
+void FgVideoScaler::scaleFrame(AVFrame* frame)
+{
+	float fRatio;
+	int pixelFormat;
+	{
+		CAutoLock oLock(m_mutexJob, "scaleFrame");
+		fRatio = m_fScaleRatio;
+		pixelFormat = m_nPixelFormat;
+		if (m_nBoxWidth > 0 && m_nBoxHeight > 0) {
+			fRatio = min((float)m_nBoxWidth / frame->width, (float)m_nBoxHeight / frame->height);
+		}
+	}
+	int dstWidth = max(2, (int)(frame->width * fRatio) & ~1);
+	int dstHeight = max(2, (int)(frame->height * fRatio) & ~1);
+	if (!prepare(frame, dstWidth, dstHeight, pixelFormat)) {
+		return;
+	}
+
+	TRACE_SPAN_BEGIN(scale);
+	m_pSrcFrame = frame;
+	int running = 0;
+	if (m_nWorkers > 1 && m_workers[1].dstH > 0) {
+		HANDLE doneEvents[FG_SCALE_MAX_WORKERS];
+		for (int i = 0; i < m_nWorkers; i++) {
+			if (m_workers[i].dstH > 0) {
+				SetEvent(m_workers[i].hStart);
+				doneEvents[running++] = m_workers[i].hDone;
+			}
+		}
+		WaitForMultipleObjects(running, doneEvents, TRUE, INFINITE);
+	}
+	else {
+		scaleBand(&m_workers[0]);
+		running = 1;
+	}
+	m_pSrcFrame = NULL;
+	TRACE_SPAN_END_ARG(scale, "scale", running);
+
+	m_sVideoFrame.pts = frame->pts;
+	m_sVideoFrame.isKey = frame->key_frame;
+	if (m_pCallback != NULL) {
+		TRACE_SPAN_BEGIN(output);
+		m_pCallback->outputVideo(&m_sVideoFrame, m_strRemoteName.c_str(), m_strRemoteDeviceId.c_str());
+		TRACE_SPAN_END(output, "outputVideo");
+	}
+	m_pHub->publishVideoFrame(&m_sVideoFrame, m_strRemoteName.c_str(), m_strRemoteDeviceId.c_str());
+}
+
+DWORD WINAPI FgVideoScaler::workerThread(LPVOID param)
+{
+	SFgScaleWorker* worker = (SFgScaleWorker*)param;
+	FgVideoScaler* pOwner = worker->pOwner;
+	TRACE_THREAD_NAME("scale_worker");
+	raop_apply_thread_policy(RAOP_THREAD_DECODE);
+	while (true) {
+		WaitForSingleObject(worker->hStart, INFINITE);
+		if (pOwner->m_bQuit) {
+			break;
+		}
+		pOwner->scaleBand(worker);
+		SetEvent(worker->hDone);
+	}
+	raop_revert_thread_policy();
+	return 0;
+}
+
+void FgVideoScaler::scaleBand(SFgScaleWorker* worker)
+{
+	AVFrame* src = m_pSrcFrame;
+	const uint8_t* srcPlanes[3] = {
+		src->data[0] + worker->srcY * src->linesize[0],
+		src->data[1] + (worker->srcY >> 1) * src->linesize[1],
+		src->data[2] + (worker->srcY >> 1) * src->linesize[2]
+	};
+	uint8_t* dstPlanes[4] = { NULL, NULL, NULL, NULL };
+	for (int i = 0; i < 3; i++) {
+		if (m_dstPlanes[i] != NULL && m_dstStrides[i] > 0) {
+			// Chroma planes of I420 / NV12 have half the rows
+			int y = (i == 0) ? worker->dstY : (worker->dstY >> 1);
+			dstPlanes[i] = m_dstPlanes[i] + y * m_dstStrides[i];
+		}
+	}
+	TRACE_SPAN_BEGIN(band);
+	sws_scale(worker->pSwsCtx, srcPlanes, src->linesize, 0, worker->srcH,
+		dstPlanes, m_dstStrides);
+	TRACE_SPAN_END_ARG(band, "sws_scale", worker->dstH);
+}